@@ -23,10 +23,17 @@ enum class DataType
     CHAR,
     BOOL,
     STRING,
+    LONG, // 64-bit integer, used for compiler temporaries
     AUTO,
     UNKNOWN
 };
 
+// Size in bytes of a value of the type
+int getTypeSize(DataType type);
+
+// Type a variable created by assigning expr to it gets
+DataType inferTypeFromExpression(const ExprAST *expr);
+
 // Base class for all expression nodes.
 class ExprAST
 {
@@ -103,6 +110,7 @@ public:
     void print() const override { std::cout << Name; }
     void codegen(CodeGen &gen) const override;
     const string &getName() const { return Name; }
+    void setName(const string &NewName) { Name = NewName; }
 };
 
 // Expression class for a binary operator.
@@ -127,6 +135,8 @@ public:
     const string &getOp() const { return Op; }
     const ExprAST *getLHS() const { return LHS.get(); }
     const ExprAST *getRHS() const { return RHS.get(); }
+    unique_ptr<ExprAST> &getLHSRef() { return LHS; }
+    unique_ptr<ExprAST> &getRHSRef() { return RHS; }
 };
 
 // Expression class for unary operators
@@ -144,6 +154,9 @@ public:
         Operand->print();
     }
     void codegen(CodeGen &gen) const override;
+    const string &getOp() const { return Op; }
+    const ExprAST *getOperand() const { return Operand.get(); }
+    unique_ptr<ExprAST> &getOperandRef() { return Operand; }
 };
 
 // Expression class for function calls.
@@ -168,6 +181,9 @@ public:
         std::cout << ")";
     }
     void codegen(CodeGen &gen) const override;
+    const string &getCallee() const { return Callee; }
+    const vector<unique_ptr<ExprAST>> &getArgs() const { return Args; }
+    vector<unique_ptr<ExprAST>> &getArgs() { return Args; }
 };
 
 // Expression class for array access
@@ -187,6 +203,8 @@ public:
         std::cout << "]";
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getArray() const { return Array.get(); }
+    const ExprAST *getIndex() const { return Index.get(); }
 };
 
 // Expression class for assignment
@@ -205,6 +223,10 @@ public:
         RHS->print();
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getLHS() const { return LHS.get(); }
+    const ExprAST *getRHS() const { return RHS.get(); }
+    unique_ptr<ExprAST> &getLHSRef() { return LHS; }
+    unique_ptr<ExprAST> &getRHSRef() { return RHS; }
 };
 
 // Variable declaration statement
@@ -234,6 +256,7 @@ public:
     }
     DataType getVarType() const { return Type; }
     const std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &getVars() const { return Vars; }
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &getVars() { return Vars; }
     void codegen(CodeGen &gen) const override;
 };
 
@@ -250,6 +273,8 @@ public:
         std::cout << ";";
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getExpr() const { return Expr.get(); }
+    unique_ptr<ExprAST> &getExprRef() { return Expr; }
 };
 
 // Compound statement (block of statements)
@@ -272,6 +297,8 @@ public:
         std::cout << "}";
     }
     void addStatement(unique_ptr<StmtAST> stmt) { Statements.push_back(std::move(stmt)); }
+    const vector<unique_ptr<StmtAST>> &getStatements() const { return Statements; }
+    vector<unique_ptr<StmtAST>> &getStatements() { return Statements; }
     void codegen(CodeGen &gen) const override;
 };
 
@@ -298,6 +325,12 @@ public:
         }
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getCondition() const { return Condition.get(); }
+    const StmtAST *getThen() const { return ThenStmt.get(); }
+    const StmtAST *getElse() const { return ElseStmt.get(); }
+    unique_ptr<ExprAST> &getConditionRef() { return Condition; }
+    unique_ptr<StmtAST> &getThenRef() { return ThenStmt; }
+    unique_ptr<StmtAST> &getElseRef() { return ElseStmt; }
 };
 
 // While loop statement
@@ -317,6 +350,10 @@ public:
         Body->print();
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getCondition() const { return Condition.get(); }
+    const StmtAST *getBody() const { return Body.get(); }
+    unique_ptr<ExprAST> &getConditionRef() { return Condition; }
+    unique_ptr<StmtAST> &getBodyRef() { return Body; }
 };
 
 // For loop statement
@@ -326,6 +363,7 @@ class ForStmtAST : public StmtAST
     unique_ptr<ExprAST> Condition;
     unique_ptr<ExprAST> Update;
     unique_ptr<StmtAST> Body;
+    int UnrollHint = 0; // #pragma unroll: 0 none, -1 completely, n copies
 
 public:
     ForStmtAST(unique_ptr<StmtAST> Init, unique_ptr<ExprAST> Condition,
@@ -334,6 +372,12 @@ public:
           Update(std::move(Update)), Body(std::move(Body)) {}
     void print() const override
     {
+        if (UnrollHint == 1)
+            std::cout << "#pragma nounroll" << std::endl;
+        else if (UnrollHint > 1)
+            std::cout << "#pragma unroll(" << UnrollHint << ")" << std::endl;
+        else if (UnrollHint < 0)
+            std::cout << "#pragma unroll" << std::endl;
         std::cout << "for (";
         if (Init)
             Init->print();
@@ -347,6 +391,67 @@ public:
         Body->print();
     }
     void codegen(CodeGen &gen) const override;
+    const StmtAST *getInit() const { return Init.get(); }
+    const ExprAST *getCondition() const { return Condition.get(); }
+    const ExprAST *getUpdate() const { return Update.get(); }
+    const StmtAST *getBody() const { return Body.get(); }
+    unique_ptr<StmtAST> &getInitRef() { return Init; }
+    unique_ptr<ExprAST> &getConditionRef() { return Condition; }
+    unique_ptr<ExprAST> &getUpdateRef() { return Update; }
+    unique_ptr<StmtAST> &getBodyRef() { return Body; }
+    int getUnrollHint() const { return UnrollHint; }
+    void setUnrollHint(int hint) { UnrollHint = hint; }
+};
+
+// One case of a switch: the labels that enter it and the statements up to
+// the next label. Control falls through into the next case unless a break
+// leaves the switch.
+struct SwitchCase
+{
+    vector<long long> Values;  // case labels
+    bool IsDefault = false;    // the default label enters here too
+    unique_ptr<StmtAST> Body;  // always a CompoundStmtAST
+};
+
+// Switch statement
+class SwitchStmtAST : public StmtAST
+{
+    unique_ptr<ExprAST> Value;
+    vector<SwitchCase> Cases;
+
+public:
+    SwitchStmtAST(unique_ptr<ExprAST> Value, vector<SwitchCase> Cases)
+        : Value(std::move(Value)), Cases(std::move(Cases)) {}
+    void print() const override
+    {
+        std::cout << "switch (";
+        Value->print();
+        std::cout << ") {" << std::endl;
+        for (const auto &c : Cases)
+        {
+            for (long long value : c.Values)
+                std::cout << "case " << value << ":" << std::endl;
+            if (c.IsDefault)
+                std::cout << "default:" << std::endl;
+            c.Body->print();
+            std::cout << std::endl;
+        }
+        std::cout << "}";
+    }
+    void codegen(CodeGen &gen) const override;
+    const ExprAST *getValue() const { return Value.get(); }
+    unique_ptr<ExprAST> &getValueRef() { return Value; }
+    const vector<SwitchCase> &getCases() const { return Cases; }
+    vector<SwitchCase> &getCases() { return Cases; }
+    bool hasDefault() const
+    {
+        for (const auto &c : Cases)
+        {
+            if (c.IsDefault)
+                return true;
+        }
+        return false;
+    }
 };
 
 // Return statement
@@ -366,6 +471,8 @@ public:
         }
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getValue() const { return Value.get(); }
+    unique_ptr<ExprAST> &getValueRef() { return Value; }
 };
 
 // Break statement
@@ -398,6 +505,8 @@ public:
         std::cout << ")";
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getValue() const { return Value.get(); }
+    unique_ptr<ExprAST> &getValueRef() { return Value; }
 };
 
 // This class represents the "prototype" for a function,
@@ -450,6 +559,9 @@ public:
         Body->print();
     }
     void codegen(CodeGen &gen) const override;
+    const PrototypeAST *getProto() const { return Proto.get(); }
+    const StmtAST *getBody() const { return Body.get(); }
+    unique_ptr<StmtAST> &getBodyRef() { return Body; }
 };
 
 // Program AST - top level container
@@ -465,6 +577,10 @@ public:
     void addStatement(unique_ptr<StmtAST> stmt) { Statements.push_back(std::move(stmt)); }
     void addFunction(unique_ptr<FunctionAST> func) { Functions.push_back(std::move(func)); }
     void addExtern(unique_ptr<PrototypeAST> ext) { Externs.push_back(std::move(ext)); }
+    const vector<unique_ptr<StmtAST>> &getStatements() const { return Statements; }
+    vector<unique_ptr<StmtAST>> &getStatements() { return Statements; }
+    const vector<unique_ptr<FunctionAST>> &getFunctions() const { return Functions; }
+    vector<unique_ptr<FunctionAST>> &getFunctions() { return Functions; }
 
     void print() const
     {
@@ -503,6 +619,8 @@ public:
         std::cout << "::" << Member;
     }
     void codegen(CodeGen &gen) const override;
+    const ExprAST *getBase() const { return Base.get(); }
+    const std::string &getMember() const { return Member; }
 };
 
 #endif // AST_H
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+#include "MachineIR.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Machine code and data of a module, laid out at fixed addresses: the
+// text first, .rodata right after it in the same read-only pages, then
+// .data on the next page, then .bss right after it.
+struct AssembledImage
+{
+    uint64_t textAddress = 0;
+    uint64_t rodataAddress = 0;
+    uint64_t dataAddress = 0;
+    uint64_t bssAddress = 0;
+    std::vector<uint8_t> text;
+    std::vector<uint8_t> rodata;
+    std::vector<uint8_t> data;
+    uint64_t bssSize = 0;
+    std::map<std::string, uint64_t> symbols; // labels, functions and data, local labels qualified
+    uint64_t entry = 0;                      // address of _start
+
+    uint64_t end() const { return bssAddress + bssSize; }
+};
+
+// Built-in x86-64 assembler for the machine IR. It encodes every opcode
+// and operand form the code generator produces, with the same meaning
+// NASM gives the printed text: ".name" labels belong to the label before
+// them, and bare symbols in memory operands are absolute addresses, so
+// the image has to be placed below 2 GiB. Data definitions may list
+// symbols, which become their absolute addresses (jump tables).
+//
+// Jumps and calls always take a 32-bit displacement, which keeps every
+// instruction's size independent of where its targets end up; all
+// symbol references are patched once the layout is known.
+class Assembler
+{
+public:
+    // Throws std::runtime_error for anything it cannot encode and for
+    // references to undefined symbols
+    static AssembledImage assemble(const MachineModule &module, uint64_t textAddress);
+};
@@ -0,0 +1,110 @@
+#pragma once
+#include "AST.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Bytecode backend. The optimized AST is lowered to a register-based
+// bytecode: each function has a frame of 64-bit registers, variables live in
+// fixed registers and temporaries above them, and comparisons that only
+// decide a branch are fused into it. The interpreter threads the code
+// through computed goto (a GNU extension that g++ and clang++ support), so
+// each instruction ends in its own indirect jump to the next handler.
+//
+// Values behave as in the native backend: arithmetic is 64-bit, stores to
+// int, char and bool variables wrap to 32 bits, and print() output is
+// buffered the same way.
+
+enum class VmOp : uint8_t
+{
+    Halt,   // exit with status r[a]
+    Mov,    // r[a] = r[b]
+    LoadI,  // r[a] = b
+    Sext,   // r[a] = low 32 bits of r[b], sign-extended
+    Add,    // r[a] = r[b] op r[c]
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    AddI,   // r[a] = r[b] op c
+    SubI,
+    MulI,
+    AddW,   // as Add, Sub, Mul, AddI, SubI and MulI, wrapped to 32 bits
+    SubW,
+    MulW,
+    AddIW,
+    SubIW,
+    MulIW,
+    Neg,    // r[a] = op r[b]
+    Not,
+    BitNot,
+    Eq,     // r[a] = r[b] op r[c], 0 or 1
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    EqI,    // r[a] = r[b] op c, 0 or 1
+    NeI,
+    LtI,
+    LeI,
+    GtI,
+    GeI,
+    Jmp,    // go to c
+    Jz,     // go to c if r[a] == 0
+    Jnz,    // go to c if r[a] != 0
+    JEq,    // go to c if r[a] op r[b]
+    JNe,
+    JLt,
+    JLe,
+    JGt,
+    JGe,
+    JEqI,   // go to c if r[a] op b
+    JNeI,
+    JLtI,
+    JLeI,
+    JGtI,
+    JGeI,
+    Call,     // r[a] = function b, with its arguments in r[c], r[c+1], ...
+    TailCall, // replace this call by function b, arguments as for Call
+    Ret,      // return r[a]
+    Print,    // print r[a] on a line
+    Flush     // write out buffered print output
+};
+
+struct VmInstr
+{
+    VmOp op;
+    int32_t a = 0;
+    int32_t b = 0;
+    int32_t c = 0;
+};
+
+struct VmFunction
+{
+    std::string name;
+    int entry = 0;     // index of the first instruction
+    int params = 0;    // arguments arrive in the first registers
+    int frameSize = 1; // registers the function uses
+};
+
+struct VmProgram
+{
+    std::vector<VmInstr> code;
+    std::vector<VmFunction> functions; // user functions, then the top level
+    int main = 0;                      // index of the top level
+};
+
+class BytecodeVM
+{
+public:
+    static VmProgram compile(const ProgramAST &program);
+
+    // One instruction per line, grouped by function
+    static std::string listing(const VmProgram &program);
+
+    // Returns false (after printing an error) if the program divides by
+    // zero or recurses past 8 MiB of registers, the native stack size;
+    // otherwise runs it to completion. print() writes to outputFd.
+    static bool run(const VmProgram &program, int &exitStatus, int outputFd = 1);
+};
@@ -0,0 +1,22 @@
+#pragma once
+#include "AST.h"
+#include <string>
+
+// C backend. The optimized AST is translated into one self-contained C99
+// file: each Vesper function becomes a static C function over int64_t
+// values, if, while, for, break, continue and return become their C
+// counterparts, and print() goes through a small buffered runtime at the
+// top of the file. A C compiler then builds it with its own optimizer.
+//
+// Values behave as in the native backend: arithmetic is 64-bit and wraps
+// (the file is compiled with -fwrapv), stores to int, char and bool
+// variables wrap to 32 bits, and operands are evaluated left to right.
+class CBackend
+{
+public:
+    static std::string translate(const ProgramAST &program);
+
+    // Compile a translated file with $CC (default cc) at -O2. Returns false
+    // (after printing an error) if the compiler fails.
+    static bool compile(const std::string &cFile, const std::string &outputBinary);
+};
@@ -1,8 +1,10 @@
 #pragma once
 #include "AST.h"
+#include "MachineIR.h"
+#include "Peephole.h"
+#include <map>
 #include <string>
 #include <vector>
-#include <sstream>
 
 class CodeGen
 {
@@ -21,18 +23,45 @@ public:
     // Complete pipeline: generate assembly and binary
     bool generateBinary(const std::string &asmFile, const std::string &outputBinary);
 
+    // Encode the generated code with the built-in assembler and write a
+    // static executable, without nasm or ld
+    bool writeExecutable(const std::string &outputBinary);
+
     // Write the generated assembly to a file (legacy)
     void writeToFile(const std::string &filename) const;
 
     // Get the generated assembly as a string (legacy)
     std::string getAssembly() const;
 
-    // Emit a line of assembly code
+    // Emit an instruction into the current function. The text form takes
+    // one instruction (or comment) in NASM syntax and is only used for the
+    // fixed runtime routines; lowering builds instructions directly.
     void emit(const std::string &line);
+    void emit(const MachineInstr &instr);
+
+    // Start a new function, or a new block of the current one, at a label
+    void beginFunction(const std::string &name);
+    void emitLabel(const std::string &label);
+
+    // Size the frame the current function allocates with sub rsp in its
+    // prologue, once all of its stack slots are known
+    void setFrameSize(int bytes);
+
+    // Define read-only data in .rodata and data in .data, reserve zeroed
+    // space in .bss, and export a symbol
+    void emitRodata(const std::string &definition);
+    void emitData(const std::string &definition);
+    void emitBss(const std::string &definition);
+    void declareGlobal(const std::string &name);
+
+    const MachineModule &getModule() const { return module; }
+
+    // Rewrites made by the peephole pass, per rule
+    const std::map<std::string, int> &getPeepholeStats() const { return peephole.getStats(); }
 
 private:
-    std::ostringstream code;                // Modern approach using stringstream
-    std::vector<std::string> assemblyLines; // Legacy support
+    MachineModule module;
+    PeepholeOptimizer peephole;
 
     // Helper methods for different AST node types can be added here
 };
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+#include "Assembler.h"
+#include <cstdint>
+#include <string>
+
+// Minimal static ELF64 executable for Linux x86-64: the ELF header, one
+// read/execute segment holding the headers, the text and .rodata, one
+// read/write segment holding .data with .bss after it, and a
+// non-executable stack.
+// There are no section headers or symbols; the file is only meant to run.
+class ElfWriter
+{
+public:
+    static const uint64_t BaseAddress = 0x400000;
+
+    // Where the text has to be assembled to sit right after the headers
+    static uint64_t textAddress();
+
+    // Returns false (after printing an error) if the file cannot be written
+    static bool write(const AssembledImage &image, const std::string &path);
+};
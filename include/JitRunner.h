@@ -0,0 +1,18 @@
+#pragma once
+#include "MachineIR.h"
+
+// Runs a compiled program inside the compiler process. The module is
+// encoded with the built-in assembler into memory below 2 GiB, the text
+// is made read/execute only, and the program starts on a stack of its
+// own with a guard page below it, so runaway recursion faults as it does
+// in the built executable. Its exit_program is replaced by a trampoline
+// that switches back to the caller's stack, so ending the program returns
+// its exit status instead of ending the process. Nothing is written to
+// disk.
+class JitRunner
+{
+public:
+    // Returns false (after printing an error) if the program cannot be
+    // loaded; otherwise runs it to completion
+    static bool run(const MachineModule &module, int &exitStatus);
+};
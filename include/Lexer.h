@@ -63,6 +63,7 @@ private:
     std::string getStringLiteral();
     std::string getCharLiteral();
     std::string getPreprocessorDirective();
+    bool isPragma() const;
     std::string getMultiCharOperator();
 
     // Keyword recognition methods
@@ -0,0 +1,169 @@
+#pragma once
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Machine-level representation of the generated x86-64 code. Lowering
+// builds it, backend passes (the peephole optimizer) rewrite it, and the
+// printer serializes it as NASM assembly.
+
+enum class Opcode
+{
+    Mov,
+    Movsxd,
+    Movzx,
+    Lea,
+    Xchg,
+    Push,
+    Pop,
+    Add,
+    Sub,
+    Imul,
+    Mul,
+    Idiv,
+    Div,
+    Neg,
+    Not,
+    Inc,
+    Dec,
+    And,
+    Or,
+    Xor,
+    Shl,
+    Shr,
+    Sar,
+    Bsr,
+    Bt,
+    Cmp,
+    Test,
+    Cqo,
+    Jmp,
+    Jcc,
+    Setcc,
+    Cmovcc,
+    Call,
+    Ret,
+    Syscall,
+    Comment // no instruction, only the comment text
+};
+
+struct MachineOperand
+{
+    enum Kind
+    {
+        Register,
+        Immediate,
+        Memory,
+        Label
+    };
+
+    Kind kind = Immediate;
+    std::string text; // register name, immediate expression, address inside the brackets, or label name
+    int size = 0;     // memory access width in bytes, 0 if implied by the other operand
+
+    static MachineOperand reg(const std::string &name);
+    static MachineOperand imm(long long value);
+    static MachineOperand mem(const std::string &address, int size = 0);
+    static MachineOperand label(const std::string &name);
+
+    // NASM operand syntax; a bare name is a label when it is a jump or call
+    // target and an immediate (symbol address) otherwise
+    static MachineOperand parse(const std::string &text, bool target = false);
+
+    bool isReg() const { return kind == Register; }
+    bool isReg(const std::string &name) const { return kind == Register && text == name; }
+    bool isMem() const { return kind == Memory; }
+    bool isImm() const { return kind == Immediate; }
+    bool isImm(long long value) const;
+    bool getImm(long long &value) const; // numeric immediates only
+
+    // True if the operand reads or is the given 64-bit register
+    bool uses(const std::string &reg64) const;
+
+    std::string str() const;
+    bool operator==(const MachineOperand &other) const
+    {
+        return kind == other.kind && text == other.text && size == other.size;
+    }
+    bool operator!=(const MachineOperand &other) const { return !(*this == other); }
+};
+
+struct MachineInstr
+{
+    Opcode opcode;
+    std::string condition; // e, ne, l, ... for Jcc, Setcc and Cmovcc
+    std::vector<MachineOperand> operands;
+    std::string comment;
+
+    MachineInstr(Opcode opcode, std::vector<MachineOperand> operands = {}, std::string comment = "")
+        : opcode(opcode), operands(std::move(operands)), comment(std::move(comment)) {}
+
+    static MachineInstr conditional(Opcode opcode, const std::string &condition, std::vector<MachineOperand> operands);
+    static MachineInstr note(const std::string &comment) { return MachineInstr(Opcode::Comment, {}, comment); }
+
+    // Builders for the common forms lowering emits. Anything else is built
+    // with the constructor or conditional().
+    static MachineInstr mov(const MachineOperand &dest, const MachineOperand &source, std::string comment = "");
+    static MachineInstr lea(const MachineOperand &dest, const std::string &address);
+    static MachineInstr push(const MachineOperand &source);
+    static MachineInstr pop(const MachineOperand &dest);
+    static MachineInstr cmp(const MachineOperand &left, const MachineOperand &right);
+    static MachineInstr arithmetic(Opcode opcode, const MachineOperand &dest, const MachineOperand &source); // dest op= source
+    static MachineInstr jump(const std::string &target, std::string comment = "");
+    static MachineInstr jumpIf(const std::string &condition, const std::string &target);
+    static MachineInstr call(const std::string &target, std::string comment = "");
+
+    // One instruction in NASM syntax, with an optional trailing comment.
+    // Only the fixed runtime routines are written this way. Throws
+    // std::invalid_argument for a mnemonic outside the opcode set.
+    static MachineInstr parse(const std::string &line);
+
+    std::string mnemonic() const;
+    bool is(Opcode op, size_t operandCount) const { return opcode == op && operands.size() == operandCount; }
+    bool isTerminator() const { return opcode == Opcode::Jmp || opcode == Opcode::Jcc || opcode == Opcode::Ret; }
+    bool readsFlags() const { return opcode == Opcode::Jcc || opcode == Opcode::Setcc || opcode == Opcode::Cmovcc; }
+    bool writesFlags() const;
+
+    std::string str() const;
+};
+
+// Straight-line run of instructions. A block starts at a label (or right
+// after a terminator, in which case it has none) and control only leaves
+// it through its last instructions or by falling into the next block.
+struct MachineBasicBlock
+{
+    std::string label; // empty if only reachable by falling through
+    std::vector<MachineInstr> instrs;
+
+    // Last instruction that is not a comment, or nullptr
+    const MachineInstr *last() const;
+};
+
+struct MachineFunction
+{
+    std::string name;
+    std::vector<MachineBasicBlock> blocks;
+
+    explicit MachineFunction(const std::string &name);
+
+    // Append an instruction, starting a new block after a terminator
+    void append(const MachineInstr &instr);
+    void appendLabel(const std::string &label);
+
+    size_t instructionCount() const;
+    void print(std::ostream &out) const;
+};
+
+// Everything the assembler sees: data definitions and reservations, exported symbols and
+// the functions in emission order
+struct MachineModule
+{
+    std::vector<std::string> rodata; // lines of the .rodata section
+    std::vector<std::string> data;   // lines of the .data section
+    std::vector<std::string> bss;  // lines of the .bss section
+    std::vector<std::string> globals;
+    std::vector<MachineFunction> functions;
+
+    void print(std::ostream &out) const;
+};
@@ -0,0 +1,121 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "AST.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+// Counters collected by the optimization passes, keyed by "pass.event"
+using OptStats = std::map<std::string, int>;
+
+// AST-level optimizer run between parsing and code generation.
+// The passes rewrite the program in place; the code generator then
+// lowers whatever is left.
+class Optimizer
+{
+public:
+    Optimizer(int optLevel = 2);
+
+    // Run the pass pipeline for the configured optimization level
+    void run(ProgramAST &program);
+
+    // Largest callee body, in AST nodes, that the inliner copies into a
+    // call site (-O2 only)
+    void setInlineThreshold(int threshold) { InlineThreshold = threshold; }
+
+    // Number of body copies for partially unrolled loops (-O2 only);
+    // 1 turns unrolling off unless a #pragma asks for it
+    void setUnrollFactor(int factor) { UnrollFactor = factor; }
+
+    const OptStats &getStats() const { return Stats; }
+    void printStats() const;
+
+private:
+    void simplify(ProgramAST &program);
+
+    int OptLevel;
+    int InlineThreshold = 40;
+    int UnrollFactor = 4;
+    OptStats Stats;
+};
+
+// Passes. Each returns true if it changed the program.
+bool resolveVariableNames(ProgramAST &program, OptStats &stats);
+bool foldConstants(ProgramAST &program, OptStats &stats);
+bool eliminateDeadCode(ProgramAST &program, OptStats &stats);
+bool eliminateCommonSubexpressions(ProgramAST &program, OptStats &stats);
+bool hoistLoopInvariants(ProgramAST &program, OptStats &stats);
+bool reduceInductionVariables(ProgramAST &program, OptStats &stats);
+bool inlineFunctions(ProgramAST &program, OptStats &stats, int threshold);
+bool unrollLoops(ProgramAST &program, OptStats &stats, int factor);
+bool eliminateClosedFormLoops(ProgramAST &program, OptStats &stats);
+bool unswitchLoops(ProgramAST &program, OptStats &stats);
+
+// Analysis helpers shared by the passes
+
+// Evaluate an expression made only of literals. Fails for anything that
+// depends on runtime state or whose result would not fit in an int.
+bool evaluateConstant(const ExprAST *expr, long long &value);
+
+// True if the operation itself can trap: a division or modulo whose divisor
+// is not a known non-zero constant
+bool canTrap(const BinaryExprAST *binary);
+
+// True if evaluating the expression can change program state or trap
+bool hasSideEffects(const ExprAST *expr);
+
+// Collect every variable name read by an expression
+void collectReadVariables(const ExprAST *expr, std::set<std::string> &vars);
+
+// Collect every variable stored to by an expression
+void collectWrittenVariables(const ExprAST *expr, std::set<std::string> &vars);
+
+// Collect every variable a statement can store to, including declarations
+void collectWrittenVariables(StmtAST *stmt, std::set<std::string> &vars);
+
+// Collect every variable declared anywhere inside a statement
+void collectDeclarations(StmtAST *stmt, std::set<std::string> &names);
+
+// Declare 64-bit compiler temporaries at the start of a statement list. They
+// hold values the code generator computed in 64-bit registers, so reusing
+// one is exactly equivalent to recomputing it.
+void declareTemporaries(std::vector<std::unique_ptr<StmtAST>> &stmts, const std::vector<std::string> &names);
+
+// The top-level statements and the body of every function. Each one has its
+// own variables, so passes treat them as separate units.
+std::vector<std::vector<std::unique_ptr<StmtAST>> *> codeUnits(ProgramAST &program);
+
+// Recognize i = i + c, i = c + i and i = i - c; step is c (or -c)
+bool isIncrementOf(const ExprAST *expr, const std::string &name, long long &step);
+
+// The comparison with its operands swapped: a < b is b > a
+std::string mirrorComparison(const std::string &op);
+
+// Number of times "for (i = start; i op bound; i = i + step)" runs its body,
+// for a relational op and a step that moves i towards the bound
+long long tripCount(long long start, const std::string &op, long long bound, long long step);
+
+// Size of a tree in AST nodes, used by the code growth heuristics
+int countNodes(const StmtAST *stmt);
+int countNodes(const ExprAST *expr);
+
+// Gives the expression that stands for a variable in a copied tree: the
+// variable itself, a renamed one or a literal. Declared names and
+// assignment targets must map to a variable.
+using VariableMapper = std::function<std::unique_ptr<ExprAST>(const std::string &)>;
+
+// Deep copy of an expression or statement, with every variable passed
+// through the mapper if one is given. Returns null if the tree contains
+// something the passes do not model (strings, arrays, scope expressions).
+std::unique_ptr<ExprAST> cloneExpr(const ExprAST *expr, const VariableMapper &map = nullptr);
+std::unique_ptr<StmtAST> cloneStmt(const StmtAST *stmt, const VariableMapper &map = nullptr);
+
+// Apply a callback to every top-level expression slot (conditions,
+// initializers, updates, values) of a statement and its children
+void forEachExpression(StmtAST *stmt, const std::function<void(std::unique_ptr<ExprAST> &)> &fn);
+
+#endif // OPTIMIZER_H
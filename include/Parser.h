@@ -26,6 +26,9 @@ enum Token
     tok_continue = -10,
     tok_true = -11,
     tok_false = -12,
+    tok_switch = -13,
+    tok_case = -14,
+    tok_default = -15,
 
     // Types
     tok_int = -20,
@@ -77,6 +80,9 @@ enum Token
     tok_left_bracket = -66,  // [
     tok_right_bracket = -67, // ]
 
+    // Compiler hints
+    tok_pragma = -70, // #pragma line
+
     // Single character operators (use ASCII values)
     // '+', '-', '*', '/', '%', '<', '>', '&', '|', '^', '~', '?', ':'
 };
@@ -93,6 +99,7 @@ private:
     double NumVal;        // Holds the number value
     string StringVal;     // Holds string literal value
     char CharVal;         // Holds character literal value
+    string PragmaStr;     // Holds a #pragma hint without whitespace
 
     // Operator precedence map
     map<string, int> BinOpPrecedence;
@@ -126,10 +133,12 @@ private:
     unique_ptr<StmtAST> ParseIfStatement();
     unique_ptr<StmtAST> ParseWhileStatement();
     unique_ptr<StmtAST> ParseForStatement();
+    unique_ptr<StmtAST> ParseSwitchStatement();
     unique_ptr<StmtAST> ParseReturnStatement();
     unique_ptr<StmtAST> ParseBreakStatement();
     unique_ptr<StmtAST> ParseContinueStatement();
     unique_ptr<StmtAST> ParsePrintStatement();
+    unique_ptr<StmtAST> ParsePragmaStatement();
 
     // Function parsing
     unique_ptr<PrototypeAST> ParsePrototype();
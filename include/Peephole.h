@@ -0,0 +1,40 @@
+#pragma once
+#include "MachineIR.h"
+#include <map>
+#include <string>
+
+// Local rewrites over a few neighbouring instructions.
+//
+// Each rule looks at a window of consecutive instructions in one basic
+// block (comments are skipped) and replaces it with something cheaper:
+//
+//   push_pop        push rax / pop rcx        ->  mov rcx, rax (or nothing)
+//   push_move_pop   push 2 / mov rsi, 3 / pop rdi  ->  mov rsi, 3 / mov rdi, 2
+//   store_reload    mov [slot], rax / mov rax, [slot]  ->  the store alone
+//   zero_idiom      mov rax, 0                ->  xor eax, eax, when no
+//                                                 instruction reads the flags
+//   self_move       mov rax, rax              ->  nothing
+//   overwritten_move  mov r10, 0 / mov r10, 5   ->  mov r10, 5
+//
+// Two rules look across blocks:
+//
+//   jump_to_next    jmp L / L:                ->  L:
+//   unreachable     instructions in a block without a label that follows
+//                   a jmp or ret
+//
+// Rules are retried until none applies. Every rewrite is counted per rule.
+class PeepholeOptimizer
+{
+public:
+    void run(MachineFunction &function);
+
+    // Rewrites per rule, keyed "peephole.<rule>"
+    const std::map<std::string, int> &getStats() const { return Stats; }
+
+private:
+    std::map<std::string, int> Stats;
+
+    bool runOnBlock(MachineBasicBlock &block);
+    bool dropJumpsToNext(MachineFunction &function);
+    bool dropUnreachable(MachineFunction &function);
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include "AST.h"
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Live range of a variable, in positions of the evaluation order of a code
+// unit. A variable is live at every position from start to end.
+struct LiveInterval
+{
+    std::string name;
+    int start;
+    int end;
+    std::string reg; // empty when the variable stays in its stack slot
+};
+
+// Linear-scan register allocation for the variables of one code unit (a
+// function body or the top-level statements).
+//
+// Expressions and statements are numbered in the order the code generator
+// evaluates them. The left operand of a binary operator may be read after
+// a right operand that is not a leaf, so the variables it reads then occur
+// again at the operator. A variable's interval runs from its first to its last
+// occurrence and is widened to cover every loop it occurs in, since its
+// value may flow around the back edge. Calls clobber the caller-saved
+// registers and print clobbers rdi, so an interval spanning one of those
+// only gets a register that survives it.
+//
+// rax, rcx and rdx are the code generator's scratch registers (accumulator,
+// right operand, idiv) and are never handed out; the other eleven
+// registers besides rsp and rbp hold variables and expression temporaries.
+//
+// Variables left without a register get stack slots below rbp. Slots are
+// 4 bytes (int, char, bool) or 8 bytes (long, and variables created by
+// assignment, whose type is only known at code generation), aligned to
+// their size, and a slot is reused by a later variable of the same width
+// once the interval of its previous owner has ended. The frame is exactly
+// the slots handed out.
+class RegisterAllocator
+{
+public:
+    // Allocate the variables of stmts. Parameters are live on entry; a
+    // function that tail-calls itself loops back to its start.
+    void run(const std::vector<const StmtAST *> &stmts, const std::vector<std::string> &params = {},
+             const std::string &function = "");
+
+    // Register holding a variable, or nullptr if it lives in memory
+    const std::string *registerOf(const std::string &name) const;
+
+    // Callee-saved registers the unit writes, in save order
+    std::vector<std::string> calleeSavedUsed() const;
+
+    // Registers no variable needs while expr is evaluated. With
+    // acrossCalls only registers that survive a call are returned.
+    std::vector<std::string> freeDuring(const ExprAST *expr, bool acrossCalls) const;
+
+    // Stack slot of a variable without a register, as an offset below rbp,
+    // and its width in bytes; 0 if it has none
+    int stackSlotOf(const std::string &name) const;
+    int slotWidthOf(const std::string &name) const;
+
+    // Bytes of stack slots the unit needs
+    int frameBytes() const { return FrameBytes; }
+
+    const std::vector<LiveInterval> &intervals() const { return Intervals; }
+
+    static bool isCalleeSaved(const std::string &reg);
+
+private:
+    std::vector<LiveInterval> Intervals;
+    std::unordered_map<std::string, std::string> Homes;
+    std::unordered_map<const ExprAST *, std::pair<int, int>> ExprRanges;
+    std::unordered_map<std::string, std::pair<int, int>> Slots; // offset, width
+    int FrameBytes = 0;
+
+    void assignStackSlots(const std::map<std::string, int> &widths);
+};
+
+// Width of the stack slot holding a value of the given size: values are
+// accessed as dwords or qwords
+int slotWidth(int size);
+
+// 32-bit name of an allocatable register (ebx, r10d, ...)
+std::string register32(const std::string &reg);
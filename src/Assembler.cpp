@@ -0,0 +1,876 @@
+#include "Assembler.h"
+#include <cctype>
+#include <stdexcept>
+
+namespace
+{
+    const uint64_t pageSize = 4096;
+
+    uint64_t alignUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    std::string trim(const std::string &text)
+    {
+        size_t begin = text.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+            return "";
+        size_t end = text.find_last_not_of(" \t");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    bool fitsInt8(int64_t value) { return value >= -128 && value <= 127; }
+    bool fitsInt32(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+    struct Register
+    {
+        int number = 0;       // hardware encoding: rax rcx rdx rbx rsp rbp rsi rdi r8 ... r15
+        int size = 8;         // bytes
+        bool high = false;    // ah, ch, dh, bh: not encodable with a REX prefix
+        bool rexByte = false; // spl, bpl, sil, dil: only encodable with one
+    };
+
+    bool parseRegister(const std::string &name, Register &reg)
+    {
+        static const char *const names[4][8] = {
+            {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi"},
+            {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"},
+            {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"},
+            {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil"}};
+        static const int sizes[4] = {8, 4, 2, 1};
+        static const char *const highNames[4] = {"ah", "ch", "dh", "bh"};
+
+        for (int row = 0; row < 4; ++row)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                if (name == names[row][i])
+                {
+                    reg = Register();
+                    reg.number = i;
+                    reg.size = sizes[row];
+                    reg.rexByte = row == 3 && i >= 4;
+                    return true;
+                }
+            }
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            if (name == highNames[i])
+            {
+                reg = Register();
+                reg.number = i + 4;
+                reg.size = 1;
+                reg.high = true;
+                return true;
+            }
+        }
+
+        // r8 ... r15 with an optional d, w or b suffix
+        if (name.size() < 2 || name[0] != 'r' || !std::isdigit(static_cast<unsigned char>(name[1])))
+            return false;
+        size_t digits = 1;
+        while (digits + 1 < name.size() && std::isdigit(static_cast<unsigned char>(name[digits + 1])))
+            ++digits;
+        int number = std::stoi(name.substr(1, digits));
+        std::string suffix = name.substr(1 + digits);
+        if (number < 8 || number > 15)
+            return false;
+        int size = suffix.empty() ? 8 : suffix == "d" ? 4 : suffix == "w" ? 2 : suffix == "b" ? 1 : 0;
+        if (!size)
+            return false;
+        reg = Register();
+        reg.number = number;
+        reg.size = size;
+        return true;
+    }
+
+    // Decimal or hex number, or a character constant
+    bool parseNumber(const std::string &text, int64_t &value)
+    {
+        if (text.size() == 3 && text[0] == '\'' && text[2] == '\'')
+        {
+            value = static_cast<unsigned char>(text[1]);
+            return true;
+        }
+        if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])))
+            return false;
+        size_t used = 0;
+        uint64_t magnitude;
+        try
+        {
+            bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+            magnitude = std::stoull(text, &used, hex ? 16 : 10);
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+        if (used != text.size())
+            return false;
+        value = static_cast<int64_t>(magnitude);
+        return true;
+    }
+
+    bool parseSigned(const std::string &text, int64_t &value)
+    {
+        if (!text.empty() && text[0] == '-')
+        {
+            if (!parseNumber(trim(text.substr(1)), value))
+                return false;
+            value = static_cast<int64_t>(0 - static_cast<uint64_t>(value));
+            return true;
+        }
+        return parseNumber(text, value);
+    }
+
+    struct Operand
+    {
+        enum Kind
+        {
+            Reg,
+            Mem,
+            Imm
+        };
+
+        Kind kind = Imm;
+        Register reg;
+        int base = -1, index = -1, scale = 1; // memory
+        int64_t value = 0;                    // displacement or immediate
+        std::string symbol;                   // added to value once laid out
+        int size = 0;                         // register or memory access width, 0 if implied
+    };
+
+    // A label name as NASM sees it: ".name" belongs to the last label
+    // without a leading dot
+    std::string qualify(const std::string &name, const std::string &scope)
+    {
+        return !name.empty() && name[0] == '.' ? scope + name : name;
+    }
+
+    // Sum of registers, scaled registers, numbers and at most one symbol,
+    // as inside memory brackets or in an immediate
+    void parseSum(const std::string &text, const std::string &scope, Operand &operand, bool allowRegisters)
+    {
+        size_t i = 0;
+        while (i < text.size())
+        {
+            bool negative = false;
+            while (i < text.size() && (text[i] == ' ' || text[i] == '+' || text[i] == '-'))
+            {
+                if (text[i] == '-')
+                    negative = !negative;
+                ++i;
+            }
+            size_t start = i;
+            if (i < text.size() && text[i] == '\'')
+                i = std::min(text.size(), i + 3);
+            while (i < text.size() && text[i] != '+' && text[i] != '-')
+                ++i;
+            std::string term = trim(text.substr(start, i - start));
+            if (term.empty())
+                throw std::runtime_error("Malformed operand: " + text);
+
+            int64_t number;
+            Register reg;
+            size_t star = term.find('*');
+            if (star != std::string::npos)
+            {
+                std::string left = trim(term.substr(0, star)), right = trim(term.substr(star + 1));
+                int64_t scale;
+                if (!parseRegister(left, reg))
+                    std::swap(left, right);
+                if (!allowRegisters || negative || operand.index >= 0 || !parseRegister(left, reg) ||
+                    reg.size != 8 || !parseNumber(right, scale) || (scale != 1 && scale != 2 && scale != 4 && scale != 8))
+                    throw std::runtime_error("Bad index in operand: " + text);
+                operand.index = reg.number;
+                operand.scale = static_cast<int>(scale);
+            }
+            else if (parseNumber(term, number))
+            {
+                operand.value += static_cast<int64_t>(negative ? 0 - static_cast<uint64_t>(number) : number);
+            }
+            else if (parseRegister(term, reg))
+            {
+                if (!allowRegisters || negative || reg.size != 8)
+                    throw std::runtime_error("Bad register in operand: " + text);
+                if (operand.base < 0)
+                    operand.base = reg.number;
+                else if (operand.index < 0)
+                    operand.index = reg.number;
+                else
+                    throw std::runtime_error("Too many registers in operand: " + text);
+            }
+            else
+            {
+                if (negative || !operand.symbol.empty())
+                    throw std::runtime_error("Unsupported symbol expression: " + text);
+                operand.symbol = qualify(term, scope);
+            }
+        }
+
+        // rsp cannot be an index; [rsp + r] is the same as [r + rsp]
+        if (operand.index == 4 && operand.scale == 1)
+            std::swap(operand.base, operand.index);
+        if (operand.index == 4)
+            throw std::runtime_error("rsp cannot be an index register: " + text);
+    }
+
+    Operand convert(const MachineOperand &source, const std::string &scope)
+    {
+        Operand operand;
+        switch (source.kind)
+        {
+        case MachineOperand::Register:
+            operand.kind = Operand::Reg;
+            if (!parseRegister(source.text, operand.reg))
+                throw std::runtime_error("Unknown register: " + source.text);
+            operand.size = operand.reg.size;
+            break;
+        case MachineOperand::Memory:
+            operand.kind = Operand::Mem;
+            parseSum(source.text, scope, operand, true);
+            operand.size = source.size;
+            break;
+        case MachineOperand::Immediate:
+            operand.kind = Operand::Imm;
+            parseSum(source.text, scope, operand, false);
+            break;
+        case MachineOperand::Label:
+            operand.kind = Operand::Imm;
+            operand.symbol = qualify(source.text, scope);
+            break;
+        }
+        return operand;
+    }
+
+    int conditionCode(const std::string &condition)
+    {
+        static const struct
+        {
+            const char *name;
+            int code;
+        } codes[] = {{"o", 0}, {"no", 1}, {"b", 2}, {"c", 2}, {"nae", 2}, {"ae", 3}, {"nb", 3}, {"nc", 3},
+                     {"e", 4}, {"z", 4}, {"ne", 5}, {"nz", 5}, {"be", 6}, {"na", 6}, {"a", 7}, {"nbe", 7},
+                     {"s", 8}, {"ns", 9}, {"p", 10}, {"pe", 10}, {"np", 11}, {"po", 11}, {"l", 12}, {"nge", 12},
+                     {"ge", 13}, {"nl", 13}, {"le", 14}, {"ng", 14}, {"g", 15}, {"nle", 15}};
+        for (const auto &entry : codes)
+        {
+            if (condition == entry.name)
+                return entry.code;
+        }
+        throw std::runtime_error("Unknown condition: " + condition);
+    }
+
+    struct Fixup
+    {
+        size_t offset; // into the text, or the data section it belongs to
+        std::string symbol;
+        int64_t addend;
+        int width;     // 4 or 8 bytes
+        bool relative; // from the end of the field, for jumps and calls
+    };
+
+    class Encoder
+    {
+    public:
+        std::vector<uint8_t> code;
+        std::vector<Fixup> fixups;
+
+        void byte(int value) { code.push_back(static_cast<uint8_t>(value)); }
+
+        void value(int64_t value, int width)
+        {
+            for (int i = 0; i < width; ++i)
+                byte(static_cast<int>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff));
+        }
+
+        // An immediate or displacement field, patched later if it names a symbol
+        void field(const Operand &operand, int width, bool relative = false)
+        {
+            if (!operand.symbol.empty())
+                fixups.push_back({code.size(), operand.symbol, operand.value, width, relative});
+            else if (width == 1 ? operand.value < -128 || operand.value > 255
+                                : width == 2 ? operand.value < -32768 || operand.value > 65535
+                                : width == 4 ? operand.value < INT32_MIN || operand.value > UINT32_MAX : false)
+                throw std::runtime_error("Immediate out of range: " + std::to_string(operand.value));
+            value(operand.symbol.empty() ? operand.value : 0, width);
+        }
+
+        // Operand-size prefix, REX, opcode and ModRM (with SIB and
+        // displacement) for an instruction whose reg field holds a register
+        // or an opcode extension digit
+        void modrm(std::initializer_list<int> opcode, int size, const Register *reg, int digit, const Operand &rm,
+                   bool default64 = false)
+        {
+            int regNumber = reg ? reg->number : digit;
+            int rex = 0;
+            if (size == 8 && !default64)
+                rex |= 8;
+            if (regNumber >= 8)
+                rex |= 4;
+            if (rm.kind == Operand::Reg && rm.reg.number >= 8)
+                rex |= 1;
+            if (rm.kind == Operand::Mem && rm.index >= 8)
+                rex |= 2;
+            if (rm.kind == Operand::Mem && rm.base >= 8)
+                rex |= 1;
+            bool byteRex = (reg && reg->rexByte) || (rm.kind == Operand::Reg && rm.reg.rexByte);
+            if ((rex || byteRex) && ((reg && reg->high) || (rm.kind == Operand::Reg && rm.reg.high)))
+                throw std::runtime_error("ah, bh, ch and dh cannot be used with this operand");
+
+            if (size == 2)
+                byte(0x66);
+            if (rex || byteRex)
+                byte(0x40 | rex);
+            for (int op : opcode)
+                byte(op);
+
+            int regBits = (regNumber & 7) << 3;
+            if (rm.kind == Operand::Reg)
+            {
+                byte(0xc0 | regBits | (rm.reg.number & 7));
+                return;
+            }
+            if (rm.kind != Operand::Mem)
+                throw std::runtime_error("Expected a register or memory operand");
+
+            static const int scaleBits[9] = {0, 0, 1, 0, 2, 0, 0, 0, 3};
+            int indexBits = (rm.index < 0 ? 4 : rm.index & 7) << 3;
+            if (rm.base < 0)
+            {
+                // Absolute address, with an optional index, through a SIB byte
+                byte(0x04 | regBits);
+                byte((scaleBits[rm.scale] << 6) | indexBits | 5);
+                field(rm, 4);
+                return;
+            }
+
+            int mod = !rm.symbol.empty() || !fitsInt8(rm.value) ? 2 : rm.value || (rm.base & 7) == 5 ? 1 : 0;
+            bool sib = rm.index >= 0 || (rm.base & 7) == 4;
+            byte((mod << 6) | regBits | (sib ? 4 : rm.base & 7));
+            if (sib)
+                byte((scaleBits[rm.scale] << 6) | indexBits | (rm.base & 7));
+            if (mod == 1)
+                value(rm.value, 1);
+            else if (mod == 2)
+                field(rm, 4);
+        }
+
+        // Opcode with the register in its low three bits (push, pop, mov imm)
+        void shortForm(int opcode, int size, const Register &reg, bool default64 = false)
+        {
+            int rex = (size == 8 && !default64 ? 8 : 0) | (reg.number >= 8 ? 1 : 0);
+            if (size == 2)
+                byte(0x66);
+            if (rex || reg.rexByte)
+                byte(0x40 | rex);
+            byte(opcode + (reg.number & 7));
+        }
+
+        void branch(std::initializer_list<int> opcode, const Operand &target)
+        {
+            if (target.symbol.empty() || target.kind != Operand::Imm)
+                throw std::runtime_error("Branch target must be a label");
+            for (int op : opcode)
+                byte(op);
+            Operand displacement = target;
+            displacement.value = 0;
+            field(displacement, 4, true);
+        }
+    };
+
+    // Width of a two-operand instruction: the register's, or the memory
+    // operand's size prefix
+    int operandSize(const Operand &dest, const Operand &source)
+    {
+        if (dest.size)
+            return dest.size;
+        if (source.kind == Operand::Reg)
+            return source.size;
+        throw std::runtime_error("Operand size not specified");
+    }
+
+    // 64-bit operations take a 32-bit immediate and sign-extend it
+    void checkImmediate(const Operand &source, int size)
+    {
+        if (size == 8 && source.kind == Operand::Imm && source.symbol.empty() && !fitsInt32(source.value))
+            throw std::runtime_error("Immediate out of range: " + std::to_string(source.value));
+    }
+
+    void arithmetic(Encoder &encoder, int digit, const Operand &dest, const Operand &source)
+    {
+        int size = operandSize(dest, source);
+        checkImmediate(source, size);
+        if (source.kind == Operand::Imm)
+        {
+            if (size == 1)
+            {
+                encoder.modrm({0x80}, size, nullptr, digit, dest);
+                encoder.field(source, 1);
+            }
+            else if (source.symbol.empty() && fitsInt8(source.value))
+            {
+                encoder.modrm({0x83}, size, nullptr, digit, dest);
+                encoder.value(source.value, 1);
+            }
+            else
+            {
+                encoder.modrm({0x81}, size, nullptr, digit, dest);
+                encoder.field(source, size == 2 ? 2 : 4);
+            }
+        }
+        else if (source.kind == Operand::Reg)
+            encoder.modrm({digit * 8 + (size == 1 ? 0 : 1)}, size, &source.reg, 0, dest);
+        else if (dest.kind == Operand::Reg)
+            encoder.modrm({digit * 8 + (size == 1 ? 2 : 3)}, size, &dest.reg, 0, source);
+        else
+            throw std::runtime_error("Two memory operands");
+    }
+
+    void move(Encoder &encoder, const Operand &dest, const Operand &source)
+    {
+        int size = operandSize(dest, source);
+        if (source.kind == Operand::Imm && dest.kind == Operand::Reg)
+        {
+            if (size == 8 && (!source.symbol.empty() || fitsInt32(source.value)))
+            {
+                encoder.modrm({0xc7}, size, nullptr, 0, dest);
+                encoder.field(source, 4);
+            }
+            else
+            {
+                encoder.shortForm(size == 1 ? 0xb0 : 0xb8, size, dest.reg);
+                encoder.field(source, size);
+            }
+        }
+        else if (source.kind == Operand::Imm)
+        {
+            checkImmediate(source, size);
+            encoder.modrm({size == 1 ? 0xc6 : 0xc7}, size, nullptr, 0, dest);
+            encoder.field(source, size == 8 ? 4 : size);
+        }
+        else if (source.kind == Operand::Reg)
+            encoder.modrm({size == 1 ? 0x88 : 0x89}, size, &source.reg, 0, dest);
+        else if (dest.kind == Operand::Reg)
+            encoder.modrm({size == 1 ? 0x8a : 0x8b}, size, &dest.reg, 0, source);
+        else
+            throw std::runtime_error("Two memory operands");
+    }
+
+    // One-operand group of F6/F7: not, neg, mul, imul, div, idiv
+    void unary(Encoder &encoder, int digit, const Operand &operand)
+    {
+        if (!operand.size)
+            throw std::runtime_error("Operand size not specified");
+        encoder.modrm({operand.size == 1 ? 0xf6 : 0xf7}, operand.size, nullptr, digit, operand);
+    }
+
+    void shift(Encoder &encoder, int digit, const Operand &dest, const Operand &count)
+    {
+        int size = dest.size;
+        if (!size)
+            throw std::runtime_error("Operand size not specified");
+        if (count.kind == Operand::Reg && count.reg.number == 1 && count.size == 1)
+            encoder.modrm({size == 1 ? 0xd2 : 0xd3}, size, nullptr, digit, dest);
+        else if (count.kind == Operand::Imm && count.symbol.empty() && count.value == 1)
+            encoder.modrm({size == 1 ? 0xd0 : 0xd1}, size, nullptr, digit, dest);
+        else if (count.kind == Operand::Imm)
+        {
+            encoder.modrm({size == 1 ? 0xc0 : 0xc1}, size, nullptr, digit, dest);
+            encoder.field(count, 1);
+        }
+        else
+            throw std::runtime_error("Shift count must be an immediate or cl");
+    }
+
+    // reg, r/m forms with a 0F-prefixed opcode
+    void registerFromRm(Encoder &encoder, std::initializer_list<int> opcode, const Operand &dest, const Operand &source)
+    {
+        if (dest.kind != Operand::Reg)
+            throw std::runtime_error("Destination must be a register");
+        encoder.modrm(opcode, dest.size, &dest.reg, 0, source);
+    }
+
+    void encodeInstruction(Encoder &encoder, const MachineInstr &instr, const std::string &scope)
+    {
+        std::vector<Operand> ops;
+        for (const auto &operand : instr.operands)
+            ops.push_back(convert(operand, scope));
+
+        auto expect = [&](size_t count)
+        {
+            if (ops.size() != count)
+                throw std::runtime_error("Wrong operand count for " + instr.mnemonic());
+        };
+
+        switch (instr.opcode)
+        {
+        case Opcode::Comment:
+            return;
+        case Opcode::Mov:
+            expect(2);
+            move(encoder, ops[0], ops[1]);
+            return;
+        case Opcode::Movsxd:
+            expect(2);
+            registerFromRm(encoder, {0x63}, ops[0], ops[1]);
+            return;
+        case Opcode::Movzx:
+        {
+            expect(2);
+            int sourceSize = ops[1].size;
+            if (sourceSize != 1 && sourceSize != 2)
+                throw std::runtime_error("movzx source must be a byte or word");
+            registerFromRm(encoder, {0x0f, sourceSize == 1 ? 0xb6 : 0xb7}, ops[0], ops[1]);
+            return;
+        }
+        case Opcode::Lea:
+            expect(2);
+            if (ops[1].kind != Operand::Mem)
+                throw std::runtime_error("lea needs a memory operand");
+            registerFromRm(encoder, {0x8d}, ops[0], ops[1]);
+            return;
+        case Opcode::Xchg:
+        {
+            expect(2);
+            const Operand &reg = ops[1].kind == Operand::Reg ? ops[1] : ops[0];
+            const Operand &rm = ops[1].kind == Operand::Reg ? ops[0] : ops[1];
+            if (reg.kind != Operand::Reg)
+                throw std::runtime_error("xchg needs a register operand");
+            encoder.modrm({reg.size == 1 ? 0x86 : 0x87}, reg.size, &reg.reg, 0, rm);
+            return;
+        }
+        case Opcode::Push:
+            expect(1);
+            if (ops[0].kind == Operand::Reg)
+                encoder.shortForm(0x50, 8, ops[0].reg, true);
+            else if (ops[0].kind == Operand::Mem)
+                encoder.modrm({0xff}, 8, nullptr, 6, ops[0], true);
+            else if (ops[0].symbol.empty() && fitsInt8(ops[0].value))
+            {
+                encoder.byte(0x6a);
+                encoder.value(ops[0].value, 1);
+            }
+            else
+            {
+                checkImmediate(ops[0], 8);
+                encoder.byte(0x68);
+                encoder.field(ops[0], 4);
+            }
+            return;
+        case Opcode::Pop:
+            expect(1);
+            if (ops[0].kind == Operand::Reg)
+                encoder.shortForm(0x58, 8, ops[0].reg, true);
+            else
+                encoder.modrm({0x8f}, 8, nullptr, 0, ops[0], true);
+            return;
+        case Opcode::Add:
+        case Opcode::Or:
+        case Opcode::And:
+        case Opcode::Sub:
+        case Opcode::Xor:
+        case Opcode::Cmp:
+        {
+            expect(2);
+            int digit = instr.opcode == Opcode::Add ? 0 : instr.opcode == Opcode::Or ? 1 : instr.opcode == Opcode::And ? 4
+                      : instr.opcode == Opcode::Sub ? 5 : instr.opcode == Opcode::Xor ? 6 : 7;
+            arithmetic(encoder, digit, ops[0], ops[1]);
+            return;
+        }
+        case Opcode::Test:
+        {
+            expect(2);
+            const Operand *dest = &ops[0], *source = &ops[1];
+            if (dest->kind == Operand::Reg && source->kind == Operand::Mem)
+                std::swap(dest, source);
+            int size = operandSize(*dest, *source);
+            checkImmediate(*source, size);
+            if (source->kind == Operand::Imm)
+            {
+                encoder.modrm({size == 1 ? 0xf6 : 0xf7}, size, nullptr, 0, *dest);
+                encoder.field(*source, size == 8 ? 4 : size);
+            }
+            else if (source->kind == Operand::Reg)
+                encoder.modrm({size == 1 ? 0x84 : 0x85}, size, &source->reg, 0, *dest);
+            else
+                throw std::runtime_error("Two memory operands");
+            return;
+        }
+        case Opcode::Imul:
+            if (ops.size() == 1)
+                unary(encoder, 5, ops[0]);
+            else if (ops.size() == 2)
+                registerFromRm(encoder, {0x0f, 0xaf}, ops[0], ops[1]);
+            else
+            {
+                expect(3);
+                if (ops[2].kind != Operand::Imm)
+                    throw std::runtime_error("imul needs an immediate third operand");
+                checkImmediate(ops[2], ops[0].size);
+                bool shortImm = ops[2].symbol.empty() && fitsInt8(ops[2].value);
+                registerFromRm(encoder, {shortImm ? 0x6b : 0x69}, ops[0], ops[1]);
+                encoder.field(ops[2], shortImm ? 1 : ops[0].size == 2 ? 2 : 4);
+            }
+            return;
+        case Opcode::Not:
+        case Opcode::Neg:
+        case Opcode::Mul:
+        case Opcode::Div:
+        case Opcode::Idiv:
+        {
+            expect(1);
+            int digit = instr.opcode == Opcode::Not ? 2 : instr.opcode == Opcode::Neg ? 3 : instr.opcode == Opcode::Mul ? 4
+                      : instr.opcode == Opcode::Div ? 6 : 7;
+            unary(encoder, digit, ops[0]);
+            return;
+        }
+        case Opcode::Inc:
+        case Opcode::Dec:
+            expect(1);
+            if (!ops[0].size)
+                throw std::runtime_error("Operand size not specified");
+            encoder.modrm({ops[0].size == 1 ? 0xfe : 0xff}, ops[0].size, nullptr, instr.opcode == Opcode::Inc ? 0 : 1, ops[0]);
+            return;
+        case Opcode::Shl:
+        case Opcode::Shr:
+        case Opcode::Sar:
+            expect(2);
+            shift(encoder, instr.opcode == Opcode::Shl ? 4 : instr.opcode == Opcode::Shr ? 5 : 7, ops[0], ops[1]);
+            return;
+        case Opcode::Bsr:
+            expect(2);
+            registerFromRm(encoder, {0x0f, 0xbd}, ops[0], ops[1]);
+            return;
+        case Opcode::Bt:
+            expect(2);
+            if (ops[1].kind == Operand::Reg)
+                encoder.modrm({0x0f, 0xa3}, ops[1].size, &ops[1].reg, 0, ops[0]);
+            else
+            {
+                if (!ops[0].size)
+                    throw std::runtime_error("Operand size not specified");
+                encoder.modrm({0x0f, 0xba}, ops[0].size, nullptr, 4, ops[0]);
+                encoder.field(ops[1], 1);
+            }
+            return;
+        case Opcode::Cqo:
+            encoder.byte(0x48);
+            encoder.byte(0x99);
+            return;
+        case Opcode::Jmp:
+            expect(1);
+            if (ops[0].kind != Operand::Imm)
+                encoder.modrm({0xff}, 8, nullptr, 4, ops[0], true); // indirect
+            else
+                encoder.branch({0xe9}, ops[0]);
+            return;
+        case Opcode::Jcc:
+            expect(1);
+            encoder.branch({0x0f, 0x80 + conditionCode(instr.condition)}, ops[0]);
+            return;
+        case Opcode::Call:
+            expect(1);
+            encoder.branch({0xe8}, ops[0]);
+            return;
+        case Opcode::Setcc:
+            expect(1);
+            if (ops[0].size && ops[0].size != 1)
+                throw std::runtime_error("set" + instr.condition + " needs a byte operand");
+            encoder.modrm({0x0f, 0x90 + conditionCode(instr.condition)}, 1, nullptr, 0, ops[0]);
+            return;
+        case Opcode::Cmovcc:
+            expect(2);
+            registerFromRm(encoder, {0x0f, 0x40 + conditionCode(instr.condition)}, ops[0], ops[1]);
+            return;
+        case Opcode::Ret:
+            encoder.byte(0xc3);
+            return;
+        case Opcode::Syscall:
+            encoder.byte(0x0f);
+            encoder.byte(0x05);
+            return;
+        }
+        throw std::runtime_error("Cannot encode " + instr.str());
+    }
+
+    // Comma-separated list, keeping commas inside quotes
+    std::vector<std::string> splitList(const std::string &text)
+    {
+        std::vector<std::string> items;
+        std::string current;
+        char quote = 0;
+        for (char c : text)
+        {
+            if (quote)
+            {
+                if (c == quote)
+                    quote = 0;
+            }
+            else if (c == '"' || c == '\'')
+                quote = c;
+            else if (c == ',')
+            {
+                items.push_back(trim(current));
+                current.clear();
+                continue;
+            }
+            current += c;
+        }
+        items.push_back(trim(current));
+        return items;
+    }
+
+    // "name db|dw|dd|dq values" or "name times N db value". A dd or dq
+    // value may name a symbol, which is patched to its address.
+    void assembleData(const std::string &line, std::vector<uint8_t> &data, std::map<std::string, uint64_t> &offsets,
+                      std::vector<Fixup> &fixups)
+    {
+        std::string text = trim(line);
+        size_t space = text.find_first_of(" \t");
+        if (space == std::string::npos)
+            throw std::runtime_error("Cannot assemble data: " + line);
+        std::string name = text.substr(0, space), rest = trim(text.substr(space));
+        if (!name.empty() && name.back() == ':')
+            name.pop_back();
+        offsets[name] = data.size();
+
+        int64_t repeat = 1;
+        if (rest.compare(0, 6, "times ") == 0)
+        {
+            rest = trim(rest.substr(6));
+            size_t end = rest.find_first_of(" \t");
+            if (end == std::string::npos || !parseNumber(rest.substr(0, end), repeat))
+                throw std::runtime_error("Cannot assemble data: " + line);
+            rest = trim(rest.substr(end));
+        }
+
+        std::string directive = rest.substr(0, 2);
+        int width = directive == "db" ? 1 : directive == "dw" ? 2 : directive == "dd" ? 4 : directive == "dq" ? 8 : 0;
+        if (!width || (rest.size() > 2 && rest[2] != ' ' && rest[2] != '\t'))
+            throw std::runtime_error("Cannot assemble data: " + line);
+
+        std::vector<uint8_t> bytes;
+        for (const std::string &item : splitList(trim(rest.substr(2))))
+        {
+            int64_t value;
+            if (width == 1 && item.size() >= 2 && item.front() == '"' && item.back() == '"')
+                bytes.insert(bytes.end(), item.begin() + 1, item.end() - 1);
+            else if (parseSigned(item, value))
+            {
+                for (int i = 0; i < width; ++i)
+                    bytes.push_back(static_cast<uint8_t>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff));
+            }
+            else if (width >= 4 && repeat == 1 && !item.empty() &&
+                     (std::isalpha(static_cast<unsigned char>(item[0])) || item[0] == '_'))
+            {
+                fixups.push_back({data.size() + bytes.size(), item, 0, width, false});
+                bytes.resize(bytes.size() + width);
+            }
+            else
+                throw std::runtime_error("Cannot assemble data: " + line);
+        }
+        for (int64_t i = 0; i < repeat; ++i)
+            data.insert(data.end(), bytes.begin(), bytes.end());
+    }
+
+    // "name resb|resw|resd|resq count"; returns the bytes reserved
+    uint64_t reserveBss(const std::string &line, uint64_t offset, std::map<std::string, uint64_t> &offsets)
+    {
+        std::string text = trim(line);
+        size_t space = text.find_first_of(" \t");
+        std::string rest = space == std::string::npos ? "" : trim(text.substr(space));
+        int64_t count;
+        int width = rest.compare(0, 5, "resb ") == 0 ? 1 : rest.compare(0, 5, "resw ") == 0 ? 2
+                  : rest.compare(0, 5, "resd ") == 0 ? 4 : rest.compare(0, 5, "resq ") == 0 ? 8 : 0;
+        if (!width || !parseNumber(trim(rest.substr(5)), count))
+            throw std::runtime_error("Cannot reserve: " + line);
+        offsets[text.substr(0, space)] = offset;
+        return static_cast<uint64_t>(count) * width;
+    }
+}
+
+AssembledImage Assembler::assemble(const MachineModule &module, uint64_t textAddress)
+{
+    AssembledImage image;
+    image.textAddress = textAddress;
+
+    // Text, with label offsets
+    Encoder encoder;
+    std::map<std::string, uint64_t> textOffsets;
+    std::string scope;
+    for (const auto &function : module.functions)
+    {
+        for (const auto &block : function.blocks)
+        {
+            if (!block.label.empty())
+            {
+                std::string name = qualify(block.label, scope);
+                if (block.label[0] != '.')
+                    scope = block.label;
+                if (!textOffsets.emplace(name, encoder.code.size()).second)
+                    throw std::runtime_error("Label defined twice: " + name);
+            }
+            for (const auto &instr : block.instrs)
+                encodeInstruction(encoder, instr, scope);
+        }
+    }
+    image.text = std::move(encoder.code);
+
+    std::map<std::string, uint64_t> rodataOffsets, dataOffsets, bssOffsets;
+    std::vector<Fixup> rodataFixups, dataFixups;
+    for (const auto &line : module.rodata)
+        assembleData(line, image.rodata, rodataOffsets, rodataFixups);
+    for (const auto &line : module.data)
+        assembleData(line, image.data, dataOffsets, dataFixups);
+    for (const auto &line : module.bss)
+        image.bssSize += reserveBss(line, image.bssSize, bssOffsets);
+
+    // Layout
+    image.rodataAddress = alignUp(textAddress + image.text.size(), 8);
+    image.dataAddress = alignUp(image.rodataAddress + image.rodata.size(), pageSize);
+    image.bssAddress = alignUp(image.dataAddress + image.data.size(), 16);
+    auto define = [&](const std::map<std::string, uint64_t> &offsets, uint64_t base)
+    {
+        for (const auto &entry : offsets)
+        {
+            if (!image.symbols.emplace(entry.first, base + entry.second).second)
+                throw std::runtime_error("Symbol defined twice: " + entry.first);
+        }
+    };
+    define(textOffsets, image.textAddress);
+    define(rodataOffsets, image.rodataAddress);
+    define(dataOffsets, image.dataAddress);
+    define(bssOffsets, image.bssAddress);
+    if (image.end() > INT32_MAX)
+        throw std::runtime_error("Image does not fit below 2 GiB");
+
+    // Patch symbol references
+    auto patch = [&](std::vector<uint8_t> &bytes, uint64_t base, const std::vector<Fixup> &fixups)
+    {
+        for (const Fixup &fixup : fixups)
+        {
+            auto symbol = image.symbols.find(fixup.symbol);
+            if (symbol == image.symbols.end())
+                throw std::runtime_error("Undefined symbol: " + fixup.symbol);
+            int64_t value = static_cast<int64_t>(symbol->second) + fixup.addend;
+            if (fixup.relative)
+                value -= static_cast<int64_t>(base + fixup.offset + fixup.width);
+            if (fixup.width == 4 && !fitsInt32(value))
+                throw std::runtime_error("Reference to " + fixup.symbol + " out of range");
+            for (int i = 0; i < fixup.width; ++i)
+                bytes[fixup.offset + i] = static_cast<uint8_t>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff);
+        }
+    };
+    patch(image.text, image.textAddress, encoder.fixups);
+    patch(image.rodata, image.rodataAddress, rodataFixups);
+    patch(image.data, image.dataAddress, dataFixups);
+
+    auto start = image.symbols.find("_start");
+    if (start == image.symbols.end())
+        throw std::runtime_error("No _start symbol");
+    image.entry = start->second;
+    return image;
+}
@@ -0,0 +1,1077 @@
+#include "BytecodeVM.h"
+#include "Optimizer.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <unistd.h>
+
+namespace
+{
+    const size_t maxRegisterArguments = 6; // calls the native backend accepts
+    const size_t outputBufferSize = 65536;
+    const size_t maxRegisterFile = (8 << 20) / sizeof(int64_t); // the 8 MiB native stack
+
+    // Comparison operators in the order of the Eq ... Ge opcodes
+    const char *const comparisons[] = {"==", "!=", "<", "<=", ">", ">="};
+    const int mirrored[] = {0, 1, 4, 5, 2, 3}; // a op b == b mirrored(op) a
+    const int inverted[] = {1, 0, 5, 4, 3, 2}; // !(a op b) == a inverted(op) b
+
+    int comparisonIndex(const std::string &op)
+    {
+        for (int i = 0; i < 6; ++i)
+        {
+            if (op == comparisons[i])
+                return i;
+        }
+        return -1;
+    }
+
+    VmOp offset(VmOp first, int index)
+    {
+        return static_cast<VmOp>(static_cast<int>(first) + index);
+    }
+
+    bool constant(const ExprAST *expr, int32_t &value)
+    {
+        long long result;
+        if (!evaluateConstant(expr, result))
+            return false;
+        value = static_cast<int32_t>(result);
+        return true;
+    }
+
+    // Every variable a function stores to gets a home register
+    void collectHomes(const StmtAST *stmt, std::set<std::string> &names)
+    {
+        if (!stmt)
+            return;
+        if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+        {
+            for (const auto &var : varDecl->getVars())
+            {
+                names.insert(var.first);
+                collectWrittenVariables(var.second.get(), names);
+            }
+        }
+        else if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+            collectWrittenVariables(exprStmt->getExpr(), names);
+        else if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+                collectHomes(child.get(), names);
+        }
+        else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+        {
+            collectWrittenVariables(ifStmt->getCondition(), names);
+            collectHomes(ifStmt->getThen(), names);
+            collectHomes(ifStmt->getElse(), names);
+        }
+        else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+        {
+            collectWrittenVariables(whileStmt->getCondition(), names);
+            collectHomes(whileStmt->getBody(), names);
+        }
+        else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+        {
+            collectHomes(forStmt->getInit(), names);
+            collectWrittenVariables(forStmt->getCondition(), names);
+            collectWrittenVariables(forStmt->getUpdate(), names);
+            collectHomes(forStmt->getBody(), names);
+        }
+        else if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+        {
+            collectWrittenVariables(switchStmt->getValue(), names);
+            for (const auto &c : switchStmt->getCases())
+                collectHomes(c.Body.get(), names);
+        }
+        else if (const ReturnStmtAST *returnStmt = dynamic_cast<const ReturnStmtAST *>(stmt))
+            collectWrittenVariables(returnStmt->getValue(), names);
+        else if (const PrintStmtAST *printStmt = dynamic_cast<const PrintStmtAST *>(stmt))
+            collectWrittenVariables(printStmt->getValue(), names);
+    }
+
+    // Lowers one function at a time. Like the native code generator, a
+    // variable is known from its declaration or first assignment on, in
+    // program order; reading it before that gives 0.
+    class Compiler
+    {
+    public:
+        Compiler(VmProgram &program, const std::map<std::string, int> &functions)
+            : program(program), functions(functions)
+        {
+        }
+
+        void function(VmFunction &function, const std::vector<std::pair<DataType, std::string>> &params,
+                      const std::vector<const StmtAST *> &body, bool topLevel)
+        {
+            this->topLevel = topLevel;
+            homes.clear();
+            variables.clear();
+            loops.clear();
+
+            std::set<std::string> names;
+            for (const auto *stmt : body)
+                collectHomes(stmt, names);
+            for (const auto &param : params)
+                homes.emplace(param.second, static_cast<int>(homes.size()));
+            for (const auto &name : names)
+                homes.emplace(name, static_cast<int>(homes.size()));
+            nextTemp = maxTemp = static_cast<int>(homes.size());
+
+            // Arguments are stored into their parameters like any other
+            // value, so int parameters wrap
+            function.entry = static_cast<int>(program.code.size());
+            function.params = static_cast<int>(params.size());
+            for (const auto &param : params)
+            {
+                int reg = homes[param.second];
+                variables[param.second] = {reg, getTypeSize(param.first) == 8};
+                if (getTypeSize(param.first) != 8)
+                    emit(VmOp::Sext, reg, reg);
+            }
+
+            for (const auto *stmt : body)
+                statement(stmt);
+            int zero = temp();
+            emit(VmOp::LoadI, zero, 0);
+            emit(topLevel ? VmOp::Halt : VmOp::Ret, zero);
+            function.frameSize = std::max(maxTemp, 1);
+        }
+
+    private:
+        struct Variable
+        {
+            int reg;
+            bool wide; // 8 bytes; narrower values wrap to 32 bits
+        };
+
+        // An enclosing loop, or a switch, which only takes breaks
+        struct Loop
+        {
+            std::vector<int> breaks;
+            std::vector<int> continues;
+            bool isSwitch = false;
+        };
+
+        VmProgram &program;
+        const std::map<std::string, int> &functions;
+        std::map<std::string, int> homes;
+        std::map<std::string, Variable> variables;
+        std::vector<Loop> loops;
+        int nextTemp = 0;
+        int maxTemp = 0;
+        bool topLevel = false;
+
+        int emit(VmOp op, int32_t a = 0, int32_t b = 0, int32_t c = 0)
+        {
+            program.code.push_back({op, a, b, c});
+            return static_cast<int>(program.code.size()) - 1;
+        }
+
+        int here() const { return static_cast<int>(program.code.size()); }
+
+        void patch(const std::vector<int> &jumps, int target)
+        {
+            for (int jump : jumps)
+                program.code[jump].c = target;
+        }
+
+        int temp()
+        {
+            maxTemp = std::max(maxTemp, nextTemp + 1);
+            return nextTemp++;
+        }
+
+        // Map a function call to its index, or -1 if the native backend
+        // would not call it either
+        int callee(const CallExprAST *call) const
+        {
+            auto found = functions.find(call->getCallee());
+            if (found == functions.end() || call->getArgs().size() > maxRegisterArguments ||
+                static_cast<int>(call->getArgs().size()) != program.functions[found->second].params)
+                return -1;
+            return found->second;
+        }
+
+        // Evaluate the arguments into consecutive temporaries, where the
+        // callee's frame will start
+        int arguments(const CallExprAST *call)
+        {
+            int base = nextTemp;
+            for (const auto &arg : call->getArgs())
+                expression(arg.get(), temp());
+            return base;
+        }
+
+        // A register holding the value of expr. A variable is read in place
+        // unless evaluating what follows it could store to it first.
+        int operand(const ExprAST *expr, const ExprAST *evaluatedAfter = nullptr)
+        {
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                auto found = variables.find(var->getName());
+                std::set<std::string> written;
+                collectWrittenVariables(evaluatedAfter, written);
+                if (found != variables.end() && !written.count(var->getName()))
+                    return found->second.reg;
+            }
+            int reg = temp();
+            expression(expr, reg);
+            return reg;
+        }
+
+        // Evaluate expr into dest. dest is only written by the last
+        // instruction, so expr may still read the variable living there.
+        void expression(const ExprAST *expr, int dest)
+        {
+            int32_t value;
+            if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+                emit(VmOp::LoadI, dest, static_cast<int>(num->getValue()));
+            else if (constant(expr, value))
+                emit(VmOp::LoadI, dest, value);
+            else if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                auto found = variables.find(var->getName());
+                if (found == variables.end())
+                    emit(VmOp::LoadI, dest, 0);
+                else if (found->second.reg != dest)
+                    emit(VmOp::Mov, dest, found->second.reg);
+            }
+            else if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+                binaryExpression(binary, dest);
+            else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                const std::string &op = unary->getOp();
+                if (op != "-" && op != "!" && op != "~")
+                {
+                    expression(unary->getOperand(), dest);
+                    return;
+                }
+                int mark = nextTemp;
+                int source = operand(unary->getOperand());
+                emit(op == "-" ? VmOp::Neg : op == "!" ? VmOp::Not : VmOp::BitNot, dest, source);
+                nextTemp = mark;
+            }
+            else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+            {
+                // flush() writes out buffered print output, unless the
+                // program defines a function of that name
+                int index = callee(call);
+                if (call->getCallee() == "flush" && call->getArgs().empty() && !functions.count("flush"))
+                    emit(VmOp::Flush);
+                if (index < 0)
+                {
+                    emit(VmOp::LoadI, dest, 0);
+                    return;
+                }
+                int mark = nextTemp;
+                emit(VmOp::Call, dest, index, arguments(call));
+                nextTemp = mark;
+            }
+            else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+            {
+                const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(assign->getLHS());
+                if (!var)
+                {
+                    expression(assign->getRHS(), dest);
+                    return;
+                }
+                int reg = store(var->getName(), assign->getRHS());
+                if (reg != dest)
+                    emit(VmOp::Mov, dest, reg);
+            }
+            else if (const ScopeExprAST *scope = dynamic_cast<const ScopeExprAST *>(expr))
+                expression(scope->getBase(), dest);
+            else
+                emit(VmOp::LoadI, dest, 0); // strings and arrays have no values yet
+        }
+
+        void binaryExpression(const BinaryExprAST *binary, int dest)
+        {
+            const std::string &op = binary->getOp();
+            const ExprAST *lhs = binary->getLHS(), *rhs = binary->getRHS();
+
+            // && and || only evaluate the right operand when the left one
+            // does not decide the result, and produce 0 or 1
+            if (op == "&&" || op == "||")
+            {
+                bool isAnd = op == "&&";
+                std::vector<int> decided, end;
+                branch(lhs, !isAnd, decided);
+                branch(rhs, !isAnd, decided);
+                emit(VmOp::LoadI, dest, isAnd);
+                end.push_back(emit(VmOp::Jmp));
+                patch(decided, here());
+                emit(VmOp::LoadI, dest, !isAnd);
+                patch(end, here());
+                return;
+            }
+
+            int mark = nextTemp;
+            int32_t value;
+            int comparison = comparisonIndex(op);
+            bool commutative = op == "+" || op == "*";
+            bool immediate = op == "+" || op == "-" || op == "*";
+            if ((comparison >= 0 || immediate) && constant(rhs, value))
+            {
+                int left = operand(lhs);
+                if (comparison >= 0)
+                    emit(offset(VmOp::EqI, comparison), dest, left, value);
+                else
+                    emit(op == "+" ? VmOp::AddI : op == "-" ? VmOp::SubI : VmOp::MulI, dest, left, value);
+            }
+            else if ((comparison >= 0 || commutative) && constant(lhs, value))
+            {
+                int right = operand(rhs);
+                if (comparison >= 0)
+                    emit(offset(VmOp::EqI, mirrored[comparison]), dest, right, value);
+                else
+                    emit(op == "+" ? VmOp::AddI : VmOp::MulI, dest, right, value);
+            }
+            else
+            {
+                int left = operand(lhs, rhs);
+                int right = operand(rhs);
+                if (comparison >= 0)
+                    emit(offset(VmOp::Eq, comparison), dest, left, right);
+                else if (op == "+")
+                    emit(VmOp::Add, dest, left, right);
+                else if (op == "-")
+                    emit(VmOp::Sub, dest, left, right);
+                else if (op == "*")
+                    emit(VmOp::Mul, dest, left, right);
+                else if (op == "/")
+                    emit(VmOp::Div, dest, left, right);
+                else if (op == "%")
+                    emit(VmOp::Mod, dest, left, right);
+                else if (left != dest)
+                    emit(VmOp::Mov, dest, left); // no other operators yet
+            }
+            nextTemp = mark;
+        }
+
+        // Jump to one of the given jumps' targets (patched later) when the
+        // condition is true, or false. Comparisons become a single fused
+        // compare-and-branch, ! swaps the sense of the jump, and && and ||
+        // become chains of jumps.
+        void branch(const ExprAST *condition, bool jumpIfTrue, std::vector<int> &jumps)
+        {
+            int32_t value;
+            if (constant(condition, value))
+            {
+                if ((value != 0) == jumpIfTrue)
+                    jumps.push_back(emit(VmOp::Jmp));
+                return;
+            }
+
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(condition))
+            {
+                if (unary->getOp() == "!")
+                {
+                    branch(unary->getOperand(), !jumpIfTrue, jumps);
+                    return;
+                }
+            }
+
+            int mark = nextTemp;
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(condition))
+            {
+                const std::string &op = binary->getOp();
+                bool isAnd = op == "&&";
+                if (isAnd || op == "||")
+                {
+                    // The left operand alone decides a && that is false and
+                    // a || that is true
+                    if (jumpIfTrue != isAnd)
+                    {
+                        branch(binary->getLHS(), jumpIfTrue, jumps);
+                        branch(binary->getRHS(), jumpIfTrue, jumps);
+                    }
+                    else
+                    {
+                        std::vector<int> skip;
+                        branch(binary->getLHS(), !jumpIfTrue, skip);
+                        branch(binary->getRHS(), jumpIfTrue, jumps);
+                        patch(skip, here());
+                    }
+                    return;
+                }
+
+                int comparison = comparisonIndex(op);
+                if (comparison >= 0)
+                {
+                    if (!jumpIfTrue)
+                        comparison = inverted[comparison];
+                    if (constant(binary->getRHS(), value))
+                    {
+                        int left = operand(binary->getLHS());
+                        jumps.push_back(emit(offset(VmOp::JEqI, comparison), left, value));
+                    }
+                    else if (constant(binary->getLHS(), value))
+                    {
+                        int right = operand(binary->getRHS());
+                        jumps.push_back(emit(offset(VmOp::JEqI, mirrored[comparison]), right, value));
+                    }
+                    else
+                    {
+                        int left = operand(binary->getLHS(), binary->getRHS());
+                        int right = operand(binary->getRHS());
+                        jumps.push_back(emit(offset(VmOp::JEq, comparison), left, right));
+                    }
+                    nextTemp = mark;
+                    return;
+                }
+            }
+
+            int reg = operand(condition);
+            jumps.push_back(emit(jumpIfTrue ? VmOp::Jnz : VmOp::Jz, reg));
+            nextTemp = mark;
+        }
+
+        // Evaluate value into the variable's home and wrap it to the
+        // variable's width. A variable first assigned here takes the type of
+        // the value, after the value is evaluated.
+        int store(const std::string &name, const ExprAST *value)
+        {
+            int reg = homes.at(name);
+            int start = here();
+            expression(value, reg);
+            auto found = variables.find(name);
+            if (found == variables.end())
+                found = variables.emplace(name, Variable{reg, getTypeSize(inferTypeFromExpression(value)) == 8}).first;
+            if (!found->second.wide)
+                wrap(reg, start);
+            return reg;
+        }
+
+        // Wrap the value just computed into reg to 32 bits, in the
+        // instruction that computed it when that has a wrapping form
+        void wrap(int reg, int start)
+        {
+            if (here() > start && program.code.back().a == reg)
+            {
+                VmInstr &last = program.code.back();
+                static const std::pair<VmOp, VmOp> wrapping[] = {{VmOp::Add, VmOp::AddW},   {VmOp::Sub, VmOp::SubW},
+                                                                 {VmOp::Mul, VmOp::MulW},   {VmOp::AddI, VmOp::AddIW},
+                                                                 {VmOp::SubI, VmOp::SubIW}, {VmOp::MulI, VmOp::MulIW}};
+                for (const auto &form : wrapping)
+                {
+                    if (last.op == form.first)
+                    {
+                        last.op = form.second;
+                        return;
+                    }
+                }
+
+                // Values that already fit
+                if (last.op == VmOp::LoadI || last.op == VmOp::Not ||
+                    (last.op >= VmOp::Eq && last.op <= VmOp::GeI) || (last.op == VmOp::Mov && narrow(last.b)))
+                    return;
+            }
+            emit(VmOp::Sext, reg, reg);
+        }
+
+        // True if reg is the home of a variable that holds 32-bit values
+        bool narrow(int reg) const
+        {
+            for (const auto &var : variables)
+            {
+                if (var.second.reg == reg)
+                    return !var.second.wide;
+            }
+            return false;
+        }
+
+        void statement(const StmtAST *stmt)
+        {
+            if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+            {
+                // The variable is known inside its own initializer
+                for (const auto &var : varDecl->getVars())
+                {
+                    int reg = homes.at(var.first);
+                    variables[var.first] = {reg, getTypeSize(varDecl->getVarType()) == 8};
+                    if (var.second)
+                        store(var.first, var.second.get());
+                    else
+                        emit(VmOp::LoadI, reg, 0);
+                }
+            }
+            else if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+                effect(exprStmt->getExpr());
+            else if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            {
+                for (const auto &child : compound->getStatements())
+                    statement(child.get());
+            }
+            else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            {
+                std::vector<int> otherwise, end;
+                branch(ifStmt->getCondition(), false, otherwise);
+                statement(ifStmt->getThen());
+                if (ifStmt->getElse())
+                    end.push_back(emit(VmOp::Jmp));
+                patch(otherwise, here());
+                statement(ifStmt->getElse());
+                patch(end, here());
+            }
+            else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+            {
+                // Rotated like the native loops: one fused branch per
+                // iteration, at the bottom
+                std::vector<int> end, again;
+                branch(whileStmt->getCondition(), false, end);
+                int top = here();
+                loops.emplace_back();
+                statement(whileStmt->getBody());
+                patch(loops.back().continues, here());
+                branch(whileStmt->getCondition(), true, again);
+                patch(again, top);
+                patch(end, here());
+                patch(loops.back().breaks, here());
+                loops.pop_back();
+            }
+            else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+            {
+                std::vector<int> end, again;
+                statement(forStmt->getInit());
+                if (forStmt->getCondition())
+                    branch(forStmt->getCondition(), false, end);
+                int top = here();
+                loops.emplace_back();
+                statement(forStmt->getBody());
+                patch(loops.back().continues, here());
+                effect(forStmt->getUpdate());
+                if (forStmt->getCondition())
+                    branch(forStmt->getCondition(), true, again);
+                else
+                    again.push_back(emit(VmOp::Jmp));
+                patch(again, top);
+                patch(end, here());
+                patch(loops.back().breaks, here());
+                loops.pop_back();
+            }
+            else if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+                switchStatement(switchStmt);
+            else if (const ReturnStmtAST *returnStmt = dynamic_cast<const ReturnStmtAST *>(stmt))
+                returnStatement(returnStmt->getValue());
+            else if (dynamic_cast<const BreakStmtAST *>(stmt))
+            {
+                if (!loops.empty())
+                    loops.back().breaks.push_back(emit(VmOp::Jmp));
+            }
+            else if (dynamic_cast<const ContinueStmtAST *>(stmt))
+            {
+                for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop)
+                {
+                    if (!loop->isSwitch)
+                    {
+                        loop->continues.push_back(emit(VmOp::Jmp));
+                        break;
+                    }
+                }
+            }
+            else if (const PrintStmtAST *printStmt = dynamic_cast<const PrintStmtAST *>(stmt))
+            {
+                int mark = nextTemp;
+                emit(VmOp::Print, operand(printStmt->getValue()));
+                nextTemp = mark;
+            }
+        }
+
+        // Cases are entered through a binary search of fused compares on the
+        // sorted case values; the bytecode has no indirect jump for a table
+        void switchStatement(const SwitchStmtAST *switchStmt)
+        {
+            const auto &cases = switchStmt->getCases();
+            std::vector<std::pair<long long, size_t>> targets; // value, case
+            std::vector<std::vector<int>> entries(cases.size());
+            std::vector<int> otherwise;
+            for (size_t i = 0; i < cases.size(); ++i)
+            {
+                for (long long value : cases[i].Values)
+                    targets.emplace_back(value, i);
+            }
+            std::sort(targets.begin(), targets.end());
+
+            int mark = nextTemp;
+            int value = operand(switchStmt->getValue());
+            dispatch(value, targets, 0, targets.size(), entries, otherwise);
+            nextTemp = mark;
+
+            loops.emplace_back();
+            loops.back().isSwitch = true;
+            for (size_t i = 0; i < cases.size(); ++i)
+            {
+                patch(entries[i], here());
+                if (cases[i].IsDefault)
+                    patch(otherwise, here());
+                statement(cases[i].Body.get());
+            }
+            if (!switchStmt->hasDefault())
+                patch(otherwise, here());
+            patch(loops.back().breaks, here());
+            loops.pop_back();
+        }
+
+        void dispatch(int value, const std::vector<std::pair<long long, size_t>> &targets, size_t begin, size_t end,
+                      std::vector<std::vector<int>> &entries, std::vector<int> &otherwise)
+        {
+            if (end - begin <= 3)
+            {
+                for (size_t i = begin; i < end; ++i)
+                    entries[targets[i].second].push_back(emit(VmOp::JEqI, value, static_cast<int32_t>(targets[i].first)));
+                otherwise.push_back(emit(VmOp::Jmp));
+                return;
+            }
+            size_t middle = begin + (end - begin) / 2;
+            std::vector<int> upper;
+            upper.push_back(emit(VmOp::JGeI, value, static_cast<int32_t>(targets[middle].first)));
+            dispatch(value, targets, begin, middle, entries, otherwise);
+            patch(upper, here());
+            dispatch(value, targets, middle, end, entries, otherwise);
+        }
+
+        // An expression evaluated only for its effects; assignments store
+        // straight into the variable
+        void effect(const ExprAST *expr)
+        {
+            if (!expr)
+                return;
+            const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr);
+            const VariableExprAST *var = assign ? dynamic_cast<const VariableExprAST *>(assign->getLHS()) : nullptr;
+            if (var)
+            {
+                store(var->getName(), assign->getRHS());
+                return;
+            }
+            int mark = nextTemp;
+            expression(expr, temp());
+            nextTemp = mark;
+        }
+
+        void returnStatement(const ExprAST *value)
+        {
+            int mark = nextTemp;
+
+            // A returned call reuses the frame, so deep tail recursion runs
+            // in constant space as it does natively
+            const CallExprAST *call = dynamic_cast<const CallExprAST *>(value);
+            if (!topLevel && call && callee(call) >= 0)
+            {
+                emit(VmOp::TailCall, 0, callee(call), arguments(call));
+                nextTemp = mark;
+                return;
+            }
+
+            int reg;
+            if (value)
+                reg = operand(value);
+            else
+                emit(VmOp::LoadI, reg = temp(), 0);
+            emit(topLevel ? VmOp::Halt : VmOp::Ret, reg);
+            nextTemp = mark;
+        }
+    };
+
+    const char *const opNames[] = {"halt", "mov",   "loadi",  "sext",   "add",  "sub",  "mul",  "div",
+                                   "mod",  "addi",  "subi",   "muli",   "addw", "subw", "mulw", "addiw",
+                                   "subiw", "muliw", "neg",   "not",    "bitnot", "eq", "ne",   "lt",
+                                   "le",   "gt",    "ge",     "eqi",    "nei",  "lti",  "lei",  "gti",
+                                   "gei",  "jmp",   "jz",     "jnz",    "jeq",  "jne",  "jlt",  "jle",
+                                   "jgt",  "jge",   "jeqi",   "jnei",   "jlti", "jlei", "jgti", "jgei",
+                                   "call", "tailcall", "ret", "print",  "flush"};
+    static_assert(sizeof(opNames) / sizeof(opNames[0]) == static_cast<size_t>(VmOp::Flush) + 1,
+                  "every opcode has a name");
+
+    // print() output, buffered like the native runtime's: written out when
+    // the buffer fills, on flush() and at exit, and after every line when
+    // the output is a terminal
+    class Output
+    {
+    public:
+        explicit Output(int fd) : fd(fd), terminal(isatty(fd)), buffer(outputBufferSize) {}
+
+        void print(int64_t value)
+        {
+            if (length > outputBufferSize - 21)
+                flush();
+            length = std::to_chars(&buffer[length], buffer.data() + outputBufferSize, value).ptr - buffer.data();
+            buffer[length++] = '\n';
+            if (terminal)
+                flush();
+        }
+
+        void flush()
+        {
+            size_t written = 0;
+            while (written < length)
+            {
+                ssize_t count = write(fd, &buffer[written], length - written);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    break;
+                written += count;
+            }
+            length = 0;
+        }
+
+    private:
+        int fd;
+        bool terminal;
+        std::vector<char> buffer;
+        size_t length = 0;
+    };
+
+    // Two's complement arithmetic without signed overflow
+    int64_t wrap64(uint64_t value) { return static_cast<int64_t>(value); }
+    int64_t wrap32(uint64_t value) { return static_cast<int32_t>(static_cast<uint32_t>(value)); }
+}
+
+VmProgram BytecodeVM::compile(const ProgramAST &program)
+{
+    VmProgram result;
+    std::map<std::string, int> functions;
+    for (const auto &func : program.getFunctions())
+    {
+        VmFunction function;
+        function.name = func->getProto()->getName();
+        function.params = static_cast<int>(func->getProto()->getArgs().size());
+        functions.emplace(function.name, static_cast<int>(result.functions.size()));
+        result.functions.push_back(function);
+    }
+    result.main = static_cast<int>(result.functions.size());
+    result.functions.push_back({"(top level)"});
+
+    Compiler compiler(result, functions);
+    for (size_t i = 0; i < program.getFunctions().size(); ++i)
+    {
+        const auto &func = program.getFunctions()[i];
+        compiler.function(result.functions[i], func->getProto()->getArgs(), {func->getBody()}, false);
+    }
+    std::vector<const StmtAST *> statements;
+    for (const auto &stmt : program.getStatements())
+        statements.push_back(stmt.get());
+    compiler.function(result.functions[result.main], {}, statements, true);
+    return result;
+}
+
+std::string BytecodeVM::listing(const VmProgram &program)
+{
+    std::ostringstream out;
+    for (const auto &function : program.functions)
+    {
+        int end = static_cast<int>(program.code.size());
+        for (const auto &other : program.functions)
+        {
+            if (other.entry > function.entry)
+                end = std::min(end, other.entry);
+        }
+        out << function.name << ": ; " << function.params << " params, " << function.frameSize << " registers\n";
+        for (int pc = function.entry; pc < end; ++pc)
+        {
+            const VmInstr &instr = program.code[pc];
+            out << "    " << pc << "\t" << opNames[static_cast<int>(instr.op)];
+            auto reg = [](int32_t index) { return "r" + std::to_string(index); };
+            switch (instr.op)
+            {
+            case VmOp::Flush:
+                break;
+            case VmOp::Halt:
+            case VmOp::Ret:
+            case VmOp::Print:
+                out << " " << reg(instr.a);
+                break;
+            case VmOp::LoadI:
+                out << " " << reg(instr.a) << ", " << instr.b;
+                break;
+            case VmOp::Mov:
+            case VmOp::Sext:
+            case VmOp::Neg:
+            case VmOp::Not:
+            case VmOp::BitNot:
+                out << " " << reg(instr.a) << ", " << reg(instr.b);
+                break;
+            case VmOp::Jmp:
+                out << " " << instr.c;
+                break;
+            case VmOp::Jz:
+            case VmOp::Jnz:
+                out << " " << reg(instr.a) << ", " << instr.c;
+                break;
+            case VmOp::Call:
+                out << " " << reg(instr.a) << ", " << program.functions[instr.b].name << ", " << reg(instr.c);
+                break;
+            case VmOp::TailCall:
+                out << " " << program.functions[instr.b].name << ", " << reg(instr.c);
+                break;
+            default:
+                if (instr.op >= VmOp::JEqI)
+                    out << " " << reg(instr.a) << ", " << instr.b << ", " << instr.c;
+                else if (instr.op >= VmOp::JEq)
+                    out << " " << reg(instr.a) << ", " << reg(instr.b) << ", " << instr.c;
+                else if ((instr.op >= VmOp::AddI && instr.op <= VmOp::MulI) ||
+                         (instr.op >= VmOp::AddIW && instr.op <= VmOp::MulIW) || instr.op >= VmOp::EqI)
+                    out << " " << reg(instr.a) << ", " << reg(instr.b) << ", " << instr.c;
+                else
+                    out << " " << reg(instr.a) << ", " << reg(instr.b) << ", " << reg(instr.c);
+            }
+            out << "\n";
+        }
+    }
+    return out.str();
+}
+
+bool BytecodeVM::run(const VmProgram &program, int &exitStatus, int outputFd)
+{
+    // Direct threading: each instruction carries the address of its handler
+    static const void *const handlers[] = {
+        &&op_Halt, &&op_Mov,  &&op_LoadI, &&op_Sext,  &&op_Add,   &&op_Sub,   &&op_Mul,   &&op_Div,
+        &&op_Mod,  &&op_AddI, &&op_SubI,  &&op_MulI,  &&op_AddW,  &&op_SubW,  &&op_MulW,  &&op_AddIW,
+        &&op_SubIW, &&op_MulIW, &&op_Neg, &&op_Not,   &&op_BitNot, &&op_Eq,   &&op_Ne,    &&op_Lt,
+        &&op_Le,   &&op_Gt,   &&op_Ge,    &&op_EqI,   &&op_NeI,   &&op_LtI,   &&op_LeI,   &&op_GtI,
+        &&op_GeI,  &&op_Jmp,  &&op_Jz,    &&op_Jnz,   &&op_JEq,   &&op_JNe,   &&op_JLt,   &&op_JLe,
+        &&op_JGt,  &&op_JGe,  &&op_JEqI,  &&op_JNeI,  &&op_JLtI,  &&op_JLeI,  &&op_JGtI,  &&op_JGeI,
+        &&op_Call, &&op_TailCall, &&op_Ret, &&op_Print, &&op_Flush};
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(VmOp::Flush) + 1,
+                  "every opcode has a handler");
+
+    struct Threaded
+    {
+        const void *handler;
+        int32_t a, b, c;
+    };
+    struct Frame
+    {
+        const Threaded *returnTo;
+        size_t base;
+        int32_t dest;
+    };
+
+    std::vector<Threaded> threaded;
+    threaded.reserve(program.code.size());
+    for (const auto &instr : program.code)
+        threaded.push_back({handlers[static_cast<int>(instr.op)], instr.a, instr.b, instr.c});
+    const Threaded *code = threaded.data();
+
+    const VmFunction &main = program.functions[program.main];
+    std::vector<int64_t> registers(std::max<size_t>(main.frameSize, 1024));
+    std::vector<Frame> frames;
+    size_t base = 0;
+    int64_t *r = registers.data();
+    const Threaded *ip = code + main.entry;
+    const VmFunction *callee;
+    Output output(outputFd);
+    std::cout.flush();
+
+#define DISPATCH() goto *ip->handler
+#define NEXT()        \
+    do                \
+    {                 \
+        ++ip;         \
+        DISPATCH();   \
+    } while (0)
+#define BRANCH(condition)            \
+    do                               \
+    {                                \
+        ip = (condition) ? code + ip->c : ip + 1; \
+        DISPATCH();                  \
+    } while (0)
+
+    DISPATCH();
+
+op_Halt:
+    output.flush();
+    exitStatus = static_cast<int>(r[ip->a] & 0xff);
+    return true;
+op_Mov:
+    r[ip->a] = r[ip->b];
+    NEXT();
+op_LoadI:
+    r[ip->a] = ip->b;
+    NEXT();
+op_Sext:
+    r[ip->a] = wrap32(r[ip->b]);
+    NEXT();
+op_Add:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) + r[ip->c]);
+    NEXT();
+op_Sub:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) - r[ip->c]);
+    NEXT();
+op_Mul:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) * r[ip->c]);
+    NEXT();
+op_Div:
+    if (r[ip->c] == 0)
+        goto divide_by_zero;
+    // INT64_MIN / -1 wraps instead of trapping
+    r[ip->a] = r[ip->c] == -1 ? wrap64(0 - static_cast<uint64_t>(r[ip->b])) : r[ip->b] / r[ip->c];
+    NEXT();
+op_Mod:
+    if (r[ip->c] == 0)
+        goto divide_by_zero;
+    r[ip->a] = r[ip->c] == -1 ? 0 : r[ip->b] % r[ip->c];
+    NEXT();
+op_AddI:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) + ip->c);
+    NEXT();
+op_SubI:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) - ip->c);
+    NEXT();
+op_MulI:
+    r[ip->a] = wrap64(static_cast<uint64_t>(r[ip->b]) * ip->c);
+    NEXT();
+op_AddW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) + r[ip->c]);
+    NEXT();
+op_SubW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) - r[ip->c]);
+    NEXT();
+op_MulW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) * r[ip->c]);
+    NEXT();
+op_AddIW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) + ip->c);
+    NEXT();
+op_SubIW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) - ip->c);
+    NEXT();
+op_MulIW:
+    r[ip->a] = wrap32(static_cast<uint64_t>(r[ip->b]) * ip->c);
+    NEXT();
+op_Neg:
+    r[ip->a] = wrap64(0 - static_cast<uint64_t>(r[ip->b]));
+    NEXT();
+op_Not:
+    r[ip->a] = r[ip->b] == 0;
+    NEXT();
+op_BitNot:
+    r[ip->a] = ~r[ip->b];
+    NEXT();
+op_Eq:
+    r[ip->a] = r[ip->b] == r[ip->c];
+    NEXT();
+op_Ne:
+    r[ip->a] = r[ip->b] != r[ip->c];
+    NEXT();
+op_Lt:
+    r[ip->a] = r[ip->b] < r[ip->c];
+    NEXT();
+op_Le:
+    r[ip->a] = r[ip->b] <= r[ip->c];
+    NEXT();
+op_Gt:
+    r[ip->a] = r[ip->b] > r[ip->c];
+    NEXT();
+op_Ge:
+    r[ip->a] = r[ip->b] >= r[ip->c];
+    NEXT();
+op_EqI:
+    r[ip->a] = r[ip->b] == ip->c;
+    NEXT();
+op_NeI:
+    r[ip->a] = r[ip->b] != ip->c;
+    NEXT();
+op_LtI:
+    r[ip->a] = r[ip->b] < ip->c;
+    NEXT();
+op_LeI:
+    r[ip->a] = r[ip->b] <= ip->c;
+    NEXT();
+op_GtI:
+    r[ip->a] = r[ip->b] > ip->c;
+    NEXT();
+op_GeI:
+    r[ip->a] = r[ip->b] >= ip->c;
+    NEXT();
+op_Jmp:
+    ip = code + ip->c;
+    DISPATCH();
+op_Jz:
+    BRANCH(r[ip->a] == 0);
+op_Jnz:
+    BRANCH(r[ip->a] != 0);
+op_JEq:
+    BRANCH(r[ip->a] == r[ip->b]);
+op_JNe:
+    BRANCH(r[ip->a] != r[ip->b]);
+op_JLt:
+    BRANCH(r[ip->a] < r[ip->b]);
+op_JLe:
+    BRANCH(r[ip->a] <= r[ip->b]);
+op_JGt:
+    BRANCH(r[ip->a] > r[ip->b]);
+op_JGe:
+    BRANCH(r[ip->a] >= r[ip->b]);
+op_JEqI:
+    BRANCH(r[ip->a] == ip->b);
+op_JNeI:
+    BRANCH(r[ip->a] != ip->b);
+op_JLtI:
+    BRANCH(r[ip->a] < ip->b);
+op_JLeI:
+    BRANCH(r[ip->a] <= ip->b);
+op_JGtI:
+    BRANCH(r[ip->a] > ip->b);
+op_JGeI:
+    BRANCH(r[ip->a] >= ip->b);
+op_Call:
+    // The arguments already sit where the callee's frame begins
+    frames.push_back({ip + 1, base, ip->a});
+    base += ip->c;
+    callee = &program.functions[ip->b];
+    goto enter;
+op_TailCall:
+    callee = &program.functions[ip->b];
+    std::copy(r + ip->c, r + ip->c + callee->params, r);
+    goto enter;
+enter:
+    if (base + callee->frameSize > registers.size())
+    {
+        // Runaway recursion stops where native code would fault
+        if (base + callee->frameSize > maxRegisterFile)
+            goto stack_overflow;
+        registers.resize(std::min(std::max(registers.size() * 2, base + callee->frameSize), maxRegisterFile));
+    }
+    r = registers.data() + base;
+    std::fill(r + callee->params, r + callee->frameSize, 0);
+    ip = code + callee->entry;
+    DISPATCH();
+op_Ret:
+{
+    int64_t value = r[ip->a];
+    const Frame &frame = frames.back();
+    base = frame.base;
+    r = registers.data() + base;
+    r[frame.dest] = value;
+    ip = frame.returnTo;
+    frames.pop_back();
+    DISPATCH();
+}
+op_Print:
+    output.print(r[ip->a]);
+    NEXT();
+op_Flush:
+    output.flush();
+    NEXT();
+
+divide_by_zero:
+    output.flush();
+    std::cerr << "Error: Division by zero" << std::endl;
+    return false;
+
+stack_overflow:
+    output.flush();
+    std::cerr << "Error: Stack overflow" << std::endl;
+    return false;
+
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+}
@@ -0,0 +1,669 @@
+#include "CBackend.h"
+#include "Optimizer.h"
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+    const size_t maxRegisterArguments = 6; // calls the native backend accepts
+
+    // print() as the native runtime does it: decimal lines in a buffer that
+    // is written out when full, on flush() and at exit, and after every line
+    // when the output is a terminal
+    const char *const runtime = R"(#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+static char vs_out[65536];
+static size_t vs_outlen;
+static int vs_tty;
+
+static void vs_flush(void)
+{
+    size_t done = 0;
+    while (done < vs_outlen)
+    {
+        ssize_t count = write(1, vs_out + done, vs_outlen - done);
+        if (count <= 0)
+            break;
+        done += (size_t)count;
+    }
+    vs_outlen = 0;
+}
+
+static void vs_print(int64_t value)
+{
+    char digits[20];
+    int count = 0;
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    if (vs_outlen > sizeof(vs_out) - 21)
+        vs_flush();
+    if (value < 0)
+        vs_out[vs_outlen++] = '-';
+    do
+    {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    while (count)
+        vs_out[vs_outlen++] = digits[--count];
+    vs_out[vs_outlen++] = '\n';
+    if (vs_tty)
+        vs_flush();
+}
+
+static int vs_exit(int64_t status)
+{
+    vs_flush();
+    return (int)(status & 0xff);
+}
+
+/* Stores to int, char and bool variables keep the low 32 bits */
+static int64_t vs_wrap32(int64_t value)
+{
+    return (int32_t)(uint32_t)value;
+}
+
+/* Division by zero traps as idiv does, after the output so far is written,
+   and INT64_MIN / -1 wraps. Being calls with an effect, they are not
+   removed when their value is unused. */
+static void vs_divide_by_zero(void)
+{
+    vs_flush();
+    raise(SIGFPE);
+}
+
+static int64_t vs_div(int64_t dividend, int64_t divisor)
+{
+    if (divisor == 0)
+        vs_divide_by_zero();
+    return divisor == -1 ? (int64_t)(0 - (uint64_t)dividend) : dividend / divisor;
+}
+
+static int64_t vs_mod(int64_t dividend, int64_t divisor)
+{
+    if (divisor == 0)
+        vs_divide_by_zero();
+    return divisor == -1 ? 0 : dividend % divisor;
+}
+)";
+
+    std::string literal(long long value)
+    {
+        return value < 0 ? "(" + std::to_string(value) + ")" : std::to_string(value);
+    }
+
+    bool isLiteral(const std::string &text)
+    {
+        return text.find_first_not_of("0123456789()-") == std::string::npos;
+    }
+
+    // C name of a variable. The optimizer's temporaries have dots in their
+    // names, so underscores are doubled and dots become _d.
+    std::string variableName(const std::string &name)
+    {
+        std::string result = "v_";
+        for (char c : name)
+            result += c == '_' ? "__" : c == '.' ? "_d" : std::string(1, c);
+        return result;
+    }
+
+    // A condition without the parentheses around the whole of it
+    std::string unwrap(const std::string &text)
+    {
+        if (text.size() < 2 || text.front() != '(' || text.back() != ')')
+            return text;
+        int depth = 0;
+        for (size_t i = 0; i + 1 < text.size(); ++i)
+        {
+            depth += text[i] == '(' ? 1 : text[i] == ')' ? -1 : 0;
+            if (depth == 0)
+                return text;
+        }
+        return text.substr(1, text.size() - 2);
+    }
+
+    // True if control can run off the end of stmt. Only returns count as
+    // leaving: a stray break or continue is dropped, so it falls through.
+    bool canFallThrough(const StmtAST *stmt)
+    {
+        if (dynamic_cast<const ReturnStmtAST *>(stmt))
+            return false;
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+            {
+                if (!canFallThrough(child.get()))
+                    return false;
+            }
+            return true;
+        }
+        if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            return !ifStmt->getElse() || canFallThrough(ifStmt->getThen()) || canFallThrough(ifStmt->getElse());
+        return true;
+    }
+
+    // Translates one function at a time. Like the native code generator, a
+    // variable is known from its declaration or first assignment on, in
+    // program order; reading it before that gives 0.
+    class Translator
+    {
+    public:
+        explicit Translator(const std::map<std::string, size_t> &arity) : arity(arity) {}
+
+        std::string function(const std::string &header, const std::vector<std::pair<DataType, std::string>> &params,
+                             const std::vector<const StmtAST *> &body, bool topLevel)
+        {
+            this->topLevel = topLevel;
+            lines.clear();
+            variables.clear();
+            loops.clear();
+            switches = 0;
+            temps = 0;
+            labels = 0;
+            depth = 1;
+
+            // Arguments are stored into their parameters like any other
+            // value, so int parameters wrap
+            std::set<std::string> paramNames;
+            for (const auto &param : params)
+            {
+                paramNames.insert(param.second);
+                bool wide = getTypeSize(param.first) == 8;
+                variables[param.second] = wide;
+                if (!wide)
+                    line(variableName(param.second) + " = vs_wrap32(" + variableName(param.second) + ");");
+            }
+            if (topLevel)
+                line("vs_tty = isatty(1);");
+            bool fallsThrough = true;
+            for (const auto *stmt : body)
+            {
+                statement(stmt);
+                fallsThrough = fallsThrough && canFallThrough(stmt);
+            }
+            if (fallsThrough)
+                line(topLevel ? "return vs_exit(0);" : "return 0;");
+
+            std::ostringstream out;
+            out << header << "\n{\n";
+            for (const auto &var : variables)
+            {
+                if (!paramNames.count(var.first))
+                    out << "    int64_t " << variableName(var.first) << " = 0;\n";
+            }
+            for (const auto &text : lines)
+                out << text << "\n";
+            out << "}\n";
+            return out.str();
+        }
+
+    private:
+        struct Loop
+        {
+            std::string continueLabel; // empty when continue can be used
+            bool continued;
+        };
+
+        const std::map<std::string, size_t> &arity;
+        std::vector<std::string> lines;
+        std::map<std::string, bool> variables; // known so far, and whether 8 bytes wide
+        std::vector<Loop> loops;
+        int switches = 0; // enclosing switch statements, which also take break
+        int temps = 0;
+        int labels = 0;
+        int depth = 1;
+        bool topLevel = false;
+
+        void line(const std::string &text) { lines.push_back(std::string(4 * depth, ' ') + text); }
+
+        void open()
+        {
+            line("{");
+            ++depth;
+        }
+
+        void close()
+        {
+            --depth;
+            line("}");
+        }
+
+        // Hold a value in a new temporary
+        std::string temporary(const std::string &value)
+        {
+            std::string name = "t" + std::to_string(temps++);
+            line("int64_t " + name + " = " + value + ";");
+            return name;
+        }
+
+        // The single line a statement writes, to go inside a for header
+        template <typename Emit>
+        std::string inlined(Emit emit)
+        {
+            size_t mark = lines.size();
+            emit();
+            if (lines.size() != mark + 1)
+                return "";
+            std::string text = lines.back();
+            lines.pop_back();
+            text = text.substr(text.find_first_not_of(' '));
+            return text.substr(0, text.size() - 1);
+        }
+
+        bool callIsValid(const CallExprAST *call) const
+        {
+            auto found = arity.find(call->getCallee());
+            return found != arity.end() && call->getArgs().size() == found->second &&
+                   call->getArgs().size() <= maxRegisterArguments;
+        }
+
+        // A C expression for expr with no side effects. Calls and
+        // assignments inside it are written out as statements first, in
+        // evaluation order, and an operand they could change is copied
+        // before they run.
+        std::string value(const ExprAST *expr)
+        {
+            long long folded;
+            if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+                return literal(static_cast<int>(num->getValue()));
+            if (evaluateConstant(expr, folded))
+                return literal(folded);
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+                return variables.count(var->getName()) ? variableName(var->getName()) : "0";
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+                return binaryValue(binary);
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                std::string operand = value(unary->getOperand());
+                const std::string &op = unary->getOp();
+                if (op == "-" || op == "!" || op == "~")
+                    return "(" + op + operand + ")";
+                return operand;
+            }
+            if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+            {
+                // flush() writes out buffered print output, unless the
+                // program defines a function of that name
+                if (call->getCallee() == "flush" && call->getArgs().empty() && !arity.count("flush"))
+                    line("vs_flush();");
+                if (!callIsValid(call))
+                    return "0";
+                return temporary("fn_" + call->getCallee() + "(" + arguments(call) + ")");
+            }
+            if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+            {
+                const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(assign->getLHS());
+                if (!var)
+                    return value(assign->getRHS());
+                store(var->getName(), assign->getRHS());
+                return variableName(var->getName());
+            }
+            if (const ScopeExprAST *scope = dynamic_cast<const ScopeExprAST *>(expr))
+                return value(scope->getBase());
+            return "0"; // strings and arrays have no values yet
+        }
+
+        // An operand stays as it is unless what is evaluated after it stores
+        // to a variable
+        std::string operand(const ExprAST *expr, const ExprAST *evaluatedAfter)
+        {
+            std::string text = value(expr);
+            std::set<std::string> written;
+            collectWrittenVariables(evaluatedAfter, written);
+            if (!written.empty() && text.find("v_") != std::string::npos)
+                return temporary(text);
+            return text;
+        }
+
+        std::string arguments(const CallExprAST *call)
+        {
+            std::string list;
+            const auto &args = call->getArgs();
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                std::string arg = value(args[i].get());
+                std::set<std::string> written;
+                for (size_t j = i + 1; j < args.size(); ++j)
+                    collectWrittenVariables(args[j].get(), written);
+                if (!written.empty() && arg.find("v_") != std::string::npos)
+                    arg = temporary(arg);
+                list += (i ? ", " : "") + arg;
+            }
+            return list;
+        }
+
+        std::string binaryValue(const BinaryExprAST *binary)
+        {
+            const std::string &op = binary->getOp();
+            const ExprAST *lhs = binary->getLHS(), *rhs = binary->getRHS();
+
+            // The right operand of && and || only runs when the left one
+            // does not decide the result
+            if (op == "&&" || op == "||")
+            {
+                std::string left = value(lhs);
+                if (!hasSideEffects(rhs))
+                    return "(" + left + " " + op + " " + value(rhs) + ")";
+                std::string result = temporary("(" + left + " != 0)");
+                line(op == "&&" ? "if (" + result + ")" : "if (!" + result + ")");
+                open();
+                line(result + " = (" + value(rhs) + " != 0);");
+                close();
+                return result;
+            }
+
+            std::string left = operand(lhs, rhs);
+            std::string right = value(rhs);
+            static const std::set<std::string> operators = {"+", "-", "*", "/", "%", "==", "!=", "<", "<=", ">", ">="};
+            if (!operators.count(op))
+                return left; // no other operators yet
+            if (op == "/" || op == "%")
+                return std::string(op == "/" ? "vs_div(" : "vs_mod(") + unwrap(left) + ", " + unwrap(right) + ")";
+
+            // C combines two ints (literals and truth values) in 32 bits,
+            // and an int with an int64_t in 64 as the other backends do
+            if (narrow(lhs, left) && narrow(rhs, right))
+                left = "(int64_t)" + left;
+            return "(" + left + " " + op + " " + right + ")";
+        }
+
+        // True if text, the C expression for expr, has type int: a literal,
+        // a truth value, or a unary operator on one
+        bool narrow(const ExprAST *expr, const std::string &text) const
+        {
+            if (isLiteral(text))
+                return true;
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                static const std::set<std::string> truthValues = {"==", "!=", "<", "<=", ">", ">=", "&&", "||"};
+                return truthValues.count(binary->getOp()) > 0;
+            }
+            const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr);
+            return unary && (unary->getOp() == "!" || narrow(unary->getOperand(), ""));
+        }
+
+        // Store value into a variable, wrapped to the variable's width. A
+        // variable first assigned here takes the type of the value, after
+        // the value is evaluated.
+        void store(const std::string &name, const ExprAST *expr)
+        {
+            std::string text = unwrap(value(expr));
+            if (!variables.count(name))
+                variables[name] = getTypeSize(inferTypeFromExpression(expr)) == 8;
+            line(variableName(name) + " = " + (variables[name] || fits32(expr) ? text : "vs_wrap32(" + text + ")") + ";");
+        }
+
+        // Values that need no wrapping: int constants, int variables, and
+        // truth values
+        bool fits32(const ExprAST *expr) const
+        {
+            long long folded;
+            if (evaluateConstant(expr, folded))
+                return true;
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                auto found = variables.find(var->getName());
+                return found == variables.end() || !found->second;
+            }
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                static const std::set<std::string> truthValues = {"==", "!=", "<", "<=", ">", ">=", "&&", "||"};
+                return truthValues.count(binary->getOp()) > 0;
+            }
+            const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr);
+            return unary && unary->getOp() == "!";
+        }
+
+        // An expression evaluated only for its effects
+        void effect(const ExprAST *expr)
+        {
+            const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr);
+            const VariableExprAST *var = assign ? dynamic_cast<const VariableExprAST *>(assign->getLHS()) : nullptr;
+            if (var)
+            {
+                store(var->getName(), assign->getRHS());
+                return;
+            }
+            std::string text = value(expr);
+            if (text[0] == '(')
+                line("(void)" + text + ";");
+            else if (text.compare(0, 3, "vs_") == 0)
+                line(text + ";");
+        }
+
+        // Whether an expression statement fits in a for header
+        bool inlinable(const ExprAST *expr) const
+        {
+            const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr);
+            if (assign && dynamic_cast<const VariableExprAST *>(assign->getLHS()))
+                return !hasSideEffects(assign->getRHS());
+            return !hasSideEffects(expr);
+        }
+
+        void body(const StmtAST *stmt)
+        {
+            open();
+            statement(stmt);
+            close();
+        }
+
+        void statement(const StmtAST *stmt)
+        {
+            if (!stmt)
+                return;
+            if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+            {
+                // The variable is known inside its own initializer
+                for (const auto &var : varDecl->getVars())
+                {
+                    variables[var.first] = getTypeSize(varDecl->getVarType()) == 8;
+                    if (var.second)
+                        store(var.first, var.second.get());
+                    else
+                        line(variableName(var.first) + " = 0;");
+                }
+            }
+            else if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+                effect(exprStmt->getExpr());
+            else if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            {
+                for (const auto &child : compound->getStatements())
+                    statement(child.get());
+            }
+            else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            {
+                line("if (" + unwrap(value(ifStmt->getCondition())) + ")");
+                body(ifStmt->getThen());
+                if (ifStmt->getElse())
+                {
+                    line("else");
+                    body(ifStmt->getElse());
+                }
+            }
+            else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+                whileStatement(whileStmt);
+            else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+                forStatement(forStmt);
+            else if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+                switchStatement(switchStmt);
+            else if (const ReturnStmtAST *returnStmt = dynamic_cast<const ReturnStmtAST *>(stmt))
+            {
+                std::string result = returnStmt->getValue() ? unwrap(value(returnStmt->getValue())) : "0";
+                line(topLevel ? "return vs_exit(" + result + ");" : "return " + result + ";");
+            }
+            else if (dynamic_cast<const BreakStmtAST *>(stmt))
+            {
+                if (!loops.empty() || switches > 0)
+                    line("break;");
+            }
+            else if (dynamic_cast<const ContinueStmtAST *>(stmt))
+            {
+                if (loops.empty())
+                    return;
+                if (loops.back().continueLabel.empty())
+                    line("continue;");
+                else
+                {
+                    line("goto " + loops.back().continueLabel + ";");
+                    loops.back().continued = true;
+                }
+            }
+            else if (const PrintStmtAST *printStmt = dynamic_cast<const PrintStmtAST *>(stmt))
+                line("vs_print(" + unwrap(value(printStmt->getValue())) + ");");
+        }
+
+        // A C switch with the same fallthrough; each case's statements get
+        // a block of their own so they can declare temporaries. The C
+        // compiler picks the dispatch. Loops are only ever nested inside a
+        // case, so the loop stack still decides what continue does.
+        void switchStatement(const SwitchStmtAST *switchStmt)
+        {
+            line("switch (" + unwrap(value(switchStmt->getValue())) + ")");
+            open();
+            ++switches;
+            for (const auto &c : switchStmt->getCases())
+            {
+                for (long long label : c.Values)
+                    line("case " + std::to_string(label) + ":");
+                if (c.IsDefault)
+                    line("default:");
+                body(c.Body.get());
+            }
+            --switches;
+            close();
+        }
+
+        void whileStatement(const WhileStmtAST *whileStmt)
+        {
+            const ExprAST *condition = whileStmt->getCondition();
+            loops.push_back({"", false});
+            if (!hasSideEffects(condition))
+            {
+                line("while (" + unwrap(value(condition)) + ")");
+                body(whileStmt->getBody());
+            }
+            else
+            {
+                // The condition's statements run at the top of each
+                // iteration, where continue goes
+                line("for (;;)");
+                open();
+                line("if (!" + value(condition) + ")");
+                line("    break;");
+                statement(whileStmt->getBody());
+                close();
+            }
+            loops.pop_back();
+        }
+
+        void forStatement(const ForStmtAST *forStmt)
+        {
+            const StmtAST *init = forStmt->getInit();
+            const ExprAST *condition = forStmt->getCondition();
+            const ExprAST *update = forStmt->getUpdate();
+
+            const VarDeclStmtAST *initDecl = dynamic_cast<const VarDeclStmtAST *>(init);
+            const ExprStmtAST *initExpr = dynamic_cast<const ExprStmtAST *>(init);
+            bool initInline = !init || (initDecl && initDecl->getVars().size() == 1 &&
+                                        !hasSideEffects(initDecl->getVars()[0].second.get())) ||
+                              (initExpr && inlinable(initExpr->getExpr()));
+            std::string initText;
+            if (initInline)
+                initText = inlined([&] { statement(init); });
+            else
+                statement(init);
+
+            if (!hasSideEffects(condition) && (!update || inlinable(update)))
+            {
+                // The header is filled in once the update has been
+                // translated, after the body as in the native backend
+                std::string conditionText = condition ? unwrap(value(condition)) : "";
+                size_t header = lines.size();
+                line("");
+                loops.push_back({"", false});
+                body(forStmt->getBody());
+                loops.pop_back();
+                std::string updateText = update ? inlined([&] { effect(update); }) : "";
+                lines[header] = std::string(4 * depth, ' ') + "for (" + initText + "; " + conditionText + "; " +
+                                updateText + ")";
+                return;
+            }
+
+            // Otherwise the condition is tested at the top of the loop and
+            // continue jumps to the update
+            if (!initText.empty())
+                line(initText + ";");
+            std::string continueLabel = "continue_" + std::to_string(labels++);
+            line("for (;;)");
+            open();
+            if (condition)
+            {
+                line("if (!" + value(condition) + ")");
+                line("    break;");
+            }
+            loops.push_back({continueLabel, false});
+            statement(forStmt->getBody());
+            bool continued = loops.back().continued;
+            loops.pop_back();
+            if (continued)
+                line(continueLabel + ":;");
+            if (update)
+                effect(update);
+            close();
+        }
+    };
+}
+
+std::string CBackend::translate(const ProgramAST &program)
+{
+    std::map<std::string, size_t> arity;
+    std::ostringstream out;
+    out << "/* Generated by the Vesper compiler */\n" << runtime << "\n";
+
+    std::vector<std::string> headers;
+    for (const auto &func : program.getFunctions())
+    {
+        const PrototypeAST *proto = func->getProto();
+        arity[proto->getName()] = proto->getArgs().size();
+        std::string header = "static int64_t fn_" + proto->getName() + "(";
+        for (size_t i = 0; i < proto->getArgs().size(); ++i)
+            header += (i ? ", int64_t " : "int64_t ") + variableName(proto->getArgs()[i].second);
+        headers.push_back(header + (proto->getArgs().empty() ? "void)" : ")"));
+        out << headers.back() << ";\n";
+    }
+
+    Translator translator(arity);
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        const auto &func = program.getFunctions()[i];
+        out << "\n" << translator.function(headers[i], func->getProto()->getArgs(), {func->getBody()}, false);
+    }
+
+    std::vector<const StmtAST *> statements;
+    for (const auto &stmt : program.getStatements())
+        statements.push_back(stmt.get());
+    out << "\n" << translator.function("int main(void)", {}, statements, true);
+    return out.str();
+}
+
+bool CBackend::compile(const std::string &cFile, const std::string &outputBinary)
+{
+    const char *cc = std::getenv("CC");
+    std::string compileCmd = std::string(cc && *cc ? cc : "cc") + " -std=c99 -O2 -fwrapv -o " + outputBinary + " " +
+                             cFile;
+    std::cout << "Compiling: " << compileCmd << std::endl;
+
+    if (std::system(compileCmd.c_str()) != 0)
+    {
+        std::cerr << "Error: C compilation failed" << std::endl;
+        return false;
+    }
+
+    std::cout << "✅ Binary generated successfully: " << outputBinary << std::endl;
+    return true;
+}
@@ -1,5 +1,10 @@
 #include "CodeGen.h"
 #include "AST.h"
+#include "Assembler.h"
+#include "ElfWriter.h"
+#include "Optimizer.h"
+#include "RegisterAllocator.h"
+#include <algorithm>
 #include <fstream>
 #include <unordered_map>
 #include <sstream>
@@ -20,13 +25,73 @@ struct VariableInfo
 {
     int stackOffset;
     DataType type;
-    int size; // size in bytes
+    int size;        // size in bytes
+    std::string reg; // register holding the variable, empty if it is in memory
 };
 
 static std::unordered_map<std::string, VariableInfo> symbolTable;
 static int stackOffset = 0;
 static int labelCounter = 0; // For generating unique labels
 
+// Jump targets of the enclosing loops, innermost last
+struct LoopLabels
+{
+    std::string breakLabel;
+    std::string continueLabel;
+};
+static std::vector<LoopLabels> loopStack;
+
+// Parameter counts of the user functions, and whether code is currently
+// being generated for a function body (return) or for _start (exit)
+static std::unordered_map<std::string, size_t> functionArity;
+static bool inFunction = false;
+static std::string currentFunction;
+
+// Register assignment of the code unit being generated, the callee-saved
+// registers its function saves, and the registers currently holding left
+// operands, innermost last
+static RegisterAllocator allocation;
+static std::vector<std::string> savedRegisters;
+static std::vector<std::string> heldTemporaries;
+
+// System V AMD64 integer argument registers
+static const char *const argumentRegisters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static const size_t maxRegisterArguments = 6;
+
+// Operands lowering builds instructions from
+static MachineOperand reg(const std::string &name)
+{
+    return MachineOperand::reg(name);
+}
+
+static MachineOperand imm(long long value)
+{
+    return MachineOperand::imm(value);
+}
+
+static const MachineOperand rax = MachineOperand::reg("rax");
+static const MachineOperand rcx = MachineOperand::reg("rcx");
+static const MachineOperand rdx = MachineOperand::reg("rdx");
+static const MachineOperand rdi = MachineOperand::reg("rdi");
+static const MachineOperand al = MachineOperand::reg("al");
+
+// print appends to this much buffered output before it is written out
+static const int outputBufferSize = 65536;
+
+// User functions get a prefix so they cannot clash with runtime labels or
+// instruction mnemonics
+static std::string functionLabel(const std::string &name)
+{
+    return "fn_" + name;
+}
+
+// Start of a function's body, after the frame is set up. Self tail calls
+// jump here with the new arguments in registers.
+static std::string functionBodyLabel(const std::string &name)
+{
+    return functionLabel(name) + ".body";
+}
+
 // Helper to generate unique labels
 std::string generateLabel(const std::string &prefix)
 {
@@ -39,12 +104,76 @@ CodeGen::CodeGen()
     symbolTable.clear();
     stackOffset = 0;
     labelCounter = 0;
+    loopStack.clear();
+    functionArity.clear();
+    inFunction = false;
+    currentFunction.clear();
+    allocation = RegisterAllocator();
+    savedRegisters.clear();
+    heldTemporaries.clear();
 }
 
 // Helper to emit assembly
 void CodeGen::emit(const std::string &line)
 {
-    code << line << std::endl;
+    emit(MachineInstr::parse(line));
+}
+
+void CodeGen::emit(const MachineInstr &instr)
+{
+    if (module.functions.empty())
+        beginFunction("");
+    module.functions.back().append(instr);
+}
+
+void CodeGen::beginFunction(const std::string &name)
+{
+    module.functions.emplace_back(name);
+}
+
+void CodeGen::emitLabel(const std::string &label)
+{
+    if (module.functions.empty())
+        beginFunction("");
+    module.functions.back().appendLabel(label);
+}
+
+void CodeGen::setFrameSize(int bytes)
+{
+    // Whole 16-byte units, so rsp keeps its alignment relative to rbp
+    bytes = (bytes + 15) / 16 * 16;
+    auto &entry = module.functions.back().blocks.front().instrs;
+    for (auto instr = entry.begin(); instr != entry.end(); ++instr)
+    {
+        if (instr->is(Opcode::Sub, 2) && instr->operands[0].isReg("rsp"))
+        {
+            if (bytes == 0)
+                entry.erase(instr);
+            else
+                instr->operands[1] = MachineOperand::imm(bytes);
+            return;
+        }
+    }
+}
+
+void CodeGen::emitRodata(const std::string &definition)
+{
+    module.rodata.push_back(definition);
+}
+
+void CodeGen::emitData(const std::string &definition)
+{
+    module.data.push_back(definition);
+}
+
+void CodeGen::emitBss(const std::string &definition)
+{
+    module.bss.push_back(definition);
+}
+
+void CodeGen::declareGlobal(const std::string &name)
+{
+    module.globals.push_back(name);
 }
 
 // Helper to get size of data type
@@ -62,11 +191,131 @@ int getTypeSize(DataType type)
         return 1;
     case DataType::STRING:
         return 8; // pointer size
+    case DataType::LONG:
+        return 8;
     default:
         return 4; // default to 4 bytes for int
     }
 }
 
+// Helper to address a variable's stack slot. 8-byte variables are kept as
+// qwords, everything else as dwords.
+static MachineOperand slotOperand(int offset, int size)
+{
+    return MachineOperand::mem("rbp-" + std::to_string(offset), size == 8 ? 8 : 4);
+}
+
+// Enter a variable into the symbol table, in its allocated register or in a
+// new stack slot
+static const VariableInfo &bindVariable(const std::string &name, DataType type)
+{
+    VariableInfo varInfo;
+    varInfo.type = type;
+    varInfo.size = getTypeSize(type);
+    varInfo.stackOffset = 0;
+    if (const std::string *reg = allocation.registerOf(name))
+    {
+        varInfo.reg = *reg;
+    }
+    else if (allocation.slotWidthOf(name) >= slotWidth(varInfo.size))
+    {
+        varInfo.stackOffset = allocation.stackSlotOf(name);
+    }
+    else
+    {
+        // A variable the frame layout did not see gets a slot past the
+        // laid-out ones
+        int width = slotWidth(varInfo.size);
+        stackOffset = (stackOffset + 2 * width - 1) / width * width;
+        varInfo.stackOffset = stackOffset;
+    }
+    return symbolTable[name] = varInfo;
+}
+
+// Load a variable into rax. Registers hold values already sign-extended
+// to 64 bits.
+static void emitLoad(CodeGen &gen, const VariableInfo &varInfo)
+{
+    if (!varInfo.reg.empty())
+    {
+        gen.emit(MachineInstr::mov(rax, reg(varInfo.reg)));
+        return;
+    }
+
+    if (varInfo.size == 8)
+    {
+        gen.emit(MachineInstr::mov(rax, slotOperand(varInfo.stackOffset, varInfo.size)));
+        return;
+    }
+
+    // Load as 32-bit integer and sign-extend to 64-bit
+    gen.emit(MachineInstr(Opcode::Movsxd, {rax, slotOperand(varInfo.stackOffset, varInfo.size)}));
+}
+
+// Store rax into a variable, truncating it to the variable's size
+static void emitStore(CodeGen &gen, const VariableInfo &varInfo, const std::string &source = "rax")
+{
+    if (varInfo.reg.empty())
+    {
+        std::string value = varInfo.size == 8 ? source : register32(source);
+        gen.emit(MachineInstr::mov(slotOperand(varInfo.stackOffset, varInfo.size), reg(value)));
+    }
+    else if (varInfo.size == 8)
+    {
+        if (varInfo.reg != source)
+            gen.emit(MachineInstr::mov(reg(varInfo.reg), reg(source)));
+    }
+    else
+    {
+        gen.emit(MachineInstr(Opcode::Movsxd, {reg(varInfo.reg), reg(register32(source))}));
+    }
+}
+
+// True if evaluating expr may call a function
+static bool containsCall(const ExprAST *expr)
+{
+    if (dynamic_cast<const CallExprAST *>(expr))
+        return true;
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        return containsCall(binary->getLHS()) || containsCall(binary->getRHS());
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        return containsCall(unary->getOperand());
+    if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+        return containsCall(assign->getRHS());
+    return false;
+}
+
+// Keep the left operand of expr, now in rax, in a register no variable
+// needs while the right operand is evaluated. Falls back to the stack when
+// none is free.
+static std::string holdLeftOperand(CodeGen &gen, const ExprAST *expr, const ExprAST *rightOperand)
+{
+    for (const auto &candidate : allocation.freeDuring(expr, containsCall(rightOperand)))
+    {
+        if (std::find(heldTemporaries.begin(), heldTemporaries.end(), candidate) == heldTemporaries.end())
+        {
+            heldTemporaries.push_back(candidate);
+            gen.emit(MachineInstr::mov(reg(candidate), rax));
+            return candidate;
+        }
+    }
+    gen.emit(MachineInstr::push(rax));
+    return "";
+}
+
+// Bring back the left operand into rax, with the right operand in rcx
+static void releaseLeftOperand(CodeGen &gen, const std::string &held)
+{
+    gen.emit(MachineInstr::mov(rcx, rax)); // Right side in rcx
+    if (held.empty())
+    {
+        gen.emit(MachineInstr::pop(rax)); // Left side back in rax
+        return;
+    }
+    gen.emit(MachineInstr::mov(rax, reg(held)));
+    heldTemporaries.pop_back();
+}
+
 // Helper function to infer type from expression
 DataType inferTypeFromExpression(const ExprAST *expr)
 {
@@ -112,9 +361,7 @@ DataType inferTypeFromExpression(const ExprAST *expr)
 // NumberExprAST codegen
 void NumberExprAST::codegen(CodeGen &gen) const
 {
-    std::ostringstream oss;
-    oss << "    mov rax, " << static_cast<int>(Val);
-    gen.emit(oss.str());
+    gen.emit(MachineInstr::mov(rax, imm(static_cast<int>(Val))));
 }
 
 // VariableExprAST codegen - Load variable from stack
@@ -122,79 +369,533 @@ void VariableExprAST::codegen(CodeGen &gen) const
 {
     if (symbolTable.find(Name) != symbolTable.end())
     {
-        const VariableInfo &varInfo = symbolTable[Name];
-        std::ostringstream oss;
+        emitLoad(gen, symbolTable[Name]);
+    }
+    else
+    {
+        gen.emit(MachineInstr::note("ERROR: Unknown variable " + Name));
+        gen.emit(MachineInstr::mov(rax, imm(0))); // Set to 0 for safety
+    }
+}
+
+// Helper to recognize an integer literal that fits in an imm32
+static bool integerLiteral(const ExprAST *expr, long long &value)
+{
+    const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr);
+    if (!num)
+        return false;
+    double val = num->getValue();
+    if (val < -2147483648.0 || val > 2147483647.0 || val != static_cast<long long>(val))
+        return false;
+    value = static_cast<long long>(val);
+    return true;
+}
 
-        // Load as 32-bit integer and sign-extend to 64-bit
-        oss << "    mov eax, dword [rbp-" << varInfo.stackOffset << "]";
-        gen.emit(oss.str());
-        gen.emit("    movsx rax, eax"); // sign extend to 64-bit
+// Helper returning k if value == 2^k, or -1
+static int powerOfTwo(unsigned long long value)
+{
+    if (value == 0 || (value & (value - 1)) != 0)
+        return -1;
+    int k = 0;
+    while ((value >>= 1) != 0)
+        ++k;
+    return k;
+}
+
+// Multiply rax by a constant using shifts and lea where possible
+static void emitMultiplyByConstant(CodeGen &gen, long long factor)
+{
+    unsigned long long magnitude = factor < 0 ? -static_cast<unsigned long long>(factor) : factor;
+
+    if (factor == 0)
+    {
+        gen.emit(MachineInstr::arithmetic(Opcode::Xor, reg("eax"), reg("eax")));
+        return;
+    }
+
+    int shift = powerOfTwo(magnitude);
+    if (shift > 0)
+    {
+        gen.emit(MachineInstr::arithmetic(Opcode::Shl, rax, imm(shift)));
     }
+    else if (shift < 0)
+    {
+        // 3, 5 and 9 times a power of two: one lea plus a shift
+        bool reduced = false;
+        for (int scale : {2, 4, 8})
+        {
+            if (magnitude % (scale + 1) != 0)
+                continue;
+            int rest = powerOfTwo(magnitude / (scale + 1));
+            if (rest < 0)
+                continue;
+            gen.emit(MachineInstr::lea(rax, "rax+rax*" + std::to_string(scale)));
+            if (rest > 0)
+                gen.emit(MachineInstr::arithmetic(Opcode::Shl, rax, imm(rest)));
+            reduced = true;
+            break;
+        }
+        if (!reduced)
+        {
+            gen.emit(MachineInstr(Opcode::Imul, {rax, rax, imm(factor)}));
+            return;
+        }
+    }
+
+    if (factor < 0)
+        gen.emit(MachineInstr(Opcode::Neg, {rax}));
+}
+
+// Compute the magic multiplier and shift for signed 64-bit division by a
+// constant (Hacker's Delight, figure 10-1). divisor must not be -1, 0 or 1.
+static void signedDivisionMagic(long long divisor, long long &multiplier, int &shift)
+{
+    const unsigned long long two63 = 1ULL << 63;
+    unsigned long long ad = divisor < 0 ? -static_cast<unsigned long long>(divisor) : divisor;
+    unsigned long long t = two63 + (static_cast<unsigned long long>(divisor) >> 63);
+    unsigned long long anc = t - 1 - t % ad; // absolute value of nc
+    unsigned long long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long long q2 = two63 / ad, r2 = two63 - q2 * ad;
+    unsigned long long delta;
+    int p = 63;
+    do
+    {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc)
+        {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad)
+        {
+            ++q2;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    multiplier = static_cast<long long>(q2 + 1);
+    if (divisor < 0)
+        multiplier = -multiplier;
+    shift = p - 64;
+}
+
+// Divide rax by a non-zero constant without idiv, rounding toward zero like
+// idiv does. With remainder set, leave x - (x / d) * d in rax instead.
+static void emitDivideByConstant(CodeGen &gen, long long divisor, bool remainder)
+{
+    unsigned long long magnitude = divisor < 0 ? -static_cast<unsigned long long>(divisor) : divisor;
+
+    if (magnitude == 1)
+    {
+        if (remainder)
+            gen.emit(MachineInstr::arithmetic(Opcode::Xor, reg("eax"), reg("eax")));
+        else if (divisor < 0)
+            gen.emit(MachineInstr(Opcode::Neg, {rax}));
+        return;
+    }
+
+    gen.emit(MachineInstr::mov(rcx, rax)); // keep the dividend
+    int shift = powerOfTwo(magnitude);
+    if (shift > 0)
+    {
+        // Bias negative dividends by 2^k - 1 so the shift rounds toward zero
+        gen.emit(MachineInstr::mov(rdx, rax));
+        gen.emit(MachineInstr::arithmetic(Opcode::Sar, rdx, imm(63)));
+        gen.emit(MachineInstr::arithmetic(Opcode::Shr, rdx, imm(64 - shift)));
+        gen.emit(MachineInstr::arithmetic(Opcode::Add, rax, rdx));
+        if (remainder)
+        {
+            // x % d has the sign of x and does not depend on the sign of d
+            gen.emit(MachineInstr::arithmetic(Opcode::And, rax, imm(-static_cast<long long>(magnitude))));
+            gen.emit(MachineInstr::arithmetic(Opcode::Sub, rcx, rax));
+            gen.emit(MachineInstr::mov(rax, rcx));
+            return;
+        }
+        gen.emit(MachineInstr::arithmetic(Opcode::Sar, rax, imm(shift)));
+        if (divisor < 0)
+            gen.emit(MachineInstr(Opcode::Neg, {rax}));
+        return;
+    }
+
+    long long multiplier;
+    int magicShift;
+    signedDivisionMagic(divisor, multiplier, magicShift);
+
+    gen.emit(MachineInstr::mov(rax, imm(multiplier)));
+    gen.emit(MachineInstr(Opcode::Imul, {rcx})); // rdx = high half of multiplier * x
+    if (divisor > 0 && multiplier < 0)
+        gen.emit(MachineInstr::arithmetic(Opcode::Add, rdx, rcx));
+    else if (divisor < 0 && multiplier > 0)
+        gen.emit(MachineInstr::arithmetic(Opcode::Sub, rdx, rcx));
+    if (magicShift > 0)
+        gen.emit(MachineInstr::arithmetic(Opcode::Sar, rdx, imm(magicShift)));
+    // Add one for negative quotients to round toward zero
+    gen.emit(MachineInstr::mov(rax, rdx));
+    gen.emit(MachineInstr::arithmetic(Opcode::Shr, rax, imm(63)));
+    gen.emit(MachineInstr::arithmetic(Opcode::Add, rax, rdx));
+
+    if (remainder)
+    {
+        gen.emit(MachineInstr(Opcode::Imul, {rax, rax, imm(divisor)}));
+        gen.emit(MachineInstr::arithmetic(Opcode::Sub, rcx, rax));
+        gen.emit(MachineInstr::mov(rax, rcx));
+    }
+}
+
+// Condition code a comparison operator sets, and its negation
+static std::string conditionCode(const std::string &op)
+{
+    if (op == "==")
+        return "e";
+    if (op == "!=")
+        return "ne";
+    if (op == "<")
+        return "l";
+    if (op == ">")
+        return "g";
+    if (op == "<=")
+        return "le";
+    if (op == ">=")
+        return "ge";
+    return "";
+}
+
+static std::string inverseConditionCode(const std::string &code)
+{
+    static const std::unordered_map<std::string, std::string> inverse = {
+        {"e", "ne"}, {"ne", "e"}, {"l", "ge"}, {"ge", "l"}, {"g", "le"}, {"le", "g"}, {"z", "nz"}, {"nz", "z"}};
+    return inverse.at(code);
+}
+
+// Instruction selection. Leaves an instruction can take as its source
+// operand are used in place instead of being evaluated into rcx first: int
+// literals as imm32, variables in registers, and long variables in their
+// qword slots. int slots hold dwords that would need a sign extension.
+static bool directOperand(const ExprAST *expr, MachineOperand &operand)
+{
+    long long value;
+    if (integerLiteral(expr, value))
+    {
+        operand = imm(value);
+        return true;
+    }
+
+    const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr);
+    if (!var)
+        return false;
+    auto found = symbolTable.find(var->getName());
+    if (found == symbolTable.end())
+        return false;
+    if (!found->second.reg.empty())
+        operand = reg(found->second.reg);
+    else if (found->second.size == 8)
+        operand = slotOperand(found->second.stackOffset, found->second.size);
     else
+        return false;
+    return true;
+}
+
+// The 32-bit form of a direct operand
+static MachineOperand lowHalf(const MachineOperand &operand)
+{
+    if (operand.isMem())
+        return MachineOperand::mem(operand.text, 4); // low half of the qword slot
+    if (operand.isReg())
+        return reg(register32(operand.text));
+    return operand;
+}
+
+// True if evaluating expr may store to a variable
+static bool containsAssignment(const ExprAST *expr)
+{
+    if (dynamic_cast<const AssignmentExprAST *>(expr))
+        return true;
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        return containsAssignment(binary->getLHS()) || containsAssignment(binary->getRHS());
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        return containsAssignment(unary->getOperand());
+    if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
     {
-        gen.emit("    ; ERROR: Unknown variable " + Name);
-        gen.emit("    mov rax, 0"); // Set to 0 for safety
+        for (const auto &arg : call->getArgs())
+        {
+            if (containsAssignment(arg.get()))
+                return true;
+        }
     }
+    return false;
 }
 
-// BinaryExprAST codegen - Fixed to handle operations correctly
+// True if a direct left operand may still be read after evaluating rhs,
+// i.e. rhs does not store to it. The register allocator keeps the left
+// operand's variables live until the operator, so no temporary of rhs and
+// no call in it takes their register.
+static bool leftReadableAfter(const ExprAST *rhs)
+{
+    return !containsAssignment(rhs);
+}
+
+// Registers needed to evaluate an expression with its operands in the
+// better order (Sethi-Ullman numbering). A direct right operand needs none.
+static int registerNeed(const ExprAST *expr)
+{
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        int lhs = registerNeed(binary->getLHS());
+        MachineOperand operand;
+        if (directOperand(binary->getRHS(), operand))
+            return lhs;
+        int rhs = registerNeed(binary->getRHS());
+        return lhs == rhs ? lhs + 1 : std::max(lhs, rhs);
+    }
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        return registerNeed(unary->getOperand());
+    if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+        return registerNeed(assign->getRHS());
+    return 1;
+}
+
+// rax = rax op operand
+static void emitOperation(CodeGen &gen, const std::string &op, const MachineOperand &operand)
+{
+    if (op == "+")
+        gen.emit(MachineInstr::arithmetic(Opcode::Add, rax, operand));
+    else if (op == "-")
+        gen.emit(MachineInstr::arithmetic(Opcode::Sub, rax, operand));
+    else if (op == "*")
+        gen.emit(operand.isImm() ? MachineInstr(Opcode::Imul, {rax, rax, operand})
+                                 : MachineInstr::arithmetic(Opcode::Imul, rax, operand));
+    else if (op == "/" || op == "%")
+    {
+        MachineOperand divisor = operand;
+        if (operand.isImm())
+        {
+            gen.emit(MachineInstr::mov(rcx, operand));
+            divisor = rcx;
+        }
+        gen.emit(MachineInstr(Opcode::Cqo)); // Sign extend rax to rdx:rax
+        gen.emit(MachineInstr(Opcode::Idiv, {divisor}));
+        if (op == "%")
+            gen.emit(MachineInstr::mov(rax, rdx)); // Remainder
+    }
+    else if (!conditionCode(op).empty())
+    {
+        gen.emit(MachineInstr::cmp(rax, operand));
+        gen.emit(MachineInstr::conditional(Opcode::Setcc, conditionCode(op), {al}));
+        gen.emit(MachineInstr(Opcode::Movzx, {rax, al}));
+    }
+}
+
+// Address arithmetic: up to two registers, one of them scaled by 1, 2, 4
+// or 8, plus a constant
+struct Address
+{
+    std::string base;
+    std::string index;
+    long long scale = 1;
+    long long displacement = 0;
+};
+
+static bool addressTerms(const ExprAST *expr, Address &address)
+{
+    long long value;
+    MachineOperand operand;
+    if (integerLiteral(expr, value))
+    {
+        address.displacement += value;
+        return true;
+    }
+    if (directOperand(expr, operand))
+    {
+        if (operand.isMem())
+            return false;
+        if (address.base.empty())
+            address.base = operand.text;
+        else if (address.index.empty())
+            address.index = operand.text;
+        else
+            return false;
+        return true;
+    }
+
+    const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr);
+    if (!binary)
+        return false;
+    if (binary->getOp() == "+")
+        return addressTerms(binary->getLHS(), address) && addressTerms(binary->getRHS(), address);
+    if (binary->getOp() == "-" && integerLiteral(binary->getRHS(), value))
+    {
+        address.displacement -= value;
+        return addressTerms(binary->getLHS(), address);
+    }
+    if (binary->getOp() == "*" && address.index.empty())
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            const ExprAST *factor = i == 0 ? binary->getLHS() : binary->getRHS();
+            const ExprAST *scaled = i == 0 ? binary->getRHS() : binary->getLHS();
+            if (integerLiteral(factor, value) && (value == 2 || value == 4 || value == 8) &&
+                directOperand(scaled, operand) && operand.isReg())
+            {
+                address.index = operand.text;
+                address.scale = value;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Sums of registers and a constant (a + b, i + 1, base + i*8 - 4) as one lea
+static bool emitAddress(CodeGen &gen, const BinaryExprAST *expr)
+{
+    if (expr->getOp() != "+" && expr->getOp() != "-")
+        return false;
+    Address address;
+    if (!addressTerms(expr, address) || address.displacement < -2147483648LL || address.displacement > 2147483647LL)
+        return false;
+    if (address.base.empty() && address.scale == 1)
+        std::swap(address.base, address.index);
+
+    // Worth it only when it replaces a move and at least one operation
+    int terms = !address.base.empty() + !address.index.empty() + (address.displacement != 0);
+    if (address.base.empty() || terms < 2)
+        return false;
+
+    std::string text = address.base;
+    if (!address.index.empty())
+        text += "+" + address.index + (address.scale != 1 ? "*" + std::to_string(address.scale) : "");
+    if (address.displacement > 0)
+        text += "+" + std::to_string(address.displacement);
+    else if (address.displacement < 0)
+        text += std::to_string(address.displacement);
+    gen.emit(MachineInstr::lea(rax, text));
+    return true;
+}
+
+// BinaryExprAST codegen
+static void emitConditionalJump(CodeGen &gen, const ExprAST *condition, bool jumpIfTrue, const std::string &target);
+static std::string emitConditionFlags(CodeGen &gen, const ExprAST *condition);
+
 void BinaryExprAST::codegen(CodeGen &gen) const
 {
-    // Evaluate left side first
-    LHS->codegen(gen);
-    gen.emit("    push rax"); // Save left side
+    // && and || only evaluate the right operand when the left one does not
+    // decide the result, and produce 0 or 1
+    if (Op == "&&" || Op == "||")
+    {
+        bool isAnd = Op == "&&";
+        std::string decidedLabel = generateLabel(isAnd ? "and_false_" : "or_true_");
+        std::string endLabel = generateLabel("logic_end_");
+        emitConditionalJump(gen, LHS.get(), !isAnd, decidedLabel);
+        gen.emit(MachineInstr::conditional(Opcode::Setcc, emitConditionFlags(gen, RHS.get()), {al}));
+        gen.emit(MachineInstr(Opcode::Movzx, {rax, al}));
+        gen.emit(MachineInstr::jump(endLabel));
+        gen.emitLabel(decidedLabel);
+        gen.emit(isAnd ? MachineInstr::arithmetic(Opcode::Xor, reg("eax"), reg("eax"))
+                       : MachineInstr::mov(rax, imm(1)));
+        gen.emitLabel(endLabel);
+        return;
+    }
 
-    // Evaluate right side
-    RHS->codegen(gen);
-    gen.emit("    mov rcx, rax"); // Right side in rcx
-    gen.emit("    pop rax");      // Left side back in rax
+    if (emitAddress(gen, this))
+        return;
 
-    if (Op == "+")
-        gen.emit("    add rax, rcx");
-    else if (Op == "-")
-        gen.emit("    sub rax, rcx");
-    else if (Op == "*")
-        gen.emit("    imul rax, rcx");
-    else if (Op == "/")
+    // Multiply, divide and modulo by a constant avoid imul/idiv
+    long long constant;
+    if ((Op == "*" || Op == "/" || Op == "%") && integerLiteral(RHS.get(), constant) &&
+        (Op == "*" || constant != 0))
     {
-        gen.emit("    cqo");      // Sign extend rax to rdx:rax
-        gen.emit("    idiv rcx"); // Divide rdx:rax by rcx
+        LHS->codegen(gen);
+        if (Op == "*")
+            emitMultiplyByConstant(gen, constant);
+        else
+            emitDivideByConstant(gen, constant, Op == "%");
+        return;
     }
-    else if (Op == "==")
+    if (Op == "*" && integerLiteral(LHS.get(), constant))
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    sete al");
-        gen.emit("    movzx rax, al");
+        RHS->codegen(gen);
+        emitMultiplyByConstant(gen, constant);
+        return;
     }
-    else if (Op == "!=")
+
+    // A leaf right operand is used in place, and so is a leaf left operand
+    // of a commutative operator or (mirrored) of a comparison
+    bool commutative = Op == "+" || Op == "*";
+    bool comparison = !conditionCode(Op).empty();
+    MachineOperand operand;
+    if (directOperand(RHS.get(), operand))
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    setne al");
-        gen.emit("    movzx rax, al");
+        LHS->codegen(gen);
+        emitOperation(gen, Op, operand);
+        return;
     }
-    else if (Op == "<")
+    if ((commutative || comparison) && directOperand(LHS.get(), operand) && leftReadableAfter(RHS.get()))
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    setl al");
-        gen.emit("    movzx rax, al");
+        RHS->codegen(gen);
+        emitOperation(gen, comparison ? mirrorComparison(Op) : Op, operand);
+        return;
     }
-    else if (Op == ">")
+
+    // An int slot is not a qword operand, but sign-extends into rcx
+    const VariableExprAST *rightVar = dynamic_cast<const VariableExprAST *>(RHS.get());
+    if (rightVar && symbolTable.count(rightVar->getName()))
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    setg al");
-        gen.emit("    movzx rax, al");
+        const VariableInfo &varInfo = symbolTable[rightVar->getName()];
+        LHS->codegen(gen);
+        gen.emit(MachineInstr(Opcode::Movsxd, {rcx, slotOperand(varInfo.stackOffset, varInfo.size)}));
+        emitOperation(gen, Op, rcx);
+        return;
     }
-    else if (Op == "<=")
+
+    // Evaluate the side that needs more registers first so fewer values are
+    // held at once (Sethi-Ullman), unless either side has effects the other
+    // could observe
+    const ExprAST *first = LHS.get(), *second = RHS.get();
+    bool pure = !containsCall(first) && !containsCall(second) && !containsAssignment(first) &&
+                !containsAssignment(second);
+    bool rightFirst = pure && registerNeed(RHS.get()) > registerNeed(LHS.get());
+    if (rightFirst)
+        std::swap(first, second);
+
+    first->codegen(gen);
+    std::string held = holdLeftOperand(gen, this, second);
+    second->codegen(gen);
+
+    if (held.empty())
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    setle al");
-        gen.emit("    movzx rax, al");
+        if (rightFirst)
+            gen.emit(MachineInstr::pop(rcx));
+        else
+            releaseLeftOperand(gen, held);
+        emitOperation(gen, Op, rcx);
+        return;
     }
-    else if (Op == ">=")
+
+    // One operand in rax, the other in a held register
+    heldTemporaries.pop_back();
+    if (rightFirst || commutative)
     {
-        gen.emit("    cmp rax, rcx");
-        gen.emit("    setge al");
-        gen.emit("    movzx rax, al");
+        emitOperation(gen, Op, reg(held));
+    }
+    else if (comparison)
+    {
+        emitOperation(gen, mirrorComparison(Op), reg(held));
+    }
+    else if (Op == "-")
+    {
+        gen.emit(MachineInstr::arithmetic(Opcode::Sub, reg(held), rax));
+        gen.emit(MachineInstr::mov(rax, reg(held)));
+    }
+    else
+    {
+        gen.emit(MachineInstr::mov(rcx, rax));
+        gen.emit(MachineInstr::mov(rax, reg(held)));
+        emitOperation(gen, Op, rcx);
     }
 }
 
@@ -212,72 +913,142 @@ void AssignmentExprAST::codegen(CodeGen &gen) const
         if (symbolTable.find(var->getName()) != symbolTable.end())
         {
             // Variable exists, just store to it
-            const VariableInfo &varInfo = symbolTable[var->getName()];
-            std::ostringstream oss;
-            oss << "    mov dword [rbp-" << varInfo.stackOffset << "], eax";
-            gen.emit(oss.str());
+            emitStore(gen, symbolTable[var->getName()]);
         }
         else
         {
             // Variable doesn't exist - dynamic type inference!
-            gen.emit("    ; Dynamic type inference for variable: " + var->getName());
+            gen.emit(MachineInstr::note("Dynamic type inference for variable: " + var->getName()));
 
-            // Infer type from RHS expression
+            // Infer type from RHS expression and create the variable
             DataType inferredType = inferTypeFromExpression(RHS.get());
-
-            // Create new variable in symbol table
-            int typeSize = getTypeSize(inferredType);
-            stackOffset += typeSize;
-
-            VariableInfo varInfo;
-            varInfo.stackOffset = stackOffset;
-            varInfo.type = inferredType;
-            varInfo.size = typeSize;
-            symbolTable[var->getName()] = varInfo;
+            const VariableInfo &varInfo = bindVariable(var->getName(), inferredType);
 
             // Store the value (RHS already evaluated and in rax)
-            std::ostringstream oss;
-            oss << "    mov dword [rbp-" << stackOffset << "], eax";
-            gen.emit(oss.str());
+            emitStore(gen, varInfo);
 
-            gen.emit("    ; Created variable '" + var->getName() + "' with inferred type");
+            gen.emit(MachineInstr::note("Created variable '" + var->getName() + "' with inferred type"));
         }
     }
     else
     {
-        gen.emit("    ; ERROR: Invalid left-hand side in assignment");
+        gen.emit(MachineInstr::note("ERROR: Invalid left-hand side in assignment"));
+    }
+}
+
+// Store a leaf value straight into a variable's home
+static bool emitDirectStore(CodeGen &gen, const VariableInfo &dest, const ExprAST *value)
+{
+    MachineOperand operand;
+    if (!directOperand(value, operand))
+        return false;
+
+    if (!dest.reg.empty())
+    {
+        if (operand.isReg(dest.reg))
+            return true;
+        if (dest.size == 8 || operand.isImm())
+            gen.emit(MachineInstr::mov(reg(dest.reg), operand));
+        else
+            gen.emit(MachineInstr(Opcode::Movsxd, {reg(dest.reg), lowHalf(operand)}));
+        return true;
     }
+
+    // No memory-to-memory moves
+    if (operand.isMem())
+        return false;
+    gen.emit(MachineInstr::mov(slotOperand(dest.stackOffset, dest.size), dest.size == 8 ? operand : lowHalf(operand)));
+    return true;
+}
+
+// x = x + y, x = x - y and x = x * y with a leaf y update x where it lives
+static bool emitUpdateInPlace(CodeGen &gen, const VariableInfo &dest, const std::string &name, const ExprAST *value)
+{
+    const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(value);
+    if (!binary || (binary->getOp() != "+" && binary->getOp() != "-" && binary->getOp() != "*"))
+        return false;
+    const std::string &op = binary->getOp();
+
+    const VariableExprAST *lhs = dynamic_cast<const VariableExprAST *>(binary->getLHS());
+    const VariableExprAST *rhs = dynamic_cast<const VariableExprAST *>(binary->getRHS());
+    const ExprAST *other = nullptr;
+    if (lhs && lhs->getName() == name)
+        other = binary->getRHS();
+    else if (op != "-" && rhs && rhs->getName() == name)
+        other = binary->getLHS();
+    MachineOperand operand;
+    if (!other || !directOperand(other, operand))
+        return false;
+
+    // Multiplication by a constant has cheaper forms than imul
+    if (op == "*" && operand.isImm())
+        return false;
+    Opcode opcode = op == "+" ? Opcode::Add : op == "-" ? Opcode::Sub : Opcode::Imul;
+
+    if (dest.reg.empty())
+    {
+        // Memory destinations take add and sub with a register or immediate
+        if (op == "*" || operand.isMem())
+            return false;
+        gen.emit(MachineInstr::arithmetic(opcode, slotOperand(dest.stackOffset, dest.size),
+                                          dest.size == 8 ? operand : lowHalf(operand)));
+        return true;
+    }
+    if (dest.size == 8)
+    {
+        gen.emit(MachineInstr::arithmetic(opcode, reg(dest.reg), operand));
+        return true;
+    }
+
+    // int registers wrap at 32 bits and are kept sign-extended
+    MachineOperand reg32 = reg(register32(dest.reg));
+    gen.emit(MachineInstr::arithmetic(opcode, reg32, lowHalf(operand)));
+    gen.emit(MachineInstr(Opcode::Movsxd, {reg(dest.reg), reg32}));
+    return true;
+}
+
+// An assignment whose value is not used stores without going through rax
+// when it can
+static void emitAssignmentStatement(CodeGen &gen, const ExprAST *expr)
+{
+    const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr);
+    const VariableExprAST *var = assign ? dynamic_cast<const VariableExprAST *>(assign->getLHS()) : nullptr;
+    if (var && symbolTable.count(var->getName()))
+    {
+        const VariableInfo &varInfo = symbolTable[var->getName()];
+        if (emitDirectStore(gen, varInfo, assign->getRHS()) ||
+            emitUpdateInPlace(gen, varInfo, var->getName(), assign->getRHS()))
+            return;
+    }
+    expr->codegen(gen);
 }
 
 // VarDeclStmtAST codegen - Declare variables and initialize
 void VarDeclStmtAST::codegen(CodeGen &gen) const
 {
     for (const auto &var : Vars)
-    {
-        int typeSize = getTypeSize(Type);
-        stackOffset += typeSize;
-
-        // Add to symbol table
-        VariableInfo varInfo;
-        varInfo.stackOffset = stackOffset;
-        varInfo.type = Type;
-        varInfo.size = typeSize;
-        symbolTable[var.first] = varInfo;
+    {
+        // The initializer may create variables of its own, so remember
+        // where this one lives
+        VariableInfo varInfo = bindVariable(var.first, Type);
 
         // If there's an initializer, evaluate it and store
         if (var.second)
         {
+            if (emitDirectStore(gen, varInfo, var.second.get()))
+                continue;
             var.second->codegen(gen);
-            std::ostringstream oss;
-            oss << "    mov dword [rbp-" << stackOffset << "], eax";
-            gen.emit(oss.str());
+            emitStore(gen, varInfo);
         }
-        else
+        else if (!varInfo.reg.empty())
         {
             // Initialize to zero if no initializer
-            std::ostringstream oss;
-            oss << "    mov dword [rbp-" << stackOffset << "], 0";
-            gen.emit(oss.str());
+            MachineOperand reg32 = reg(register32(varInfo.reg));
+            gen.emit(MachineInstr::arithmetic(Opcode::Xor, reg32, reg32));
+        }
+        else
+        {
+            gen.emit(MachineInstr::mov(slotOperand(varInfo.stackOffset, varInfo.size), imm(0)));
         }
     }
 }
@@ -285,7 +1056,7 @@ void VarDeclStmtAST::codegen(CodeGen &gen) const
 // ExprStmtAST codegen
 void ExprStmtAST::codegen(CodeGen &gen) const
 {
-    Expr->codegen(gen);
+    emitAssignmentStatement(gen, Expr.get());
 }
 
 // CompoundStmtAST codegen
@@ -297,183 +1068,193 @@ void CompoundStmtAST::codegen(CodeGen &gen) const
     }
 }
 
-// Helper function to recursively calculate stack space for all variables
-int calculateTotalStackSpace(const std::vector<std::unique_ptr<StmtAST>> &statements)
-{
-    int totalSpace = 0;
-
-    for (const auto &stmt : statements)
-    {
-        // Check for variable declarations
-        const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt.get());
-        if (varDecl)
-        {
-            for (const auto &var : varDecl->getVars())
-            {
-                totalSpace += getTypeSize(varDecl->getVarType());
-            }
-        }
-
-        // Check for compound statements (blocks with more statements)
-        const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt.get());
-        if (compound)
-        {
-            // Recursively scan compound statements
-            // We need to access the statements inside, but CompoundStmtAST doesn't expose them
-            // For now, just add extra space
-            totalSpace += 32; // Buffer for compound statement variables
-        }
-
-        // Check for if statements
-        const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt.get());
-        if (ifStmt)
-        {
-            totalSpace += 16; // Buffer for if statement variables
-        }
-
-        // Check for for loops
-        const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt.get());
-        if (forStmt)
-        {
-            totalSpace += 16; // Space for for loop variable (typically int i)
-        }
-
-        // Check for while loops
-        const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt.get());
-        if (whileStmt)
-        {
-            totalSpace += 16; // Buffer for while loop variables
-        }
-    }
-
-    return totalSpace;
-}
-
 // ProgramAST codegen - Main program entry point
 void ProgramAST::codegen(CodeGen &gen) const
 {
     // Linux ELF64 assembly header
-    gen.emit("section .data");
-    gen.emit("    buffer times 32 db 0");
-    gen.emit("");
-    gen.emit("section .text");
-    gen.emit("global _start");
-    gen.emit("");
-
-    // Simple print function for integers - Linux specific
-    gen.emit("print_int:");
-    gen.emit("    ; Convert integer in rdi to string and print");
-    gen.emit("    push rbp");
-    gen.emit("    mov rbp, rsp");
+    std::string digitPairs, powers;
+    for (int i = 0; i < 100; ++i)
+        digitPairs += std::to_string(i / 10) + std::to_string(i % 10);
+    for (int i = 0; i < 20; ++i)
+        powers += (i ? ", 1" : "1") + std::string(i, '0');
+    gen.emitData("digit_pairs db \"" + digitPairs + "\"");
+    gen.emitData("pow10 dq " + powers);
+    gen.emitBss("outbuf resb " + std::to_string(outputBufferSize));
+    gen.emitBss("outlen resq 1");
+    gen.emitBss("outtty resb 1");
+    gen.emitBss("termios resb 64");
+    gen.declareGlobal("_start");
+
+    // Simple print function for integers - Linux specific. The text goes
+    // into outbuf; flush_output writes it out. The digit count comes from
+    // the bit length, so the digits are stored in place, two at a time,
+    // without a div.
+    gen.beginFunction("print_int");
+    gen.emit("    ; Format the integer in rdi as a decimal line in outbuf");
     gen.emit("    push rbx");
     gen.emit("    push rcx");
     gen.emit("    push rdx");
     gen.emit("    push rsi");
-    gen.emit("");
-    gen.emit("    mov rax, rdi         ; number to convert");
-    gen.emit("    mov rsi, buffer + 31 ; point to end of buffer");
-    gen.emit("    mov byte [rsi], 0    ; null terminator");
-    gen.emit("    dec rsi");
-    gen.emit("    mov byte [rsi], 10   ; newline");
-    gen.emit("    dec rsi");
-    gen.emit("");
-    gen.emit("    ; Handle negative numbers");
-    gen.emit("    test rax, rax");
-    gen.emit("    jns .positive");
-    gen.emit("    neg rax");
-    gen.emit("    mov bl, 1            ; remember negative");
-    gen.emit("    jmp .convert");
-    gen.emit(".positive:");
-    gen.emit("    mov bl, 0            ; not negative");
-    gen.emit("");
-    gen.emit(".convert:");
-    gen.emit("    mov rcx, 10");
-    gen.emit("    xor rdx, rdx");
-    gen.emit("    div rcx              ; rax = quotient, rdx = remainder");
-    gen.emit("    add dl, '0'          ; convert to ASCII");
-    gen.emit("    mov [rsi], dl");
-    gen.emit("    dec rsi");
+    gen.emit("    ; Make room for the longest number and its newline");
+    gen.emit("    cmp qword [outlen], " + std::to_string(outputBufferSize - 21));
+    gen.emit("    jbe .room");
+    gen.emit("    call flush_output");
+    gen.emitLabel(".room");
+    gen.emit("    mov rsi, [outlen]");
+    gen.emit("    add rsi, outbuf      ; where the text starts");
+    gen.emit("    mov rax, rdi");
     gen.emit("    test rax, rax");
-    gen.emit("    jnz .convert");
-    gen.emit("");
-    gen.emit("    ; Add minus sign if negative");
-    gen.emit("    test bl, bl");
-    gen.emit("    jz .print");
+    gen.emit("    jns .count");
     gen.emit("    mov byte [rsi], '-'");
-    gen.emit("    dec rsi");
-    gen.emit("");
-    gen.emit(".print:");
-    gen.emit("    inc rsi              ; point to first character");
-    gen.emit("    ; Calculate string length");
-    gen.emit("    mov rdx, buffer + 32");
-    gen.emit("    sub rdx, rsi         ; length including newline");
-    gen.emit("    ; Linux sys_write system call");
+    gen.emit("    inc rsi");
+    gen.emit("    neg rax              ; unsigned from here on, so INT64_MIN works");
+    gen.emitLabel(".count");
+    gen.emit("    ; digits = bits * 1233 / 4096, plus one unless below that power of 10");
+    gen.emit("    mov rcx, rax");
+    gen.emit("    or rcx, 1");
+    gen.emit("    bsr rbx, rcx");
+    gen.emit("    inc rbx              ; bit length");
+    gen.emit("    imul rbx, rbx, 1233");
+    gen.emit("    shr rbx, 12");
+    gen.emit("    cmp rcx, [pow10 + rbx*8]");
+    gen.emit("    jb .counted");
+    gen.emit("    inc rbx");
+    gen.emitLabel(".counted");
+    gen.emit("    add rsi, rbx         ; end of the digits");
+    gen.emit("    mov byte [rsi], 10   ; newline");
+    gen.emit("    lea rcx, [rsi + 1]");
+    gen.emit("    sub rcx, outbuf");
+    gen.emit("    mov [outlen], rcx");
+    gen.emitLabel(".pairs");
+    gen.emit("    cmp rax, 100");
+    gen.emit("    jb .last");
+    gen.emit("    ; q = (v >> 2) * ceil(2^68 / 100) >> 68 = v / 100");
+    gen.emit("    mov rbx, rax");
+    gen.emit("    shr rax, 2");
+    gen.emit("    mov rcx, 2951479051793528259");
+    gen.emit("    mul rcx");
+    gen.emit("    shr rdx, 2");
+    gen.emit("    imul rcx, rdx, 100");
+    gen.emit("    sub rbx, rcx         ; v % 100");
+    gen.emit("    movzx ecx, word [digit_pairs + rbx*2]");
+    gen.emit("    sub rsi, 2");
+    gen.emit("    mov [rsi], cx");
+    gen.emit("    mov rax, rdx");
+    gen.emit("    jmp .pairs");
+    gen.emitLabel(".last");
+    gen.emit("    cmp rax, 10");
+    gen.emit("    jb .single");
+    gen.emit("    movzx ecx, word [digit_pairs + rax*2]");
+    gen.emit("    mov [rsi - 2], cx");
+    gen.emit("    jmp .written");
+    gen.emitLabel(".single");
+    gen.emit("    add al, '0'");
+    gen.emit("    mov [rsi - 1], al");
+    gen.emitLabel(".written");
+    gen.emit("    ; A terminal sees every line as it is printed");
+    gen.emit("    cmp byte [outtty], 0");
+    gen.emit("    je .done");
+    gen.emit("    call flush_output");
+    gen.emitLabel(".done");
+    gen.emit("    pop rsi");
+    gen.emit("    pop rdx");
+    gen.emit("    pop rcx");
+    gen.emit("    pop rbx");
+    gen.emit("    ret");
+
+    // Write out the buffered output; only rax is clobbered
+    gen.beginFunction("flush_output");
+    gen.emit("    push rcx             ; syscall clobbers rcx and r11");
+    gen.emit("    push rdx");
+    gen.emit("    push rsi");
+    gen.emit("    push rdi");
+    gen.emit("    push r11");
+    gen.emit("    mov rsi, outbuf");
+    gen.emit("    mov rdx, [outlen]");
+    gen.emitLabel(".write");
+    gen.emit("    test rdx, rdx");
+    gen.emit("    jz .done");
     gen.emit("    mov rax, 1           ; sys_write");
     gen.emit("    mov rdi, 1           ; stdout");
     gen.emit("    syscall");
-    gen.emit("");
+    gen.emit("    test rax, rax");
+    gen.emit("    jle .done            ; give up on a write error");
+    gen.emit("    add rsi, rax         ; short write: go on with the rest");
+    gen.emit("    sub rdx, rax");
+    gen.emit("    jmp .write");
+    gen.emitLabel(".done");
+    gen.emit("    mov qword [outlen], 0");
+    gen.emit("    pop r11");
+    gen.emit("    pop rdi");
     gen.emit("    pop rsi");
     gen.emit("    pop rdx");
     gen.emit("    pop rcx");
-    gen.emit("    pop rbx");
-    gen.emit("    pop rbp");
     gen.emit("    ret");
-    gen.emit("");
-
-    gen.emit("_start:");
-    gen.emit("    push rbp");
-    gen.emit("    mov rbp, rsp");
 
-    // Calculate total stack space needed - recursively scan ALL statements
-    int totalStackNeeded = calculateTotalStackSpace(Statements);
+    // Every way out of the program comes through here, so an embedder
+    // can replace this one function to get control back
+    gen.beginFunction("exit_program");
+    gen.emit("    ; End the program with the status in rdi");
+    gen.emit("    call flush_output");
+    gen.emit("    mov rax, 60          ; sys_exit");
+    gen.emit("    syscall");
 
-    // Reserve extra space for loop variables and nested declarations
-    totalStackNeeded += 128; // Extra buffer for loop variables and safety
+    // User functions
+    for (const auto &func : Functions)
+        functionArity[func->getProto()->getName()] = func->getProto()->getArgs().size();
+    for (const auto &func : Functions)
+        func->codegen(gen);
 
-    // Reserve stack space if needed
-    if (totalStackNeeded > 0)
-    {
-        // Align to 16-byte boundary
-        int alignedStack = ((totalStackNeeded + 15) / 16) * 16;
-        std::ostringstream oss;
-        oss << "    sub rsp, " << alignedStack;
-        gen.emit(oss.str());
-    }
+    // The top level never returns, so it saves no registers
+    std::vector<const StmtAST *> statements;
+    for (const auto &stmt : Statements)
+        statements.push_back(stmt.get());
+    allocation.run(statements);
+    stackOffset = allocation.frameBytes();
+
+    gen.beginFunction("_start");
+    gen.emit(MachineInstr::push(reg("rbp")));
+    gen.emit(MachineInstr::mov(reg("rbp"), reg("rsp")));
+    gen.emit(MachineInstr::arithmetic(Opcode::Sub, reg("rsp"), imm(0)));
+    gen.emit("    ; Line-buffer output when stdout is a terminal");
+    gen.emit("    mov rax, 16         ; sys_ioctl");
+    gen.emit("    mov rdi, 1          ; stdout");
+    gen.emit("    mov rsi, 21505      ; TCGETS");
+    gen.emit("    mov rdx, termios");
+    gen.emit("    syscall");
+    gen.emit("    test rax, rax");
+    gen.emit("    sete byte [outtty]");
 
     // Generate code for all statements
     for (const auto &stmt : Statements)
     {
         stmt->codegen(gen);
     }
+    gen.setFrameSize(stackOffset);
 
     // Program exit - Linux specific
-    gen.emit("    ; Exit program");
-    gen.emit("    mov rax, 60         ; sys_exit");
-    gen.emit("    mov rdi, 0          ; exit status");
-    gen.emit("    syscall");
+    gen.emit(MachineInstr::note("Exit program"));
+    gen.emit(MachineInstr::mov(rdi, imm(0), "exit status"));
+    gen.emit(MachineInstr::jump("exit_program"));
 }
 
 // Boolean expression codegen
 void BoolExprAST::codegen(CodeGen &gen) const
 {
-    std::ostringstream oss;
-    oss << "    mov rax, " << (Val ? 1 : 0);
-    gen.emit(oss.str());
+    gen.emit(MachineInstr::mov(rax, imm(Val ? 1 : 0)));
 }
 
 // Character expression codegen
 void CharExprAST::codegen(CodeGen &gen) const
 {
-    std::ostringstream oss;
-    oss << "    mov rax, " << static_cast<int>(Val);
-    gen.emit(oss.str());
+    gen.emit(MachineInstr::mov(rax, imm(static_cast<int>(Val))));
 }
 
 // String expression codegen
 void StringExprAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; String literal: " + Val);
-    gen.emit("    mov rax, 0  ; String pointer placeholder");
+    gen.emit(MachineInstr::note("String literal: " + Val));
+    gen.emit(MachineInstr::mov(rax, imm(0), "String pointer placeholder"));
 }
 
 // Unary expression codegen
@@ -483,45 +1264,324 @@ void UnaryExprAST::codegen(CodeGen &gen) const
 
     if (Op == "-")
     {
-        gen.emit("    neg rax");
+        gen.emit(MachineInstr(Opcode::Neg, {rax}));
     }
     else if (Op == "!")
     {
-        gen.emit("    test rax, rax");
-        gen.emit("    setz al");
-        gen.emit("    movzx rax, al");
+        gen.emit(MachineInstr(Opcode::Test, {rax, rax}));
+        gen.emit(MachineInstr::conditional(Opcode::Setcc, "z", {al}));
+        gen.emit(MachineInstr(Opcode::Movzx, {rax, al}));
     }
     else if (Op == "~")
     {
-        gen.emit("    not rax");
+        gen.emit(MachineInstr(Opcode::Not, {rax}));
+    }
+}
+
+// Helper to check a call against the callee's signature
+static bool callIsValid(const CallExprAST *call)
+{
+    auto function = functionArity.find(call->getCallee());
+    return function != functionArity.end() && call->getArgs().size() == function->second &&
+           call->getArgs().size() <= maxRegisterArguments;
+}
+
+// Helper to evaluate arguments left to right, then move them into place
+static void emitArguments(CodeGen &gen, const CallExprAST *call)
+{
+    const auto &args = call->getArgs();
+    for (const auto &arg : args)
+    {
+        MachineOperand operand;
+        if (directOperand(arg.get(), operand))
+        {
+            gen.emit(MachineInstr::push(operand));
+            continue;
+        }
+        arg->codegen(gen);
+        gen.emit(MachineInstr::push(rax));
     }
+    for (size_t i = args.size(); i-- > 0;)
+        gen.emit(MachineInstr::pop(reg(argumentRegisters[i])));
 }
 
-// Function call codegen
+// Function call codegen - arguments are passed in registers
 void CallExprAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; Function call: " + Callee);
-    // For now, just placeholder
+    // flush() writes out buffered print output, unless the program
+    // defines a function of that name
+    if (Callee == "flush" && Args.empty() && functionArity.find(Callee) == functionArity.end())
+    {
+        gen.emit(MachineInstr::call("flush_output"));
+        gen.emit(MachineInstr::mov(rax, imm(0)));
+        return;
+    }
+
+    if (!callIsValid(this))
+    {
+        if (functionArity.find(Callee) == functionArity.end())
+            gen.emit(MachineInstr::note("ERROR: Unknown function " + Callee));
+        else
+            gen.emit(MachineInstr::note("ERROR: Wrong number of arguments to " + Callee));
+        gen.emit(MachineInstr::mov(rax, imm(0)));
+        return;
+    }
+
+    emitArguments(gen, this);
+    gen.emit(MachineInstr::call(functionLabel(Callee)));
 }
 
 // Array access codegen
 void ArrayExprAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; Array access - placeholder");
+    gen.emit(MachineInstr::note("Array access - placeholder"));
 }
 
 // If statement codegen - Fixed label generation
+// Evaluate a condition into the flags and return the code that is set when
+// it holds. Comparisons set the flags with their own cmp.
+static std::string emitConditionFlags(CodeGen &gen, const ExprAST *condition)
+{
+    const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(condition);
+    if (binary && !conditionCode(binary->getOp()).empty())
+    {
+        const ExprAST *lhs = binary->getLHS(), *rhs = binary->getRHS();
+        const std::string &op = binary->getOp();
+        MachineOperand left, right;
+        bool leftDirect = directOperand(lhs, left);
+        bool rightDirect = directOperand(rhs, right);
+
+        // cmp takes a register or memory first operand and a register or
+        // immediate second one; an int slot compares as a dword against an
+        // immediate
+        const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(lhs);
+        if (!leftDirect && var && rightDirect && right.isImm() && symbolTable.count(var->getName()))
+        {
+            const VariableInfo &varInfo = symbolTable[var->getName()];
+            left = slotOperand(varInfo.stackOffset, varInfo.size);
+            leftDirect = true;
+        }
+        if (leftDirect && rightDirect && !left.isImm() && !(left.isMem() && right.isMem()))
+        {
+            gen.emit(MachineInstr::cmp(left, right));
+            return conditionCode(op);
+        }
+        if (rightDirect)
+        {
+            lhs->codegen(gen);
+            gen.emit(MachineInstr::cmp(rax, right));
+            return conditionCode(op);
+        }
+        if (leftDirect && leftReadableAfter(rhs))
+        {
+            rhs->codegen(gen);
+            gen.emit(MachineInstr::cmp(rax, left));
+            return conditionCode(mirrorComparison(op));
+        }
+
+        lhs->codegen(gen);
+        std::string held = holdLeftOperand(gen, binary, rhs);
+        rhs->codegen(gen);
+        if (!held.empty())
+        {
+            heldTemporaries.pop_back();
+            gen.emit(MachineInstr::cmp(reg(held), rax));
+            return conditionCode(op);
+        }
+        releaseLeftOperand(gen, held);
+        gen.emit(MachineInstr::cmp(rax, rcx));
+        return conditionCode(op);
+    }
+
+    MachineOperand operand;
+    if (directOperand(condition, operand) && operand.isReg())
+    {
+        gen.emit(MachineInstr(Opcode::Test, {operand, operand}));
+        return "nz";
+    }
+    condition->codegen(gen);
+    gen.emit(MachineInstr(Opcode::Test, {rax, rax}));
+    return "nz";
+}
+
+// Jump to target when the condition is true (or false). Comparisons branch
+// on their own flags instead of materializing a 0/1 value, ! swaps the
+// sense of the jump, and && and || become chains of jumps that skip the
+// right operand once the left one decides the outcome.
+static void emitConditionalJump(CodeGen &gen, const ExprAST *condition, bool jumpIfTrue, const std::string &target)
+{
+    long long value;
+    if (integerLiteral(condition, value))
+    {
+        if ((value != 0) == jumpIfTrue)
+            gen.emit(MachineInstr::jump(target));
+        return;
+    }
+
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(condition))
+    {
+        if (unary->getOp() == "!")
+        {
+            emitConditionalJump(gen, unary->getOperand(), !jumpIfTrue, target);
+            return;
+        }
+    }
+
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(condition))
+    {
+        // The left operand alone decides a && that is false and a || that
+        // is true
+        bool isAnd = binary->getOp() == "&&";
+        if (isAnd || binary->getOp() == "||")
+        {
+            if (jumpIfTrue != isAnd)
+            {
+                emitConditionalJump(gen, binary->getLHS(), jumpIfTrue, target);
+                emitConditionalJump(gen, binary->getRHS(), jumpIfTrue, target);
+            }
+            else
+            {
+                std::string skipLabel = generateLabel("cond_skip_");
+                emitConditionalJump(gen, binary->getLHS(), !jumpIfTrue, skipLabel);
+                emitConditionalJump(gen, binary->getRHS(), jumpIfTrue, target);
+                gen.emitLabel(skipLabel);
+            }
+            return;
+        }
+    }
+
+    std::string code = emitConditionFlags(gen, condition);
+    gen.emit(MachineInstr::jumpIf(jumpIfTrue ? code : inverseConditionCode(code), target));
+}
+
+// If-conversion. A diamond whose branches each store one cheap value into
+// the same variable,
+//
+//   if (c) x = a; else x = b;
+//
+// is emitted as x = c ? a : b with a cmov, and so is if (c) x = a; with b
+// being x itself. Both values are computed unconditionally, so they have to
+// be free of side effects and unable to trap, and small enough that
+// computing the unused one costs less than a mispredicted branch.
+static const int maxSelectOperandCost = 3; // nodes in each of a and b
+
+// Node count of a value that may be computed speculatively, or -1
+static int selectOperandCost(const ExprAST *expr)
+{
+    if (dynamic_cast<const NumberExprAST *>(expr) || dynamic_cast<const BoolExprAST *>(expr) ||
+        dynamic_cast<const CharExprAST *>(expr))
+        return 1;
+    if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+        return symbolTable.count(var->getName()) ? 1 : -1;
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        int cost = selectOperandCost(unary->getOperand());
+        return cost < 0 ? -1 : cost + 1;
+    }
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        // Division may trap on the path that was not taken, and && and ||
+        // branch themselves
+        if (binary->getOp() == "/" || binary->getOp() == "%" || binary->getOp() == "&&" || binary->getOp() == "||")
+            return -1;
+        int lhs = selectOperandCost(binary->getLHS());
+        int rhs = selectOperandCost(binary->getRHS());
+        return lhs < 0 || rhs < 0 ? -1 : lhs + rhs + 1;
+    }
+    return -1;
+}
+
+// True if evaluating the condition stores nothing the values could read
+static bool conditionIsPure(const ExprAST *expr)
+{
+    if (dynamic_cast<const AssignmentExprAST *>(expr) || dynamic_cast<const CallExprAST *>(expr))
+        return false;
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        return conditionIsPure(unary->getOperand());
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        return conditionIsPure(binary->getLHS()) && conditionIsPure(binary->getRHS());
+    return true;
+}
+
+// The assignment a branch consists of, looking through one-statement blocks
+static const AssignmentExprAST *singleAssignment(const StmtAST *stmt)
+{
+    while (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+    {
+        if (compound->getStatements().size() != 1)
+            return nullptr;
+        stmt = compound->getStatements()[0].get();
+    }
+    const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt);
+    if (!exprStmt)
+        return nullptr;
+    const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(exprStmt->getExpr());
+    if (!assign || !dynamic_cast<const VariableExprAST *>(assign->getLHS()))
+        return nullptr;
+    return assign;
+}
+
+static bool emitConditionalMove(CodeGen &gen, const ExprAST *condition, const StmtAST *thenStmt,
+                                const StmtAST *elseStmt)
+{
+    const AssignmentExprAST *thenAssign = singleAssignment(thenStmt);
+    if (!thenAssign || !conditionIsPure(condition))
+        return false;
+    const std::string &name = static_cast<const VariableExprAST *>(thenAssign->getLHS())->getName();
+    auto slot = symbolTable.find(name);
+    if (slot == symbolTable.end())
+        return false;
+
+    // Without an else the variable keeps its value
+    VariableExprAST current(name);
+    const ExprAST *elseValue = &current;
+    if (elseStmt)
+    {
+        const AssignmentExprAST *elseAssign = singleAssignment(elseStmt);
+        if (!elseAssign || static_cast<const VariableExprAST *>(elseAssign->getLHS())->getName() != name)
+            return false;
+        elseValue = elseAssign->getRHS();
+    }
+
+    int thenCost = selectOperandCost(thenAssign->getRHS());
+    int elseCost = selectOperandCost(elseValue);
+    if (thenCost < 0 || elseCost < 0 || thenCost > maxSelectOperandCost || elseCost > maxSelectOperandCost)
+        return false;
+
+    // Leaf values are loaded after the compare, since mov keeps the flags
+    MachineOperand thenOperand, elseOperand;
+    if (directOperand(thenAssign->getRHS(), thenOperand) && directOperand(elseValue, elseOperand))
+    {
+        std::string code = emitConditionFlags(gen, condition);
+        gen.emit(MachineInstr::mov(rax, thenOperand));
+        gen.emit(MachineInstr::mov(rcx, elseOperand));
+        gen.emit(MachineInstr::conditional(Opcode::Cmovcc, inverseConditionCode(code), {rax, rcx}));
+        emitStore(gen, slot->second);
+        return true;
+    }
+
+    elseValue->codegen(gen);
+    gen.emit(MachineInstr::push(rax));
+    thenAssign->getRHS()->codegen(gen);
+    gen.emit(MachineInstr::push(rax));
+    std::string code = emitConditionFlags(gen, condition);
+    gen.emit(MachineInstr::pop(rax));
+    gen.emit(MachineInstr::pop(rcx));
+    gen.emit(MachineInstr::conditional(Opcode::Cmovcc, inverseConditionCode(code), {rax, rcx}));
+    emitStore(gen, slot->second);
+    return true;
+}
+
 void IfStmtAST::codegen(CodeGen &gen) const
 {
+    if (emitConditionalMove(gen, Condition.get(), ThenStmt.get(), ElseStmt.get()))
+        return;
+
     std::string falseLabel = generateLabel("if_false_");
     std::string endLabel = generateLabel("if_end_");
 
-    // Evaluate condition
-    Condition->codegen(gen);
-
-    // Test condition and jump if false
-    gen.emit("    test rax, rax");
-    gen.emit("    jz " + falseLabel);
+    // Jump over the then statement if the condition is false
+    emitConditionalJump(gen, Condition.get(), false, falseLabel);
 
     // Generate then statement
     ThenStmt->codegen(gen);
@@ -529,55 +1589,56 @@ void IfStmtAST::codegen(CodeGen &gen) const
     // If there's an else clause, jump over it
     if (ElseStmt)
     {
-        gen.emit("    jmp " + endLabel);
+        gen.emit(MachineInstr::jump(endLabel));
     }
 
     // False label
-    gen.emit(falseLabel + ":");
+    gen.emitLabel(falseLabel);
 
     // Generate else statement if it exists
     if (ElseStmt)
     {
         ElseStmt->codegen(gen);
-        gen.emit(endLabel + ":");
+        gen.emitLabel(endLabel);
     }
     else
     {
         // No else clause, false label is the end
-        gen.emit(endLabel + ":");
+        gen.emitLabel(endLabel);
     }
 }
 
-// While loop codegen - Fixed
+// While loop codegen. The loop is rotated into a guarded do-while: the
+// condition is tested once on entry and then again at the bottom, so each
+// iteration runs a single conditional backward branch.
 void WhileStmtAST::codegen(CodeGen &gen) const
 {
     std::string loopLabel = generateLabel("while_loop_");
+    std::string condLabel = generateLabel("while_cond_");
     std::string endLabel = generateLabel("while_end_");
 
-    // Loop start
-    gen.emit(loopLabel + ":");
-
-    // Evaluate condition
-    Condition->codegen(gen);
-
-    // Test condition and jump if false
-    gen.emit("    test rax, rax");
-    gen.emit("    jz " + endLabel);
+    // Skip the loop if the condition is false on entry
+    emitConditionalJump(gen, Condition.get(), false, endLabel);
 
-    // Generate loop body
+    // Generate loop body; continue re-evaluates the condition
+    gen.emitLabel(loopLabel);
+    loopStack.push_back({endLabel, condLabel});
     Body->codegen(gen);
+    loopStack.pop_back();
 
-    // Jump back to condition
-    gen.emit("    jmp " + loopLabel);
+    // Go around again while the condition holds
+    gen.emitLabel(condLabel);
+    emitConditionalJump(gen, Condition.get(), true, loopLabel);
 
     // End label
-    gen.emit(endLabel + ":");
+    gen.emitLabel(endLabel);
 }
 
-// For loop codegen - Fixed to handle increment properly
+// For loop codegen, rotated like the while loop
 void ForStmtAST::codegen(CodeGen &gen) const
 {
     std::string loopLabel = generateLabel("for_loop_");
+    std::string updateLabel = generateLabel("for_update_");
     std::string endLabel = generateLabel("for_end_");
 
     // Generate initialization
@@ -586,95 +1647,345 @@ void ForStmtAST::codegen(CodeGen &gen) const
         Init->codegen(gen);
     }
 
-    // Loop start
-    gen.emit(loopLabel + ":");
-
-    // Evaluate condition
+    // Skip the loop if the condition is false on entry
     if (Condition)
-    {
-        Condition->codegen(gen);
-        gen.emit("    test rax, rax");
-        gen.emit("    jz " + endLabel);
-    }
+        emitConditionalJump(gen, Condition.get(), false, endLabel);
 
-    // Generate loop body
+    // Generate loop body; continue jumps to the update expression
+    gen.emitLabel(loopLabel);
+    loopStack.push_back({endLabel, updateLabel});
     Body->codegen(gen);
+    loopStack.pop_back();
 
     // Generate update expression
+    gen.emitLabel(updateLabel);
     if (Update)
     {
-        Update->codegen(gen);
+        emitAssignmentStatement(gen, Update.get());
     }
 
-    // Jump back to condition check
-    gen.emit("    jmp " + loopLabel);
+    // Go around again while the condition holds
+    if (Condition)
+        emitConditionalJump(gen, Condition.get(), true, loopLabel);
+    else
+        gen.emit(MachineInstr::jump(loopLabel));
 
     // End label
-    gen.emit(endLabel + ":");
+    gen.emitLabel(endLabel);
+}
+
+// Switch dispatch. A sorted run of case values is lowered by how densely it
+// covers its range: a compare chain for up to three values, bit tests (one
+// mask per target) when the range fits in 64 bits and the values go to at
+// most three cases, a bounds-checked jump table in .rodata when at least
+// 40% of the slots are used, and otherwise a compare against the median
+// value that splits the run in two. Dispatch takes O(log n) compares.
+struct SwitchTarget
+{
+    long long value;
+    std::string label;
+};
+
+static const size_t minJumpTableCases = 4;
+static const long long minJumpTableDensity = 40; // percent of the range
+static const size_t maxCompareChain = 3;
+static const size_t maxBitTestTargets = 3;
+
+// The value is in rax; jump to the target of each listed value, or to
+// otherLabel for anything else
+static void emitSwitchDispatch(CodeGen &gen, const std::vector<SwitchTarget> &targets, size_t begin, size_t end,
+                               const std::string &otherLabel)
+{
+    size_t count = end - begin;
+    if (count <= maxCompareChain)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            gen.emit(MachineInstr::cmp(rax, imm(targets[i].value)));
+            gen.emit(MachineInstr::jumpIf("e", targets[i].label));
+        }
+        gen.emit(MachineInstr::jump(otherLabel));
+        return;
+    }
+
+    long long low = targets[begin].value, high = targets[end - 1].value;
+    long long range = high - low + 1; // case values are ints, so this cannot overflow
+
+    std::vector<std::string> distinct;
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (std::find(distinct.begin(), distinct.end(), targets[i].label) == distinct.end())
+            distinct.push_back(targets[i].label);
+    }
+
+    bool jumpTable = count >= minJumpTableCases && static_cast<long long>(count) * 100 >= range * minJumpTableDensity;
+    bool bitTests = range <= 64 && distinct.size() <= maxBitTestTargets;
+    if (jumpTable || bitTests)
+    {
+        // Unsigned bounds check of value - low, which also rejects values
+        // below low
+        gen.emit(MachineInstr::mov(rcx, rax));
+        if (low != 0)
+            gen.emit(MachineInstr::arithmetic(Opcode::Sub, rcx, imm(low)));
+        gen.emit(MachineInstr::cmp(rcx, imm(range - 1)));
+        gen.emit(MachineInstr::jumpIf("a", otherLabel));
+    }
+
+    if (bitTests)
+    {
+        for (const auto &label : distinct)
+        {
+            unsigned long long mask = 0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                if (targets[i].label == label)
+                    mask |= 1ULL << (targets[i].value - low);
+            }
+            gen.emit(MachineInstr::mov(rdx, imm(static_cast<long long>(mask))));
+            gen.emit(MachineInstr(Opcode::Bt, {rdx, rcx}));
+            gen.emit(MachineInstr::jumpIf("c", label));
+        }
+        gen.emit(MachineInstr::jump(otherLabel));
+        return;
+    }
+
+    if (jumpTable)
+    {
+        std::string table = generateLabel("switch_table_");
+        std::string entries;
+        size_t next = begin;
+        for (long long value = low; value <= high; ++value)
+        {
+            bool listed = next < end && targets[next].value == value;
+            entries += (value == low ? "" : ", ") + (listed ? targets[next++].label : otherLabel);
+        }
+        gen.emitRodata(table + " dd " + entries);
+        gen.emit(MachineInstr::mov(reg("ecx"), MachineOperand::mem(table + "+rcx*4", 4)));
+        gen.emit(MachineInstr(Opcode::Jmp, {rcx}));
+        return;
+    }
+
+    // Binary search: values below the median go left
+    size_t middle = begin + count / 2;
+    std::string upperLabel = generateLabel("switch_upper_");
+    gen.emit(MachineInstr::cmp(rax, imm(targets[middle].value)));
+    gen.emit(MachineInstr::jumpIf("ge", upperLabel));
+    emitSwitchDispatch(gen, targets, begin, middle, otherLabel);
+    gen.emitLabel(upperLabel);
+    emitSwitchDispatch(gen, targets, middle, end, otherLabel);
+}
+
+void SwitchStmtAST::codegen(CodeGen &gen) const
+{
+    std::string endLabel = generateLabel("switch_end_");
+    std::vector<std::string> caseLabels;
+    std::string defaultLabel = endLabel;
+    std::vector<SwitchTarget> targets;
+    for (const auto &c : Cases)
+    {
+        caseLabels.push_back(generateLabel("switch_case_"));
+        if (c.IsDefault)
+            defaultLabel = caseLabels.back();
+        for (long long value : c.Values)
+            targets.push_back({value, caseLabels.back()});
+    }
+    std::sort(targets.begin(), targets.end(), [](const SwitchTarget &a, const SwitchTarget &b)
+              { return a.value < b.value; });
+
+    Value->codegen(gen);
+    emitSwitchDispatch(gen, targets, 0, targets.size(), defaultLabel);
+
+    // Cases fall through into each other; break leaves the switch and
+    // continue still belongs to the enclosing loop
+    std::string continueLabel = loopStack.empty() ? "" : loopStack.back().continueLabel;
+    loopStack.push_back({endLabel, continueLabel});
+    for (size_t i = 0; i < Cases.size(); ++i)
+    {
+        gen.emitLabel(caseLabels[i]);
+        Cases[i].Body->codegen(gen);
+    }
+    loopStack.pop_back();
+    gen.emitLabel(endLabel);
+}
+
+// Tear down the current function's frame and restore the callee-saved
+// registers it used
+static void emitFrameExit(CodeGen &gen)
+{
+    gen.emit(MachineInstr::mov(reg("rsp"), reg("rbp")));
+    gen.emit(MachineInstr::pop(reg("rbp")));
+    for (size_t i = savedRegisters.size(); i-- > 0;)
+        gen.emit(MachineInstr::pop(reg(savedRegisters[i])));
 }
 
 // Return statement codegen
 void ReturnStmtAST::codegen(CodeGen &gen) const
 {
+    // A returned call is a tail call: nothing of the current frame is
+    // needed afterwards, so the callee reuses it instead of nesting a new
+    // one, and deep recursion runs in constant stack
+    const CallExprAST *call = dynamic_cast<const CallExprAST *>(Value.get());
+    if (inFunction && call && callIsValid(call))
+    {
+        emitArguments(gen, call);
+        if (call->getCallee() == currentFunction)
+        {
+            // Self recursion becomes a loop: rebind the parameters and
+            // start the body again in the same frame
+            gen.emit(MachineInstr::jump(functionBodyLabel(currentFunction), "tail call"));
+            return;
+        }
+
+        // Sibling call: drop our frame and let the callee return straight
+        // to our caller
+        emitFrameExit(gen);
+        gen.emit(MachineInstr::jump(functionLabel(call->getCallee()), "tail call"));
+        return;
+    }
+
     if (Value)
     {
         Value->codegen(gen);
     }
     else
     {
-        gen.emit("    mov rax, 0"); // Return 0 if no value
+        gen.emit(MachineInstr::mov(rax, imm(0))); // Return 0 if no value
     }
 
-    gen.emit("    mov rsp, rbp");
-    gen.emit("    pop rbp");
-    gen.emit("    ret");
+    if (!inFunction)
+    {
+        // Returning from the top level ends the program
+        gen.emit(MachineInstr::mov(rdi, rax, "exit status"));
+        gen.emit(MachineInstr::jump("exit_program"));
+        return;
+    }
+
+    emitFrameExit(gen);
+    gen.emit(MachineInstr(Opcode::Ret));
 }
 
-// Break and continue statements - simplified
+// Break and continue statements - jump to the innermost loop's (or for
+// break, switch's) labels
 void BreakStmtAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; break statement - placeholder");
+    if (loopStack.empty())
+    {
+        gen.emit(MachineInstr::note("ERROR: break outside of a loop"));
+        return;
+    }
+    gen.emit(MachineInstr::jump(loopStack.back().breakLabel));
 }
 
 void ContinueStmtAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; continue statement - placeholder");
+    if (loopStack.empty() || loopStack.back().continueLabel.empty())
+    {
+        gen.emit(MachineInstr::note("ERROR: continue outside of a loop"));
+        return;
+    }
+    gen.emit(MachineInstr::jump(loopStack.back().continueLabel));
 }
 
 // Function definition codegen
 void PrototypeAST::codegen(CodeGen &gen) const
 {
-    gen.emit(Name + ":");
-    gen.emit("    push rbp");
-    gen.emit("    mov rbp, rsp");
+    gen.beginFunction(functionLabel(Name));
+    for (const auto &saved : savedRegisters)
+        gen.emit(MachineInstr::push(reg(saved)));
+    gen.emit(MachineInstr::push(reg("rbp")));
+    gen.emit(MachineInstr::mov(reg("rbp"), reg("rsp")));
 }
 
 void FunctionAST::codegen(CodeGen &gen) const
 {
+    // Each function has its own frame and variables
+    auto savedSymbols = std::move(symbolTable);
+    int savedOffset = stackOffset;
+    symbolTable.clear();
+    stackOffset = 0;
+    inFunction = true;
+    currentFunction = Proto->getName();
+
+    std::vector<std::string> params;
+    for (const auto &arg : Proto->getArgs())
+        params.push_back(arg.second);
+    allocation.run({Body.get()}, params, currentFunction);
+    savedRegisters = allocation.calleeSavedUsed();
+
+    stackOffset = allocation.frameBytes();
+
     Proto->codegen(gen);
+    gen.emit(MachineInstr::arithmetic(Opcode::Sub, reg("rsp"), imm(0)));
+
+    // Move the register arguments into their homes. If a home is the
+    // incoming register of another argument, go through the stack so no
+    // argument is overwritten before it is read.
+    gen.emitLabel(functionBodyLabel(Proto->getName()));
+    const auto &args = Proto->getArgs();
+    size_t count = std::min(args.size(), maxRegisterArguments);
+    std::vector<VariableInfo> homes;
+    bool overlapping = false;
+    for (size_t i = 0; i < count; ++i)
+    {
+        homes.push_back(bindVariable(args[i].second, args[i].first));
+        for (size_t j = 0; j < count; ++j)
+        {
+            if (j != i && homes.back().reg == argumentRegisters[j])
+                overlapping = true;
+        }
+    }
+    if (overlapping)
+    {
+        for (size_t i = 0; i < count; ++i)
+            gen.emit(MachineInstr::push(reg(argumentRegisters[i])));
+        for (size_t i = count; i-- > 0;)
+        {
+            gen.emit(MachineInstr::pop(rax));
+            emitStore(gen, homes[i]);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < count; ++i)
+            emitStore(gen, homes[i], argumentRegisters[i]);
+    }
+
     Body->codegen(gen);
-    gen.emit("    mov rax, 0");
-    gen.emit("    mov rsp, rbp");
-    gen.emit("    pop rbp");
-    gen.emit("    ret");
+    gen.emit(MachineInstr::mov(rax, imm(0)));
+    emitFrameExit(gen);
+    gen.emit(MachineInstr(Opcode::Ret));
+    gen.setFrameSize(stackOffset);
+
+    inFunction = false;
+    currentFunction.clear();
+    savedRegisters.clear();
+    symbolTable = std::move(savedSymbols);
+    stackOffset = savedOffset;
 }
 
 // Scope expression codegen
 void ScopeExprAST::codegen(CodeGen &gen) const
 {
-    gen.emit("    ; Scope resolution: " + Member);
+    gen.emit(MachineInstr::note("Scope resolution: " + Member));
     Base->codegen(gen);
 }
 
 // Print statement codegen - Fixed for Linux
 void PrintStmtAST::codegen(CodeGen &gen) const
 {
-    // Generate code to evaluate the expression
-    Value->codegen(gen);
-
-    // Call our print function
-    gen.emit("    mov rdi, rax        ; argument for print_int");
-    gen.emit("    call print_int      ; call our print function");
+    // Generate code to evaluate the expression, straight into rdi if it is
+    // a leaf
+    MachineOperand operand;
+    if (directOperand(Value.get(), operand))
+    {
+        gen.emit(MachineInstr::mov(rdi, operand, "argument for print_int"));
+    }
+    else
+    {
+        Value->codegen(gen);
+        gen.emit(MachineInstr::mov(rdi, rax, "argument for print_int"));
+    }
+    gen.emit(MachineInstr::call("print_int", "call our print function"));
 }
 
 // Generate assembly from AST
@@ -683,6 +1994,8 @@ void CodeGen::generateAssembly(ProgramAST *root)
     if (root)
     {
         root->codegen(*this);
+        for (auto &function : module.functions)
+            peephole.run(function);
     }
 }
 
@@ -695,14 +2008,16 @@ void CodeGen::writeToFile(const std::string &filename) const
         std::cerr << "Error: Could not open file " << filename << " for writing" << std::endl;
         return;
     }
-    file << code.str();
+    file << getAssembly();
     file.close();
 }
 
 // Get assembly as string
 std::string CodeGen::getAssembly() const
 {
-    return code.str();
+    std::ostringstream text;
+    module.print(text);
+    return text.str();
 }
 
 void CodeGen::generateAssembly(const std::string &filename)
@@ -713,7 +2028,7 @@ void CodeGen::generateAssembly(const std::string &filename)
         std::cerr << "Error: Could not open file " << filename << " for writing" << std::endl;
         return;
     }
-    file << code.str();
+    file << getAssembly();
     file.close();
     std::cout << "📄 Assembly written to " << filename << std::endl;
 }
@@ -757,4 +2072,22 @@ bool CodeGen::generateBinary(const std::string &asmFile, const std::string &outp
 {
     generateAssembly(asmFile);
     return assembleToBinary(asmFile, outputBinary);
+}
+
+bool CodeGen::writeExecutable(const std::string &outputBinary)
+{
+    try
+    {
+        AssembledImage image = Assembler::assemble(module, ElfWriter::textAddress());
+        if (!ElfWriter::write(image, outputBinary))
+            return false;
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return false;
+    }
+
+    std::cout << "✅ Binary generated successfully: " << outputBinary << std::endl;
+    return true;
 }
\ No newline at end of file
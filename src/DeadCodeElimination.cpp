@@ -0,0 +1,506 @@
+#include "Optimizer.h"
+
+// Dead code elimination over the statement tree.
+//
+// Vesper only has structured control flow, so the control-flow graph is
+// implied by the statement tree: a statement list is a chain of blocks,
+// if/else is a diamond and every loop has a single header. The pass works
+// directly on that structure in two steps:
+//
+//   1. Unreachable code: statements after return/break/continue and the
+//      untaken side of constant branches are dropped.
+//   2. Dead stores: a backward "strong liveness" analysis finds stores whose
+//      value can never reach a print, return, call or branch condition.
+//      Those stores are removed, and so are declarations of locals that are
+//      never live, which also takes them out of the stack frame. A division
+//      that can trap is kept even when its value is not needed.
+
+namespace
+{
+    using LiveSet = std::set<std::string>;
+
+    bool isEmptyStatement(const StmtAST *stmt)
+    {
+        if (!stmt)
+            return true;
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            return compound->getStatements().empty();
+        return false;
+    }
+
+    // True if control can continue with the statement that follows
+    bool canFallThrough(const StmtAST *stmt)
+    {
+        if (dynamic_cast<const ReturnStmtAST *>(stmt) || dynamic_cast<const BreakStmtAST *>(stmt) ||
+            dynamic_cast<const ContinueStmtAST *>(stmt))
+            return false;
+
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+            {
+                if (!canFallThrough(child.get()))
+                    return false;
+            }
+            return true;
+        }
+
+        if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+        {
+            if (!ifStmt->getElse())
+                return true;
+            return canFallThrough(ifStmt->getThen()) || canFallThrough(ifStmt->getElse());
+        }
+
+        return true;
+    }
+
+    class DeadCodeEliminator
+    {
+    public:
+        DeadCodeEliminator(OptStats &stats) : Stats(stats) {}
+
+        bool changed() const { return Changed; }
+
+        // Record every variable read or written outside of a declaration
+        void collectReferences(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+            {
+                forEachExpression(stmt.get(), [&](std::unique_ptr<ExprAST> &expr)
+                                  {
+                                      collectReadVariables(expr.get(), Referenced);
+                                      collectWrittenVariables(expr.get(), Referenced); });
+            }
+        }
+
+        // Step 1: drop unreachable statements and fold constant branches
+        void removeUnreachable(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (size_t i = 0; i < stmts.size(); ++i)
+            {
+                simplifyStmt(stmts[i]);
+                if (stmts[i] && !canFallThrough(stmts[i].get()) && i + 1 < stmts.size())
+                {
+                    Stats["dce.unreachable_removed"] += static_cast<int>(stmts.size() - i - 1);
+                    stmts.erase(stmts.begin() + i + 1, stmts.end());
+                    Changed = true;
+                }
+            }
+            eraseNull(stmts);
+        }
+
+        // Step 2: remove dead stores. Returns the variables live before the list.
+        LiveSet processList(std::vector<std::unique_ptr<StmtAST>> &stmts, LiveSet live, bool apply)
+        {
+            for (size_t i = stmts.size(); i-- > 0;)
+                live = processStmt(stmts[i], live, apply);
+            if (apply)
+                eraseNull(stmts);
+            return live;
+        }
+
+    private:
+        struct LoopContext
+        {
+            LiveSet breakLive;
+            LiveSet continueLive;
+        };
+
+        OptStats &Stats;
+        std::vector<LoopContext> Loops;
+        std::set<std::string> Referenced;
+        bool Changed = false;
+
+        void eraseNull(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (size_t i = 0; i < stmts.size();)
+            {
+                if (!stmts[i])
+                    stmts.erase(stmts.begin() + i);
+                else
+                    ++i;
+            }
+        }
+
+        void removeStmt(std::unique_ptr<StmtAST> &stmt, const char *counter)
+        {
+            stmt.reset();
+            Stats[counter]++;
+            Changed = true;
+        }
+
+        void simplifyStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            long long value;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                removeUnreachable(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                simplifyStmt(ifStmt->getThenRef());
+                simplifyStmt(ifStmt->getElseRef());
+                if (!ifStmt->getThenRef())
+                    ifStmt->getThenRef() = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+
+                if (evaluateConstant(ifStmt->getCondition(), value))
+                {
+                    std::unique_ptr<StmtAST> taken = value ? std::move(ifStmt->getThenRef())
+                                                           : std::move(ifStmt->getElseRef());
+                    stmt = std::move(taken);
+                    Stats["dce.constant_branches"]++;
+                    Changed = true;
+                }
+                else if (isEmptyStatement(ifStmt->getThen()) && isEmptyStatement(ifStmt->getElse()) &&
+                         !hasSideEffects(ifStmt->getCondition()))
+                {
+                    removeStmt(stmt, "dce.empty_branches");
+                }
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                simplifyStmt(whileStmt->getBodyRef());
+                if (!whileStmt->getBodyRef())
+                    whileStmt->getBodyRef() = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+
+                if (evaluateConstant(whileStmt->getCondition(), value) && value == 0)
+                    removeStmt(stmt, "dce.constant_branches");
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                simplifyStmt(forStmt->getBodyRef());
+                if (!forStmt->getBodyRef())
+                    forStmt->getBodyRef() = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+
+                if (evaluateConstant(forStmt->getCondition(), value) && value == 0)
+                {
+                    // Only the initializer ever runs
+                    std::unique_ptr<StmtAST> init = std::move(forStmt->getInitRef());
+                    stmt = std::move(init);
+                    Stats["dce.constant_branches"]++;
+                    Changed = true;
+                }
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    simplifyStmt(c.Body);
+            }
+            else if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt.get()))
+            {
+                if (!hasSideEffects(exprStmt->getExpr()))
+                    removeStmt(stmt, "dce.unused_expressions");
+            }
+        }
+
+        // Backward transfer for an expression. When the expression's value is
+        // not needed, only the parts with side effects are kept; with apply set
+        // the expression is rewritten accordingly (possibly to nullptr).
+        LiveSet processExpr(std::unique_ptr<ExprAST> &expr, LiveSet live, bool valueNeeded, bool apply)
+        {
+            if (!expr)
+                return live;
+
+            if (VariableExprAST *var = dynamic_cast<VariableExprAST *>(expr.get()))
+            {
+                if (valueNeeded)
+                    live.insert(var->getName());
+                else if (apply)
+                    expr.reset();
+                return live;
+            }
+
+            if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+            {
+                VariableExprAST *target = dynamic_cast<VariableExprAST *>(assign->getLHSRef().get());
+                if (!target)
+                {
+                    std::set<std::string> reads;
+                    collectReadVariables(expr.get(), reads);
+                    live.insert(reads.begin(), reads.end());
+                    return live;
+                }
+
+                if (live.count(target->getName()))
+                {
+                    live.erase(target->getName());
+                    return processExpr(assign->getRHSRef(), live, true, apply);
+                }
+
+                // Nothing reads the stored value: keep only the right-hand side
+                live = processExpr(assign->getRHSRef(), live, valueNeeded, apply);
+                if (apply)
+                {
+                    std::unique_ptr<ExprAST> rhs = std::move(assign->getRHSRef());
+                    expr = std::move(rhs);
+                    Stats["dce.dead_stores"]++;
+                    Changed = true;
+                }
+                return live;
+            }
+
+            if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+            {
+                // A division that can trap is kept whole, value or not
+                if (canTrap(binary))
+                    valueNeeded = true;
+
+                if (binary->getOp() == "&&" || binary->getOp() == "||")
+                {
+                    // The right operand only runs when the left one does not
+                    // decide the result, so its stores may not happen, and if
+                    // any of it is kept the left operand still has to decide
+                    bool rightKept = valueNeeded || hasSideEffects(binary->getRHS());
+                    LiveSet rightLive = processExpr(binary->getRHSRef(), live, valueNeeded, apply);
+                    live.insert(rightLive.begin(), rightLive.end());
+                    live = processExpr(binary->getLHSRef(), live, rightKept, apply);
+                    if (apply && !rightKept)
+                    {
+                        std::unique_ptr<ExprAST> rest = std::move(binary->getLHSRef());
+                        expr = std::move(rest);
+                    }
+                    return live;
+                }
+
+                // Operands are evaluated left to right
+                live = processExpr(binary->getRHSRef(), live, valueNeeded, apply);
+                live = processExpr(binary->getLHSRef(), live, valueNeeded, apply);
+                if (apply && !valueNeeded)
+                {
+                    if (!binary->getLHSRef())
+                    {
+                        std::unique_ptr<ExprAST> rest = std::move(binary->getRHSRef());
+                        expr = std::move(rest);
+                    }
+                    else if (!binary->getRHSRef())
+                    {
+                        std::unique_ptr<ExprAST> rest = std::move(binary->getLHSRef());
+                        expr = std::move(rest);
+                    }
+                }
+                return live;
+            }
+
+            if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+            {
+                if (unary->getOp() == "++" || unary->getOp() == "--")
+                {
+                    // Read-modify-write: always kept
+                    std::set<std::string> reads;
+                    collectReadVariables(unary->getOperand(), reads);
+                    live.insert(reads.begin(), reads.end());
+                    return live;
+                }
+
+                live = processExpr(unary->getOperandRef(), live, valueNeeded, apply);
+                if (apply && !valueNeeded)
+                {
+                    std::unique_ptr<ExprAST> rest = std::move(unary->getOperandRef());
+                    expr = std::move(rest);
+                }
+                return live;
+            }
+
+            if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+            {
+                auto &args = call->getArgs();
+                for (size_t i = args.size(); i-- > 0;)
+                    live = processExpr(args[i], live, true, apply);
+                return live;
+            }
+
+            if (dynamic_cast<NumberExprAST *>(expr.get()) || dynamic_cast<BoolExprAST *>(expr.get()) ||
+                dynamic_cast<CharExprAST *>(expr.get()) || dynamic_cast<StringExprAST *>(expr.get()))
+            {
+                if (apply && !valueNeeded)
+                    expr.reset();
+                return live;
+            }
+
+            // Anything else is kept as-is and treated as reading all its variables
+            std::set<std::string> reads;
+            collectReadVariables(expr.get(), reads);
+            live.insert(reads.begin(), reads.end());
+            return live;
+        }
+
+        // Live-in at the loop header, iterated to a fixed point. Starting from
+        // the smallest set means variables that only feed their own updates
+        // (like accumulators nobody reads) never become live.
+        LiveSet processLoop(std::unique_ptr<ExprAST> *condition, std::unique_ptr<ExprAST> *update,
+                            std::unique_ptr<StmtAST> &body, const LiveSet &exitLive, bool apply)
+        {
+            LiveSet header = condition ? processExpr(*condition, exitLive, true, false) : LiveSet();
+
+            while (true)
+            {
+                LiveSet updateIn = update ? processExpr(*update, header, false, false) : header;
+                Loops.push_back({exitLive, updateIn});
+                LiveSet bodyIn = processStmt(body, updateIn, false);
+                Loops.pop_back();
+
+                LiveSet afterCondition = exitLive;
+                afterCondition.insert(bodyIn.begin(), bodyIn.end());
+                LiveSet next = condition ? processExpr(*condition, afterCondition, true, false) : bodyIn;
+                if (next == header)
+                    break;
+                header = next;
+            }
+
+            if (apply)
+            {
+                LiveSet updateIn = update ? processExpr(*update, header, false, true) : header;
+                Loops.push_back({exitLive, updateIn});
+                processStmt(body, updateIn, true);
+                Loops.pop_back();
+                if (!body)
+                    body = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+            }
+            return header;
+        }
+
+        LiveSet processStmt(std::unique_ptr<StmtAST> &stmt, LiveSet live, bool apply)
+        {
+            if (!stmt)
+                return live;
+
+            if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt.get()))
+            {
+                live = processExpr(exprStmt->getExprRef(), live, false, apply);
+                if (apply && !exprStmt->getExprRef())
+                    stmt.reset();
+                return live;
+            }
+
+            if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt.get()))
+            {
+                auto &vars = varDecl->getVars();
+                for (size_t i = vars.size(); i-- > 0;)
+                {
+                    const std::string name = vars[i].first;
+                    if (live.count(name))
+                    {
+                        live.erase(name);
+                        live = processExpr(vars[i].second, live, true, apply);
+                    }
+                    else if (hasSideEffects(vars[i].second.get()))
+                    {
+                        // Keep the declaration so the initializer still runs
+                        live = processExpr(vars[i].second, live, true, apply);
+                    }
+                    else if (apply && Referenced.count(name))
+                    {
+                        // Stored to later: keep the slot and its declared
+                        // type, only the initial value is dead
+                        if (vars[i].second)
+                        {
+                            vars[i].second.reset();
+                            Stats["dce.dead_stores"]++;
+                            Changed = true;
+                        }
+                    }
+                    else if (apply)
+                    {
+                        // Never live: drop the local from the frame entirely
+                        vars.erase(vars.begin() + i);
+                        Stats["dce.unused_locals"]++;
+                        Changed = true;
+                    }
+                }
+                if (apply && vars.empty())
+                    stmt.reset();
+                return live;
+            }
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                return processList(compound->getStatements(), live, apply);
+            }
+
+            if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                LiveSet thenLive = processStmt(ifStmt->getThenRef(), live, apply);
+                LiveSet elseLive = ifStmt->getElseRef() ? processStmt(ifStmt->getElseRef(), live, apply) : live;
+                thenLive.insert(elseLive.begin(), elseLive.end());
+                if (apply && !ifStmt->getThenRef())
+                    ifStmt->getThenRef() = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+                return processExpr(ifStmt->getConditionRef(), thenLive, true, apply);
+            }
+
+            if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                return processLoop(&whileStmt->getConditionRef(), nullptr, whileStmt->getBodyRef(), live, apply);
+            }
+
+            if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                std::unique_ptr<ExprAST> *condition = forStmt->getConditionRef() ? &forStmt->getConditionRef() : nullptr;
+                std::unique_ptr<ExprAST> *update = forStmt->getUpdateRef() ? &forStmt->getUpdateRef() : nullptr;
+                LiveSet header = processLoop(condition, update, forStmt->getBodyRef(), live, apply);
+                return processStmt(forStmt->getInitRef(), header, apply);
+            }
+
+            if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                // A break leaves the switch; a continue still belongs to the
+                // enclosing loop. Each case falls through into the next one.
+                LiveSet continueLive = Loops.empty() ? live : Loops.back().continueLive;
+                Loops.push_back({live, continueLive});
+                auto &cases = switchStmt->getCases();
+                LiveSet next = live;
+                LiveSet entry = switchStmt->hasDefault() ? LiveSet() : live;
+                for (size_t i = cases.size(); i-- > 0;)
+                {
+                    next = processStmt(cases[i].Body, next, apply);
+                    entry.insert(next.begin(), next.end());
+                    if (apply && !cases[i].Body)
+                        cases[i].Body = std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+                }
+                Loops.pop_back();
+                return processExpr(switchStmt->getValueRef(), entry, true, apply);
+            }
+
+            if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt.get()))
+            {
+                return processExpr(returnStmt->getValueRef(), LiveSet(), true, apply);
+            }
+
+            if (dynamic_cast<BreakStmtAST *>(stmt.get()))
+            {
+                return Loops.empty() ? live : Loops.back().breakLive;
+            }
+
+            if (dynamic_cast<ContinueStmtAST *>(stmt.get()))
+            {
+                return Loops.empty() ? live : Loops.back().continueLive;
+            }
+
+            if (PrintStmtAST *printStmt = dynamic_cast<PrintStmtAST *>(stmt.get()))
+            {
+                return processExpr(printStmt->getValueRef(), live, true, apply);
+            }
+
+            // Unknown statement: assume it reads everything it mentions
+            forEachExpression(stmt.get(), [&](std::unique_ptr<ExprAST> &expr)
+                              { collectReadVariables(expr.get(), live); });
+            return live;
+        }
+    };
+}
+
+bool eliminateDeadCode(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        DeadCodeEliminator eliminator(stats);
+        eliminator.removeUnreachable(*stmts);
+        eliminator.collectReferences(*stmts);
+        // Nothing is live once the program exits or the function returns
+        eliminator.processList(*stmts, std::set<std::string>(), true);
+        changed |= eliminator.changed();
+    }
+    return changed;
+}
@@ -0,0 +1,92 @@
+#include "ElfWriter.h"
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+#include <vector>
+
+namespace
+{
+    const uint64_t elfHeaderSize = 64;
+    const uint64_t programHeaderSize = 56;
+    const uint64_t programHeaderCount = 3;
+
+    const uint32_t PT_LOAD = 1;
+    const uint32_t PT_GNU_STACK = 0x6474e551;
+    const uint32_t PF_X = 1, PF_W = 2, PF_R = 4;
+
+    void put(std::vector<uint8_t> &out, uint64_t value, int width)
+    {
+        for (int i = 0; i < width; ++i)
+            out.push_back(static_cast<uint8_t>((value >> (8 * i)) & 0xff));
+    }
+
+    void programHeader(std::vector<uint8_t> &out, uint32_t type, uint32_t flags, uint64_t offset, uint64_t address,
+                       uint64_t fileSize, uint64_t memorySize, uint64_t alignment)
+    {
+        put(out, type, 4);
+        put(out, flags, 4);
+        put(out, offset, 8);
+        put(out, address, 8); // virtual
+        put(out, address, 8); // physical
+        put(out, fileSize, 8);
+        put(out, memorySize, 8);
+        put(out, alignment, 8);
+    }
+}
+
+uint64_t ElfWriter::textAddress()
+{
+    return BaseAddress + elfHeaderSize + programHeaderCount * programHeaderSize;
+}
+
+bool ElfWriter::write(const AssembledImage &image, const std::string &path)
+{
+    std::vector<uint8_t> file;
+
+    // ELF header
+    const uint8_t ident[16] = {0x7f, 'E', 'L', 'F', 2 /* 64-bit */, 1 /* little endian */, 1 /* version */};
+    file.insert(file.end(), ident, ident + 16);
+    put(file, 2, 2);    // ET_EXEC
+    put(file, 0x3e, 2); // EM_X86_64
+    put(file, 1, 4);    // EV_CURRENT
+    put(file, image.entry, 8);
+    put(file, elfHeaderSize, 8); // program headers follow
+    put(file, 0, 8);             // no section headers
+    put(file, 0, 4);             // flags
+    put(file, elfHeaderSize, 2);
+    put(file, programHeaderSize, 2);
+    put(file, programHeaderCount, 2);
+    put(file, 64, 2); // section header entry size
+    put(file, 0, 2);
+    put(file, 0, 2);
+
+    // File offsets mirror addresses, so each segment's offset and address
+    // agree modulo the page size
+    uint64_t textEnd = image.rodataAddress + image.rodata.size();
+    programHeader(file, PT_LOAD, PF_R | PF_X, 0, BaseAddress, textEnd - BaseAddress, textEnd - BaseAddress, 0x1000);
+    programHeader(file, PT_LOAD, PF_R | PF_W, image.dataAddress - BaseAddress, image.dataAddress, image.data.size(),
+                  image.end() - image.dataAddress, 0x1000);
+    programHeader(file, PT_GNU_STACK, PF_R | PF_W, 0, 0, 0, 0, 16);
+
+    file.resize(image.textAddress - BaseAddress);
+    file.insert(file.end(), image.text.begin(), image.text.end());
+    file.resize(image.rodataAddress - BaseAddress);
+    file.insert(file.end(), image.rodata.begin(), image.rodata.end());
+    file.resize(image.dataAddress - BaseAddress);
+    file.insert(file.end(), image.data.begin(), image.data.end());
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cerr << "Error: Could not open file " << path << " for writing" << std::endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(file.data()), static_cast<std::streamsize>(file.size()));
+    out.close();
+    if (!out || chmod(path.c_str(), 0755) != 0)
+    {
+        std::cerr << "Error: Could not write executable " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,559 @@
+#include "Optimizer.h"
+#include <algorithm>
+
+// Function inlining.
+//
+// A call is replaced by a copy of the callee's body. The call's statement S
+// becomes
+//
+//   { int p1 = arg1; ...; long ret = 0; body'; S[call := ret] }
+//
+// where body' is the callee body with every variable renamed to a prefix
+// that is unique to the call site, so the copy can never clash with the
+// caller's variables (or another copy of the same callee). Parameters keep
+// their declared type, which truncates arguments exactly like the spill in
+// the callee's prologue does. A parameter that is never stored to and is
+// passed a literal is substituted directly, which lets constant folding and
+// dead code elimination specialize the copy.
+//
+// A body whose only return is its last statement turns that return into a
+// store to ret. Otherwise the body is wrapped in a one-iteration loop,
+//
+//   while (1) { body'; break; }
+//
+// and every return becomes { ret = value; break; }. A return inside one of
+// the callee's own loops would only leave that loop, so such callees are not
+// inlined.
+//
+// Only calls that are evaluated exactly once by a statement are inlined, and
+// only when nothing with a side effect is evaluated before them; hoisting the
+// body in front of the statement then keeps the order of every effect.
+//
+// Cost model: the size of a callee is the number of AST nodes in its body.
+// A call is inlined when that size, minus a bonus for every literal argument,
+// is at most the threshold. Bodies no larger than a call sequence (accessors
+// and other one-line helpers) are always inlined. The total growth of one
+// caller is capped, functions that are part of a recursive cycle are never
+// inlined, and copies nest at most MaxInlineDepth levels deep. Functions are
+// processed callees first, so a copy already contains the inlined bodies of
+// its own callees. Functions that are no longer reachable from the top level
+// are removed afterwards.
+//
+// A call with more than MaxCallArguments arguments is left alone: the code
+// generators reject it and it yields 0, which a copy would not.
+
+namespace
+{
+    const int MaxInlineDepth = 4;
+    const int AccessorSize = 8;
+    const int ConstantArgumentBonus = 8;
+    const int GrowthFactor = 4;
+    const size_t MaxCallArguments = 6; // as many as the code generators pass
+
+    void collectCallees(const ExprAST *expr, std::set<std::string> &callees)
+    {
+        if (!expr)
+            return;
+
+        if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        {
+            collectCallees(binary->getLHS(), callees);
+            collectCallees(binary->getRHS(), callees);
+        }
+        else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        {
+            collectCallees(unary->getOperand(), callees);
+        }
+        else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+        {
+            collectCallees(assign->getRHS(), callees);
+        }
+        else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+        {
+            callees.insert(call->getCallee());
+            for (const auto &arg : call->getArgs())
+                collectCallees(arg.get(), callees);
+        }
+    }
+
+    void collectCallees(std::vector<std::unique_ptr<StmtAST>> &stmts, std::set<std::string> &callees)
+    {
+        for (auto &stmt : stmts)
+        {
+            forEachExpression(stmt.get(), [&](std::unique_ptr<ExprAST> &expr)
+                              { collectCallees(expr.get(), callees); });
+        }
+    }
+
+    // Turn every return of a copied body into { ret = value; break; },
+    // leaving the one-iteration loop the copy is wrapped in
+    void lowerReturns(std::unique_ptr<StmtAST> &stmt, const std::string &result)
+    {
+        if (!stmt)
+            return;
+
+        if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt.get()))
+        {
+            std::vector<std::unique_ptr<StmtAST>> stmts;
+            if (returnStmt->getValueRef())
+            {
+                stmts.push_back(std::make_unique<ExprStmtAST>(std::make_unique<AssignmentExprAST>(
+                    std::make_unique<VariableExprAST>(result), std::move(returnStmt->getValueRef()))));
+            }
+            stmts.push_back(std::make_unique<BreakStmtAST>());
+            stmt = std::make_unique<CompoundStmtAST>(std::move(stmts));
+        }
+        else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+        {
+            for (auto &child : compound->getStatements())
+                lowerReturns(child, result);
+        }
+        else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+        {
+            lowerReturns(ifStmt->getThenRef(), result);
+            lowerReturns(ifStmt->getElseRef(), result);
+        }
+    }
+
+    // Facts about a callee that decide whether and how it can be inlined
+    struct CalleeInfo
+    {
+        FunctionAST *function = nullptr;
+        int size = 0;
+        int depth = 0;          // nesting of copies already inside the body
+        bool recursive = false; // part of a call-graph cycle
+        bool copyable = false;  // returns and jumps can be lowered
+        bool trailingReturn = false;
+        std::set<std::string> written;
+    };
+
+    class Inliner
+    {
+    public:
+        Inliner(ProgramAST &program, OptStats &stats, int threshold)
+            : Program(program), Stats(stats), Threshold(threshold) {}
+
+        void run()
+        {
+            std::vector<std::vector<std::unique_ptr<StmtAST>> *> units = codeUnits(Program);
+            for (size_t i = 0; i < Program.getFunctions().size(); ++i)
+            {
+                FunctionAST *func = Program.getFunctions()[i].get();
+                CalleeInfo &info = Callees[func->getProto()->getName()];
+                info.function = func;
+                collectCallees(*units[i + 1], CallGraph[func->getProto()->getName()]);
+                Units[func->getProto()->getName()] = units[i + 1];
+            }
+            findRecursion();
+
+            // Callees first, so their copies carry their own inlined calls
+            std::set<std::string> visited;
+            for (auto &func : Program.getFunctions())
+                processBottomUp(func->getProto()->getName(), visited);
+
+            CurrentDepth = 0;
+            processUnit(Program.getStatements());
+            removeUnreachable();
+        }
+
+        bool changed() const { return Changed; }
+
+    private:
+        ProgramAST &Program;
+        OptStats &Stats;
+        int Threshold;
+        std::map<std::string, CalleeInfo> Callees;
+        std::map<std::string, std::set<std::string>> CallGraph;
+        std::map<std::string, std::vector<std::unique_ptr<StmtAST>> *> Units;
+        int NextSite = 0;
+        bool Changed = false;
+
+        // State for the unit being processed
+        int CurrentDepth = 0;
+        int Budget = 0;
+
+        void findRecursion()
+        {
+            for (auto &entry : Callees)
+            {
+                // A function is recursive if it can reach itself
+                std::set<std::string> seen;
+                std::vector<std::string> work(CallGraph[entry.first].begin(), CallGraph[entry.first].end());
+                while (!work.empty())
+                {
+                    std::string name = work.back();
+                    work.pop_back();
+                    if (name == entry.first)
+                    {
+                        entry.second.recursive = true;
+                        break;
+                    }
+                    if (!seen.insert(name).second)
+                        continue;
+                    for (const auto &callee : CallGraph[name])
+                        work.push_back(callee);
+                }
+            }
+        }
+
+        void processBottomUp(const std::string &name, std::set<std::string> &visited)
+        {
+            if (!Callees.count(name) || !visited.insert(name).second)
+                return;
+            for (const auto &callee : CallGraph[name])
+                processBottomUp(callee, visited);
+
+            CalleeInfo &info = Callees[name];
+            CurrentDepth = 0;
+            processUnit(*Units[name]);
+            info.depth = CurrentDepth;
+            analyze(info, *Units[name]);
+        }
+
+        void analyze(CalleeInfo &info, std::vector<std::unique_ptr<StmtAST>> &body)
+        {
+            info.size = 0;
+            for (const auto &stmt : body)
+                info.size += countNodes(stmt.get());
+
+            int returns = 0;
+            bool returnInLoop = false, strayJump = false;
+            for (const auto &stmt : body)
+                checkControlFlow(stmt.get(), 0, returns, returnInLoop, strayJump);
+            info.trailingReturn = returns == 1 && dynamic_cast<ReturnStmtAST *>(body.back().get());
+            // A return in the callee's own loop would only leave that loop,
+            // and a break or continue outside one would bind to the wrapper
+            info.copyable = !strayJump && (info.trailingReturn || !returnInLoop);
+
+            for (auto &stmt : body)
+                collectWrittenVariables(stmt.get(), info.written);
+        }
+
+        void checkControlFlow(const StmtAST *stmt, int loopDepth, int &returns, bool &returnInLoop, bool &strayJump)
+        {
+            if (!stmt)
+                return;
+            if (dynamic_cast<const ReturnStmtAST *>(stmt))
+            {
+                returns++;
+                returnInLoop |= loopDepth > 0;
+            }
+            else if (dynamic_cast<const BreakStmtAST *>(stmt) || dynamic_cast<const ContinueStmtAST *>(stmt))
+            {
+                strayJump |= loopDepth == 0;
+            }
+            else if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            {
+                for (const auto &child : compound->getStatements())
+                    checkControlFlow(child.get(), loopDepth, returns, returnInLoop, strayJump);
+            }
+            else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            {
+                checkControlFlow(ifStmt->getThen(), loopDepth, returns, returnInLoop, strayJump);
+                checkControlFlow(ifStmt->getElse(), loopDepth, returns, returnInLoop, strayJump);
+            }
+            else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+            {
+                checkControlFlow(whileStmt->getBody(), loopDepth + 1, returns, returnInLoop, strayJump);
+            }
+            else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+            {
+                checkControlFlow(forStmt->getBody(), loopDepth + 1, returns, returnInLoop, strayJump);
+            }
+        }
+
+        void processUnit(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            int size = 0;
+            for (const auto &stmt : stmts)
+                size += countNodes(stmt.get());
+            Budget = GrowthFactor * std::max(size, Threshold);
+            processList(stmts);
+        }
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt);
+        }
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements());
+                return;
+            }
+            if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                processStmt(ifStmt->getThenRef());
+                processStmt(ifStmt->getElseRef());
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                processStmt(whileStmt->getBodyRef());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                processStmt(forStmt->getBodyRef());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    processStmt(c.Body);
+            }
+            inlineCalls(stmt);
+        }
+
+        // The expression a statement evaluates exactly once, if any
+        std::unique_ptr<ExprAST> *evaluatedOnce(StmtAST *stmt)
+        {
+            if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+                return &exprStmt->getExprRef();
+            if (PrintStmtAST *printStmt = dynamic_cast<PrintStmtAST *>(stmt))
+                return &printStmt->getValueRef();
+            if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+                return &ifStmt->getConditionRef();
+            if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+                return &switchStmt->getValueRef();
+            if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt))
+                return returnStmt->getValueRef() ? &returnStmt->getValueRef() : nullptr;
+            if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+            {
+                if (varDecl->getVars().size() == 1 && varDecl->getVars()[0].second)
+                    return &varDecl->getVars()[0].second;
+            }
+            return nullptr;
+        }
+
+        // Find the first call in evaluation order. Stops at anything with a
+        // side effect, since the call's body would move in front of it, and
+        // at the right operand of && and ||, which may not be evaluated.
+        std::unique_ptr<ExprAST> *firstCall(std::unique_ptr<ExprAST> &expr, bool &blocked)
+        {
+            if (!expr || blocked)
+                return nullptr;
+
+            if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+            {
+                for (auto &arg : call->getArgs())
+                {
+                    if (std::unique_ptr<ExprAST> *inner = firstCall(arg, blocked))
+                        return inner;
+                    if (blocked)
+                        return nullptr;
+                }
+                return &expr;
+            }
+
+            if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+            {
+                if (std::unique_ptr<ExprAST> *inner = firstCall(binary->getLHSRef(), blocked))
+                    return inner;
+                if (blocked || hasSideEffects(binary->getLHS()) || binary->getOp() == "&&" || binary->getOp() == "||")
+                {
+                    blocked = true;
+                    return nullptr;
+                }
+                return firstCall(binary->getRHSRef(), blocked);
+            }
+
+            if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+                return firstCall(unary->getOperandRef(), blocked);
+
+            if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+            {
+                if (!dynamic_cast<VariableExprAST *>(assign->getLHSRef().get()))
+                {
+                    blocked = true;
+                    return nullptr;
+                }
+                return firstCall(assign->getRHSRef(), blocked);
+            }
+
+            if (hasSideEffects(expr.get()))
+                blocked = true;
+            return nullptr;
+        }
+
+        // Inline the calls of one statement, first to last
+        void inlineCalls(std::unique_ptr<StmtAST> &stmt)
+        {
+            std::unique_ptr<ExprAST> *value = evaluatedOnce(stmt.get());
+            if (!value)
+                return;
+
+            bool blocked = false;
+            std::unique_ptr<ExprAST> *slot = firstCall(*value, blocked);
+            if (!slot)
+                return;
+
+            std::vector<std::unique_ptr<StmtAST>> block;
+            if (!expand(static_cast<CallExprAST *>(slot->get()), *slot, block))
+                return;
+
+            block.push_back(std::move(stmt));
+            stmt = std::make_unique<CompoundStmtAST>(std::move(block));
+            inlineCalls(static_cast<CompoundStmtAST *>(stmt.get())->getStatements().back());
+        }
+
+        bool worthInlining(const CalleeInfo &info, const CallExprAST *call)
+        {
+            if (!info.copyable || info.recursive || info.depth + 1 > MaxInlineDepth)
+                return false;
+            if (info.size <= AccessorSize)
+                return true;
+
+            int bonus = 0;
+            long long value;
+            for (const auto &arg : call->getArgs())
+            {
+                if (evaluateConstant(arg.get(), value))
+                    bonus += ConstantArgumentBonus;
+            }
+            return info.size - bonus <= Threshold && info.size <= Budget;
+        }
+
+        // Build the statements that replace the call, and replace the call
+        // itself with a read of the result
+        bool expand(CallExprAST *call, std::unique_ptr<ExprAST> &slot, std::vector<std::unique_ptr<StmtAST>> &block)
+        {
+            auto found = Callees.find(call->getCallee());
+            if (found == Callees.end())
+                return false;
+            const CalleeInfo &info = found->second;
+            const auto &params = info.function->getProto()->getArgs();
+            if (call->getArgs().size() != params.size() || params.size() > MaxCallArguments ||
+                !worthInlining(info, call))
+                return false;
+            for (const auto &arg : call->getArgs())
+            {
+                if (hasSideEffects(arg.get()))
+                    return false;
+            }
+
+            std::string prefix = ".inl" + std::to_string(NextSite) + ".";
+            std::string result = prefix + "ret";
+
+            // Literals passed to parameters the body never stores to are
+            // substituted directly
+            std::map<std::string, long long> constants;
+            for (size_t i = 0; i < params.size(); ++i)
+            {
+                long long value;
+                bool integer = params[i].first == DataType::INT || params[i].first == DataType::LONG;
+                if (integer && !info.written.count(params[i].second) &&
+                    evaluateConstant(call->getArgs()[i].get(), value))
+                    constants[params[i].second] = value;
+            }
+
+            // Every variable of the copy gets the call site's prefix
+            VariableMapper rename = [&](const std::string &name) -> std::unique_ptr<ExprAST>
+            {
+                auto constant = constants.find(name);
+                if (constant != constants.end())
+                    return std::make_unique<NumberExprAST>(static_cast<double>(constant->second));
+                return std::make_unique<VariableExprAST>(prefix + name);
+            };
+
+            const std::vector<std::unique_ptr<StmtAST>> &body = *Units[call->getCallee()];
+            std::vector<std::unique_ptr<StmtAST>> copy;
+            for (size_t i = 0; i < body.size(); ++i)
+            {
+                std::unique_ptr<StmtAST> stmt = cloneStmt(body[i].get(), rename);
+                if (!stmt)
+                    return false;
+                copy.push_back(std::move(stmt));
+            }
+
+            if (info.trailingReturn)
+            {
+                // The final return just stores the result
+                ReturnStmtAST *last = static_cast<ReturnStmtAST *>(copy.back().get());
+                std::unique_ptr<ExprAST> value = std::move(last->getValueRef());
+                copy.pop_back();
+                if (value)
+                {
+                    copy.push_back(std::make_unique<ExprStmtAST>(
+                        std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(result), std::move(value))));
+                }
+            }
+            else
+            {
+                for (auto &stmt : copy)
+                    lowerReturns(stmt, result);
+                copy.push_back(std::make_unique<BreakStmtAST>());
+                std::unique_ptr<StmtAST> loop = std::make_unique<WhileStmtAST>(
+                    std::make_unique<NumberExprAST>(1), std::make_unique<CompoundStmtAST>(std::move(copy)));
+                copy.clear();
+                copy.push_back(std::move(loop));
+            }
+
+            // Parameters, in argument order
+            for (size_t i = 0; i < params.size(); ++i)
+            {
+                if (constants.count(params[i].second))
+                    continue;
+                std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
+                vars.emplace_back(prefix + params[i].second, std::move(call->getArgs()[i]));
+                block.push_back(std::make_unique<VarDeclStmtAST>(params[i].first, std::move(vars)));
+            }
+            std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> resultVar;
+            resultVar.emplace_back(result, std::make_unique<NumberExprAST>(0));
+            block.push_back(std::make_unique<VarDeclStmtAST>(DataType::LONG, std::move(resultVar)));
+            for (auto &stmt : copy)
+                block.push_back(std::move(stmt));
+
+            slot = std::make_unique<VariableExprAST>(result);
+
+            NextSite++;
+            CurrentDepth = std::max(CurrentDepth, info.depth + 1);
+            if (info.size > AccessorSize)
+                Budget -= info.size;
+            Stats["inline.calls_inlined"]++;
+            Changed = true;
+            return true;
+        }
+
+        // Drop functions that no call from the top level can reach any more
+        void removeUnreachable()
+        {
+            std::set<std::string> reachable;
+            std::set<std::string> work;
+            collectCallees(Program.getStatements(), work);
+            while (!work.empty())
+            {
+                std::string name = *work.begin();
+                work.erase(work.begin());
+                if (!reachable.insert(name).second || !Units.count(name))
+                    continue;
+                collectCallees(*Units[name], work);
+            }
+
+            auto &functions = Program.getFunctions();
+            size_t before = functions.size();
+            functions.erase(std::remove_if(functions.begin(), functions.end(),
+                                           [&](const std::unique_ptr<FunctionAST> &func)
+                                           { return !reachable.count(func->getProto()->getName()); }),
+                            functions.end());
+            if (functions.size() != before)
+            {
+                Stats["inline.functions_removed"] += static_cast<int>(before - functions.size());
+                Changed = true;
+            }
+        }
+    };
+}
+
+bool inlineFunctions(ProgramAST &program, OptStats &stats, int threshold)
+{
+    if (program.getFunctions().empty())
+        return false;
+
+    Inliner inliner(program, stats, threshold);
+    inliner.run();
+    return inliner.changed();
+}
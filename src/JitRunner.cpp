@@ -0,0 +1,126 @@
+#include "JitRunner.h"
+#include "Assembler.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+
+namespace
+{
+    const uint64_t pageSize = 4096;
+    const size_t stackSize = 8 << 20;
+
+    MachineFunction function(const std::string &name, const std::vector<std::string> &lines)
+    {
+        MachineFunction result(name);
+        for (const auto &line : lines)
+            result.append(MachineInstr::parse(line));
+        return result;
+    }
+
+    // The program plus an entry point that saves the host's callee-saved
+    // registers and stack and switches to the program's stack, and an
+    // exit_program that switches back and returns the status
+    MachineModule hostedModule(const MachineModule &program)
+    {
+        MachineModule module = program;
+        module.bss.push_back("jit_host_rsp resq 1");
+
+        auto exit = module.functions.begin();
+        while (exit != module.functions.end() && exit->name != "exit_program")
+            ++exit;
+        if (exit == module.functions.end())
+            throw std::runtime_error("Program has no exit_program");
+
+        *exit = function("exit_program", {"    call flush_output",
+                                          "    mov rax, rdi         ; exit status",
+                                          "    mov rsp, [jit_host_rsp]",
+                                          "    pop r15",
+                                          "    pop r14",
+                                          "    pop r13",
+                                          "    pop r12",
+                                          "    pop rbp",
+                                          "    pop rbx",
+                                          "    ret"});
+        module.functions.push_back(function("jit_enter", {"    ; Called from C++ with the program's stack top in rdi",
+                                                          "    push rbx",
+                                                          "    push rbp",
+                                                          "    push r12",
+                                                          "    push r13",
+                                                          "    push r14",
+                                                          "    push r15",
+                                                          "    mov [jit_host_rsp], rsp",
+                                                          "    mov rsp, rdi",
+                                                          "    jmp _start"}));
+        return module;
+    }
+
+    uint64_t alignUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+}
+
+bool JitRunner::run(const MachineModule &program, int &exitStatus)
+{
+    MachineModule module;
+    AssembledImage image;
+    size_t imageSize;
+    void *memory;
+    try
+    {
+        module = hostedModule(program);
+
+        // Instruction sizes do not depend on addresses, so a trial layout
+        // at any page gives the size to map
+        AssembledImage trial = Assembler::assemble(module, pageSize);
+        imageSize = alignUp(trial.end() - trial.textAddress, pageSize);
+        memory = mmap(nullptr, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::runtime_error("Could not map memory for the program");
+        try
+        {
+            image = Assembler::assemble(module, reinterpret_cast<uint64_t>(memory));
+        }
+        catch (...)
+        {
+            munmap(memory, imageSize);
+            throw;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return false;
+    }
+
+    // .bss is already zero; the text and .rodata become executable and
+    // read-only
+    std::memcpy(reinterpret_cast<void *>(image.textAddress), image.text.data(), image.text.size());
+    std::memcpy(reinterpret_cast<void *>(image.rodataAddress), image.rodata.data(), image.rodata.size());
+    std::memcpy(reinterpret_cast<void *>(image.dataAddress), image.data.data(), image.data.size());
+
+    // The lowest page of the stack mapping is a guard, so runaway recursion
+    // faults instead of running into whatever is mapped below
+    const size_t stackMapping = stackSize + pageSize;
+    void *stack = mmap(nullptr, stackMapping, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED || mprotect(stack, pageSize, PROT_NONE) != 0 ||
+        mprotect(memory, image.dataAddress - image.textAddress, PROT_READ | PROT_EXEC) != 0)
+    {
+        std::cerr << "Error: Could not prepare memory for the program" << std::endl;
+        if (stack != MAP_FAILED)
+            munmap(stack, stackMapping);
+        munmap(memory, imageSize);
+        return false;
+    }
+
+    // The program writes to file descriptor 1 directly
+    std::cout.flush();
+    auto enter = reinterpret_cast<long (*)(uint64_t)>(image.symbols.at("jit_enter"));
+    long status = enter(reinterpret_cast<uint64_t>(stack) + stackMapping);
+
+    munmap(stack, stackMapping);
+    munmap(memory, imageSize);
+    exitStatus = static_cast<int>(status & 0xff);
+    return true;
+}
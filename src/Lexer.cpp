@@ -324,6 +324,15 @@ std::string Lexer::getCharLiteral()
     return result;
 }
 
+bool Lexer::isPragma() const
+{
+    size_t pos = current_pos_ + 1;
+    while (pos < source_.length() && (source_[pos] == ' ' || source_[pos] == '\t'))
+        pos++;
+    return source_.compare(pos, 6, "pragma") == 0 &&
+           (pos + 6 == source_.length() || !std::isalnum(static_cast<unsigned char>(source_[pos + 6])));
+}
+
 std::string Lexer::getPreprocessorDirective()
 {
     std::string result = "#";
@@ -434,7 +443,22 @@ std::vector<std::string> Lexer::tokenize()
             continue;
         }
 
-        // Handle comments
+        // Compiler hints: #pragma lines become a single token, with the
+        // whitespace removed ("PRAGMA:unroll(4)")
+        if (current_char_ == '#' && isPragma())
+        {
+            std::string directive = getPreprocessorDirective();
+            std::string hint;
+            for (char c : directive.substr(directive.find("pragma") + 6))
+            {
+                if (!std::isspace(static_cast<unsigned char>(c)))
+                    hint += c;
+            }
+            tokens.push_back("PRAGMA:" + hint);
+            continue;
+        }
+
+        // Handle comments and other preprocessor lines
         if (current_char_ == '#' || (current_char_ == '/' && current_pos_ + 1 < source_.length() && source_[current_pos_ + 1] == '/'))
         {
             skipComment();
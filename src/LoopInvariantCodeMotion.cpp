@@ -0,0 +1,230 @@
+#include "Optimizer.h"
+
+// Loop-invariant code motion.
+//
+// Every while/for statement is a natural loop with a single header, so the
+// preheader is simply a block placed in front of the loop statement: the
+// loop slot is replaced by { hoisted computations; loop }.
+//
+// An expression is invariant if it is pure and none of the variables it
+// reads is stored to anywhere in the loop (for loops count their init as
+// part of the loop, since the hoisted code runs before it). The largest
+// invariant operations are computed once into a 64-bit temporary in the
+// preheader and the loop reads the temporary instead. Hoisted code runs even
+// if the loop body does not, so anything that can trap (division by a value
+// that is not a known non-zero constant) stays where it is.
+//
+// Loops are handled outermost first, so a computation that is invariant in
+// a whole loop nest moves all the way out in one step.
+
+namespace
+{
+    // Structural key used to share one temporary between identical
+    // invariant expressions of the same loop
+    bool structuralKey(const ExprAST *expr, std::string &key)
+    {
+        long long value;
+        if (evaluateConstant(expr, value))
+        {
+            key = "#" + std::to_string(value);
+            return true;
+        }
+
+        if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+        {
+            key = var->getName();
+            return true;
+        }
+
+        if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        {
+            std::string operand;
+            if (!structuralKey(unary->getOperand(), operand))
+                return false;
+            key = "(" + unary->getOp() + " " + operand + ")";
+            return true;
+        }
+
+        if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        {
+            std::string lhs, rhs;
+            if (!structuralKey(binary->getLHS(), lhs) || !structuralKey(binary->getRHS(), rhs))
+                return false;
+            key = "(" + lhs + " " + binary->getOp() + " " + rhs + ")";
+            return true;
+        }
+
+        return false;
+    }
+
+    class LoopInvariantMover
+    {
+    public:
+        LoopInvariantMover(OptStats &stats) : Stats(stats) {}
+
+        const std::vector<std::string> &temporaries() const { return Temps; }
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt);
+        }
+
+    private:
+        OptStats &Stats;
+        std::vector<std::string> Temps;
+
+        // State for the loop currently being hoisted from
+        std::set<std::string> Written;
+        std::map<std::string, std::string> TempForKey;
+        std::vector<std::unique_ptr<StmtAST>> Preheader;
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                processStmt(ifStmt->getThenRef());
+                processStmt(ifStmt->getElseRef());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    processStmt(c.Body);
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                hoistFromLoop(stmt, {&whileStmt->getConditionRef()}, whileStmt->getBodyRef().get());
+                processStmt(whileStmt->getBodyRef());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                hoistFromLoop(stmt, {&forStmt->getConditionRef(), &forStmt->getUpdateRef()},
+                              forStmt->getBodyRef().get());
+                processStmt(forStmt->getBodyRef());
+            }
+        }
+
+        // Move the invariant computations of a loop into a preheader. The
+        // loop slot is replaced by a block that holds the preheader and the
+        // loop itself; the loop node is unchanged and stays valid.
+        void hoistFromLoop(std::unique_ptr<StmtAST> &loop, std::vector<std::unique_ptr<ExprAST> *> header,
+                           StmtAST *body)
+        {
+            Written.clear();
+            TempForKey.clear();
+            Preheader.clear();
+            collectWrittenVariables(loop.get(), Written);
+
+            for (auto *slot : header)
+                hoistExpr(*slot);
+            forEachExpression(body, [&](std::unique_ptr<ExprAST> &expr)
+                              { hoistExpr(expr); });
+
+            if (Preheader.empty())
+                return;
+
+            Stats["licm.loops"]++;
+            std::vector<std::unique_ptr<StmtAST>> block = std::move(Preheader);
+            block.push_back(std::move(loop));
+            loop = std::make_unique<CompoundStmtAST>(std::move(block));
+        }
+
+        bool isInvariant(const ExprAST *expr) const
+        {
+            if (!expr)
+                return false;
+
+            if (dynamic_cast<const NumberExprAST *>(expr) || dynamic_cast<const BoolExprAST *>(expr) ||
+                dynamic_cast<const CharExprAST *>(expr))
+                return true;
+
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+                return !Written.count(var->getName());
+
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                if (unary->getOp() == "++" || unary->getOp() == "--")
+                    return false;
+                return isInvariant(unary->getOperand());
+            }
+
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                if (canTrap(binary))
+                    return false;
+                return isInvariant(binary->getLHS()) && isInvariant(binary->getRHS());
+            }
+
+            return false;
+        }
+
+        void hoistExpr(std::unique_ptr<ExprAST> &expr)
+        {
+            if (!expr)
+                return;
+
+            // Leaves are a single load or immediate already
+            bool operation = dynamic_cast<BinaryExprAST *>(expr.get()) || dynamic_cast<UnaryExprAST *>(expr.get());
+            std::string key;
+            if (operation && isInvariant(expr.get()) && structuralKey(expr.get(), key))
+            {
+                auto found = TempForKey.find(key);
+                std::string temp;
+                if (found != TempForKey.end())
+                {
+                    temp = found->second;
+                }
+                else
+                {
+                    temp = ".licm" + std::to_string(Temps.size());
+                    Temps.push_back(temp);
+                    TempForKey[key] = temp;
+                    Preheader.push_back(std::make_unique<ExprStmtAST>(
+                        std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(temp), std::move(expr))));
+                }
+                expr = std::make_unique<VariableExprAST>(temp);
+                Stats["licm.hoisted"]++;
+                return;
+            }
+
+            if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+            {
+                hoistExpr(binary->getLHSRef());
+                hoistExpr(binary->getRHSRef());
+            }
+            else if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+            {
+                hoistExpr(unary->getOperandRef());
+            }
+            else if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+            {
+                hoistExpr(assign->getRHSRef());
+            }
+            else if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+            {
+                for (auto &arg : call->getArgs())
+                    hoistExpr(arg);
+            }
+        }
+    };
+}
+
+bool hoistLoopInvariants(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        LoopInvariantMover mover(stats);
+        mover.processList(*stmts);
+        declareTemporaries(*stmts, mover.temporaries());
+        changed |= !mover.temporaries().empty();
+    }
+    return changed;
+}
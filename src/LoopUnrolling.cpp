@@ -0,0 +1,492 @@
+#include "Optimizer.h"
+#include <climits>
+#include <iostream>
+
+// Loop unrolling for counted for loops.
+//
+// A counted loop has the shape
+//
+//   for (init; i < bound; i = i + c) body
+//
+// (or <=, >, >= with a step of matching sign), where the body never stores
+// to i, the bound is a pure expression the loop never changes, and no break
+// or continue leaves the body early.
+//
+// If init sets i to a constant and the bound is constant, the trip count is
+// known. Small loops are then unrolled completely: the loop becomes one copy
+// of the body per iteration with i replaced by its value in that iteration,
+// followed by a store of the final value of i. Everything else is unrolled
+// partially by a factor k:
+//
+//   init;
+//   for (; i + (k-1)*c < bound; i = i + k*c) { body[i]; body[i+c]; ... }
+//   for (; i < bound; i = i + c) body        // remainder
+//
+// The remainder loop is left out when the trip count is known to be a
+// multiple of k. Copies of the body get their own names for the variables
+// the body declares, so every name still has a single declaration.
+//
+// Without a hint, only innermost loops are unrolled and only while the
+// copies stay small. #pragma unroll(N) asks for N copies regardless of size,
+// a bare #pragma unroll for complete unrolling when the trip count is known,
+// and #pragma nounroll keeps the loop as written. Either way a loop becomes
+// at most MaxPragmaCopies copies.
+
+namespace
+{
+    const long long MaxFullUnrollTrips = 16; // without a hint
+    const long long MaxPragmaCopies = 1024;  // with #pragma unroll
+    const int MaxUnrolledSize = 96;          // AST nodes across all copies
+
+    bool fitsInInt(long long value)
+    {
+        return value >= INT_MIN && value <= INT_MAX;
+    }
+
+    // True if a break or continue in this statement targets the enclosing loop
+    bool containsLoopJump(const StmtAST *stmt)
+    {
+        if (!stmt)
+            return false;
+        if (dynamic_cast<const BreakStmtAST *>(stmt) || dynamic_cast<const ContinueStmtAST *>(stmt))
+            return true;
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+            {
+                if (containsLoopJump(child.get()))
+                    return true;
+            }
+            return false;
+        }
+        if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            return containsLoopJump(ifStmt->getThen()) || containsLoopJump(ifStmt->getElse());
+        if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+        {
+            // A break only leaves the switch, but a continue still jumps
+            // here; counting both keeps this simple and conservative
+            for (const auto &c : switchStmt->getCases())
+            {
+                if (containsLoopJump(c.Body.get()))
+                    return true;
+            }
+            return false;
+        }
+        // Jumps inside nested loops bind to those loops
+        return false;
+    }
+
+    bool containsLoop(const StmtAST *stmt)
+    {
+        if (!stmt)
+            return false;
+        if (dynamic_cast<const WhileStmtAST *>(stmt) || dynamic_cast<const ForStmtAST *>(stmt))
+            return true;
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+            {
+                if (containsLoop(child.get()))
+                    return true;
+            }
+            return false;
+        }
+        if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            return containsLoop(ifStmt->getThen()) || containsLoop(ifStmt->getElse());
+        if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+        {
+            for (const auto &c : switchStmt->getCases())
+            {
+                if (containsLoop(c.Body.get()))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Renaming a body's declarations is only safe if no iteration reads one
+    // of them before declaring it, i.e. no value is carried over from the
+    // previous iteration through a redeclared variable
+    bool declaredBeforeUse(StmtAST *stmt, const std::set<std::string> &declared, std::set<std::string> &seen)
+    {
+        if (!stmt)
+            return true;
+
+        auto check = [&](const ExprAST *expr)
+        {
+            std::set<std::string> reads;
+            collectReadVariables(expr, reads);
+            collectWrittenVariables(expr, reads);
+            for (const auto &name : reads)
+            {
+                if (declared.count(name) && !seen.count(name))
+                    return false;
+            }
+            return true;
+        };
+
+        if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+        {
+            for (const auto &var : varDecl->getVars())
+            {
+                if (!check(var.second.get()))
+                    return false;
+                seen.insert(var.first);
+            }
+            return true;
+        }
+        if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+        {
+            for (auto &child : compound->getStatements())
+            {
+                if (!declaredBeforeUse(child.get(), declared, seen))
+                    return false;
+            }
+            return true;
+        }
+        if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+        {
+            if (!check(ifStmt->getCondition()))
+                return false;
+            // A declaration in one branch does not cover code after the if
+            std::set<std::string> thenSeen = seen, elseSeen = seen;
+            return declaredBeforeUse(ifStmt->getThenRef().get(), declared, thenSeen) &&
+                   declaredBeforeUse(ifStmt->getElseRef().get(), declared, elseSeen);
+        }
+        if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+        {
+            if (!check(switchStmt->getValue()))
+                return false;
+            // Any case can be entered directly from the dispatch
+            for (auto &c : switchStmt->getCases())
+            {
+                std::set<std::string> caseSeen = seen;
+                if (!declaredBeforeUse(c.Body.get(), declared, caseSeen))
+                    return false;
+            }
+            return true;
+        }
+        if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+        {
+            std::set<std::string> inner = seen;
+            return check(whileStmt->getCondition()) && declaredBeforeUse(whileStmt->getBodyRef().get(), declared, inner);
+        }
+        if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+        {
+            std::set<std::string> inner = seen;
+            return declaredBeforeUse(forStmt->getInitRef().get(), declared, inner) &&
+                   check(forStmt->getCondition()) && declaredBeforeUse(forStmt->getBodyRef().get(), declared, inner) &&
+                   check(forStmt->getUpdate());
+        }
+
+        bool ok = true;
+        forEachExpression(stmt, [&](std::unique_ptr<ExprAST> &expr)
+                          { ok = ok && check(expr.get()); });
+        return ok;
+    }
+
+    // The shape of a counted loop, with the condition normalized to
+    // "var op bound"
+    struct CountedLoop
+    {
+        std::string var;
+        long long step = 0;
+        std::string op;
+        const ExprAST *bound = nullptr;
+        bool knownStart = false;
+        long long start = 0;
+    };
+
+    bool matchCountedLoop(ForStmtAST *loop, CountedLoop &info)
+    {
+        const AssignmentExprAST *update = dynamic_cast<const AssignmentExprAST *>(loop->getUpdate());
+        const VariableExprAST *target = update ? dynamic_cast<const VariableExprAST *>(update->getLHS()) : nullptr;
+        if (!target)
+            return false;
+        info.var = target->getName();
+        if (!isIncrementOf(update, info.var, info.step) || info.step == 0)
+            return false;
+
+        const BinaryExprAST *condition = dynamic_cast<const BinaryExprAST *>(loop->getCondition());
+        if (!condition)
+            return false;
+        info.op = condition->getOp();
+        if (info.op != "<" && info.op != "<=" && info.op != ">" && info.op != ">=")
+            return false;
+        const VariableExprAST *lhs = dynamic_cast<const VariableExprAST *>(condition->getLHS());
+        const VariableExprAST *rhs = dynamic_cast<const VariableExprAST *>(condition->getRHS());
+        if (lhs && lhs->getName() == info.var)
+        {
+            info.bound = condition->getRHS();
+        }
+        else if (rhs && rhs->getName() == info.var)
+        {
+            info.bound = condition->getLHS();
+            info.op = mirrorComparison(info.op);
+        }
+        else
+        {
+            return false;
+        }
+
+        // The loop has to move towards the bound
+        bool upward = info.op == "<" || info.op == "<=";
+        if (upward != (info.step > 0))
+            return false;
+
+        // Only the update may store to the counter, and nothing in the loop
+        // may change the bound
+        std::set<std::string> written, read;
+        collectWrittenVariables(loop->getBodyRef().get(), written);
+        if (written.count(info.var) || hasSideEffects(info.bound))
+            return false;
+        written.insert(info.var);
+        collectReadVariables(info.bound, read);
+        for (const auto &name : read)
+        {
+            if (written.count(name))
+                return false;
+        }
+
+        if (containsLoopJump(loop->getBody()))
+            return false;
+
+        // A constant start value gives a known trip count
+        StmtAST *init = loop->getInitRef().get();
+        if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(init))
+        {
+            if (varDecl->getVars().size() == 1 && varDecl->getVars()[0].first == info.var &&
+                (varDecl->getVarType() == DataType::INT || varDecl->getVarType() == DataType::LONG))
+                info.knownStart = evaluateConstant(varDecl->getVars()[0].second.get(), info.start);
+        }
+        else if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(init))
+        {
+            const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(exprStmt->getExpr());
+            const VariableExprAST *var = assign ? dynamic_cast<const VariableExprAST *>(assign->getLHS()) : nullptr;
+            if (var && var->getName() == info.var)
+                info.knownStart = evaluateConstant(assign->getRHS(), info.start);
+        }
+        return true;
+    }
+
+    class LoopUnroller
+    {
+    public:
+        LoopUnroller(OptStats &stats, int factor) : Stats(stats), Factor(factor) {}
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt);
+        }
+
+        bool changed() const { return Changed; }
+
+    private:
+        OptStats &Stats;
+        int Factor;
+        int NextCopy = 0;
+        bool Changed = false;
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            if (!stmt)
+                return;
+
+            // Inner loops first
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                processStmt(ifStmt->getThenRef());
+                processStmt(ifStmt->getElseRef());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    processStmt(c.Body);
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                processStmt(whileStmt->getBodyRef());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                processStmt(forStmt->getBodyRef());
+                unroll(stmt);
+            }
+        }
+
+        // Copy the body with the counter read as `counter` and the body's
+        // own declarations renamed
+        std::unique_ptr<StmtAST> copyBody(const StmtAST *body, const std::string &var,
+                                          const std::set<std::string> &declared,
+                                          const std::function<std::unique_ptr<ExprAST>()> &counter)
+        {
+            std::string prefix = ".unr" + std::to_string(NextCopy++) + ".";
+            return cloneStmt(body, [&](const std::string &name) -> std::unique_ptr<ExprAST>
+                             {
+                                 if (name == var)
+                                     return counter();
+                                 if (declared.count(name))
+                                     return std::make_unique<VariableExprAST>(prefix + name);
+                                 return std::make_unique<VariableExprAST>(name); });
+        }
+
+        void unroll(std::unique_ptr<StmtAST> &stmt)
+        {
+            ForStmtAST *loop = static_cast<ForStmtAST *>(stmt.get());
+            int hint = loop->getUnrollHint();
+            CountedLoop info;
+            if (hint == 1 || !matchCountedLoop(loop, info))
+                return;
+
+            StmtAST *body = loop->getBodyRef().get();
+            std::set<std::string> declared, seen;
+            collectDeclarations(body, declared);
+            if (!declaredBeforeUse(body, declared, seen))
+                return;
+
+            // Without a hint, only small innermost loops are worth it
+            int bodySize = countNodes(body);
+            bool automatic = hint == 0;
+            if (automatic && (Factor <= 1 || containsLoop(body)))
+                return;
+
+            long long bound;
+            bool knownTrips = info.knownStart && evaluateConstant(info.bound, bound);
+            long long trips = knownTrips ? tripCount(info.start, info.op, bound, info.step) : 0;
+            if (knownTrips && !fitsInInt(info.start + trips * info.step))
+                knownTrips = false;
+
+            if (knownTrips && hint <= 0)
+            {
+                bool small = automatic ? trips <= MaxFullUnrollTrips && trips * bodySize <= MaxUnrolledSize
+                                       : trips <= MaxPragmaCopies;
+                if (small)
+                {
+                    unrollCompletely(stmt, info, trips, declared);
+                    return;
+                }
+            }
+
+            if (hint > MaxPragmaCopies)
+            {
+                std::cerr << "Warning: #pragma unroll(" << hint << ") limited to " << MaxPragmaCopies << " copies"
+                          << std::endl;
+                hint = MaxPragmaCopies;
+                loop->setUnrollHint(hint);
+            }
+            int factor = hint > 1 ? hint : Factor;
+            if (factor <= 1 || (automatic && factor * bodySize > MaxUnrolledSize))
+                return;
+            if (knownTrips && trips < factor)
+            {
+                if (hint > 1)
+                    unrollCompletely(stmt, info, trips, declared);
+                return;
+            }
+            if (!fitsInInt(info.step * factor))
+                return;
+            unrollPartially(stmt, info, factor, knownTrips && trips % factor == 0, declared);
+        }
+
+        void unrollCompletely(std::unique_ptr<StmtAST> &stmt, const CountedLoop &info, long long trips,
+                              const std::set<std::string> &declared)
+        {
+            ForStmtAST *loop = static_cast<ForStmtAST *>(stmt.get());
+            std::vector<std::unique_ptr<StmtAST>> block;
+            block.push_back(std::move(loop->getInitRef()));
+            for (long long iteration = 0; iteration < trips; ++iteration)
+            {
+                long long value = info.start + iteration * info.step;
+                std::unique_ptr<StmtAST> copy = copyBody(loop->getBody(), info.var, declared, [&]()
+                                                         { return std::make_unique<NumberExprAST>(static_cast<double>(value)); });
+                if (!copy)
+                {
+                    // Put the init back; the loop stays as it was
+                    loop->getInitRef() = std::move(block.front());
+                    return;
+                }
+                block.push_back(std::move(copy));
+            }
+
+            // The counter keeps the value it has after the loop
+            block.push_back(std::make_unique<ExprStmtAST>(std::make_unique<AssignmentExprAST>(
+                std::make_unique<VariableExprAST>(info.var),
+                std::make_unique<NumberExprAST>(static_cast<double>(info.start + trips * info.step)))));
+
+            stmt = std::make_unique<CompoundStmtAST>(std::move(block));
+            Stats["unroll.complete"]++;
+            Changed = true;
+        }
+
+        void unrollPartially(std::unique_ptr<StmtAST> &stmt, const CountedLoop &info, int factor, bool exact,
+                             const std::set<std::string> &declared)
+        {
+            ForStmtAST *loop = static_cast<ForStmtAST *>(stmt.get());
+
+            std::vector<std::unique_ptr<StmtAST>> copies;
+            for (int copy = 0; copy < factor; ++copy)
+            {
+                long long offset = info.step * copy;
+                std::unique_ptr<StmtAST> body = copyBody(loop->getBody(), info.var, declared, [&]() -> std::unique_ptr<ExprAST>
+                                                         {
+                                                             auto var = std::make_unique<VariableExprAST>(info.var);
+                                                             if (offset == 0)
+                                                                 return var;
+                                                             return std::make_unique<BinaryExprAST>(
+                                                                 "+", std::move(var), std::make_unique<NumberExprAST>(static_cast<double>(offset))); });
+                if (!body)
+                    return;
+                copies.push_back(std::move(body));
+            }
+
+            // The unrolled loop runs while all of its iterations are in
+            // range; with an exact multiple the original test is enough
+            std::unique_ptr<ExprAST> counter = std::make_unique<VariableExprAST>(info.var);
+            if (!exact)
+            {
+                counter = std::make_unique<BinaryExprAST>(
+                    "+", std::move(counter), std::make_unique<NumberExprAST>(static_cast<double>(info.step * (factor - 1))));
+            }
+            std::unique_ptr<ExprAST> guard =
+                std::make_unique<BinaryExprAST>(info.op, std::move(counter), cloneExpr(info.bound));
+            std::unique_ptr<ExprAST> update = std::make_unique<AssignmentExprAST>(
+                std::make_unique<VariableExprAST>(info.var),
+                std::make_unique<BinaryExprAST>("+", std::make_unique<VariableExprAST>(info.var),
+                                                std::make_unique<NumberExprAST>(static_cast<double>(info.step * factor))));
+            auto unrolled = std::make_unique<ForStmtAST>(nullptr, std::move(guard), std::move(update),
+                                                         std::make_unique<CompoundStmtAST>(std::move(copies)));
+            unrolled->setUnrollHint(1);
+
+            std::vector<std::unique_ptr<StmtAST>> block;
+            if (loop->getInitRef())
+                block.push_back(std::move(loop->getInitRef()));
+            block.push_back(std::move(unrolled));
+            if (!exact)
+            {
+                // The original loop runs the remaining iterations
+                loop->setUnrollHint(1);
+                block.push_back(std::move(stmt));
+            }
+            stmt = std::make_unique<CompoundStmtAST>(std::move(block));
+            Stats["unroll.partial"]++;
+            Changed = true;
+        }
+    };
+}
+
+bool unrollLoops(ProgramAST &program, OptStats &stats, int factor)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        LoopUnroller unroller(stats, factor);
+        unroller.processList(*stmts);
+        changed |= unroller.changed();
+    }
+    return changed;
+}
@@ -0,0 +1,250 @@
+#include "Optimizer.h"
+
+// Loop unswitching.
+//
+// An if inside a loop whose condition the loop never changes takes the
+// same branch on every iteration. The test is moved in front of the loop
+// and the loop is copied once per outcome:
+//
+//   for (...) { A; if (c) B; else C; D; }
+//
+// becomes
+//
+//   if (c) for (...) { A; B; D; } else for (...) { A; C; D; }
+//
+// The condition has to be pure, read nothing the loop stores to and be
+// unable to trap, since it now runs even when the loop body does not. Ifs
+// inside nested loops count too, so a test that is invariant in a whole
+// loop nest moves all the way out. Each copy can be unswitched again on
+// another condition.
+//
+// Every unswitch duplicates the loop, so only loops up to a fixed size are
+// copied and each code unit has a growth budget. The copy gets its own
+// names for the variables the loop declares, which keeps every name
+// declared once; loops whose variables are read after the loop are left
+// alone.
+
+namespace
+{
+    const int MaxUnswitchedLoopSize = 120; // AST nodes of the loop being copied
+    const int MaxUnswitchGrowth = 360;     // AST nodes added per code unit
+
+    // Reads of every statement except one subtree
+    void collectReadsOutside(StmtAST *stmt, const StmtAST *skip, std::set<std::string> &reads)
+    {
+        if (!stmt || stmt == skip)
+            return;
+
+        if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+        {
+            for (auto &child : compound->getStatements())
+                collectReadsOutside(child.get(), skip, reads);
+        }
+        else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+        {
+            collectReadVariables(ifStmt->getCondition(), reads);
+            collectReadsOutside(ifStmt->getThenRef().get(), skip, reads);
+            collectReadsOutside(ifStmt->getElseRef().get(), skip, reads);
+        }
+        else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+        {
+            collectReadVariables(whileStmt->getCondition(), reads);
+            collectReadsOutside(whileStmt->getBodyRef().get(), skip, reads);
+        }
+        else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+        {
+            collectReadsOutside(forStmt->getInitRef().get(), skip, reads);
+            collectReadVariables(forStmt->getCondition(), reads);
+            collectReadVariables(forStmt->getUpdate(), reads);
+            collectReadsOutside(forStmt->getBodyRef().get(), skip, reads);
+        }
+        else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+        {
+            collectReadVariables(switchStmt->getValue(), reads);
+            for (auto &c : switchStmt->getCases())
+                collectReadsOutside(c.Body.get(), skip, reads);
+        }
+        else
+        {
+            forEachExpression(stmt, [&](std::unique_ptr<ExprAST> &expr)
+                              { collectReadVariables(expr.get(), reads); });
+        }
+    }
+
+    class LoopUnswitcher
+    {
+    public:
+        LoopUnswitcher(std::vector<std::unique_ptr<StmtAST>> &unit, OptStats &stats) : Unit(unit), Stats(stats) {}
+
+        bool changed() const { return Changed; }
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt);
+        }
+
+    private:
+        std::vector<std::unique_ptr<StmtAST>> &Unit;
+        OptStats &Stats;
+        int Growth = 0;
+        int NextCopy = 0;
+        bool Changed = false;
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                processStmt(ifStmt->getThenRef());
+                processStmt(ifStmt->getElseRef());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    processStmt(c.Body);
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                // Outermost first; the copies are visited again as the two
+                // branches of the new if
+                if (unswitch(stmt))
+                    processStmt(stmt);
+                else
+                    processStmt(whileStmt->getBodyRef());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                if (unswitch(stmt))
+                    processStmt(stmt);
+                else
+                    processStmt(forStmt->getBodyRef());
+            }
+        }
+
+        bool isInvariant(const ExprAST *expr, const std::set<std::string> &written) const
+        {
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                if (canTrap(binary))
+                    return false;
+                return isInvariant(binary->getLHS(), written) && isInvariant(binary->getRHS(), written);
+            }
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+                return isInvariant(unary->getOperand(), written) && !hasSideEffects(unary);
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+                return !written.count(var->getName());
+            return dynamic_cast<const NumberExprAST *>(expr) || dynamic_cast<const BoolExprAST *>(expr) ||
+                   dynamic_cast<const CharExprAST *>(expr);
+        }
+
+        // First if in a loop body whose condition the loop never changes
+        std::unique_ptr<StmtAST> *findInvariantIf(std::unique_ptr<StmtAST> &stmt, const std::set<std::string> &written)
+        {
+            if (!stmt)
+                return nullptr;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                for (auto &child : compound->getStatements())
+                {
+                    if (std::unique_ptr<StmtAST> *found = findInvariantIf(child, written))
+                        return found;
+                }
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                long long value;
+                if (!evaluateConstant(ifStmt->getCondition(), value) && isInvariant(ifStmt->getCondition(), written))
+                    return &stmt;
+                if (std::unique_ptr<StmtAST> *found = findInvariantIf(ifStmt->getThenRef(), written))
+                    return found;
+                return findInvariantIf(ifStmt->getElseRef(), written);
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                return findInvariantIf(whileStmt->getBodyRef(), written);
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                return findInvariantIf(forStmt->getBodyRef(), written);
+            }
+            return nullptr;
+        }
+
+        bool unswitch(std::unique_ptr<StmtAST> &loop)
+        {
+            int size = countNodes(loop.get());
+            if (size > MaxUnswitchedLoopSize || Growth + size > MaxUnswitchGrowth)
+                return false;
+
+            std::set<std::string> written;
+            collectWrittenVariables(loop.get(), written);
+            std::unique_ptr<StmtAST> *body = nullptr;
+            if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(loop.get()))
+                body = &whileStmt->getBodyRef();
+            else
+                body = &static_cast<ForStmtAST *>(loop.get())->getBodyRef();
+            std::unique_ptr<StmtAST> *slot = findInvariantIf(*body, written);
+            if (!slot)
+                return false;
+
+            // The copy renames the loop's declarations, which code after the
+            // loop would no longer see
+            std::set<std::string> declared, outside;
+            collectDeclarations(loop.get(), declared);
+            for (auto &stmt : Unit)
+                collectReadsOutside(stmt.get(), loop.get(), outside);
+            for (const auto &name : declared)
+            {
+                if (outside.count(name))
+                    return false;
+            }
+
+            IfStmtAST *test = static_cast<IfStmtAST *>(slot->get());
+            std::unique_ptr<ExprAST> condition = cloneExpr(test->getCondition());
+            if (!condition || !cloneStmt(loop.get()))
+                return false;
+
+            // The copy takes the then branch, the original the else branch
+            std::unique_ptr<StmtAST> ifNode = std::move(*slot);
+            *slot = takeBranch(test->getThenRef());
+            std::string prefix = ".uns" + std::to_string(NextCopy++) + ".";
+            std::unique_ptr<StmtAST> thenLoop = cloneStmt(loop.get(), [&](const std::string &name)
+                                                          { return std::make_unique<VariableExprAST>(
+                                                                declared.count(name) ? prefix + name : name); });
+            *slot = takeBranch(test->getElseRef());
+
+            loop = std::make_unique<IfStmtAST>(std::move(condition), std::move(thenLoop), std::move(loop));
+            Growth += size;
+            Stats["unswitch.loops"]++;
+            Changed = true;
+            return true;
+        }
+
+        static std::unique_ptr<StmtAST> takeBranch(std::unique_ptr<StmtAST> &branch)
+        {
+            if (branch)
+                return std::move(branch);
+            return std::make_unique<CompoundStmtAST>(std::vector<std::unique_ptr<StmtAST>>());
+        }
+    };
+}
+
+bool unswitchLoops(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        LoopUnswitcher unswitcher(*stmts, stats);
+        unswitcher.processList(*stmts);
+        changed |= unswitcher.changed();
+    }
+    return changed;
+}
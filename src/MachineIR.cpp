@@ -0,0 +1,491 @@
+#include "MachineIR.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+    struct OpcodeName
+    {
+        Opcode opcode;
+        const char *name;
+    };
+
+    const OpcodeName opcodeNames[] = {
+        {Opcode::Mov, "mov"}, {Opcode::Movsxd, "movsxd"}, {Opcode::Movzx, "movzx"}, {Opcode::Lea, "lea"},
+        {Opcode::Xchg, "xchg"}, {Opcode::Push, "push"}, {Opcode::Pop, "pop"}, {Opcode::Add, "add"},
+        {Opcode::Sub, "sub"}, {Opcode::Imul, "imul"}, {Opcode::Mul, "mul"}, {Opcode::Idiv, "idiv"},
+        {Opcode::Div, "div"}, {Opcode::Neg, "neg"}, {Opcode::Not, "not"}, {Opcode::Inc, "inc"},
+        {Opcode::Dec, "dec"}, {Opcode::And, "and"}, {Opcode::Or, "or"}, {Opcode::Xor, "xor"},
+        {Opcode::Shl, "shl"}, {Opcode::Shr, "shr"}, {Opcode::Sar, "sar"}, {Opcode::Bsr, "bsr"},
+        {Opcode::Bt, "bt"}, {Opcode::Cmp, "cmp"}, {Opcode::Test, "test"}, {Opcode::Cqo, "cqo"},
+        {Opcode::Jmp, "jmp"}, {Opcode::Call, "call"}, {Opcode::Ret, "ret"}, {Opcode::Syscall, "syscall"},
+    };
+
+    const char *const conditions[] = {"e", "ne", "z", "nz", "l", "le", "g", "ge", "b", "be",
+                                      "a", "ae", "s", "ns", "o", "no", "c", "nc", "p", "np"};
+
+    // 64-bit register of every general-purpose register name
+    struct RegisterName
+    {
+        const char *name;
+        const char *full;
+    };
+
+    const RegisterName registerNames[] = {
+        {"rax", "rax"}, {"eax", "rax"}, {"ax", "rax"}, {"al", "rax"}, {"ah", "rax"},
+        {"rbx", "rbx"}, {"ebx", "rbx"}, {"bx", "rbx"}, {"bl", "rbx"}, {"bh", "rbx"},
+        {"rcx", "rcx"}, {"ecx", "rcx"}, {"cx", "rcx"}, {"cl", "rcx"}, {"ch", "rcx"},
+        {"rdx", "rdx"}, {"edx", "rdx"}, {"dx", "rdx"}, {"dl", "rdx"}, {"dh", "rdx"},
+        {"rsi", "rsi"}, {"esi", "rsi"}, {"si", "rsi"}, {"sil", "rsi"},
+        {"rdi", "rdi"}, {"edi", "rdi"}, {"di", "rdi"}, {"dil", "rdi"},
+        {"rsp", "rsp"}, {"esp", "rsp"}, {"sp", "rsp"}, {"spl", "rsp"},
+        {"rbp", "rbp"}, {"ebp", "rbp"}, {"bp", "rbp"}, {"bpl", "rbp"},
+    };
+
+    // Register a name refers to, as its 64-bit form, or "" if it is not one
+    std::string fullRegister(const std::string &name)
+    {
+        for (const auto &entry : registerNames)
+        {
+            if (name == entry.name)
+                return entry.full;
+        }
+        // r8 ... r15 with an optional d/w/b suffix
+        if (name.size() >= 2 && name[0] == 'r' && isdigit(static_cast<unsigned char>(name[1])))
+        {
+            size_t digits = 1;
+            while (digits < name.size() && isdigit(static_cast<unsigned char>(name[digits])))
+                ++digits;
+            int number = std::stoi(name.substr(1, digits - 1));
+            std::string suffix = name.substr(digits);
+            if (number >= 8 && number <= 15 && (suffix.empty() || suffix == "d" || suffix == "w" || suffix == "b"))
+                return name.substr(0, digits);
+        }
+        return "";
+    }
+
+    std::string trim(const std::string &text)
+    {
+        size_t start = text.find_first_not_of(" \t");
+        if (start == std::string::npos)
+            return "";
+        size_t end = text.find_last_not_of(" \t");
+        return text.substr(start, end - start + 1);
+    }
+
+    // Position of the ';' starting a comment, skipping quoted characters
+    size_t commentStart(const std::string &line)
+    {
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i)
+        {
+            if (line[i] == '\'' || line[i] == '"')
+                quoted = !quoted;
+            else if (line[i] == ';' && !quoted)
+                return i;
+        }
+        return std::string::npos;
+    }
+
+    // Operands are separated by commas outside brackets and quotes
+    std::vector<std::string> splitOperands(const std::string &text)
+    {
+        std::vector<std::string> operands;
+        std::string current;
+        int depth = 0;
+        bool quoted = false;
+        for (char c : text)
+        {
+            if (c == '\'' || c == '"')
+                quoted = !quoted;
+            else if (c == '[' && !quoted)
+                ++depth;
+            else if (c == ']' && !quoted)
+                --depth;
+            if (c == ',' && depth == 0 && !quoted)
+            {
+                operands.push_back(trim(current));
+                current.clear();
+                continue;
+            }
+            current += c;
+        }
+        if (!trim(current).empty())
+            operands.push_back(trim(current));
+        return operands;
+    }
+
+    const char *sizeName(int size)
+    {
+        switch (size)
+        {
+        case 1:
+            return "byte";
+        case 2:
+            return "word";
+        case 4:
+            return "dword";
+        default:
+            return "qword";
+        }
+    }
+}
+
+MachineOperand MachineOperand::reg(const std::string &name)
+{
+    MachineOperand operand;
+    operand.kind = Register;
+    operand.text = name;
+    return operand;
+}
+
+MachineOperand MachineOperand::imm(long long value)
+{
+    MachineOperand operand;
+    operand.kind = Immediate;
+    operand.text = std::to_string(value);
+    return operand;
+}
+
+MachineOperand MachineOperand::mem(const std::string &address, int size)
+{
+    MachineOperand operand;
+    operand.kind = Memory;
+    operand.text = address;
+    operand.size = size;
+    return operand;
+}
+
+MachineOperand MachineOperand::label(const std::string &name)
+{
+    MachineOperand operand;
+    operand.kind = Label;
+    operand.text = name;
+    return operand;
+}
+
+MachineOperand MachineOperand::parse(const std::string &text, bool target)
+{
+    std::string operand = trim(text);
+    size_t open = operand.find('[');
+    if (open != std::string::npos)
+    {
+        std::string prefix = trim(operand.substr(0, open));
+        int size = prefix == "byte" ? 1 : prefix == "word" ? 2 : prefix == "dword" ? 4 : prefix == "qword" ? 8 : 0;
+        return mem(trim(operand.substr(open + 1, operand.rfind(']') - open - 1)), size);
+    }
+    if (!fullRegister(operand).empty())
+        return reg(operand);
+    if (target)
+        return label(operand);
+
+    MachineOperand immediate;
+    immediate.kind = Immediate;
+    immediate.text = operand;
+    return immediate;
+}
+
+bool MachineOperand::getImm(long long &value) const
+{
+    if (kind != Immediate || text.empty())
+        return false;
+    size_t used = 0;
+    try
+    {
+        value = std::stoll(text, &used);
+    }
+    catch (const std::exception &)
+    {
+        return false;
+    }
+    return used == text.size();
+}
+
+bool MachineOperand::isImm(long long value) const
+{
+    long long actual;
+    return getImm(actual) && actual == value;
+}
+
+bool MachineOperand::uses(const std::string &reg64) const
+{
+    if (kind == Register)
+        return fullRegister(text) == reg64;
+    if (kind != Memory)
+        return false;
+
+    // Check each name in the address expression
+    std::string name;
+    for (size_t i = 0; i <= text.size(); ++i)
+    {
+        if (i < text.size() && isalnum(static_cast<unsigned char>(text[i])))
+        {
+            name += text[i];
+            continue;
+        }
+        if (!name.empty() && fullRegister(name) == reg64)
+            return true;
+        name.clear();
+    }
+    return false;
+}
+
+std::string MachineOperand::str() const
+{
+    if (kind == Memory)
+        return size ? std::string(sizeName(size)) + " [" + text + "]" : "[" + text + "]";
+    return text;
+}
+
+MachineInstr MachineInstr::conditional(Opcode opcode, const std::string &condition, std::vector<MachineOperand> operands)
+{
+    MachineInstr instr(opcode, std::move(operands));
+    instr.condition = condition;
+    return instr;
+}
+
+MachineInstr MachineInstr::mov(const MachineOperand &dest, const MachineOperand &source, std::string comment)
+{
+    return MachineInstr(Opcode::Mov, {dest, source}, std::move(comment));
+}
+
+MachineInstr MachineInstr::lea(const MachineOperand &dest, const std::string &address)
+{
+    return MachineInstr(Opcode::Lea, {dest, MachineOperand::mem(address)});
+}
+
+MachineInstr MachineInstr::push(const MachineOperand &source)
+{
+    return MachineInstr(Opcode::Push, {source});
+}
+
+MachineInstr MachineInstr::pop(const MachineOperand &dest)
+{
+    return MachineInstr(Opcode::Pop, {dest});
+}
+
+MachineInstr MachineInstr::cmp(const MachineOperand &left, const MachineOperand &right)
+{
+    return MachineInstr(Opcode::Cmp, {left, right});
+}
+
+MachineInstr MachineInstr::arithmetic(Opcode opcode, const MachineOperand &dest, const MachineOperand &source)
+{
+    return MachineInstr(opcode, {dest, source});
+}
+
+MachineInstr MachineInstr::jump(const std::string &target, std::string comment)
+{
+    return MachineInstr(Opcode::Jmp, {MachineOperand::label(target)}, std::move(comment));
+}
+
+MachineInstr MachineInstr::jumpIf(const std::string &condition, const std::string &target)
+{
+    return conditional(Opcode::Jcc, condition, {MachineOperand::label(target)});
+}
+
+MachineInstr MachineInstr::call(const std::string &target, std::string comment)
+{
+    return MachineInstr(Opcode::Call, {MachineOperand::label(target)}, std::move(comment));
+}
+
+MachineInstr MachineInstr::parse(const std::string &line)
+{
+    size_t semicolon = commentStart(line);
+    std::string body = trim(line.substr(0, semicolon));
+    std::string comment = semicolon == std::string::npos ? "" : trim(line.substr(semicolon + 1));
+    if (body.empty())
+        return note(comment);
+
+    size_t space = body.find_first_of(" \t");
+    std::string mnemonic = body.substr(0, space);
+    std::vector<std::string> operandTexts;
+    if (space != std::string::npos)
+        operandTexts = splitOperands(body.substr(space + 1));
+
+    Opcode opcode = Opcode::Comment;
+    std::string condition;
+    auto known = std::find_if(std::begin(opcodeNames), std::end(opcodeNames), [&](const OpcodeName &entry)
+                              { return mnemonic == entry.name; });
+    if (known != std::end(opcodeNames))
+    {
+        opcode = known->opcode;
+    }
+    else
+    {
+        static const OpcodeName families[] = {{Opcode::Cmovcc, "cmov"}, {Opcode::Setcc, "set"}, {Opcode::Jcc, "j"}};
+        for (const auto &family : families)
+        {
+            std::string prefix = family.name;
+            if (mnemonic.compare(0, prefix.size(), prefix) == 0 &&
+                std::find(std::begin(conditions), std::end(conditions), mnemonic.substr(prefix.size())) != std::end(conditions))
+            {
+                opcode = family.opcode;
+                condition = mnemonic.substr(prefix.size());
+                break;
+            }
+        }
+        if (opcode == Opcode::Comment)
+            throw std::invalid_argument("unknown mnemonic '" + mnemonic + "'");
+    }
+
+    bool target = opcode == Opcode::Jmp || opcode == Opcode::Jcc || opcode == Opcode::Call;
+    MachineInstr instr(opcode, {}, comment);
+    instr.condition = condition;
+    for (const auto &text : operandTexts)
+        instr.operands.push_back(MachineOperand::parse(text, target));
+    return instr;
+}
+
+std::string MachineInstr::mnemonic() const
+{
+    switch (opcode)
+    {
+    case Opcode::Jcc:
+        return "j" + condition;
+    case Opcode::Setcc:
+        return "set" + condition;
+    case Opcode::Cmovcc:
+        return "cmov" + condition;
+    case Opcode::Comment:
+        return "";
+    default:
+        break;
+    }
+    for (const auto &entry : opcodeNames)
+    {
+        if (entry.opcode == opcode)
+            return entry.name;
+    }
+    return "";
+}
+
+bool MachineInstr::writesFlags() const
+{
+    switch (opcode)
+    {
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Imul:
+    case Opcode::Mul:
+    case Opcode::Idiv:
+    case Opcode::Div:
+    case Opcode::Neg:
+    case Opcode::Inc:
+    case Opcode::Dec:
+    case Opcode::And:
+    case Opcode::Or:
+    case Opcode::Xor:
+    case Opcode::Shl:
+    case Opcode::Shr:
+    case Opcode::Sar:
+    case Opcode::Bsr:
+    case Opcode::Bt:
+    case Opcode::Cmp:
+    case Opcode::Test:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::string MachineInstr::str() const
+{
+    if (opcode == Opcode::Comment)
+        return comment.empty() ? "" : "    ; " + comment;
+
+    std::string line = "    " + mnemonic();
+    for (size_t i = 0; i < operands.size(); ++i)
+        line += (i == 0 ? " " : ", ") + operands[i].str();
+    if (!comment.empty())
+    {
+        line.resize(std::max<size_t>(line.size() + 1, 28), ' ');
+        line += "; " + comment;
+    }
+    return line;
+}
+
+const MachineInstr *MachineBasicBlock::last() const
+{
+    for (auto instr = instrs.rbegin(); instr != instrs.rend(); ++instr)
+    {
+        if (instr->opcode != Opcode::Comment)
+            return &*instr;
+    }
+    return nullptr;
+}
+
+MachineFunction::MachineFunction(const std::string &name) : name(name)
+{
+    blocks.emplace_back();
+    blocks.back().label = name;
+}
+
+void MachineFunction::append(const MachineInstr &instr)
+{
+    const MachineInstr *last = blocks.back().last();
+    if (last && last->isTerminator() && instr.opcode != Opcode::Comment)
+        blocks.emplace_back();
+    blocks.back().instrs.push_back(instr);
+}
+
+void MachineFunction::appendLabel(const std::string &label)
+{
+    if (blocks.back().label.empty() && blocks.back().instrs.empty())
+    {
+        blocks.back().label = label;
+        return;
+    }
+    blocks.emplace_back();
+    blocks.back().label = label;
+}
+
+size_t MachineFunction::instructionCount() const
+{
+    size_t count = 0;
+    for (const auto &block : blocks)
+    {
+        count += std::count_if(block.instrs.begin(), block.instrs.end(), [](const MachineInstr &instr)
+                               { return instr.opcode != Opcode::Comment; });
+    }
+    return count;
+}
+
+void MachineFunction::print(std::ostream &out) const
+{
+    for (const auto &block : blocks)
+    {
+        if (!block.label.empty())
+            out << block.label << ":\n";
+        for (const auto &instr : block.instrs)
+            out << instr.str() << "\n";
+    }
+}
+
+void MachineModule::print(std::ostream &out) const
+{
+    if (!rodata.empty())
+    {
+        out << "section .rodata\n";
+        for (const auto &line : rodata)
+            out << "    " << line << "\n";
+        out << "\n";
+    }
+    out << "section .data\n";
+    for (const auto &line : data)
+        out << "    " << line << "\n";
+    if (!bss.empty())
+    {
+        out << "\nsection .bss\n";
+        for (const auto &line : bss)
+            out << "    " << line << "\n";
+    }
+    out << "\nsection .text\n";
+    for (const auto &name : globals)
+        out << "global " << name << "\n";
+    for (const auto &function : functions)
+    {
+        out << "\n";
+        function.print(out);
+    }
+}
@@ -0,0 +1,996 @@
+#include "Optimizer.h"
+#include <climits>
+#include <iostream>
+
+Optimizer::Optimizer(int optLevel) : OptLevel(optLevel) {}
+
+void Optimizer::run(ProgramAST &program)
+{
+    if (OptLevel <= 0)
+        return;
+
+    // Give every declaration its own name first so the later passes can
+    // reason about variables purely by name
+    resolveVariableNames(program, Stats);
+
+    // Inline first so the copied bodies are folded and cleaned up together
+    // with the code around the call sites
+    if (OptLevel >= 2)
+        inlineFunctions(program, Stats, InlineThreshold);
+
+    simplify(program);
+
+    if (OptLevel >= 2)
+    {
+        // Unswitched copies have simpler bodies for the other loop passes.
+        // Loops with a closed form go away before the unroller copies
+        // them, and complete unrolling leaves constant copies of the body
+        // behind; all of them leave work for the folder
+        bool replaced = unswitchLoops(program, Stats);
+        replaced |= eliminateClosedFormLoops(program, Stats);
+        replaced |= unrollLoops(program, Stats, UnrollFactor);
+        if (replaced)
+            simplify(program);
+
+        // Induction variables are rewritten before hoisting so their start
+        // values land in the same preheader. Hoisting before value numbering
+        // lets it see the hoisted temporaries as plain loads. Temporaries
+        // whose reuse was later folded away are cleaned up by another dead
+        // store pass.
+        bool changed = reduceInductionVariables(program, Stats);
+        changed |= hoistLoopInvariants(program, Stats);
+        changed |= eliminateCommonSubexpressions(program, Stats);
+        if (changed)
+            eliminateDeadCode(program, Stats);
+    }
+}
+
+void Optimizer::simplify(ProgramAST &program)
+{
+    // Folding exposes constant branches, and removing dead code exposes
+    // more constants; iterate until nothing changes
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        bool changed = false;
+        changed |= foldConstants(program, Stats);
+        changed |= eliminateDeadCode(program, Stats);
+        if (!changed)
+            break;
+    }
+}
+
+void Optimizer::printStats() const
+{
+    std::cout << "📊 Optimization statistics:" << std::endl;
+    if (Stats.empty())
+    {
+        std::cout << "    (no changes)" << std::endl;
+        return;
+    }
+    for (const auto &entry : Stats)
+    {
+        std::cout << "    " << entry.first << ": " << entry.second << std::endl;
+    }
+}
+
+// Helper to check that a folded value is representable by the code generator,
+// which materializes literals as 32-bit immediates
+static bool fitsInInt(long long value)
+{
+    return value >= INT_MIN && value <= INT_MAX;
+}
+
+bool evaluateConstant(const ExprAST *expr, long long &value)
+{
+    if (!expr)
+        return false;
+
+    if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+    {
+        double val = num->getValue();
+        if (val < INT_MIN || val > INT_MAX)
+            return false;
+        value = static_cast<int>(val);
+        return true;
+    }
+
+    if (const BoolExprAST *boolExpr = dynamic_cast<const BoolExprAST *>(expr))
+    {
+        value = boolExpr->getValue() ? 1 : 0;
+        return true;
+    }
+
+    if (const CharExprAST *charExpr = dynamic_cast<const CharExprAST *>(expr))
+    {
+        value = static_cast<int>(charExpr->getValue());
+        return true;
+    }
+
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        long long operand;
+        if (!evaluateConstant(unary->getOperand(), operand))
+            return false;
+
+        const std::string &op = unary->getOp();
+        if (op == "-")
+            value = -operand;
+        else if (op == "+")
+            value = operand;
+        else if (op == "!")
+            value = operand == 0 ? 1 : 0;
+        else if (op == "~")
+            value = ~operand;
+        else
+            return false;
+        return fitsInInt(value);
+    }
+
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        long long lhs, rhs;
+        const std::string &op = binary->getOp();
+
+        // A constant left operand that decides && or || makes the right one
+        // dead, whatever it is
+        if (op == "&&" || op == "||")
+        {
+            if (!evaluateConstant(binary->getLHS(), lhs))
+                return false;
+            if ((lhs != 0) != (op == "&&"))
+            {
+                value = lhs != 0;
+                return true;
+            }
+            if (!evaluateConstant(binary->getRHS(), rhs))
+                return false;
+            value = rhs != 0;
+            return true;
+        }
+
+        if (!evaluateConstant(binary->getLHS(), lhs) || !evaluateConstant(binary->getRHS(), rhs))
+            return false;
+
+        if (op == "+")
+            value = lhs + rhs;
+        else if (op == "-")
+            value = lhs - rhs;
+        else if (op == "*")
+            value = lhs * rhs;
+        else if (op == "/")
+        {
+            if (rhs == 0)
+                return false; // Leave the trap to runtime
+            value = lhs / rhs;
+        }
+        else if (op == "%")
+        {
+            if (rhs == 0)
+                return false;
+            value = lhs % rhs;
+        }
+        else if (op == "==")
+            value = lhs == rhs;
+        else if (op == "!=")
+            value = lhs != rhs;
+        else if (op == "<")
+            value = lhs < rhs;
+        else if (op == ">")
+            value = lhs > rhs;
+        else if (op == "<=")
+            value = lhs <= rhs;
+        else if (op == ">=")
+            value = lhs >= rhs;
+        else
+            return false;
+        return fitsInInt(value);
+    }
+
+    return false;
+}
+
+bool canTrap(const BinaryExprAST *binary)
+{
+    if (binary->getOp() != "/" && binary->getOp() != "%")
+        return false;
+    long long divisor;
+    return !evaluateConstant(binary->getRHS(), divisor) || divisor == 0;
+}
+
+bool hasSideEffects(const ExprAST *expr)
+{
+    if (!expr)
+        return false;
+
+    if (dynamic_cast<const NumberExprAST *>(expr) || dynamic_cast<const BoolExprAST *>(expr) ||
+        dynamic_cast<const CharExprAST *>(expr) || dynamic_cast<const StringExprAST *>(expr) ||
+        dynamic_cast<const VariableExprAST *>(expr))
+        return false;
+
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        return canTrap(binary) || hasSideEffects(binary->getLHS()) || hasSideEffects(binary->getRHS());
+
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        if (unary->getOp() == "++" || unary->getOp() == "--")
+            return true;
+        return hasSideEffects(unary->getOperand());
+    }
+
+    // Assignments, calls and anything we do not model
+    return true;
+}
+
+void collectReadVariables(const ExprAST *expr, std::set<std::string> &vars)
+{
+    if (!expr)
+        return;
+
+    if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+    {
+        vars.insert(var->getName());
+    }
+    else if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        collectReadVariables(binary->getLHS(), vars);
+        collectReadVariables(binary->getRHS(), vars);
+    }
+    else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        collectReadVariables(unary->getOperand(), vars);
+    }
+    else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+    {
+        // The target itself is written, not read
+        if (!dynamic_cast<const VariableExprAST *>(assign->getLHS()))
+            collectReadVariables(assign->getLHS(), vars);
+        collectReadVariables(assign->getRHS(), vars);
+    }
+    else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+    {
+        for (const auto &arg : call->getArgs())
+            collectReadVariables(arg.get(), vars);
+    }
+    else if (const ArrayExprAST *array = dynamic_cast<const ArrayExprAST *>(expr))
+    {
+        collectReadVariables(array->getArray(), vars);
+        collectReadVariables(array->getIndex(), vars);
+    }
+    else if (const ScopeExprAST *scope = dynamic_cast<const ScopeExprAST *>(expr))
+    {
+        collectReadVariables(scope->getBase(), vars);
+    }
+}
+
+void collectWrittenVariables(const ExprAST *expr, std::set<std::string> &vars)
+{
+    if (!expr)
+        return;
+
+    if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+    {
+        if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(assign->getLHS()))
+            vars.insert(var->getName());
+        collectWrittenVariables(assign->getRHS(), vars);
+    }
+    else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        if (unary->getOp() == "++" || unary->getOp() == "--")
+        {
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(unary->getOperand()))
+                vars.insert(var->getName());
+        }
+        collectWrittenVariables(unary->getOperand(), vars);
+    }
+    else if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        collectWrittenVariables(binary->getLHS(), vars);
+        collectWrittenVariables(binary->getRHS(), vars);
+    }
+    else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+    {
+        for (const auto &arg : call->getArgs())
+            collectWrittenVariables(arg.get(), vars);
+    }
+}
+
+void collectWrittenVariables(StmtAST *stmt, std::set<std::string> &vars)
+{
+    if (!stmt)
+        return;
+
+    if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+    {
+        for (const auto &var : varDecl->getVars())
+            vars.insert(var.first);
+    }
+    else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+    {
+        for (auto &child : compound->getStatements())
+            collectWrittenVariables(child.get(), vars);
+        return;
+    }
+    else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+    {
+        collectWrittenVariables(ifStmt->getCondition(), vars);
+        collectWrittenVariables(ifStmt->getThenRef().get(), vars);
+        collectWrittenVariables(ifStmt->getElseRef().get(), vars);
+        return;
+    }
+    else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+    {
+        collectWrittenVariables(whileStmt->getCondition(), vars);
+        collectWrittenVariables(whileStmt->getBodyRef().get(), vars);
+        return;
+    }
+    else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+    {
+        collectWrittenVariables(forStmt->getInitRef().get(), vars);
+        collectWrittenVariables(forStmt->getCondition(), vars);
+        collectWrittenVariables(forStmt->getUpdate(), vars);
+        collectWrittenVariables(forStmt->getBodyRef().get(), vars);
+        return;
+    }
+    else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+    {
+        collectWrittenVariables(switchStmt->getValue(), vars);
+        for (auto &c : switchStmt->getCases())
+            collectWrittenVariables(c.Body.get(), vars);
+        return;
+    }
+
+    forEachExpression(stmt, [&](std::unique_ptr<ExprAST> &expr)
+                      { collectWrittenVariables(expr.get(), vars); });
+}
+
+void collectDeclarations(StmtAST *stmt, std::set<std::string> &names)
+{
+    if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+    {
+        for (const auto &var : varDecl->getVars())
+            names.insert(var.first);
+    }
+    else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+    {
+        for (auto &child : compound->getStatements())
+            collectDeclarations(child.get(), names);
+    }
+    else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+    {
+        collectDeclarations(ifStmt->getThenRef().get(), names);
+        collectDeclarations(ifStmt->getElseRef().get(), names);
+    }
+    else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+    {
+        collectDeclarations(whileStmt->getBodyRef().get(), names);
+    }
+    else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+    {
+        collectDeclarations(forStmt->getInitRef().get(), names);
+        collectDeclarations(forStmt->getBodyRef().get(), names);
+    }
+    else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+    {
+        for (auto &c : switchStmt->getCases())
+            collectDeclarations(c.Body.get(), names);
+    }
+}
+
+void declareTemporaries(std::vector<std::unique_ptr<StmtAST>> &stmts, const std::vector<std::string> &names)
+{
+    if (names.empty())
+        return;
+
+    // Declared up front so every use sees the same slot
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
+    for (const auto &name : names)
+        vars.emplace_back(name, nullptr);
+    stmts.insert(stmts.begin(), std::make_unique<VarDeclStmtAST>(DataType::LONG, std::move(vars)));
+}
+
+std::vector<std::vector<std::unique_ptr<StmtAST>> *> codeUnits(ProgramAST &program)
+{
+    std::vector<std::vector<std::unique_ptr<StmtAST>> *> units;
+    units.push_back(&program.getStatements());
+    for (auto &func : program.getFunctions())
+    {
+        std::unique_ptr<StmtAST> &body = func->getBodyRef();
+        if (!dynamic_cast<CompoundStmtAST *>(body.get()))
+        {
+            std::vector<std::unique_ptr<StmtAST>> stmts;
+            if (body)
+                stmts.push_back(std::move(body));
+            body = std::make_unique<CompoundStmtAST>(std::move(stmts));
+        }
+        units.push_back(&static_cast<CompoundStmtAST *>(body.get())->getStatements());
+    }
+    return units;
+}
+
+void forEachExpression(StmtAST *stmt, const std::function<void(std::unique_ptr<ExprAST> &)> &fn)
+{
+    if (!stmt)
+        return;
+
+    if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+    {
+        for (auto &var : varDecl->getVars())
+        {
+            if (var.second)
+                fn(var.second);
+        }
+    }
+    else if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+    {
+        fn(exprStmt->getExprRef());
+    }
+    else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+    {
+        for (auto &child : compound->getStatements())
+            forEachExpression(child.get(), fn);
+    }
+    else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+    {
+        fn(ifStmt->getConditionRef());
+        forEachExpression(ifStmt->getThenRef().get(), fn);
+        forEachExpression(ifStmt->getElseRef().get(), fn);
+    }
+    else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+    {
+        fn(whileStmt->getConditionRef());
+        forEachExpression(whileStmt->getBodyRef().get(), fn);
+    }
+    else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+    {
+        forEachExpression(forStmt->getInitRef().get(), fn);
+        if (forStmt->getConditionRef())
+            fn(forStmt->getConditionRef());
+        if (forStmt->getUpdateRef())
+            fn(forStmt->getUpdateRef());
+        forEachExpression(forStmt->getBodyRef().get(), fn);
+    }
+    else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+    {
+        fn(switchStmt->getValueRef());
+        for (auto &c : switchStmt->getCases())
+            forEachExpression(c.Body.get(), fn);
+    }
+    else if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt))
+    {
+        if (returnStmt->getValueRef())
+            fn(returnStmt->getValueRef());
+    }
+    else if (PrintStmtAST *printStmt = dynamic_cast<PrintStmtAST *>(stmt))
+    {
+        fn(printStmt->getValueRef());
+    }
+}
+
+bool isIncrementOf(const ExprAST *expr, const std::string &name, long long &step)
+{
+    const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr);
+    if (!assign)
+        return false;
+    const VariableExprAST *target = dynamic_cast<const VariableExprAST *>(assign->getLHS());
+    const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(assign->getRHS());
+    if (!target || target->getName() != name || !binary)
+        return false;
+
+    auto isVar = [&](const ExprAST *operand)
+    {
+        const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(operand);
+        return var && var->getName() == name;
+    };
+
+    if (binary->getOp() == "+")
+    {
+        if (isVar(binary->getLHS()) && evaluateConstant(binary->getRHS(), step))
+            return true;
+        if (isVar(binary->getRHS()) && evaluateConstant(binary->getLHS(), step))
+            return true;
+    }
+    else if (binary->getOp() == "-")
+    {
+        if (isVar(binary->getLHS()) && evaluateConstant(binary->getRHS(), step))
+        {
+            step = -step;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string mirrorComparison(const std::string &op)
+{
+    if (op == "<")
+        return ">";
+    if (op == ">")
+        return "<";
+    if (op == "<=")
+        return ">=";
+    if (op == ">=")
+        return "<=";
+    return op;
+}
+
+long long tripCount(long long start, const std::string &op, long long bound, long long step)
+{
+    if (op == "<")
+        return start < bound ? (bound - start + step - 1) / step : 0;
+    if (op == "<=")
+        return start <= bound ? (bound - start) / step + 1 : 0;
+    if (op == ">")
+        return start > bound ? (start - bound - step - 1) / -step : 0;
+    return start >= bound ? (start - bound) / -step + 1 : 0;
+}
+
+int countNodes(const StmtAST *stmt)
+{
+    if (!stmt)
+        return 0;
+
+    int count = 1;
+    if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+    {
+        for (const auto &child : compound->getStatements())
+            count += countNodes(child.get());
+    }
+    else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+    {
+        count += countNodes(ifStmt->getCondition()) + countNodes(ifStmt->getThen()) +
+                 countNodes(ifStmt->getElse());
+    }
+    else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+    {
+        count += countNodes(whileStmt->getCondition()) + countNodes(whileStmt->getBody());
+    }
+    else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+    {
+        count += countNodes(forStmt->getInit()) + countNodes(forStmt->getCondition()) +
+                 countNodes(forStmt->getUpdate()) + countNodes(forStmt->getBody());
+    }
+    else if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+    {
+        count += countNodes(switchStmt->getValue());
+        for (const auto &c : switchStmt->getCases())
+            count += countNodes(c.Body.get());
+    }
+    else if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+    {
+        for (const auto &var : varDecl->getVars())
+            count += countNodes(var.second.get());
+    }
+    else if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+    {
+        count += countNodes(exprStmt->getExpr());
+    }
+    else if (const ReturnStmtAST *returnStmt = dynamic_cast<const ReturnStmtAST *>(stmt))
+    {
+        count += countNodes(returnStmt->getValue());
+    }
+    else if (const PrintStmtAST *printStmt = dynamic_cast<const PrintStmtAST *>(stmt))
+    {
+        count += countNodes(printStmt->getValue());
+    }
+    return count;
+}
+
+int countNodes(const ExprAST *expr)
+{
+    if (!expr)
+        return 0;
+
+    int count = 1;
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        count += countNodes(binary->getLHS()) + countNodes(binary->getRHS());
+    else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        count += countNodes(unary->getOperand());
+    else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+        count += countNodes(assign->getLHS()) + countNodes(assign->getRHS());
+    else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+    {
+        for (const auto &arg : call->getArgs())
+            count += countNodes(arg.get());
+    }
+    return count;
+}
+
+std::unique_ptr<ExprAST> cloneExpr(const ExprAST *expr, const VariableMapper &map)
+{
+    if (!expr)
+        return nullptr;
+
+    if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+        return std::make_unique<NumberExprAST>(num->getValue());
+    if (const BoolExprAST *boolExpr = dynamic_cast<const BoolExprAST *>(expr))
+        return std::make_unique<BoolExprAST>(boolExpr->getValue());
+    if (const CharExprAST *charExpr = dynamic_cast<const CharExprAST *>(expr))
+        return std::make_unique<CharExprAST>(charExpr->getValue());
+
+    if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+    {
+        if (map)
+            return map(var->getName());
+        return std::make_unique<VariableExprAST>(var->getName());
+    }
+
+    if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+    {
+        std::unique_ptr<ExprAST> lhs = cloneExpr(binary->getLHS(), map);
+        std::unique_ptr<ExprAST> rhs = cloneExpr(binary->getRHS(), map);
+        if (!lhs || !rhs)
+            return nullptr;
+        return std::make_unique<BinaryExprAST>(binary->getOp(), std::move(lhs), std::move(rhs));
+    }
+
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        std::unique_ptr<ExprAST> operand = cloneExpr(unary->getOperand(), map);
+        if (!operand)
+            return nullptr;
+        return std::make_unique<UnaryExprAST>(unary->getOp(), std::move(operand));
+    }
+
+    if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+    {
+        // The target has to stay a variable
+        std::unique_ptr<ExprAST> target = cloneExpr(assign->getLHS(), map);
+        std::unique_ptr<ExprAST> rhs = cloneExpr(assign->getRHS(), map);
+        if (!dynamic_cast<VariableExprAST *>(target.get()) || !rhs)
+            return nullptr;
+        return std::make_unique<AssignmentExprAST>(std::move(target), std::move(rhs));
+    }
+
+    if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+    {
+        std::vector<std::unique_ptr<ExprAST>> args;
+        for (const auto &arg : call->getArgs())
+        {
+            std::unique_ptr<ExprAST> copy = cloneExpr(arg.get(), map);
+            if (!copy)
+                return nullptr;
+            args.push_back(std::move(copy));
+        }
+        return std::make_unique<CallExprAST>(call->getCallee(), std::move(args));
+    }
+
+    // Strings, arrays and scope expressions are not copied
+    return nullptr;
+}
+
+std::unique_ptr<StmtAST> cloneStmt(const StmtAST *stmt, const VariableMapper &map)
+{
+    if (!stmt)
+        return nullptr;
+
+    if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+    {
+        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
+        for (const auto &var : varDecl->getVars())
+        {
+            std::unique_ptr<ExprAST> init;
+            if (var.second && !(init = cloneExpr(var.second.get(), map)))
+                return nullptr;
+
+            std::string name = var.first;
+            if (map)
+            {
+                std::unique_ptr<ExprAST> mapped = map(name);
+                VariableExprAST *renamed = dynamic_cast<VariableExprAST *>(mapped.get());
+                if (!renamed)
+                    return nullptr;
+                name = renamed->getName();
+            }
+            vars.emplace_back(name, std::move(init));
+        }
+        return std::make_unique<VarDeclStmtAST>(varDecl->getVarType(), std::move(vars));
+    }
+
+    if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+    {
+        std::unique_ptr<ExprAST> expr = cloneExpr(exprStmt->getExpr(), map);
+        if (!expr)
+            return nullptr;
+        return std::make_unique<ExprStmtAST>(std::move(expr));
+    }
+
+    if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+    {
+        std::vector<std::unique_ptr<StmtAST>> stmts;
+        for (const auto &child : compound->getStatements())
+        {
+            std::unique_ptr<StmtAST> copy = cloneStmt(child.get(), map);
+            if (!copy)
+                return nullptr;
+            stmts.push_back(std::move(copy));
+        }
+        return std::make_unique<CompoundStmtAST>(std::move(stmts));
+    }
+
+    if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+    {
+        std::unique_ptr<ExprAST> condition = cloneExpr(ifStmt->getCondition(), map);
+        std::unique_ptr<StmtAST> thenStmt = cloneStmt(ifStmt->getThen(), map);
+        std::unique_ptr<StmtAST> elseStmt;
+        if (!condition || !thenStmt || (ifStmt->getElse() && !(elseStmt = cloneStmt(ifStmt->getElse(), map))))
+            return nullptr;
+        return std::make_unique<IfStmtAST>(std::move(condition), std::move(thenStmt), std::move(elseStmt));
+    }
+
+    if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+    {
+        std::unique_ptr<ExprAST> condition = cloneExpr(whileStmt->getCondition(), map);
+        std::unique_ptr<StmtAST> body = cloneStmt(whileStmt->getBody(), map);
+        if (!condition || !body)
+            return nullptr;
+        return std::make_unique<WhileStmtAST>(std::move(condition), std::move(body));
+    }
+
+    if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+    {
+        std::unique_ptr<StmtAST> init;
+        std::unique_ptr<ExprAST> condition, update;
+        if ((forStmt->getInit() && !(init = cloneStmt(forStmt->getInit(), map))) ||
+            (forStmt->getCondition() && !(condition = cloneExpr(forStmt->getCondition(), map))) ||
+            (forStmt->getUpdate() && !(update = cloneExpr(forStmt->getUpdate(), map))))
+            return nullptr;
+        std::unique_ptr<StmtAST> body = cloneStmt(forStmt->getBody(), map);
+        if (!body)
+            return nullptr;
+        auto copy = std::make_unique<ForStmtAST>(std::move(init), std::move(condition), std::move(update),
+                                                 std::move(body));
+        copy->setUnrollHint(forStmt->getUnrollHint());
+        return copy;
+    }
+
+    if (const ReturnStmtAST *returnStmt = dynamic_cast<const ReturnStmtAST *>(stmt))
+    {
+        std::unique_ptr<ExprAST> value;
+        if (returnStmt->getValue() && !(value = cloneExpr(returnStmt->getValue(), map)))
+            return nullptr;
+        return std::make_unique<ReturnStmtAST>(std::move(value));
+    }
+
+    // Switch statements are not copied: passes that copy code rewrite returns
+    // into breaks, and a break inside a switch only leaves the switch
+    if (dynamic_cast<const BreakStmtAST *>(stmt))
+        return std::make_unique<BreakStmtAST>();
+    if (dynamic_cast<const ContinueStmtAST *>(stmt))
+        return std::make_unique<ContinueStmtAST>();
+
+    if (const PrintStmtAST *printStmt = dynamic_cast<const PrintStmtAST *>(stmt))
+    {
+        std::unique_ptr<ExprAST> value = cloneExpr(printStmt->getValue(), map);
+        if (!value)
+            return nullptr;
+        return std::make_unique<PrintStmtAST>(std::move(value));
+    }
+
+    return nullptr;
+}
+
+namespace
+{
+    // Renames variables that are declared more than once so that every name
+    // refers to exactly one stack slot. The code generator binds names in
+    // program order with a flat symbol table, so a redeclaration shadows the
+    // previous slot for everything that follows it textually.
+    class NameResolver
+    {
+    public:
+        NameResolver(OptStats &stats) : Stats(stats) {}
+
+        void resolveList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                resolveStmt(stmt.get());
+        }
+
+        bool changed() const { return Changed; }
+
+        void declareParameter(const std::string &name) { declare(name); }
+        void resolveBody(StmtAST *body) { resolveStmt(body); }
+
+    private:
+        OptStats &Stats;
+        std::map<std::string, std::string> Current; // source name -> resolved name
+        std::set<std::string> Used;                 // every resolved name handed out
+        bool Changed = false;
+
+        std::string declare(const std::string &name)
+        {
+            std::string resolved = name;
+            if (Used.count(name))
+            {
+                std::string base = name.substr(0, name.find('.'));
+                int version = 1;
+                do
+                {
+                    resolved = base + "." + std::to_string(version++);
+                } while (Used.count(resolved));
+                Stats["names.renamed"]++;
+                Changed = true;
+            }
+            Used.insert(resolved);
+            Current[name] = resolved;
+            return resolved;
+        }
+
+        void rename(VariableExprAST *var)
+        {
+            auto it = Current.find(var->getName());
+            if (it != Current.end() && it->second != var->getName())
+                var->setName(it->second);
+        }
+
+        void resolveExpr(ExprAST *expr)
+        {
+            if (!expr)
+                return;
+
+            if (VariableExprAST *var = dynamic_cast<VariableExprAST *>(expr))
+            {
+                rename(var);
+            }
+            else if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr))
+            {
+                resolveExpr(binary->getLHSRef().get());
+                resolveExpr(binary->getRHSRef().get());
+            }
+            else if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr))
+            {
+                resolveExpr(unary->getOperandRef().get());
+            }
+            else if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr))
+            {
+                // The right-hand side is generated before the target is looked up
+                resolveExpr(assign->getRHSRef().get());
+                if (VariableExprAST *target = dynamic_cast<VariableExprAST *>(assign->getLHSRef().get()))
+                {
+                    if (Current.count(target->getName()))
+                        rename(target);
+                    else
+                        target->setName(declare(target->getName())); // Implicitly declared
+                }
+            }
+            else if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr))
+            {
+                for (auto &arg : call->getArgs())
+                    resolveExpr(arg.get());
+            }
+        }
+
+        void resolveStmt(StmtAST *stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+            {
+                for (auto &var : varDecl->getVars())
+                {
+                    // The slot is bound before its initializer is generated
+                    var.first = declare(var.first);
+                    resolveExpr(var.second.get());
+                }
+            }
+            else if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+            {
+                resolveExpr(exprStmt->getExprRef().get());
+            }
+            else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+            {
+                resolveList(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+            {
+                resolveExpr(ifStmt->getConditionRef().get());
+                resolveStmt(ifStmt->getThenRef().get());
+                resolveStmt(ifStmt->getElseRef().get());
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+            {
+                resolveExpr(whileStmt->getConditionRef().get());
+                resolveStmt(whileStmt->getBodyRef().get());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+            {
+                // Same order as ForStmtAST::codegen
+                resolveStmt(forStmt->getInitRef().get());
+                resolveExpr(forStmt->getConditionRef().get());
+                resolveStmt(forStmt->getBodyRef().get());
+                resolveExpr(forStmt->getUpdateRef().get());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+            {
+                resolveExpr(switchStmt->getValueRef().get());
+                for (auto &c : switchStmt->getCases())
+                    resolveStmt(c.Body.get());
+            }
+            else if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt))
+            {
+                resolveExpr(returnStmt->getValueRef().get());
+            }
+            else if (PrintStmtAST *printStmt = dynamic_cast<PrintStmtAST *>(stmt))
+            {
+                resolveExpr(printStmt->getValueRef().get());
+            }
+        }
+    };
+
+    // Replace constant subtrees of an expression with a single literal
+    bool foldExpression(std::unique_ptr<ExprAST> &expr, OptStats &stats)
+    {
+        if (!expr)
+            return false;
+
+        bool changed = false;
+        if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+        {
+            changed |= foldExpression(binary->getLHSRef(), stats);
+            changed |= foldExpression(binary->getRHSRef(), stats);
+        }
+        else if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+        {
+            changed |= foldExpression(unary->getOperandRef(), stats);
+        }
+        else if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+        {
+            changed |= foldExpression(assign->getRHSRef(), stats);
+            return changed;
+        }
+        else if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+        {
+            for (auto &arg : call->getArgs())
+                changed |= foldExpression(arg, stats);
+            return changed;
+        }
+        else
+        {
+            return false;
+        }
+
+        long long value;
+        if (evaluateConstant(expr.get(), value))
+        {
+            expr = std::make_unique<NumberExprAST>(static_cast<double>(value));
+            stats["constfold.folded"]++;
+            changed = true;
+        }
+        return changed;
+    }
+}
+
+bool resolveVariableNames(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    {
+        NameResolver resolver(stats);
+        resolver.resolveList(program.getStatements());
+        changed |= resolver.changed();
+    }
+    for (auto &func : program.getFunctions())
+    {
+        // Parameters are bound before the body runs
+        NameResolver resolver(stats);
+        for (const auto &arg : func->getProto()->getArgs())
+            resolver.declareParameter(arg.second);
+        resolver.resolveBody(func->getBodyRef().get());
+        changed |= resolver.changed();
+    }
+    return changed;
+}
+
+bool foldConstants(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        for (auto &stmt : *stmts)
+        {
+            forEachExpression(stmt.get(), [&](std::unique_ptr<ExprAST> &expr)
+                              { changed |= foldExpression(expr, stats); });
+        }
+    }
+    return changed;
+}
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <stdexcept>
 #include <map>
+#include <algorithm>
 
 using namespace std;
 
@@ -21,7 +22,7 @@ void Parser::initializePrecedence()
 {
     // Initialize operator precedence (higher number = higher precedence)
     BinOpPrecedence["||"] = 5;
-    BinOpPrecedence["&&"] = 10;
+    BinOpPrecedence["&&"] = 7;
     BinOpPrecedence["<"] = 10;
     BinOpPrecedence[">"] = 10;
     BinOpPrecedence["<="] = 10;
@@ -101,6 +102,12 @@ int Parser::getNextToken()
             CurrentToken = tok_true;
         else if (stripped_token == "false")
             CurrentToken = tok_false;
+        else if (stripped_token == "switch")
+            CurrentToken = tok_switch;
+        else if (stripped_token == "case")
+            CurrentToken = tok_case;
+        else if (stripped_token == "default")
+            CurrentToken = tok_default;
         else if (stripped_token == "int")
             CurrentToken = tok_int;
         else if (stripped_token == "float")
@@ -139,6 +146,11 @@ int Parser::getNextToken()
         NumVal = strtod(stripped_token.c_str(), nullptr);
         CurrentToken = tok_number;
     }
+    else if (token_str.rfind("PRAGMA:", 0) == 0)
+    {
+        PragmaStr = stripped_token;
+        CurrentToken = tok_pragma;
+    }
     else if (token_str.rfind("OPERATOR:", 0) == 0)
     {
         if (stripped_token == "=")
@@ -222,8 +234,33 @@ int Parser::getNextToken()
     }
     else if (token_str.rfind("CHAR_LITERAL:", 0) == 0)
     {
-        if (!stripped_token.empty())
-            CharVal = stripped_token[0];
+        // The lexer keeps the quotes: 'a', or an escape such as '\n'
+        string body = stripped_token;
+        if (body.size() >= 2 && body.front() == '\'' && body.back() == '\'')
+            body = body.substr(1, body.size() - 2);
+        if (body.size() == 2 && body[0] == '\\')
+        {
+            switch (body[1])
+            {
+            case 'n':
+                CharVal = '\n';
+                break;
+            case 't':
+                CharVal = '\t';
+                break;
+            case 'r':
+                CharVal = '\r';
+                break;
+            case '0':
+                CharVal = '\0';
+                break;
+            default:
+                CharVal = body[1];
+                break;
+            }
+        }
+        else if (!body.empty())
+            CharVal = body[0];
         CurrentToken = tok_char_literal;
     }
     else // Fallback for simple, untagged tokens (e.g. from early tests)
@@ -853,6 +890,121 @@ unique_ptr<StmtAST> Parser::ParseForStatement()
     return make_unique<ForStmtAST>(std::move(init), std::move(condition), std::move(update), std::move(body));
 }
 
+// Value of a case label: an integer or character constant, possibly negated
+static bool caseLabelValue(const ExprAST *expr, long long &value)
+{
+    if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+    {
+        double number = num->getValue();
+        if (number != static_cast<double>(static_cast<int>(number)))
+            return false;
+        value = static_cast<int>(number);
+        return true;
+    }
+    if (const CharExprAST *charExpr = dynamic_cast<const CharExprAST *>(expr))
+    {
+        value = charExpr->getValue();
+        return true;
+    }
+    if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+    {
+        if (unary->getOp() != "-" || !caseLabelValue(unary->getOperand(), value))
+            return false;
+        value = -value;
+        return true;
+    }
+    return false;
+}
+
+// Parse switch statement. Labels that follow each other directly enter the
+// same case; the statements after them, up to the next label, are its body.
+unique_ptr<StmtAST> Parser::ParseSwitchStatement()
+{
+    getNextToken(); // eat 'switch'
+    if (!expectToken(tok_left_paren))
+        return nullptr;
+    auto value = ParseExpression();
+    if (!value)
+        return nullptr;
+    if (!expectToken(tok_right_paren))
+        return nullptr;
+    if (!expectToken(tok_left_brace))
+        return nullptr;
+
+    vector<SwitchCase> cases;
+    vector<vector<unique_ptr<StmtAST>>> bodies;
+    vector<long long> labels;
+    while (CurrentToken != tok_right_brace && CurrentToken != tok_eof)
+    {
+        if (CurrentToken == tok_case || CurrentToken == tok_default)
+        {
+            // A label after statements starts the next case
+            if (cases.empty() || !bodies.back().empty())
+            {
+                cases.emplace_back();
+                bodies.emplace_back();
+            }
+
+            if (CurrentToken == tok_default)
+            {
+                getNextToken(); // eat 'default'
+                for (const auto &c : cases)
+                {
+                    if (c.IsDefault)
+                    {
+                        cerr << "Multiple default labels in switch" << endl;
+                        return nullptr;
+                    }
+                }
+                cases.back().IsDefault = true;
+            }
+            else
+            {
+                getNextToken(); // eat 'case'
+                auto label = ParseUnaryExpr();
+                long long number;
+                if (!label || !caseLabelValue(label.get(), number))
+                {
+                    cerr << "Case label must be an integer or character constant" << endl;
+                    return nullptr;
+                }
+                if (find(labels.begin(), labels.end(), number) != labels.end())
+                {
+                    cerr << "Duplicate case label " << number << endl;
+                    return nullptr;
+                }
+                labels.push_back(number);
+                cases.back().Values.push_back(number);
+            }
+            if (!expectToken(':'))
+                return nullptr;
+            continue;
+        }
+
+        if (cases.empty())
+        {
+            cerr << "Expected case or default in switch" << endl;
+            return nullptr;
+        }
+        auto stmt = ParseStatement();
+        if (stmt)
+            bodies.back().push_back(std::move(stmt));
+        else
+        {
+            // Error recovery: skip token and continue
+            cerr << "Skipping token due to error in switch statement." << endl;
+            getNextToken();
+        }
+    }
+
+    if (!expectToken(tok_right_brace))
+        return nullptr;
+
+    for (size_t i = 0; i < cases.size(); ++i)
+        cases[i].Body = make_unique<CompoundStmtAST>(std::move(bodies[i]));
+    return make_unique<SwitchStmtAST>(std::move(value), std::move(cases));
+}
+
 // Parse return statement
 unique_ptr<StmtAST> Parser::ParseReturnStatement()
 {
@@ -910,17 +1062,54 @@ unique_ptr<StmtAST> Parser::ParsePrintStatement()
     return make_unique<PrintStmtAST>(std::move(value));
 }
 
+// Parse a #pragma hint and the statement it applies to. Unknown hints are
+// ignored.
+unique_ptr<StmtAST> Parser::ParsePragmaStatement()
+{
+    string hint = PragmaStr;
+    getNextToken(); // eat the pragma
+
+    auto stmt = ParseStatement();
+    if (!stmt)
+        return nullptr;
+
+    // unroll: unroll completely, unroll(N): N copies of the body,
+    // nounroll or unroll(1): keep the loop as written
+    int count = 0;
+    if (hint == "unroll")
+        count = -1;
+    else if (hint == "nounroll")
+        count = 1;
+    else if (hint.rfind("unroll(", 0) == 0 && hint.back() == ')')
+        count = std::max(1, atoi(hint.c_str() + 7));
+    else
+        return stmt;
+
+    ForStmtAST *loop = dynamic_cast<ForStmtAST *>(stmt.get());
+    if (!loop)
+    {
+        cerr << "Warning: #pragma " << hint << " ignored, it must come right before a for loop" << endl;
+        return stmt;
+    }
+    loop->setUnrollHint(count);
+    return stmt;
+}
+
 // Parse statement
 unique_ptr<StmtAST> Parser::ParseStatement()
 {
     switch (CurrentToken)
     {
+    case tok_pragma:
+        return ParsePragmaStatement();
     case tok_if:
         return ParseIfStatement();
     case tok_while:
         return ParseWhileStatement();
     case tok_for:
         return ParseForStatement();
+    case tok_switch:
+        return ParseSwitchStatement();
     case tok_return:
         return ParseReturnStatement();
     case tok_break:
@@ -1011,8 +1200,8 @@ unique_ptr<FunctionAST> Parser::ParseKaleidoscopeFunction()
     if (!bodyExpr)
         return nullptr;
 
-    // Wrap the expression in an ExprStmtAST
-    auto body = make_unique<ExprStmtAST>(std::move(bodyExpr));
+    // The function returns the value of its body expression
+    auto body = make_unique<ReturnStmtAST>(std::move(bodyExpr));
 
     return make_unique<FunctionAST>(std::move(proto), std::move(body));
 }
@@ -1155,8 +1344,8 @@ unique_ptr<ProgramAST> Parser::ParseProgram()
             }
         }
         else if (CurrentToken == tok_if || CurrentToken == tok_while || CurrentToken == tok_for ||
-                 CurrentToken == tok_return || CurrentToken == tok_break || CurrentToken == tok_continue ||
-                 CurrentToken == tok_left_brace)
+                 CurrentToken == tok_switch || CurrentToken == tok_return || CurrentToken == tok_break || CurrentToken == tok_continue ||
+                 CurrentToken == tok_left_brace || CurrentToken == tok_pragma)
         {
             // Handle control flow statements and compound statements
             auto stmt = ParseStatement();
@@ -0,0 +1,274 @@
+#include "Peephole.h"
+#include "RegisterAllocator.h"
+
+namespace
+{
+    using Instrs = std::vector<MachineInstr>;
+    using Window = std::vector<size_t>;
+
+    // Opcodes that neither read nor write the flags
+    bool flagsNeutral(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case Opcode::Mov:
+        case Opcode::Movsxd:
+        case Opcode::Movzx:
+        case Opcode::Lea:
+        case Opcode::Push:
+        case Opcode::Pop:
+        case Opcode::Cqo:
+        case Opcode::Xchg:
+        case Opcode::Not:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // True if the flags are overwritten before anything can read them.
+    // Calls and the end of a function leave them dead; leaving the block
+    // might read them in the next one. inc and dec keep the carry flag, so
+    // they do not count as overwriting.
+    bool flagsDeadAfter(const Instrs &instrs, size_t index)
+    {
+        for (size_t i = index + 1; i < instrs.size(); ++i)
+        {
+            const MachineInstr &instr = instrs[i];
+            if (instr.opcode == Opcode::Comment)
+                continue;
+            if (instr.readsFlags())
+                return false;
+            if (instr.opcode == Opcode::Call || instr.opcode == Opcode::Ret || instr.opcode == Opcode::Syscall ||
+                (instr.writesFlags() && instr.opcode != Opcode::Inc && instr.opcode != Opcode::Dec))
+                return true;
+            if (!flagsNeutral(instr.opcode))
+                return false;
+        }
+        return false;
+    }
+
+    bool isFullRegister(const MachineOperand &operand)
+    {
+        static const char *const names[] = {"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rsp", "rbp",
+                                            "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+        for (const char *name : names)
+        {
+            if (operand.isReg(name))
+                return true;
+        }
+        return false;
+    }
+
+    void replace(Instrs &instrs, size_t index, Opcode opcode, std::vector<MachineOperand> operands)
+    {
+        instrs[index] = MachineInstr(opcode, std::move(operands), instrs[index].comment);
+    }
+
+    // push X / pop Y
+    bool foldPushPop(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &push = instrs[window[0]], &pop = instrs[window[1]];
+        if (!push.is(Opcode::Push, 1) || !pop.is(Opcode::Pop, 1))
+            return false;
+        MachineOperand source = push.operands[0], dest = pop.operands[0];
+        if (source != dest)
+        {
+            if (!dest.isReg())
+                return false;
+            replace(instrs, window[1], Opcode::Mov, {dest, source});
+        }
+        else
+        {
+            instrs.erase(instrs.begin() + window[1]);
+        }
+        instrs.erase(instrs.begin() + window[0]);
+        return true;
+    }
+
+    // push X / mov A, B / pop Y with a move that leaves X and the stack
+    // alone, as in argument setup
+    bool foldPushMovePop(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &push = instrs[window[0]], &move = instrs[window[1]], &pop = instrs[window[2]];
+        if (!push.is(Opcode::Push, 1) || !move.is(Opcode::Mov, 2) || !pop.is(Opcode::Pop, 1))
+            return false;
+        MachineOperand source = push.operands[0], dest = pop.operands[0];
+        long long value;
+        if (!(isFullRegister(source) || source.getImm(value)) || !dest.isReg() || !isFullRegister(move.operands[0]) ||
+            move.operands[0] == source || source.uses("rsp") || move.operands[1].uses("rsp"))
+            return false;
+        replace(instrs, window[2], Opcode::Mov, {dest, source});
+        instrs.erase(instrs.begin() + window[0]);
+        return true;
+    }
+
+    // A load right after a store to the same slot takes the stored value
+    bool forwardStore(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &store = instrs[window[0]], &load = instrs[window[1]];
+        if (!store.is(Opcode::Mov, 2) || !store.operands[0].isMem() || load.operands.size() != 2 ||
+            load.operands[1] != store.operands[0] || !load.operands[0].isReg())
+            return false;
+        MachineOperand value = store.operands[1], dest = load.operands[0];
+
+        if (load.opcode == Opcode::Mov && store.operands[0].size == 8)
+        {
+            if (value == dest)
+                instrs.erase(instrs.begin() + window[1]);
+            else
+                replace(instrs, window[1], Opcode::Mov, {dest, value});
+            return true;
+        }
+        if (load.opcode == Opcode::Movsxd && store.operands[0].size == 4)
+        {
+            replace(instrs, window[1], value.isImm() ? Opcode::Mov : Opcode::Movsxd, {dest, value});
+            return true;
+        }
+        return false;
+    }
+
+    // mov reg, 0 -> xor reg32, reg32, which is shorter but sets the flags
+    bool useZeroIdiom(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &move = instrs[window[0]];
+        if (!move.is(Opcode::Mov, 2) || !move.operands[1].isImm(0) || !isFullRegister(move.operands[0]) ||
+            !flagsDeadAfter(instrs, window[0]))
+            return false;
+        MachineOperand reg32 = MachineOperand::reg(register32(move.operands[0].text));
+        replace(instrs, window[0], Opcode::Xor, {reg32, reg32});
+        return true;
+    }
+
+    bool dropSelfMove(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &move = instrs[window[0]];
+        if (!move.is(Opcode::Mov, 2) || move.operands[0] != move.operands[1] || !isFullRegister(move.operands[0]))
+            return false;
+        instrs.erase(instrs.begin() + window[0]);
+        return true;
+    }
+
+    // mov reg, X / mov reg, Y: the first value is never read
+    bool dropOverwrittenMove(Instrs &instrs, const Window &window)
+    {
+        const MachineInstr &first = instrs[window[0]], &second = instrs[window[1]];
+        if (!first.is(Opcode::Mov, 2) || !second.is(Opcode::Mov, 2) || !isFullRegister(first.operands[0]) ||
+            second.operands[0] != first.operands[0] || second.operands[1].uses(first.operands[0].text))
+            return false;
+        instrs.erase(instrs.begin() + window[0]);
+        return true;
+    }
+
+    struct Rule
+    {
+        const char *name;
+        size_t width; // instructions in the window
+        bool (*apply)(Instrs &, const Window &);
+    };
+
+    const Rule rules[] = {
+        {"push_pop", 2, foldPushPop},
+        {"push_move_pop", 3, foldPushMovePop},
+        {"store_reload", 2, forwardStore},
+        {"self_move", 1, dropSelfMove},
+        {"overwritten_move", 2, dropOverwrittenMove},
+        {"zero_idiom", 1, useZeroIdiom},
+    };
+
+    // The next width instructions from index, skipping comments
+    bool collectWindow(const Instrs &instrs, size_t index, size_t width, Window &window)
+    {
+        window.clear();
+        for (size_t i = index; i < instrs.size() && window.size() < width; ++i)
+        {
+            if (instrs[i].opcode != Opcode::Comment)
+                window.push_back(i);
+        }
+        return window.size() == width;
+    }
+}
+
+bool PeepholeOptimizer::runOnBlock(MachineBasicBlock &block)
+{
+    bool changed = false;
+    for (size_t i = 0; i < block.instrs.size(); ++i)
+    {
+        if (block.instrs[i].opcode == Opcode::Comment)
+            continue;
+        for (const Rule &rule : rules)
+        {
+            Window window;
+            if (collectWindow(block.instrs, i, rule.width, window) && rule.apply(block.instrs, window))
+            {
+                Stats[std::string("peephole.") + rule.name]++;
+                changed = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// jmp to a label that follows directly
+bool PeepholeOptimizer::dropJumpsToNext(MachineFunction &function)
+{
+    bool changed = false;
+    for (size_t b = 0; b < function.blocks.size(); ++b)
+    {
+        auto &instrs = function.blocks[b].instrs;
+        const MachineInstr *last = function.blocks[b].last();
+        if (!last || !last->is(Opcode::Jmp, 1) || last->operands[0].kind != MachineOperand::Label)
+            continue; // an indirect jmp has no label to compare
+        for (size_t next = b + 1; next < function.blocks.size(); ++next)
+        {
+            if (function.blocks[next].label == last->operands[0].text)
+            {
+                instrs.erase(instrs.begin() + (last - instrs.data()));
+                Stats["peephole.jump_to_next"]++;
+                changed = true;
+                break;
+            }
+            if (function.blocks[next].last())
+                break;
+        }
+    }
+    return changed;
+}
+
+// Nothing falls through a jmp or ret; only a label makes code reachable
+bool PeepholeOptimizer::dropUnreachable(MachineFunction &function)
+{
+    bool changed = false;
+    bool fallsThrough = true;
+    for (auto &block : function.blocks)
+    {
+        if (block.label.empty() && !fallsThrough)
+        {
+            for (size_t i = block.instrs.size(); i-- > 0;)
+            {
+                if (block.instrs[i].opcode == Opcode::Comment)
+                    continue;
+                block.instrs.erase(block.instrs.begin() + i);
+                Stats["peephole.unreachable"]++;
+                changed = true;
+            }
+            continue;
+        }
+        const MachineInstr *last = block.last();
+        fallsThrough = !last || (last->opcode != Opcode::Jmp && last->opcode != Opcode::Ret);
+    }
+    return changed;
+}
+
+void PeepholeOptimizer::run(MachineFunction &function)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = dropUnreachable(function);
+        changed |= dropJumpsToNext(function);
+        for (auto &block : function.blocks)
+            changed |= runOnBlock(block);
+    }
+}
@@ -0,0 +1,451 @@
+#include "RegisterAllocator.h"
+#include <algorithm>
+#include <set>
+
+namespace
+{
+    // Preference order: registers that need no saving come first, and
+    // r10/r11 before the argument registers a call overwrites
+    const char *const callerSaved[] = {"r10", "r11", "rsi", "rdi", "r8", "r9"};
+    const char *const calleeSaved[] = {"rbx", "r12", "r13", "r14", "r15"};
+
+    // Positions that destroy some registers
+    struct ClobberPoint
+    {
+        int position;
+        bool call; // all caller-saved registers; otherwise only rdi
+    };
+
+    // Numbers a code unit in evaluation order and records where each
+    // variable occurs
+    class IntervalBuilder
+    {
+    public:
+        explicit IntervalBuilder(const std::string &function) : Function(function) {}
+
+        std::map<std::string, std::vector<int>> Occurrences;
+        std::map<std::string, int> Widths; // slot width of declared variables
+        std::vector<std::pair<int, int>> Loops;
+        std::vector<ClobberPoint> Clobbers;
+        std::unordered_map<const ExprAST *, std::pair<int, int>> ExprRanges;
+        bool LoopsToEntry = false;
+        int Position = 0;
+
+        void occur(const std::string &name, int position) { Occurrences[name].push_back(position); }
+
+        static bool isLeaf(const ExprAST *expr)
+        {
+            return dynamic_cast<const VariableExprAST *>(expr) || dynamic_cast<const NumberExprAST *>(expr) ||
+                   dynamic_cast<const BoolExprAST *>(expr) || dynamic_cast<const CharExprAST *>(expr);
+        }
+
+        // Record every variable expr reads as occurring again at position
+        void occurAgain(const ExprAST *expr, int position)
+        {
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                occur(var->getName(), position);
+            }
+            else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+            {
+                occurAgain(assign->getLHS(), position);
+                occurAgain(assign->getRHS(), position);
+            }
+            else if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                occurAgain(binary->getLHS(), position);
+                occurAgain(binary->getRHS(), position);
+            }
+            else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                occurAgain(unary->getOperand(), position);
+            }
+            else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+            {
+                for (const auto &arg : call->getArgs())
+                    occurAgain(arg.get(), position);
+            }
+            else if (const ScopeExprAST *scope = dynamic_cast<const ScopeExprAST *>(expr))
+            {
+                occurAgain(scope->getBase(), position);
+            }
+        }
+
+        void visit(const ExprAST *expr)
+        {
+            if (!expr)
+                return;
+            int start = Position + 1;
+
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                occur(var->getName(), ++Position);
+            }
+            else if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+            {
+                visit(assign->getRHS());
+                if (const VariableExprAST *target = dynamic_cast<const VariableExprAST *>(assign->getLHS()))
+                    occur(target->getName(), ++Position);
+                else
+                    visit(assign->getLHS());
+            }
+            else if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                visit(binary->getLHS());
+                visit(binary->getRHS());
+                ++Position;
+                // Unless the right operand is a leaf, the left one may be
+                // read after it (in place, or evaluated second), so whatever
+                // it reads stays live until the operator. && and || never
+                // reorder.
+                if (binary->getOp() != "&&" && binary->getOp() != "||" && !isLeaf(binary->getRHS()))
+                    occurAgain(binary->getLHS(), Position);
+            }
+            else if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                visit(unary->getOperand());
+                ++Position;
+            }
+            else if (const CallExprAST *call = dynamic_cast<const CallExprAST *>(expr))
+            {
+                for (const auto &arg : call->getArgs())
+                    visit(arg.get());
+                Clobbers.push_back({++Position, true});
+            }
+            else if (const ScopeExprAST *scope = dynamic_cast<const ScopeExprAST *>(expr))
+            {
+                visit(scope->getBase());
+                ++Position;
+            }
+            else
+            {
+                ++Position;
+            }
+
+            ExprRanges[expr] = {start, Position};
+        }
+
+        void visit(const StmtAST *stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+            {
+                visit(exprStmt->getExpr());
+            }
+            else if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+            {
+                for (const auto &var : varDecl->getVars())
+                {
+                    visit(var.second.get());
+                    occur(var.first, ++Position);
+                    int &width = Widths[var.first];
+                    width = std::max(width, slotWidth(getTypeSize(varDecl->getVarType())));
+                }
+            }
+            else if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            {
+                for (const auto &child : compound->getStatements())
+                    visit(child.get());
+            }
+            else if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            {
+                visit(ifStmt->getCondition());
+                visit(ifStmt->getThen());
+                visit(ifStmt->getElse());
+            }
+            else if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+            {
+                // The dispatch only jumps forward
+                visit(switchStmt->getValue());
+                for (const auto &c : switchStmt->getCases())
+                    visit(c.Body.get());
+            }
+            else if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+            {
+                int start = ++Position;
+                visit(whileStmt->getCondition());
+                visit(whileStmt->getBody());
+                Loops.push_back({start, ++Position});
+            }
+            else if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+            {
+                visit(forStmt->getInit());
+                int start = ++Position;
+                visit(forStmt->getCondition());
+                visit(forStmt->getBody());
+                visit(forStmt->getUpdate());
+                Loops.push_back({start, ++Position});
+            }
+            else if (const ReturnStmtAST *ret = dynamic_cast<const ReturnStmtAST *>(stmt))
+            {
+                // A returned call does not come back here: it either
+                // restarts this function or leaves the frame
+                const CallExprAST *call = dynamic_cast<const CallExprAST *>(ret->getValue());
+                if (call && !Function.empty())
+                {
+                    for (const auto &arg : call->getArgs())
+                        visit(arg.get());
+                    ExprRanges[call] = {Position, Position};
+                    if (call->getCallee() == Function)
+                        LoopsToEntry = true;
+                }
+                else
+                {
+                    visit(ret->getValue());
+                }
+            }
+            else if (const PrintStmtAST *print = dynamic_cast<const PrintStmtAST *>(stmt))
+            {
+                visit(print->getValue());
+                Clobbers.push_back({++Position, false});
+            }
+        }
+
+    private:
+        std::string Function;
+    };
+
+    bool contains(const std::vector<std::string> &regs, const std::string &reg)
+    {
+        return std::find(regs.begin(), regs.end(), reg) != regs.end();
+    }
+}
+
+bool RegisterAllocator::isCalleeSaved(const std::string &reg)
+{
+    for (const char *saved : calleeSaved)
+    {
+        if (reg == saved)
+            return true;
+    }
+    return false;
+}
+
+int slotWidth(int size)
+{
+    return size > 4 ? 8 : 4;
+}
+
+std::string register32(const std::string &reg)
+{
+    if (reg[1] >= '0' && reg[1] <= '9')
+        return reg + "d";
+    return "e" + reg.substr(1);
+}
+
+void RegisterAllocator::run(const std::vector<const StmtAST *> &stmts, const std::vector<std::string> &params,
+                            const std::string &function)
+{
+    Intervals.clear();
+    Homes.clear();
+    Slots.clear();
+    FrameBytes = 0;
+
+    IntervalBuilder builder(function);
+    for (const auto &param : params)
+        builder.occur(param, 0);
+    for (const StmtAST *stmt : stmts)
+        builder.visit(stmt);
+    ExprRanges = std::move(builder.ExprRanges);
+    int unitEnd = builder.Position + 1;
+
+    for (const auto &entry : builder.Occurrences)
+    {
+        const std::vector<int> &positions = entry.second;
+        LiveInterval interval{entry.first, *std::min_element(positions.begin(), positions.end()),
+                              *std::max_element(positions.begin(), positions.end()), ""};
+
+        // A value used in a loop may be needed again on the next iteration
+        for (const auto &loop : builder.Loops)
+        {
+            bool inLoop = std::any_of(positions.begin(), positions.end(), [&](int position)
+                                      { return position >= loop.first && position <= loop.second; });
+            if (inLoop)
+            {
+                interval.start = std::min(interval.start, loop.first);
+                interval.end = std::max(interval.end, loop.second);
+            }
+        }
+        if (builder.LoopsToEntry)
+        {
+            interval.start = 0;
+            interval.end = unitEnd;
+        }
+        Intervals.push_back(interval);
+    }
+    std::sort(Intervals.begin(), Intervals.end(), [](const LiveInterval &a, const LiveInterval &b)
+              { return a.start != b.start ? a.start < b.start : a.name < b.name; });
+
+    // Linear scan: walk the intervals by start, freeing the registers of
+    // intervals that have ended. Under pressure the interval that ends last
+    // is spilled, which keeps the most registers free for the rest.
+    std::vector<LiveInterval *> active;
+    for (auto &interval : Intervals)
+    {
+        active.erase(std::remove_if(active.begin(), active.end(), [&](const LiveInterval *other)
+                                    { return other->end < interval.start; }),
+                     active.end());
+
+        bool crossesCall = false, crossesPrint = false;
+        for (const auto &clobber : builder.Clobbers)
+        {
+            if (clobber.position > interval.start && clobber.position < interval.end)
+                (clobber.call ? crossesCall : crossesPrint) = true;
+        }
+
+        std::vector<std::string> allowed;
+        if (!crossesCall)
+        {
+            for (const char *reg : callerSaved)
+            {
+                if (!(crossesPrint && std::string(reg) == "rdi"))
+                    allowed.push_back(reg);
+            }
+        }
+        for (const char *reg : calleeSaved)
+            allowed.push_back(reg);
+
+        std::set<std::string> taken;
+        for (const LiveInterval *other : active)
+            taken.insert(other->reg);
+        for (const auto &reg : allowed)
+        {
+            if (!taken.count(reg))
+            {
+                interval.reg = reg;
+                break;
+            }
+        }
+
+        if (interval.reg.empty())
+        {
+            LiveInterval *victim = nullptr;
+            for (LiveInterval *other : active)
+            {
+                if (contains(allowed, other->reg) && (!victim || other->end > victim->end))
+                    victim = other;
+            }
+            if (!victim || victim->end <= interval.end)
+                continue;
+            interval.reg = victim->reg;
+            victim->reg.clear();
+            active.erase(std::find(active.begin(), active.end(), victim));
+        }
+        active.push_back(&interval);
+    }
+
+    for (const auto &interval : Intervals)
+    {
+        if (!interval.reg.empty())
+            Homes[interval.name] = interval.reg;
+    }
+    assignStackSlots(builder.Widths);
+}
+
+void RegisterAllocator::assignStackSlots(const std::map<std::string, int> &widths)
+{
+    struct Slot
+    {
+        int offset;
+        int width;
+        int busyUntil; // end of the interval of the last variable in the slot
+    };
+    std::vector<Slot> slots;
+
+    // Intervals are sorted by start, so a slot whose owner ended before
+    // this interval starts is free for it
+    for (const auto &interval : Intervals)
+    {
+        if (!interval.reg.empty())
+            continue;
+        auto declared = widths.find(interval.name);
+        int width = declared == widths.end() ? 8 : declared->second;
+
+        Slot *free = nullptr;
+        for (auto &slot : slots)
+        {
+            if (slot.width == width && slot.busyUntil < interval.start)
+            {
+                free = &slot;
+                break;
+            }
+        }
+        if (!free)
+        {
+            FrameBytes = (FrameBytes + width + width - 1) / width * width;
+            slots.push_back({FrameBytes, width, interval.end});
+            free = &slots.back();
+        }
+        free->busyUntil = interval.end;
+        Slots[interval.name] = {free->offset, width};
+    }
+}
+
+int RegisterAllocator::stackSlotOf(const std::string &name) const
+{
+    auto slot = Slots.find(name);
+    return slot == Slots.end() ? 0 : slot->second.first;
+}
+
+int RegisterAllocator::slotWidthOf(const std::string &name) const
+{
+    auto slot = Slots.find(name);
+    return slot == Slots.end() ? 0 : slot->second.second;
+}
+
+const std::string *RegisterAllocator::registerOf(const std::string &name) const
+{
+    auto home = Homes.find(name);
+    return home == Homes.end() ? nullptr : &home->second;
+}
+
+std::vector<std::string> RegisterAllocator::calleeSavedUsed() const
+{
+    std::vector<std::string> used;
+    for (const char *reg : calleeSaved)
+    {
+        for (const auto &home : Homes)
+        {
+            if (home.second == reg)
+            {
+                used.push_back(reg);
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+std::vector<std::string> RegisterAllocator::freeDuring(const ExprAST *expr, bool acrossCalls) const
+{
+    std::vector<std::string> free;
+    auto range = ExprRanges.find(expr);
+    if (range == ExprRanges.end())
+        return free;
+
+    std::set<std::string> busy;
+    for (const auto &interval : Intervals)
+    {
+        if (!interval.reg.empty() && interval.start <= range->second.second && interval.end >= range->second.first)
+            busy.insert(interval.reg);
+    }
+
+    // Callee-saved registers are only free if the prologue saves them anyway
+    std::vector<std::string> saved = calleeSavedUsed();
+    if (!acrossCalls)
+    {
+        for (const char *reg : callerSaved)
+        {
+            if (!busy.count(reg))
+                free.push_back(reg);
+        }
+    }
+    for (const auto &reg : saved)
+    {
+        if (!busy.count(reg))
+            free.push_back(reg);
+    }
+    return free;
+}
@@ -0,0 +1,1143 @@
+#include "Optimizer.h"
+#include <algorithm>
+#include <climits>
+
+// Scalar evolution and closed-form loop elimination.
+//
+// The values of a loop's variables are described as add-recurrences over
+// the iteration number k. A variable whose only change per iteration is
+// x = x + g, where g is loop-invariant or itself a recurrence, has the value
+//
+//   x(k) = x0 + g0*k + g1*k(k-1)/2        for g(k) = g0 + g1*k
+//
+// at the top of iteration k. Keeping the coefficients in this binomial form
+// makes the step of a recurrence its coefficients shifted by one place.
+// The loop counter is a recurrence with a constant step that the condition
+// compares against an invariant bound, which gives the trip count n.
+//
+// A loop whose body is nothing but stores to int variables and the
+// optimizer's 64-bit (long) temporaries has no effect besides their final
+// values, so it is replaced by
+//
+//   init; if (cond) { .scevN = n; x = x(n); ... }
+//
+// A variable that is overwritten every iteration gets the value stored in
+// the last one. When the counter starts at a known constant and the bound
+// is constant, the trip count is a literal, the guard goes away and the
+// folder finishes the job.
+//
+// Loops whose inputs are all known constants where they start are instead
+// run at compile time, with the code generator's semantics, and replaced by
+// stores of the final values. That also covers loops with conditional
+// updates and nested loops. Constants are only tracked along straight-line
+// code.
+//
+// The formulas are exact modulo 2^64 and int variables truncate every store
+// to 32 bits, so a closed form stores the same bits the loop would. Trip
+// counts are only derived when the counter cannot wrap around.
+
+namespace
+{
+    // Iterations compile-time evaluation may run per loop nest
+    const long long MaxEvaluatedIterations = 100000;
+
+    // Highest power of k a closed form may contain
+    const size_t MaxDegree = 2;
+
+    using TypeMap = std::map<std::string, DataType>;
+    using ValueMap = std::map<std::string, long long>;
+
+    // Coefficients of c0 + c1*k + c2*k(k-1)/2, all loop-invariant
+    using Recurrence = std::vector<std::unique_ptr<ExprAST>>;
+
+    bool fitsInInt(long long value)
+    {
+        return value >= INT_MIN && value <= INT_MAX;
+    }
+
+    bool isScalarType(DataType type)
+    {
+        return type == DataType::INT || type == DataType::LONG;
+    }
+
+    // The value a slot holds after a store: int slots keep the low 32 bits
+    long long storedValue(DataType type, long long value)
+    {
+        if (type == DataType::LONG)
+            return value;
+        return static_cast<int>(static_cast<unsigned int>(value));
+    }
+
+    void addType(TypeMap &types, const std::string &name, DataType type)
+    {
+        auto found = types.find(name);
+        if (found == types.end())
+            types[name] = type;
+        else if (found->second != type)
+            found->second = DataType::UNKNOWN;
+    }
+
+    void collectTypes(StmtAST *stmt, TypeMap &types)
+    {
+        if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+        {
+            for (const auto &var : varDecl->getVars())
+                addType(types, var.first, varDecl->getVarType());
+        }
+        else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+        {
+            for (auto &child : compound->getStatements())
+                collectTypes(child.get(), types);
+        }
+        else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+        {
+            collectTypes(ifStmt->getThenRef().get(), types);
+            collectTypes(ifStmt->getElseRef().get(), types);
+        }
+        else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+        {
+            collectTypes(whileStmt->getBodyRef().get(), types);
+        }
+        else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+        {
+            collectTypes(forStmt->getInitRef().get(), types);
+            collectTypes(forStmt->getBodyRef().get(), types);
+        }
+        else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+        {
+            for (auto &c : switchStmt->getCases())
+                collectTypes(c.Body.get(), types);
+        }
+    }
+
+    // Evaluate an expression on known variable values the way the generated
+    // code does: 64-bit wrapping arithmetic, comparisons give 0 or 1. Fails
+    // on unknown variables, on traps and on anything with side effects.
+    bool evaluate(const ExprAST *expr, const ValueMap &values, long long &value)
+    {
+        if (dynamic_cast<const NumberExprAST *>(expr) || dynamic_cast<const BoolExprAST *>(expr) ||
+            dynamic_cast<const CharExprAST *>(expr))
+            return evaluateConstant(expr, value);
+
+        if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+        {
+            auto found = values.find(var->getName());
+            if (found == values.end())
+                return false;
+            value = found->second;
+            return true;
+        }
+
+        if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+        {
+            long long operand;
+            if (!evaluate(unary->getOperand(), values, operand))
+                return false;
+
+            const std::string &op = unary->getOp();
+            if (op == "-")
+                value = static_cast<long long>(0ULL - static_cast<unsigned long long>(operand));
+            else if (op == "!")
+                value = operand == 0 ? 1 : 0;
+            else if (op == "~")
+                value = ~operand;
+            else
+                return false;
+            return true;
+        }
+
+        if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+        {
+            long long lhs, rhs;
+            if (binary->getOp() == "&&" || binary->getOp() == "||")
+            {
+                // The right operand only runs if the left one does not decide
+                if (!evaluate(binary->getLHS(), values, lhs))
+                    return false;
+                if ((lhs != 0) != (binary->getOp() == "&&"))
+                {
+                    value = lhs != 0;
+                    return true;
+                }
+                if (!evaluate(binary->getRHS(), values, rhs))
+                    return false;
+                value = rhs != 0;
+                return true;
+            }
+
+            if (!evaluate(binary->getLHS(), values, lhs) || !evaluate(binary->getRHS(), values, rhs))
+                return false;
+
+            unsigned long long a = static_cast<unsigned long long>(lhs);
+            unsigned long long b = static_cast<unsigned long long>(rhs);
+            const std::string &op = binary->getOp();
+            if (op == "+")
+                value = static_cast<long long>(a + b);
+            else if (op == "-")
+                value = static_cast<long long>(a - b);
+            else if (op == "*")
+                value = static_cast<long long>(a * b);
+            else if (op == "/" || op == "%")
+            {
+                // idiv traps on both of these
+                if (rhs == 0 || (lhs == LLONG_MIN && rhs == -1))
+                    return false;
+                value = op == "/" ? lhs / rhs : lhs % rhs;
+            }
+            else if (op == "==")
+                value = lhs == rhs;
+            else if (op == "!=")
+                value = lhs != rhs;
+            else if (op == "<")
+                value = lhs < rhs;
+            else if (op == ">")
+                value = lhs > rhs;
+            else if (op == "<=")
+                value = lhs <= rhs;
+            else if (op == ">=")
+                value = lhs >= rhs;
+            else
+                return false;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Update the known values for a statement that is not a loop
+    void trackStores(StmtAST *stmt, const TypeMap &types, ValueMap &known)
+    {
+        if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+        {
+            for (const auto &var : varDecl->getVars())
+            {
+                long long value;
+                if (isScalarType(varDecl->getVarType()) && var.second && evaluate(var.second.get(), known, value))
+                    known[var.first] = storedValue(varDecl->getVarType(), value);
+                else
+                    known.erase(var.first);
+            }
+            return;
+        }
+
+        if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+        {
+            const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(exprStmt->getExpr());
+            const VariableExprAST *target = assign ? dynamic_cast<const VariableExprAST *>(assign->getLHS()) : nullptr;
+            auto type = target ? types.find(target->getName()) : types.end();
+            long long value;
+            if (type != types.end() && isScalarType(type->second) && evaluate(assign->getRHS(), known, value))
+            {
+                known[target->getName()] = storedValue(type->second, value);
+                return;
+            }
+        }
+
+        std::set<std::string> written;
+        collectWrittenVariables(stmt, written);
+        for (const auto &name : written)
+            known.erase(name);
+    }
+
+    // Runs a loop nest at compile time on known values
+    class LoopEvaluator
+    {
+    public:
+        LoopEvaluator(const TypeMap &types, ValueMap &values) : Types(types), Values(values) {}
+
+        bool run(const StmtAST *loop) { return execute(loop) == Flow::Normal; }
+
+    private:
+        enum class Flow
+        {
+            Normal,
+            Break,
+            Continue,
+            Failed
+        };
+
+        const TypeMap &Types;
+        ValueMap &Values;
+        long long Budget = MaxEvaluatedIterations;
+
+        bool store(const std::string &name, DataType type, const ExprAST *value)
+        {
+            long long result;
+            if (!isScalarType(type) || !value || !evaluate(value, Values, result))
+                return false;
+            Values[name] = storedValue(type, result);
+            return true;
+        }
+
+        // An expression statement or a for update
+        bool executeExpr(const ExprAST *expr)
+        {
+            if (const AssignmentExprAST *assign = dynamic_cast<const AssignmentExprAST *>(expr))
+            {
+                const VariableExprAST *target = dynamic_cast<const VariableExprAST *>(assign->getLHS());
+                auto type = target ? Types.find(target->getName()) : Types.end();
+                return type != Types.end() && store(target->getName(), type->second, assign->getRHS());
+            }
+            long long ignored;
+            return !hasSideEffects(expr) && evaluate(expr, Values, ignored);
+        }
+
+        Flow execute(const StmtAST *stmt)
+        {
+            if (!stmt)
+                return Flow::Normal;
+
+            if (const VarDeclStmtAST *varDecl = dynamic_cast<const VarDeclStmtAST *>(stmt))
+            {
+                for (const auto &var : varDecl->getVars())
+                {
+                    if (!store(var.first, varDecl->getVarType(), var.second.get()))
+                        return Flow::Failed;
+                }
+                return Flow::Normal;
+            }
+            if (const ExprStmtAST *exprStmt = dynamic_cast<const ExprStmtAST *>(stmt))
+                return executeExpr(exprStmt->getExpr()) ? Flow::Normal : Flow::Failed;
+            if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+            {
+                for (const auto &child : compound->getStatements())
+                {
+                    Flow flow = execute(child.get());
+                    if (flow != Flow::Normal)
+                        return flow;
+                }
+                return Flow::Normal;
+            }
+            if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            {
+                long long condition;
+                if (!evaluate(ifStmt->getCondition(), Values, condition))
+                    return Flow::Failed;
+                return execute(condition ? ifStmt->getThen() : ifStmt->getElse());
+            }
+            if (const WhileStmtAST *whileStmt = dynamic_cast<const WhileStmtAST *>(stmt))
+                return loop(whileStmt->getCondition(), whileStmt->getBody(), nullptr);
+            if (const ForStmtAST *forStmt = dynamic_cast<const ForStmtAST *>(stmt))
+            {
+                if (execute(forStmt->getInit()) != Flow::Normal)
+                    return Flow::Failed;
+                return loop(forStmt->getCondition(), forStmt->getBody(), forStmt->getUpdate());
+            }
+            if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+                return executeSwitch(switchStmt);
+            if (dynamic_cast<const BreakStmtAST *>(stmt))
+                return Flow::Break;
+            if (dynamic_cast<const ContinueStmtAST *>(stmt))
+                return Flow::Continue;
+
+            // Output, calls and returns have to happen at runtime
+            return Flow::Failed;
+        }
+
+        // Run from the matching case to the end, falling through; a break
+        // only leaves the switch
+        Flow executeSwitch(const SwitchStmtAST *switchStmt)
+        {
+            long long value;
+            if (!evaluate(switchStmt->getValue(), Values, value))
+                return Flow::Failed;
+
+            const auto &cases = switchStmt->getCases();
+            size_t entry = cases.size();
+            for (size_t i = 0; i < cases.size() && entry == cases.size(); ++i)
+            {
+                if (std::find(cases[i].Values.begin(), cases[i].Values.end(), value) != cases[i].Values.end())
+                    entry = i;
+            }
+            for (size_t i = 0; i < cases.size() && entry == cases.size(); ++i)
+            {
+                if (cases[i].IsDefault)
+                    entry = i;
+            }
+
+            for (size_t i = entry; i < cases.size(); ++i)
+            {
+                Flow flow = execute(cases[i].Body.get());
+                if (flow == Flow::Break)
+                    return Flow::Normal;
+                if (flow != Flow::Normal)
+                    return flow;
+            }
+            return Flow::Normal;
+        }
+
+        Flow loop(const ExprAST *condition, const StmtAST *body, const ExprAST *update)
+        {
+            while (true)
+            {
+                if (--Budget < 0)
+                    return Flow::Failed;
+                if (condition)
+                {
+                    long long value;
+                    if (!evaluate(condition, Values, value))
+                        return Flow::Failed;
+                    if (!value)
+                        return Flow::Normal;
+                }
+
+                Flow flow = execute(body);
+                if (flow == Flow::Failed)
+                    return Flow::Failed;
+                if (flow == Flow::Break)
+                    return Flow::Normal;
+                if (update && !executeExpr(update))
+                    return Flow::Failed;
+            }
+        }
+    };
+
+    std::unique_ptr<ExprAST> makeNumber(long long value)
+    {
+        return std::make_unique<NumberExprAST>(static_cast<double>(value));
+    }
+
+    // Build lhs op rhs for +, -, *, / and %, folding literals and the
+    // identities that come up when coefficients are zero or one
+    std::unique_ptr<ExprAST> combine(const std::string &op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
+    {
+        long long a = 0, b = 0;
+        bool constantLHS = evaluateConstant(lhs.get(), a);
+        bool constantRHS = evaluateConstant(rhs.get(), b);
+        if (constantLHS && constantRHS && (b != 0 || (op != "/" && op != "%")))
+        {
+            long long value;
+            if (evaluate(std::make_unique<BinaryExprAST>(op, makeNumber(a), makeNumber(b)).get(), {}, value) &&
+                fitsInInt(value))
+                return makeNumber(value);
+        }
+
+        if (op == "+" && constantLHS && a == 0)
+            return rhs;
+        if ((op == "+" || op == "-") && constantRHS && b == 0)
+            return lhs;
+        if (op == "*" && constantLHS && a == 1)
+            return rhs;
+        if ((op == "*" || op == "/") && constantRHS && b == 1)
+            return lhs;
+        // Only drop operands that cannot trap
+        if (op == "*" && ((constantLHS && a == 0 && dynamic_cast<VariableExprAST *>(rhs.get())) ||
+                          (constantRHS && b == 0 && dynamic_cast<VariableExprAST *>(lhs.get()))))
+            return makeNumber(0);
+        return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+    }
+
+    Recurrence cloneRecurrence(const Recurrence &rec)
+    {
+        Recurrence copy;
+        for (const auto &coefficient : rec)
+            copy.push_back(cloneExpr(coefficient.get()));
+        return copy;
+    }
+
+    // Coefficient-wise a + b or a - b
+    Recurrence addRecurrences(Recurrence a, Recurrence b, const std::string &op)
+    {
+        while (a.size() < b.size())
+            a.push_back(makeNumber(0));
+        for (size_t i = 0; i < b.size(); ++i)
+            a[i] = combine(op, std::move(a[i]), std::move(b[i]));
+
+        // Cancelled terms lower the degree
+        long long top;
+        while (a.size() > 1 && evaluateConstant(a.back().get(), top) && top == 0)
+            a.pop_back();
+        return a;
+    }
+
+    Recurrence scaleRecurrence(Recurrence rec, const ExprAST *factor)
+    {
+        for (auto &coefficient : rec)
+            coefficient = combine("*", std::move(coefficient), cloneExpr(factor));
+        return rec;
+    }
+
+    // k(k-1)/2 for k >= 0, computed so the product cannot overflow
+    std::unique_ptr<ExprAST> pairsOf(const ExprAST *k)
+    {
+        long long count;
+        if (evaluateConstant(k, count))
+        {
+            long long value = count % 2 == 0 ? count / 2 * (count - 1) : (count - 1) / 2 * count;
+            if (fitsInInt(value))
+                return makeNumber(value);
+        }
+
+        // (k / 2) * (k - 1) + (k % 2) * ((k - 1) / 2)
+        auto even = combine("*", combine("/", cloneExpr(k), makeNumber(2)), combine("-", cloneExpr(k), makeNumber(1)));
+        auto odd = combine("*", combine("%", cloneExpr(k), makeNumber(2)),
+                           combine("/", combine("-", cloneExpr(k), makeNumber(1)), makeNumber(2)));
+        return combine("+", std::move(even), std::move(odd));
+    }
+
+    // The value of a recurrence after k iterations
+    std::unique_ptr<ExprAST> valueAt(const Recurrence &rec, const ExprAST *k)
+    {
+        std::unique_ptr<ExprAST> value = cloneExpr(rec[0].get());
+        if (rec.size() > 1)
+            value = combine("+", std::move(value), combine("*", cloneExpr(rec[1].get()), cloneExpr(k)));
+        if (rec.size() > 2)
+            value = combine("+", std::move(value), combine("*", cloneExpr(rec[2].get()), pairsOf(k)));
+        return value;
+    }
+
+    // Describes the variables of one loop as recurrences and builds the
+    // stores of their final values
+    class RecurrenceSolver
+    {
+    public:
+        RecurrenceSolver(const TypeMap &types, const ValueMap &entry) : Types(types), Entry(entry) {}
+
+        const std::string &counter() const { return Counter; }
+        const ExprAST *bound() const { return Bound; }
+        const std::string &comparison() const { return Op; }
+        long long step() const { return Step; }
+
+        // Run one iteration symbolically. Only straight-line stores to int
+        // and long variables are understood.
+        bool summarize(StmtAST *body, const ExprAST *update)
+        {
+            return summarizeStmt(body) && (!update || summarizeStore(update));
+        }
+
+        // Classify the stored variables and find the counter the condition
+        // tests
+        bool solve(const ExprAST *condition)
+        {
+            for (const auto &name : Order)
+            {
+                if (!classify(name))
+                    return false;
+            }
+            if (!findCounter(condition) || !counterCannotWrap())
+                return false;
+
+            // A long store of an int value that changes in the loop would
+            // see it wrap in the loop but not in the formula; only the
+            // counter is known not to wrap
+            for (const auto &name : LongReadsOfInt)
+            {
+                if (Next.count(name) && name != Counter)
+                    return false;
+            }
+            return true;
+        }
+
+        // Number of iterations, for a loop that runs at least once
+        std::unique_ptr<ExprAST> tripCountExpr() const
+        {
+            auto counter = entryValue(Counter);
+            bool upward = Step > 0;
+            auto distance = upward ? combine("-", withEntryValues(Bound), std::move(counter))
+                                   : combine("-", std::move(counter), withEntryValues(Bound));
+            long long stride = upward ? Step : -Step;
+            if (Op == "<" || Op == ">")
+                return combine("/", combine("+", std::move(distance), makeNumber(stride - 1)), makeNumber(stride));
+            return combine("+", combine("/", std::move(distance), makeNumber(stride)), makeNumber(1));
+        }
+
+        // Stores of every variable's value after trips iterations (at least
+        // one), ordered so each formula still sees the entry values it reads
+        bool finalStores(const ExprAST *trips, std::vector<std::unique_ptr<StmtAST>> &stores)
+        {
+            auto last = combine("-", cloneExpr(trips), makeNumber(1));
+            std::map<std::string, std::unique_ptr<ExprAST>> finals;
+            for (const auto &name : Order)
+            {
+                Recurrence rec;
+                if (Steps.count(name))
+                {
+                    if (!recurrenceOfVariable(name, rec))
+                        return false;
+                    finals[name] = valueAt(rec, trips);
+                }
+                else
+                {
+                    // Overwritten every iteration: the value of the last one
+                    if (!recurrenceOf(Next[name].get(), rec))
+                        return false;
+                    finals[name] = valueAt(rec, last.get());
+                }
+            }
+
+            std::vector<std::string> pending = Order;
+            while (!pending.empty())
+            {
+                bool progress = false;
+                for (auto it = pending.begin(); it != pending.end();)
+                {
+                    bool readLater = false;
+                    for (const auto &other : pending)
+                    {
+                        std::set<std::string> reads;
+                        collectReadVariables(finals[other].get(), reads);
+                        readLater |= other != *it && reads.count(*it);
+                    }
+                    if (readLater)
+                    {
+                        ++it;
+                        continue;
+                    }
+
+                    stores.push_back(makeStore(*it, std::move(finals[*it])));
+                    it = pending.erase(it);
+                    progress = true;
+                }
+                if (!progress)
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        const TypeMap &Types;
+        const ValueMap &Entry; // known values before the first iteration
+
+        // Stored variables in order of their first store, and their values
+        // after one iteration in terms of the values at its start
+        std::vector<std::string> Order;
+        std::map<std::string, std::unique_ptr<ExprAST>> Next;
+        std::set<std::string> Declared;
+        std::set<std::string> LongReadsOfInt;
+
+        // x = x + step
+        std::map<std::string, std::unique_ptr<ExprAST>> Steps;
+        std::map<std::string, Recurrence> Recurrences;
+        std::set<std::string> Solving;
+
+        std::string Counter;
+        const ExprAST *Bound = nullptr;
+        std::string Op;
+        long long Step = 0;
+
+        // A variable's value before the loop, as a literal where known
+        std::unique_ptr<ExprAST> entryValue(const std::string &name) const
+        {
+            auto found = Entry.find(name);
+            if (found != Entry.end() && fitsInInt(found->second))
+                return makeNumber(found->second);
+            return std::make_unique<VariableExprAST>(name);
+        }
+
+        std::unique_ptr<ExprAST> withEntryValues(const ExprAST *expr) const
+        {
+            return cloneExpr(expr, [&](const std::string &name)
+                             { return entryValue(name); });
+        }
+
+        DataType typeOf(const std::string &name) const
+        {
+            auto found = Types.find(name);
+            return found == Types.end() ? DataType::UNKNOWN : found->second;
+        }
+
+        bool summarizeStmt(StmtAST *stmt)
+        {
+            if (!stmt)
+                return true;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+            {
+                for (auto &child : compound->getStatements())
+                {
+                    if (!summarizeStmt(child.get()))
+                        return false;
+                }
+                return true;
+            }
+            if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+            {
+                for (const auto &var : varDecl->getVars())
+                {
+                    if (!var.second || hasSideEffects(var.second.get()) || !assign(var.first, var.second.get()))
+                        return false;
+                    Declared.insert(var.first);
+                }
+                return true;
+            }
+            if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+                return summarizeStore(exprStmt->getExpr());
+            return false;
+        }
+
+        bool summarizeStore(const ExprAST *expr)
+        {
+            const AssignmentExprAST *store = dynamic_cast<const AssignmentExprAST *>(expr);
+            const VariableExprAST *target = store ? dynamic_cast<const VariableExprAST *>(store->getLHS()) : nullptr;
+            return target && !hasSideEffects(store->getRHS()) && assign(target->getName(), store->getRHS());
+        }
+
+        bool assign(const std::string &name, const ExprAST *value)
+        {
+            if (!isScalarType(typeOf(name)))
+                return false;
+
+            if (typeOf(name) == DataType::LONG)
+            {
+                std::set<std::string> reads;
+                collectReadVariables(value, reads);
+                for (const auto &read : reads)
+                {
+                    if (typeOf(read) != DataType::LONG)
+                        LongReadsOfInt.insert(read);
+                }
+            }
+
+            // Reads of variables stored earlier in the iteration see the
+            // stored value
+            auto substituted = cloneExpr(value, [&](const std::string &var) -> std::unique_ptr<ExprAST>
+                                         {
+                auto found = Next.find(var);
+                if (found != Next.end())
+                    return cloneExpr(found->second.get());
+                return std::make_unique<VariableExprAST>(var); });
+            if (!substituted)
+                return false;
+
+            if (!Next.count(name))
+                Order.push_back(name);
+            Next[name] = std::move(substituted);
+            return true;
+        }
+
+        static void splitSum(const ExprAST *expr, bool positive, std::vector<std::pair<bool, const ExprAST *>> &terms)
+        {
+            const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr);
+            if (binary && (binary->getOp() == "+" || binary->getOp() == "-"))
+            {
+                splitSum(binary->getLHS(), positive, terms);
+                splitSum(binary->getRHS(), binary->getOp() == "+" ? positive : !positive, terms);
+                return;
+            }
+            terms.push_back({positive, expr});
+        }
+
+        // A variable that reads itself has to be x + g with g free of x
+        bool classify(const std::string &name)
+        {
+            std::set<std::string> reads;
+            collectReadVariables(Next[name].get(), reads);
+            if (!reads.count(name))
+                return true;
+            if (Declared.count(name))
+                return false;
+
+            std::vector<std::pair<bool, const ExprAST *>> terms;
+            splitSum(Next[name].get(), true, terms);
+            std::unique_ptr<ExprAST> step = makeNumber(0);
+            int self = 0;
+            for (const auto &term : terms)
+            {
+                const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(term.second);
+                if (var && var->getName() == name && term.first)
+                {
+                    ++self;
+                    continue;
+                }
+                std::set<std::string> termReads;
+                collectReadVariables(term.second, termReads);
+                if (termReads.count(name))
+                    return false;
+                step = combine(term.first ? "+" : "-", std::move(step), cloneExpr(term.second));
+            }
+            if (self != 1)
+                return false;
+            Steps[name] = std::move(step);
+            return true;
+        }
+
+        bool isInvariant(const ExprAST *expr) const
+        {
+            if (hasSideEffects(expr))
+                return false;
+            std::set<std::string> reads;
+            collectReadVariables(expr, reads);
+            for (const auto &name : reads)
+            {
+                if (Next.count(name))
+                    return false;
+            }
+            return true;
+        }
+
+        // The recurrence of an expression over the values at the start of
+        // an iteration. Only sums and invariant multiples are polynomials.
+        bool recurrenceOf(const ExprAST *expr, Recurrence &out)
+        {
+            out.clear();
+            if (isInvariant(expr))
+            {
+                out.push_back(withEntryValues(expr));
+                return out.back() != nullptr;
+            }
+
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+                return Steps.count(var->getName()) && recurrenceOfVariable(var->getName(), out);
+
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                Recurrence operand, zero;
+                if (unary->getOp() != "-" || !recurrenceOf(unary->getOperand(), operand))
+                    return false;
+                zero.push_back(makeNumber(0));
+                out = addRecurrences(std::move(zero), std::move(operand), "-");
+                return true;
+            }
+
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                const std::string &op = binary->getOp();
+                if (op != "+" && op != "-" && op != "*")
+                    return false;
+                Recurrence lhs, rhs;
+                if (!recurrenceOf(binary->getLHS(), lhs) || !recurrenceOf(binary->getRHS(), rhs))
+                    return false;
+
+                if (op != "*")
+                    out = addRecurrences(std::move(lhs), std::move(rhs), op);
+                else if (lhs.size() == 1)
+                    out = scaleRecurrence(std::move(rhs), lhs[0].get());
+                else if (rhs.size() == 1)
+                    out = scaleRecurrence(std::move(lhs), rhs[0].get());
+                else
+                    return false;
+                return out.size() <= MaxDegree + 1;
+            }
+
+            return false;
+        }
+
+        bool recurrenceOfVariable(const std::string &name, Recurrence &out)
+        {
+            auto solved = Recurrences.find(name);
+            if (solved != Recurrences.end())
+            {
+                out = cloneRecurrence(solved->second);
+                return true;
+            }
+
+            // Variables whose steps depend on each other are not polynomials
+            if (Solving.count(name))
+                return false;
+            Solving.insert(name);
+            Recurrence step;
+            bool ok = recurrenceOf(Steps[name].get(), step);
+            Solving.erase(name);
+            if (!ok || step.size() > MaxDegree)
+                return false;
+
+            Recurrence rec;
+            rec.push_back(entryValue(name));
+            for (auto &coefficient : step)
+                rec.push_back(std::move(coefficient));
+            out = cloneRecurrence(rec);
+            Recurrences[name] = std::move(rec);
+            return true;
+        }
+
+        // The condition has to compare a recurrence with a constant step
+        // against an invariant bound, moving towards it
+        bool findCounter(const ExprAST *condition)
+        {
+            const BinaryExprAST *compare = dynamic_cast<const BinaryExprAST *>(condition);
+            if (!compare)
+                return false;
+            Op = compare->getOp();
+            if (Op != "<" && Op != "<=" && Op != ">" && Op != ">=")
+                return false;
+
+            const VariableExprAST *lhs = dynamic_cast<const VariableExprAST *>(compare->getLHS());
+            const VariableExprAST *rhs = dynamic_cast<const VariableExprAST *>(compare->getRHS());
+            if (lhs && Steps.count(lhs->getName()))
+            {
+                Counter = lhs->getName();
+                Bound = compare->getRHS();
+            }
+            else if (rhs && Steps.count(rhs->getName()))
+            {
+                Counter = rhs->getName();
+                Bound = compare->getLHS();
+                Op = mirrorComparison(Op);
+            }
+            else
+            {
+                return false;
+            }
+
+            Recurrence rec;
+            if (!isInvariant(Bound) || !recurrenceOfVariable(Counter, rec) || rec.size() != 2 ||
+                !evaluateConstant(rec[1].get(), Step) || Step == 0)
+                return false;
+            bool upward = Op == "<" || Op == "<=";
+            return upward == (Step > 0);
+        }
+
+        // The trip count formula assumes the counter reaches the bound
+        // without wrapping around
+        bool counterCannotWrap() const
+        {
+            long long bound;
+            bool constantBound = evaluateConstant(Bound, bound);
+            const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(Bound);
+            if (!constantBound && !(var && typeOf(var->getName()) == DataType::INT))
+                return false;
+
+            // The bound is an int, which a long counter passes long before
+            // it could wrap
+            if (typeOf(Counter) == DataType::LONG)
+                return true;
+            if (!constantBound)
+                return (Op == "<" && Step == 1) || (Op == ">" && Step == -1);
+
+            // Value of the counter when the loop exits, at worst
+            long long exit = Op == "<" ? bound - 1 + Step : Op == ">" ? bound + 1 + Step : bound + Step;
+            return fitsInInt(exit);
+        }
+
+        std::unique_ptr<StmtAST> makeStore(const std::string &name, std::unique_ptr<ExprAST> value) const
+        {
+            if (Declared.count(name))
+            {
+                std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
+                vars.emplace_back(name, std::move(value));
+                return std::make_unique<VarDeclStmtAST>(typeOf(name), std::move(vars));
+            }
+            return std::make_unique<ExprStmtAST>(
+                std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(name), std::move(value)));
+        }
+    };
+
+    class LoopEliminator
+    {
+    public:
+        LoopEliminator(const TypeMap &types, OptStats &stats) : Types(types), Stats(stats) {}
+
+        const std::vector<std::string> &temporaries() const { return Temps; }
+        bool changed() const { return Changed; }
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts, ValueMap &known)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt, known);
+        }
+
+    private:
+        const TypeMap &Types;
+        OptStats &Stats;
+        std::vector<std::string> Temps;
+        bool Changed = false;
+
+        void forget(StmtAST *stmt, ValueMap &known)
+        {
+            std::set<std::string> written;
+            collectWrittenVariables(stmt, written);
+            for (const auto &name : written)
+                known.erase(name);
+        }
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt, ValueMap &known)
+        {
+            if (!stmt)
+                return;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements(), known);
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                std::set<std::string> written;
+                collectWrittenVariables(ifStmt->getCondition(), written);
+                for (const auto &name : written)
+                    known.erase(name);
+
+                ValueMap thenKnown = known, elseKnown = known;
+                processStmt(ifStmt->getThenRef(), thenKnown);
+                processStmt(ifStmt->getElseRef(), elseKnown);
+                forget(stmt.get(), known);
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                // A case can fall in from the one before it, so the cases
+                // only see the values no case changes
+                ValueMap inner = known;
+                forget(stmt.get(), inner);
+                for (auto &c : switchStmt->getCases())
+                {
+                    ValueMap caseKnown = inner;
+                    processStmt(c.Body, caseKnown);
+                }
+                forget(stmt.get(), known);
+            }
+            else if (dynamic_cast<WhileStmtAST *>(stmt.get()) || dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                processLoop(stmt, known);
+            }
+            else
+            {
+                trackStores(stmt.get(), Types, known);
+            }
+        }
+
+        void processLoop(std::unique_ptr<StmtAST> &loop, ValueMap &known)
+        {
+            ValueMap values = known;
+            LoopEvaluator evaluator(Types, values);
+            if (evaluator.run(loop.get()) && replaceWithFinalValues(loop, values))
+            {
+                known = values;
+                Stats["scev.loops_evaluated"]++;
+                Changed = true;
+                return;
+            }
+
+            // Inner loops only see the values that hold on every iteration
+            ValueMap inner = known;
+            forget(loop.get(), inner);
+            if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(loop.get()))
+                processStmt(whileStmt->getBodyRef(), inner);
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(loop.get()))
+                processStmt(forStmt->getBodyRef(), inner);
+
+            if (replaceWithClosedForm(loop, known))
+            {
+                Stats["scev.closed_forms"]++;
+                Changed = true;
+            }
+            forget(loop.get(), known);
+        }
+
+        bool replaceWithFinalValues(std::unique_ptr<StmtAST> &loop, const ValueMap &values)
+        {
+            std::set<std::string> written, declared;
+            collectWrittenVariables(loop.get(), written);
+            collectDeclarations(loop.get(), declared);
+
+            std::vector<std::unique_ptr<StmtAST>> stores;
+            for (const auto &name : written)
+            {
+                auto found = values.find(name);
+                std::unique_ptr<ExprAST> value;
+                if (found != values.end())
+                {
+                    // Literals are 32-bit immediates
+                    if (!fitsInInt(found->second))
+                        return false;
+                    value = makeNumber(found->second);
+                }
+
+                if (declared.count(name))
+                {
+                    // Still declared, even if the declaration never ran
+                    auto type = Types.find(name);
+                    if (type == Types.end() || type->second == DataType::UNKNOWN)
+                        return false;
+                    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> vars;
+                    vars.emplace_back(name, std::move(value));
+                    stores.push_back(std::make_unique<VarDeclStmtAST>(type->second, std::move(vars)));
+                }
+                else if (value)
+                {
+                    stores.push_back(std::make_unique<ExprStmtAST>(
+                        std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(name), std::move(value))));
+                }
+            }
+            loop = std::make_unique<CompoundStmtAST>(std::move(stores));
+            return true;
+        }
+
+        bool replaceWithClosedForm(std::unique_ptr<StmtAST> &loop, const ValueMap &known)
+        {
+            std::unique_ptr<StmtAST> *init = nullptr;
+            const ExprAST *condition = nullptr, *update = nullptr;
+            StmtAST *body = nullptr;
+            if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(loop.get()))
+            {
+                condition = whileStmt->getCondition();
+                body = whileStmt->getBodyRef().get();
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(loop.get()))
+            {
+                init = &forStmt->getInitRef();
+                condition = forStmt->getCondition();
+                update = forStmt->getUpdate();
+                body = forStmt->getBodyRef().get();
+            }
+            if (!condition || hasSideEffects(condition))
+                return false;
+
+            ValueMap entry = known;
+            if (init && *init)
+                trackStores(init->get(), Types, entry);
+
+            RecurrenceSolver solver(Types, entry);
+            if (!solver.summarize(body, update) || !solver.solve(condition))
+                return false;
+
+            // A counter that starts at a known constant and a constant bound
+            // give a literal trip count
+            auto start = entry.find(solver.counter());
+            long long bound, trips = -1;
+            if (start != entry.end() && evaluateConstant(solver.bound(), bound))
+                trips = tripCount(start->second, solver.comparison(), bound, solver.step());
+
+            std::vector<std::unique_ptr<StmtAST>> block;
+            if (trips >= 0 && fitsInInt(trips))
+            {
+                auto count = makeNumber(trips);
+                if (trips > 0 && !solver.finalStores(count.get(), block))
+                    return false;
+            }
+            else
+            {
+                std::string temp = ".scev" + std::to_string(Temps.size());
+                auto count = std::make_unique<VariableExprAST>(temp);
+                std::vector<std::unique_ptr<StmtAST>> guarded;
+                guarded.push_back(std::make_unique<ExprStmtAST>(
+                    std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(temp), solver.tripCountExpr())));
+                if (!solver.finalStores(count.get(), guarded))
+                    return false;
+
+                // The formulas assume at least one iteration
+                Temps.push_back(temp);
+                block.push_back(std::make_unique<IfStmtAST>(cloneExpr(condition),
+                                                            std::make_unique<CompoundStmtAST>(std::move(guarded))));
+            }
+
+            if (init && *init)
+                block.insert(block.begin(), std::move(*init));
+            loop = std::make_unique<CompoundStmtAST>(std::move(block));
+            return true;
+        }
+    };
+}
+
+bool eliminateClosedFormLoops(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    std::vector<std::vector<std::unique_ptr<StmtAST>> *> units = codeUnits(program);
+    for (size_t i = 0; i < units.size(); ++i)
+    {
+        // The first unit is the top level, the rest are function bodies
+        TypeMap types;
+        if (i > 0)
+        {
+            for (const auto &arg : program.getFunctions()[i - 1]->getProto()->getArgs())
+                addType(types, arg.second, arg.first);
+        }
+        for (auto &stmt : *units[i])
+            collectTypes(stmt.get(), types);
+
+        LoopEliminator eliminator(types, stats);
+        ValueMap known;
+        eliminator.processList(*units[i], known);
+        declareTemporaries(*units[i], eliminator.temporaries());
+        changed |= eliminator.changed();
+    }
+    return changed;
+}
@@ -0,0 +1,358 @@
+#include "Optimizer.h"
+#include <climits>
+
+// Strength reduction of induction variable multiplications.
+//
+// A basic induction variable is a variable whose only stores inside a loop
+// are statements of the form i = i + c (or i = i - c) with a constant c.
+// For every product i * k with a constant k, a derived induction variable t
+// is introduced:
+//
+//   preheader:          t = i * k
+//   after each i += c:  t = t + c * k
+//
+// so t == i * k holds everywhere in the loop and the product becomes a load
+// of t. Multiplications the code generator already turns into a single
+// shift or lea are left alone; the update would cost more than it saves.
+//
+// The increment in a for loop's update expression has no statement to attach
+// to, so t is advanced at the end of the body instead. That is only done
+// when no continue can skip from the body straight to the update.
+
+namespace
+{
+    // True if a continue in this statement targets the enclosing loop
+    bool containsContinue(const StmtAST *stmt)
+    {
+        if (!stmt)
+            return false;
+        if (dynamic_cast<const ContinueStmtAST *>(stmt))
+            return true;
+        if (const CompoundStmtAST *compound = dynamic_cast<const CompoundStmtAST *>(stmt))
+        {
+            for (const auto &child : compound->getStatements())
+            {
+                if (containsContinue(child.get()))
+                    return true;
+            }
+        }
+        if (const IfStmtAST *ifStmt = dynamic_cast<const IfStmtAST *>(stmt))
+            return containsContinue(ifStmt->getThen()) || containsContinue(ifStmt->getElse());
+        if (const SwitchStmtAST *switchStmt = dynamic_cast<const SwitchStmtAST *>(stmt))
+        {
+            for (const auto &c : switchStmt->getCases())
+            {
+                if (containsContinue(c.Body.get()))
+                    return true;
+            }
+        }
+        // A continue inside a nested loop belongs to that loop
+        return false;
+    }
+
+    // The code generator emits a single shift or lea for these
+    bool isCheapMultiplier(long long factor)
+    {
+        unsigned long long magnitude = factor < 0 ? -static_cast<unsigned long long>(factor) : factor;
+        if ((magnitude & (magnitude - 1)) == 0)
+            return true;
+        return factor == 3 || factor == 5 || factor == 9;
+    }
+
+    struct IncrementSite
+    {
+        std::unique_ptr<StmtAST> *stmt; // nullptr for a for loop's update
+        long long step;
+    };
+
+    class InductionVariableReducer
+    {
+    public:
+        InductionVariableReducer(OptStats &stats) : Stats(stats) {}
+
+        const std::vector<std::string> &temporaries() const { return Temps; }
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            for (auto &stmt : stmts)
+                processStmt(stmt);
+        }
+
+    private:
+        OptStats &Stats;
+        std::vector<std::string> Temps;
+
+        void processStmt(std::unique_ptr<StmtAST> &stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                processList(compound->getStatements());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                processStmt(ifStmt->getThenRef());
+                processStmt(ifStmt->getElseRef());
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                for (auto &c : switchStmt->getCases())
+                    processStmt(c.Body);
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                reduceLoop(stmt, &whileStmt->getConditionRef(), nullptr, whileStmt->getBodyRef());
+                processStmt(whileStmt->getBodyRef());
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                reduceLoop(stmt, &forStmt->getConditionRef(), &forStmt->getUpdateRef(), forStmt->getBodyRef());
+                processStmt(forStmt->getBodyRef());
+            }
+        }
+
+        // Collect the increment statements of name in a loop body. Fails if
+        // the variable is stored to in any other way.
+        bool collectIncrements(std::unique_ptr<StmtAST> &stmt, const std::string &name,
+                               std::vector<IncrementSite> &sites)
+        {
+            if (!stmt)
+                return true;
+
+            if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt.get()))
+            {
+                long long step;
+                if (isIncrementOf(exprStmt->getExpr(), name, step))
+                {
+                    sites.push_back({&stmt, step});
+                    return true;
+                }
+            }
+            else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt.get()))
+            {
+                for (auto &child : compound->getStatements())
+                {
+                    if (!collectIncrements(child, name, sites))
+                        return false;
+                }
+                return true;
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt.get()))
+            {
+                return !writes(ifStmt->getCondition(), name) && collectIncrements(ifStmt->getThenRef(), name, sites) &&
+                       collectIncrements(ifStmt->getElseRef(), name, sites);
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt.get()))
+            {
+                if (writes(switchStmt->getValue(), name))
+                    return false;
+                for (auto &c : switchStmt->getCases())
+                {
+                    if (!collectIncrements(c.Body, name, sites))
+                        return false;
+                }
+                return true;
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt.get()))
+            {
+                return !writes(whileStmt->getCondition(), name) &&
+                       collectIncrements(whileStmt->getBodyRef(), name, sites);
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt.get()))
+            {
+                // Increments in a nested for's header have no statement to
+                // attach to; treat them as arbitrary stores
+                std::set<std::string> header;
+                collectWrittenVariables(forStmt->getInitRef().get(), header);
+                collectWrittenVariables(forStmt->getCondition(), header);
+                collectWrittenVariables(forStmt->getUpdate(), header);
+                return !header.count(name) && collectIncrements(forStmt->getBodyRef(), name, sites);
+            }
+
+            std::set<std::string> written;
+            collectWrittenVariables(stmt.get(), written);
+            return !written.count(name);
+        }
+
+        static bool writes(const ExprAST *expr, const std::string &name)
+        {
+            std::set<std::string> written;
+            collectWrittenVariables(expr, written);
+            return written.count(name) > 0;
+        }
+
+        // Find products of name and a constant worth reducing
+        void collectProducts(std::unique_ptr<ExprAST> &expr, const std::string &name,
+                             std::map<long long, std::vector<std::unique_ptr<ExprAST> *>> &products)
+        {
+            if (!expr)
+                return;
+
+            if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+            {
+                if (binary->getOp() == "*")
+                {
+                    const ExprAST *operands[2] = {binary->getLHS(), binary->getRHS()};
+                    for (int i = 0; i < 2; ++i)
+                    {
+                        const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(operands[i]);
+                        long long factor;
+                        if (var && var->getName() == name && evaluateConstant(operands[1 - i], factor) &&
+                            !isCheapMultiplier(factor))
+                        {
+                            products[factor].push_back(&expr);
+                            return;
+                        }
+                    }
+                }
+                collectProducts(binary->getLHSRef(), name, products);
+                collectProducts(binary->getRHSRef(), name, products);
+            }
+            else if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+            {
+                collectProducts(unary->getOperandRef(), name, products);
+            }
+            else if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+            {
+                collectProducts(assign->getRHSRef(), name, products);
+            }
+            else if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+            {
+                for (auto &arg : call->getArgs())
+                    collectProducts(arg, name, products);
+            }
+        }
+
+        void reduceLoop(std::unique_ptr<StmtAST> &loop, std::unique_ptr<ExprAST> *condition,
+                        std::unique_ptr<ExprAST> *update, std::unique_ptr<StmtAST> &body)
+        {
+            // Candidates are the variables the loop itself stores to
+            std::set<std::string> candidates;
+            collectWrittenVariables(condition->get(), candidates);
+            if (update)
+                collectWrittenVariables(update->get(), candidates);
+            collectWrittenVariables(body.get(), candidates);
+
+            std::vector<std::unique_ptr<StmtAST>> preheader;
+            std::map<std::unique_ptr<StmtAST> *, std::vector<std::unique_ptr<StmtAST>>> increments;
+            std::vector<std::unique_ptr<StmtAST>> bodyEnd;
+
+            for (const auto &name : candidates)
+            {
+                if (writes(condition->get(), name))
+                    continue;
+
+                std::vector<IncrementSite> sites;
+                if (update && writes(update->get(), name))
+                {
+                    long long step;
+                    if (!isIncrementOf(update->get(), name, step) || containsContinue(body.get()))
+                        continue;
+                    sites.push_back({nullptr, step});
+                }
+                if (!collectIncrements(body, name, sites) || sites.empty())
+                    continue;
+
+                std::map<long long, std::vector<std::unique_ptr<ExprAST> *>> products;
+                collectProducts(*condition, name, products);
+                if (update)
+                    collectProducts(*update, name, products);
+                forEachExpression(body.get(), [&](std::unique_ptr<ExprAST> &expr)
+                                  { collectProducts(expr, name, products); });
+
+                for (auto &product : products)
+                {
+                    long long factor = product.first;
+
+                    // Each update adds step * factor, which has to be an
+                    // int literal for the code generator
+                    bool fits = true;
+                    for (const auto &site : sites)
+                    {
+                        long long change = site.step * factor;
+                        if (change < INT_MIN || change > INT_MAX)
+                            fits = false;
+                    }
+                    if (!fits)
+                        continue;
+
+                    std::string temp = ".iv" + std::to_string(Temps.size());
+                    Temps.push_back(temp);
+
+                    preheader.push_back(makeStore(
+                        temp, std::make_unique<BinaryExprAST>("*", std::make_unique<VariableExprAST>(name),
+                                                              std::make_unique<NumberExprAST>(factor))));
+                    for (const auto &site : sites)
+                    {
+                        auto advance = makeStore(temp, std::make_unique<BinaryExprAST>(
+                                                           "+", std::make_unique<VariableExprAST>(temp),
+                                                           std::make_unique<NumberExprAST>(site.step * factor)));
+                        if (site.stmt)
+                            increments[site.stmt].push_back(std::move(advance));
+                        else
+                            bodyEnd.push_back(std::move(advance));
+                    }
+                    for (auto *use : product.second)
+                        *use = std::make_unique<VariableExprAST>(temp);
+
+                    Stats["sr.induction_variables"]++;
+                    Stats["sr.multiplies_replaced"] += static_cast<int>(product.second.size());
+                }
+            }
+
+            if (preheader.empty())
+                return;
+
+            // Advance the derived variables right after each increment
+            for (auto &entry : increments)
+            {
+                std::vector<std::unique_ptr<StmtAST>> block;
+                block.push_back(std::move(*entry.first));
+                for (auto &advance : entry.second)
+                    block.push_back(std::move(advance));
+                *entry.first = std::make_unique<CompoundStmtAST>(std::move(block));
+            }
+            if (!bodyEnd.empty())
+            {
+                std::vector<std::unique_ptr<StmtAST>> block;
+                block.push_back(std::move(body));
+                for (auto &advance : bodyEnd)
+                    block.push_back(std::move(advance));
+                body = std::make_unique<CompoundStmtAST>(std::move(block));
+            }
+
+            // The derived variables start from the value after the for init
+            std::vector<std::unique_ptr<StmtAST>> block;
+            if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(loop.get()))
+            {
+                if (forStmt->getInitRef())
+                    block.push_back(std::move(forStmt->getInitRef()));
+            }
+            for (auto &init : preheader)
+                block.push_back(std::move(init));
+            block.push_back(std::move(loop));
+            loop = std::make_unique<CompoundStmtAST>(std::move(block));
+        }
+
+        static std::unique_ptr<StmtAST> makeStore(const std::string &name, std::unique_ptr<ExprAST> value)
+        {
+            return std::make_unique<ExprStmtAST>(
+                std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(name), std::move(value)));
+        }
+    };
+}
+
+bool reduceInductionVariables(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        InductionVariableReducer reducer(stats);
+        reducer.processList(*stmts);
+        declareTemporaries(*stmts, reducer.temporaries());
+        changed |= !reducer.temporaries().empty();
+    }
+    return changed;
+}
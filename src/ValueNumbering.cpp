@@ -0,0 +1,333 @@
+#include "Optimizer.h"
+#include <algorithm>
+
+// Common subexpression elimination by value numbering.
+//
+// Every pure expression gets a key built from its operator and the value
+// numbers of its operands. A variable's value number is its name plus a
+// version that is bumped on every store, so a load is only considered equal
+// to an earlier one if no assignment to the variable came in between.
+//
+// The statement tree doubles as the dominator tree: a statement dominates
+// the ones after it in the same list, a condition dominates its branches and
+// the loop body, and the branches of an if only dominate their own code.
+// Available expressions are kept in a stack of scopes that follows that
+// nesting, which gives local numbering within a block and global numbering
+// across the blocks it dominates.
+//
+// When an expression is found again while an earlier computation is still
+// available, the first computation is rewritten to also store its result in
+// a compiler temporary, (tmp = a * b), and the later ones read the temporary.
+// Temporaries are 64-bit so that reusing a value is exactly equivalent to
+// recomputing it in the 64-bit registers the code generator uses.
+
+namespace
+{
+    bool isCommutative(const std::string &op)
+    {
+        return op == "+" || op == "*" || op == "==" || op == "!=";
+    }
+
+    class ValueNumberer
+    {
+    public:
+        ValueNumberer(OptStats &stats) : Stats(stats) {}
+
+        void processList(std::vector<std::unique_ptr<StmtAST>> &stmts)
+        {
+            Scopes.emplace_back();
+            for (auto &stmt : stmts)
+                processStmt(stmt.get());
+            Scopes.pop_back();
+        }
+
+        // Rewrite every expression that was computed more than once.
+        // Returns the names of the temporaries that were introduced.
+        std::vector<std::string> rewrite()
+        {
+            std::vector<std::string> temps;
+            for (auto &group : Groups)
+            {
+                if (group.redundant.empty())
+                    continue;
+
+                std::string temp = ".cse" + std::to_string(temps.size());
+                temps.push_back(temp);
+
+                std::unique_ptr<ExprAST> value = std::move(*group.first);
+                *group.first = std::make_unique<AssignmentExprAST>(std::make_unique<VariableExprAST>(temp),
+                                                                   std::move(value));
+                for (auto *slot : group.redundant)
+                    *slot = std::make_unique<VariableExprAST>(temp);
+
+                Stats["cse.eliminated"] += static_cast<int>(group.redundant.size());
+            }
+            if (!temps.empty())
+                Stats["cse.temporaries"] += static_cast<int>(temps.size());
+            return temps;
+        }
+
+    private:
+        // One value number: where it was first computed and every later
+        // place that recomputes it
+        struct Group
+        {
+            std::unique_ptr<ExprAST> *first;
+            std::vector<std::unique_ptr<ExprAST> *> redundant;
+        };
+
+        OptStats &Stats;
+        std::vector<Group> Groups;
+        std::vector<std::map<std::string, size_t>> Scopes;
+        std::map<std::string, int> Versions;
+        int NextVersion = 1;
+
+        void kill(const std::string &name)
+        {
+            Versions[name] = NextVersion++;
+        }
+
+        // Build the value key of a pure expression, or return false if the
+        // expression reads or writes anything we cannot number
+        bool keyOf(const ExprAST *expr, std::string &key)
+        {
+            if (const NumberExprAST *num = dynamic_cast<const NumberExprAST *>(expr))
+            {
+                long long value;
+                if (!evaluateConstant(num, value))
+                    return false;
+                key = "#" + std::to_string(value);
+                return true;
+            }
+
+            if (const BoolExprAST *boolExpr = dynamic_cast<const BoolExprAST *>(expr))
+            {
+                key = boolExpr->getValue() ? "#1" : "#0";
+                return true;
+            }
+
+            if (const CharExprAST *charExpr = dynamic_cast<const CharExprAST *>(expr))
+            {
+                key = "#" + std::to_string(static_cast<int>(charExpr->getValue()));
+                return true;
+            }
+
+            if (const VariableExprAST *var = dynamic_cast<const VariableExprAST *>(expr))
+            {
+                key = var->getName() + "@" + std::to_string(Versions[var->getName()]);
+                return true;
+            }
+
+            if (const UnaryExprAST *unary = dynamic_cast<const UnaryExprAST *>(expr))
+            {
+                if (unary->getOp() == "++" || unary->getOp() == "--")
+                    return false;
+                std::string operand;
+                if (!keyOf(unary->getOperand(), operand))
+                    return false;
+                key = "(" + unary->getOp() + " " + operand + ")";
+                return true;
+            }
+
+            if (const BinaryExprAST *binary = dynamic_cast<const BinaryExprAST *>(expr))
+            {
+                std::string lhs, rhs;
+                if (!keyOf(binary->getLHS(), lhs) || !keyOf(binary->getRHS(), rhs))
+                    return false;
+                if (isCommutative(binary->getOp()) && rhs < lhs)
+                    std::swap(lhs, rhs);
+                key = "(" + lhs + " " + binary->getOp() + " " + rhs + ")";
+                return true;
+            }
+
+            return false;
+        }
+
+        const Group *lookup(const std::string &key, size_t &index) const
+        {
+            for (auto scope = Scopes.rbegin(); scope != Scopes.rend(); ++scope)
+            {
+                auto found = scope->find(key);
+                if (found != scope->end())
+                {
+                    index = found->second;
+                    return &Groups[index];
+                }
+            }
+            return nullptr;
+        }
+
+        // Walk an expression in evaluation order
+        void processExpr(std::unique_ptr<ExprAST> &expr)
+        {
+            if (!expr)
+                return;
+
+            // Only operations are worth a temporary; leaves are already a
+            // single load or immediate
+            std::string key;
+            bool numbered = (dynamic_cast<BinaryExprAST *>(expr.get()) || dynamic_cast<UnaryExprAST *>(expr.get())) &&
+                            keyOf(expr.get(), key);
+            if (numbered)
+            {
+                size_t index;
+                if (lookup(key, index))
+                {
+                    Groups[index].redundant.push_back(&expr);
+                    return;
+                }
+            }
+
+            if (BinaryExprAST *binary = dynamic_cast<BinaryExprAST *>(expr.get()))
+            {
+                processExpr(binary->getLHSRef());
+                if (binary->getOp() == "&&" || binary->getOp() == "||")
+                {
+                    // The right operand may be skipped, so its values do not
+                    // dominate what follows
+                    Scopes.emplace_back();
+                    processExpr(binary->getRHSRef());
+                    Scopes.pop_back();
+                }
+                else
+                {
+                    processExpr(binary->getRHSRef());
+                }
+            }
+            else if (UnaryExprAST *unary = dynamic_cast<UnaryExprAST *>(expr.get()))
+            {
+                processExpr(unary->getOperandRef());
+                if (unary->getOp() == "++" || unary->getOp() == "--")
+                {
+                    if (VariableExprAST *var = dynamic_cast<VariableExprAST *>(unary->getOperandRef().get()))
+                        kill(var->getName());
+                }
+            }
+            else if (AssignmentExprAST *assign = dynamic_cast<AssignmentExprAST *>(expr.get()))
+            {
+                processExpr(assign->getRHSRef());
+                if (VariableExprAST *var = dynamic_cast<VariableExprAST *>(assign->getLHSRef().get()))
+                    kill(var->getName());
+            }
+            else if (CallExprAST *call = dynamic_cast<CallExprAST *>(expr.get()))
+            {
+                for (auto &arg : call->getArgs())
+                    processExpr(arg);
+            }
+
+            if (numbered)
+            {
+                Groups.push_back({&expr, {}});
+                Scopes.back()[key] = Groups.size() - 1;
+            }
+        }
+
+        void processStmt(StmtAST *stmt)
+        {
+            if (!stmt)
+                return;
+
+            if (VarDeclStmtAST *varDecl = dynamic_cast<VarDeclStmtAST *>(stmt))
+            {
+                for (auto &var : varDecl->getVars())
+                {
+                    processExpr(var.second);
+                    kill(var.first);
+                }
+            }
+            else if (ExprStmtAST *exprStmt = dynamic_cast<ExprStmtAST *>(stmt))
+            {
+                processExpr(exprStmt->getExprRef());
+            }
+            else if (CompoundStmtAST *compound = dynamic_cast<CompoundStmtAST *>(stmt))
+            {
+                // A plain block always runs to its end or leaves the
+                // enclosing construct, so it shares the enclosing scope
+                for (auto &child : compound->getStatements())
+                    processStmt(child.get());
+            }
+            else if (IfStmtAST *ifStmt = dynamic_cast<IfStmtAST *>(stmt))
+            {
+                processExpr(ifStmt->getConditionRef());
+                processScoped(ifStmt->getThenRef().get());
+                processScoped(ifStmt->getElseRef().get());
+            }
+            else if (WhileStmtAST *whileStmt = dynamic_cast<WhileStmtAST *>(stmt))
+            {
+                enterLoop(stmt);
+                processExpr(whileStmt->getConditionRef());
+                processStmt(whileStmt->getBodyRef().get());
+                Scopes.pop_back();
+            }
+            else if (ForStmtAST *forStmt = dynamic_cast<ForStmtAST *>(stmt))
+            {
+                processStmt(forStmt->getInitRef().get());
+
+                // The init runs once; only the rest of the loop repeats
+                std::set<std::string> assigned;
+                collectWrittenVariables(forStmt->getCondition(), assigned);
+                collectWrittenVariables(forStmt->getUpdate(), assigned);
+                collectWrittenVariables(forStmt->getBodyRef().get(), assigned);
+                for (const auto &name : assigned)
+                    kill(name);
+                Scopes.emplace_back();
+
+                processExpr(forStmt->getConditionRef());
+                // A continue can jump from anywhere in the body to the
+                // update, so the body does not dominate it
+                processScoped(forStmt->getBodyRef().get());
+                processExpr(forStmt->getUpdateRef());
+                Scopes.pop_back();
+            }
+            else if (SwitchStmtAST *switchStmt = dynamic_cast<SwitchStmtAST *>(stmt))
+            {
+                // Each case is entered from the dispatch or falls in from the
+                // one before it, so only the switch value dominates them all
+                processExpr(switchStmt->getValueRef());
+                for (auto &c : switchStmt->getCases())
+                    processScoped(c.Body.get());
+            }
+            else if (ReturnStmtAST *returnStmt = dynamic_cast<ReturnStmtAST *>(stmt))
+            {
+                processExpr(returnStmt->getValueRef());
+            }
+            else if (PrintStmtAST *printStmt = dynamic_cast<PrintStmtAST *>(stmt))
+            {
+                processExpr(printStmt->getValueRef());
+            }
+        }
+
+        void processScoped(StmtAST *stmt)
+        {
+            Scopes.emplace_back();
+            processStmt(stmt);
+            Scopes.pop_back();
+        }
+
+        // Values from before a loop only stay valid inside it if the loop
+        // never stores to their operands; the back edge brings those stores
+        // around to the top
+        void enterLoop(StmtAST *loop)
+        {
+            std::set<std::string> assigned;
+            collectWrittenVariables(loop, assigned);
+            for (const auto &name : assigned)
+                kill(name);
+            Scopes.emplace_back();
+        }
+    };
+}
+
+bool eliminateCommonSubexpressions(ProgramAST &program, OptStats &stats)
+{
+    bool changed = false;
+    for (auto *stmts : codeUnits(program))
+    {
+        ValueNumberer numberer(stats);
+        numberer.processList(*stmts);
+        std::vector<std::string> temps = numberer.rewrite();
+        declareTemporaries(*stmts, temps);
+        changed |= !temps.empty();
+    }
+    return changed;
+}
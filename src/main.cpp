@@ -3,24 +3,39 @@
 #include <string>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
 #include "Lexer.h"
 #include "Parser.h"
 #include "AST.h"
 #include "CodeGen.h"
+#include "Optimizer.h"
+#include "JitRunner.h"
+#include "BytecodeVM.h"
+#include "CBackend.h"
 
 void printUsage(const char *programName)
 {
     std::cout << "Usage: " << programName << " [options] <file.vsp>\n";
+    std::cout << "       " << programName << " run [options] <file.vsp>   Compile and run in memory\n";
     std::cout << "Options:\n";
     std::cout << "  -o <output>    Specify output file name (default: program)\n";
     std::cout << "  -S             Generate assembly only (don't create binary)\n";
     std::cout << "  -c             Compile to object file only\n";
+    std::cout << "  --use-nasm     Assemble and link with nasm and ld instead of the built-in assembler\n";
+    std::cout << "  --backend=<b>  native (default) compiles to x86-64; vm runs the program on the bytecode VM;\n";
+    std::cout << "                 c writes <output>.c and builds it with $CC (default cc) -O2\n";
+    std::cout << "  -O0, -O1, -O2  Optimization level (default: -O2)\n";
+    std::cout << "  --inline-threshold=<n>  Largest function body to inline, in AST nodes (default: 40)\n";
+    std::cout << "  --unroll-factor=<n>     Body copies for partially unrolled loops, 1 to disable (default: 4)\n";
     std::cout << "  -v, --verbose  Verbose output\n";
     std::cout << "  -h, --help     Show this help message\n";
     std::cout << "\nExamples:\n";
     std::cout << "  " << programName << " program.vsp              # Compile to 'program' binary\n";
     std::cout << "  " << programName << " -o myapp program.vsp     # Compile to 'myapp' binary\n";
     std::cout << "  " << programName << " -S program.vsp           # Generate assembly only\n";
+    std::cout << "  " << programName << " run program.vsp          # Run without writing any files\n";
+    std::cout << "  " << programName << " --backend=vm program.vsp # Interpret the program's bytecode\n";
+    std::cout << "  " << programName << " --backend=c program.vsp  # Build through C and the system C compiler\n";
 }
 
 int main(int argc, char *argv[])
@@ -30,9 +45,21 @@ int main(int argc, char *argv[])
     bool assemblyOnly = false;
     bool objectOnly = false;
     bool verbose = false;
+    bool useNasm = false;
+    bool runInMemory = false;
+    std::string backend = "native";
+    int optLevel = 2;
+    int inlineThreshold = 40;
+    int unrollFactor = 4;
 
     // Parse command line arguments
-    for (int i = 1; i < argc; i++)
+    int firstOption = 1;
+    if (argc > 1 && strcmp(argv[1], "run") == 0)
+    {
+        runInMemory = true;
+        firstOption = 2;
+    }
+    for (int i = firstOption; i < argc; i++)
     {
         if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
         {
@@ -46,6 +73,31 @@ int main(int argc, char *argv[])
         {
             objectOnly = true;
         }
+        else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9' && argv[i][3] == '\0')
+        {
+            optLevel = argv[i][2] - '0';
+        }
+        else if (strncmp(argv[i], "--inline-threshold=", 19) == 0)
+        {
+            inlineThreshold = atoi(argv[i] + 19);
+        }
+        else if (strncmp(argv[i], "--unroll-factor=", 16) == 0)
+        {
+            unrollFactor = atoi(argv[i] + 16);
+        }
+        else if (strncmp(argv[i], "--backend=", 10) == 0)
+        {
+            backend = argv[i] + 10;
+            if (backend != "native" && backend != "vm" && backend != "c")
+            {
+                std::cerr << "Unknown backend: " << backend << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--use-nasm") == 0)
+        {
+            useNasm = true;
+        }
         else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
         {
             verbose = true;
@@ -67,6 +119,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (runInMemory && backend == "c")
+    {
+        std::cerr << "Error: run needs the native or vm backend\n";
+        return 1;
+    }
+
     if (inputFile.empty())
     {
         std::cerr << "Error: No input file specified\n";
@@ -144,9 +202,80 @@ int main(int argc, char *argv[])
                 std::cout << "========================" << std::endl;
             }
 
-            // 3. Code Generation
+            // 3. Optimization
+            Optimizer optimizer(optLevel);
+            optimizer.setInlineThreshold(inlineThreshold);
+            optimizer.setUnrollFactor(unrollFactor);
+            optimizer.run(*program);
+            if (verbose && optLevel > 0)
+            {
+                optimizer.printStats();
+                std::cout << "✅ Optimized program:" << std::endl;
+                std::cout << "========================" << std::endl;
+                program->print();
+                std::cout << "========================" << std::endl;
+            }
+
+            // The VM runs the optimized program directly, without writing
+            // any files
+            if (backend == "vm")
+            {
+                VmProgram bytecode = BytecodeVM::compile(*program);
+                if (verbose)
+                {
+                    std::cout << "🔧 Bytecode:\n"
+                              << BytecodeVM::listing(bytecode) << std::endl;
+                }
+                int exitStatus = 0;
+                if (!BytecodeVM::run(bytecode, exitStatus))
+                    return 1;
+                return exitStatus;
+            }
+
+            // The C backend leaves code generation to the C compiler
+            if (backend == "c")
+            {
+                std::string cFile = outputFile + ".c";
+                std::ofstream source(cFile);
+                if (!source.is_open())
+                {
+                    std::cerr << "Error: Could not open file " << cFile << " for writing" << std::endl;
+                    return 1;
+                }
+                source << CBackend::translate(*program);
+                source.close();
+                std::cout << "📄 C source written to " << cFile << std::endl;
+                if (assemblyOnly)
+                    return 0;
+                if (!CBackend::compile(cFile, outputFile))
+                {
+                    std::cerr << "❌ Binary generation failed!" << std::endl;
+                    return 1;
+                }
+                std::cout << "🎉 Binary compilation successful!" << std::endl;
+                std::cout << "📦 Executable: " << outputFile << std::endl;
+                return 0;
+            }
+
+            // 4. Code Generation
             CodeGen codegen;
             codegen.generateAssembly(program.get());
+            if (verbose)
+            {
+                std::cout << "📊 Peephole statistics:" << std::endl;
+                if (codegen.getPeepholeStats().empty())
+                    std::cout << "    (no changes)" << std::endl;
+                for (const auto &entry : codegen.getPeepholeStats())
+                    std::cout << "    " << entry.first << ": " << entry.second << std::endl;
+            }
+
+            if (runInMemory)
+            {
+                int exitStatus = 0;
+                if (!JitRunner::run(codegen.getModule(), exitStatus))
+                    return 1;
+                return exitStatus;
+            }
 
             std::string asmFile = outputFile + ".asm";
             std::string objFile = outputFile + ".o";
@@ -174,7 +303,10 @@ int main(int argc, char *argv[])
                 std::cout << "🔗 Generating binary..." << std::endl;
             }
 
-            if (codegen.generateBinary(asmFile, outputFile))
+            // The built-in assembler works from the machine IR; nasm reads
+            // back the text and cross-checks it
+            bool built = useNasm ? codegen.generateBinary(asmFile, outputFile) : codegen.writeExecutable(outputFile);
+            if (built)
             {
                 std::cout << "🎉 Binary compilation successful!" << std::endl;
                 std::cout << "📦 Executable: " << outputFile << std::endl;
@@ -30,6 +30,37 @@ void test_ast_polymorphism();
 void test_ast_memory_management();
 void test_ast_error_handling();
 
+void test_constant_folding();
+void test_dead_code_elimination();
+void test_dead_store_elimination();
+void test_common_subexpression_elimination();
+void test_loop_invariant_code_motion();
+void test_induction_variable_strength_reduction();
+void test_function_inlining();
+void test_loop_unrolling();
+void test_closed_form_loops();
+void test_loop_unswitching();
+
+void test_constant_strength_reduction();
+void test_call_emission();
+void test_tail_calls();
+void test_if_conversion();
+void test_fused_branches();
+void test_short_circuit_values();
+void test_loop_rotation();
+void test_register_allocation();
+void test_instruction_selection();
+void test_frame_layout();
+void test_machine_ir();
+void test_peephole();
+void test_output_buffering();
+void test_print_formatting();
+void test_assembler();
+void test_jit_runner();
+void test_bytecode_vm();
+void test_c_backend();
+void test_switch_lowering();
+
 int main()
 {
     std::cout << "🚀 Starting Comprehensive Test Suite" << std::endl;
@@ -69,6 +100,41 @@ int main()
     test_ast_memory_management();
     test_ast_error_handling();
 
+    // Optimizer Tests
+    std::cout << "\n⚙️  Running Optimizer Tests..." << std::endl;
+    test_constant_folding();
+    test_dead_code_elimination();
+    test_dead_store_elimination();
+    test_common_subexpression_elimination();
+    test_loop_invariant_code_motion();
+    test_induction_variable_strength_reduction();
+    test_function_inlining();
+    test_loop_unrolling();
+    test_closed_form_loops();
+    test_loop_unswitching();
+
+    // Code Generator Tests
+    std::cout << "\n🛠️  Running Code Generator Tests..." << std::endl;
+    test_constant_strength_reduction();
+    test_call_emission();
+    test_tail_calls();
+    test_if_conversion();
+    test_fused_branches();
+    test_short_circuit_values();
+    test_loop_rotation();
+    test_register_allocation();
+    test_instruction_selection();
+    test_frame_layout();
+    test_machine_ir();
+    test_peephole();
+    test_output_buffering();
+    test_print_formatting();
+    test_assembler();
+    test_jit_runner();
+    test_bytecode_vm();
+    test_c_backend();
+    test_switch_lowering();
+
     std::cout << "\n🎉 All tests completed successfully!" << std::endl;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,902 @@
+#include "test_framework.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "AST.h"
+#include "CodeGen.h"
+#include "Assembler.h"
+#include "JitRunner.h"
+#include "BytecodeVM.h"
+#include "CBackend.h"
+#include "Peephole.h"
+#include "RegisterAllocator.h"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+// Generate assembly for a program without running the optimizer
+static std::string generateProgram(const std::string &code)
+{
+    Lexer lexer(code);
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    auto program = parser.ParseProgram();
+    if (!program)
+        return "";
+
+    CodeGen gen;
+    std::ostringstream out;
+    std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+    gen.generateAssembly(program.get());
+    std::cout.rdbuf(old);
+    return gen.getAssembly();
+}
+
+void test_constant_strength_reduction()
+{
+    TestFramework tf("Constant Strength Reduction");
+
+    {
+        std::string assembly = generateProgram("int x = 3; print(x * 8);");
+        tf.assert_contains(assembly, "shl rax, 3", "Multiply by power of two uses a shift");
+        // The print runtime has multiplies of its own; only the program counts
+        tf.assert_false(assembly.find("imul", assembly.find("_start:")) != std::string::npos,
+                        "No imul for power of two");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 3; print(x * 10);");
+        tf.assert_contains(assembly, "lea rax, [rax+rax*4]", "Multiply by 10 uses lea");
+        tf.assert_contains(assembly, "shl rax, 1", "Multiply by 10 finishes with a shift");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 100; print(x / 7);");
+        tf.assert_false(assembly.find("idiv") != std::string::npos, "Division by constant avoids idiv");
+        tf.assert_contains(assembly, "mov rax, 5270498306774157605", "Magic multiplier for 7");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 100; print(x % 8);");
+        tf.assert_false(assembly.find("idiv") != std::string::npos, "Modulo by power of two avoids idiv");
+        tf.assert_contains(assembly, "and rax, -8", "Modulo by power of two masks");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 100; int y = 7; print(x % y);");
+        tf.assert_contains(assembly, "mov rax, rdx", "Modulo by a variable takes the idiv remainder");
+    }
+}
+
+void test_call_emission()
+{
+    TestFramework tf("Call Emission");
+
+    {
+        std::string assembly = generateProgram("int add(int a, int b) { return a + b; } print(add(2, 3));");
+        tf.assert_contains(assembly, "fn_add:", "Function body emitted under its label");
+        tf.assert_contains(assembly, "movsxd r11, esi", "Second argument moved from esi into its register");
+        tf.assert_contains(assembly, "pop rsi", "Arguments passed in registers");
+        tf.assert_contains(assembly, "call fn_add", "Call emitted");
+    }
+
+    {
+        std::string assembly = generateProgram("print(missing(1));");
+        tf.assert_contains(assembly, "ERROR: Unknown function missing", "Unknown callee reported");
+    }
+
+    {
+        std::string assembly = generateProgram("return 3;");
+        tf.assert_contains(assembly, "mov rax, 60", "Top-level return exits the program");
+    }
+}
+
+void test_tail_calls()
+{
+    TestFramework tf("Tail Calls");
+
+    {
+        std::string assembly =
+            generateProgram("int gcd(int a, int b) { if (b == 0) { return a; } return gcd(b, a % b); } print(gcd(12, 18));");
+        tf.assert_contains(assembly, "jmp fn_gcd.body", "Self tail call loops back into the body");
+        tf.assert_false(assembly.find("call fn_gcd\n    mov rsp") != std::string::npos, "No nested frame for the tail call");
+    }
+
+    {
+        std::string assembly = generateProgram("int g(int x) { return x + 1; } int f(int x) { return g(x * 2); } print(f(3));");
+        tf.assert_contains(assembly, "pop rbp\n    jmp fn_g", "Sibling tail call drops the frame and jumps");
+    }
+
+    {
+        std::string assembly = generateProgram(
+            "int fact(int n) { if (n <= 1) { return 1; } return n * fact(n - 1); } print(fact(5));");
+        tf.assert_contains(assembly, "call fn_fact", "Call whose result is still used is not a tail call");
+    }
+}
+
+void test_if_conversion()
+{
+    TestFramework tf("If-Conversion");
+
+    {
+        std::string assembly = generateProgram("int a = 7; int b = 3; int m = 0; if (a > b) m = a; else m = b; print(m);");
+        tf.assert_contains(assembly, "cmp r10, r11\n    mov rax, r10\n    mov rcx, r11\n    cmovle rax, rcx",
+                           "Max diamond becomes cmp and cmov");
+        tf.assert_false(assembly.find("if_false_") != std::string::npos, "No branch for the diamond");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 50; if (x > 10) x = 10; print(x);");
+        tf.assert_contains(assembly, "cmovle rax, rcx", "Clamp without else keeps the old value on the other path");
+    }
+
+    {
+        std::string assembly = generateProgram("int z = 1; int m = 0; if (z) m = 2; print(m);");
+        tf.assert_contains(assembly, "test r10, r10\n    mov rax, 2\n    mov rcx, r11\n    cmovz rax, rcx",
+                           "Non-comparison condition is tested once");
+    }
+
+    {
+        std::string assembly = generateProgram("int d = 0; int q = 5; if (d != 0) q = 10 / d; print(q);");
+        tf.assert_false(assembly.find("cmov") != std::string::npos, "Division is not computed speculatively");
+    }
+
+    {
+        std::string assembly = generateProgram("int a = 1; int b = 2; if (a < b) a = b; else b = a; print(a);");
+        tf.assert_false(assembly.find("cmov") != std::string::npos, "Branches assigning different variables keep the branch");
+    }
+}
+
+void test_fused_branches()
+{
+    TestFramework tf("Fused Branches");
+
+    {
+        std::string assembly = generateProgram("int n = 5; for (int i = 0; i < n; i = i + 1) { print(i); }");
+        tf.assert_contains(assembly, "cmp r11, r10\n    jge for_end_", "Loop condition branches on the cmp flags");
+        tf.assert_false(assembly.find("setl") != std::string::npos, "No boolean materialized for the condition");
+    }
+
+    {
+        std::string assembly = generateProgram("int a = 3; int b = 0; if (!(a > 1)) { print(a); } print(b);");
+        tf.assert_contains(assembly, "cmp r10, 1\n    jg if_false_", "! flips the jump instead of computing setz");
+    }
+
+    {
+        std::string assembly = generateProgram("int a = 3; int b = 0; if (b != 0 && a / b > 1) { print(a); } print(b);");
+        tf.assert_contains(assembly, "cmp r11, 0\n    je if_false_", "&& leaves as soon as the left test fails");
+    }
+
+    {
+        std::string assembly = generateProgram("int a = 3; int b = 0; while (a > 5 || b < 2) { b = b + 1; } print(b);");
+        tf.assert_contains(assembly, "cmp r10, 5\n    jg cond_skip_", "|| skips the right test when the left holds");
+        tf.assert_contains(assembly, "cmp r11, 2\n    jge while_end_", "|| leaves when the right test fails too");
+    }
+
+    {
+        std::string assembly = generateProgram("int c = 0; while (1) { c = c + 1; if (c > 2) { break; } } print(c);");
+        tf.assert_false(assembly.find("jz while_end_") != std::string::npos, "Constant true condition needs no test");
+    }
+}
+
+void test_short_circuit_values()
+{
+    TestFramework tf("Short-Circuit Values");
+
+    {
+        std::string assembly = generateProgram("int a = 3; int b = 0; int t = a > 1 && b == 0; print(t);");
+        tf.assert_contains(assembly, "jle and_false_", "&& jumps to false when the left test fails");
+        tf.assert_contains(assembly, "sete al\n    movzx rax, al", "Right test becomes the value with setcc");
+        tf.assert_contains(assembly, "xor eax, eax", "Failed left test yields 0");
+    }
+
+    {
+        std::string assembly = generateProgram("int a = 3; int b = 0; int t = a || b; print(t);");
+        tf.assert_contains(assembly, "jnz or_true_", "|| jumps to true when the left operand is nonzero");
+        tf.assert_contains(assembly, "setnz al", "Right operand normalized to 0 or 1");
+    }
+}
+
+void test_loop_rotation()
+{
+    TestFramework tf("Loop Rotation");
+
+    {
+        std::string assembly = generateProgram("int i = 0; while (i < 10) { i = i + 1; } print(i);");
+        tf.assert_contains(assembly, "jge while_end_", "Entry guard skips the loop");
+        tf.assert_contains(assembly, "cmp r10, 10\n    jl while_loop_", "Bottom test branches back while the condition holds");
+        tf.assert_false(assembly.find("jmp while_loop_") != std::string::npos, "No unconditional backward jump");
+    }
+
+    {
+        std::string assembly = generateProgram("for (int i = 0; i < 3; i = i + 1) { if (i == 1) { continue; } print(i); }");
+        tf.assert_contains(assembly, "jmp for_update_", "Continue still runs the update");
+        tf.assert_contains(assembly, "jl for_loop_", "For loop tests its condition after the update");
+    }
+
+    {
+        std::string assembly = generateProgram("int c = 0; for (;;) { c = c + 1; if (c > 2) { break; } } print(c);");
+        tf.assert_contains(assembly, "jmp for_loop_", "Loop without a condition jumps back unconditionally");
+    }
+}
+
+static int runProgram(const std::string &code);
+
+void test_register_allocation()
+{
+    TestFramework tf("Register Allocation");
+
+    {
+        std::string assembly = generateProgram("int s = 0; for (int i = 0; i < 10; i = i + 1) { s = s + i; } print(s);");
+        tf.assert_false(assembly.find("[rbp-") != std::string::npos, "Loop variables never touch the stack");
+        tf.assert_false(assembly.find("push rax") != std::string::npos, "Left operands kept in free registers");
+    }
+
+    {
+        std::string assembly = generateProgram(
+            "int f(int x) { return x + 1; } int g(int x) { int y = x * 2; int z = f(x); return y + z; } print(g(7));");
+        tf.assert_contains(assembly, "fn_g:\n    push rbx\n    push rbp", "Value live across a call gets a callee-saved register");
+        tf.assert_contains(assembly, "pop rbp\n    pop rbx\n    ret", "Callee-saved register restored on return");
+        tf.assert_contains(assembly, "fn_f:\n    push rbp", "Leaf function saves nothing");
+    }
+
+    {
+        std::string code = "int v0 = 0; int v1 = 1; int v2 = 2; int v3 = 3; int v4 = 4; int v5 = 5; int v6 = 6; "
+                           "int v7 = 7; int v8 = 8; int v9 = 9; int v10 = 10; int v11 = 11; int v12 = 12; "
+                           "print(v0 + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + v11 + v12);";
+        std::string assembly = generateProgram(code);
+        tf.assert_contains(assembly, "[rbp-", "Variables beyond the free registers are spilled");
+    }
+
+    {
+        Lexer lexer("int n = 5; int i = 0; int t = 0; while (i < n) { t = i; i = i + 1; } print(i);");
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto program = parser.ParseProgram();
+        std::vector<const StmtAST *> stmts;
+        for (const auto &stmt : program->getStatements())
+            stmts.push_back(stmt.get());
+        RegisterAllocator allocator;
+        allocator.run(stmts);
+
+        const LiveInterval *n = nullptr, *t = nullptr, *i = nullptr;
+        for (const auto &interval : allocator.intervals())
+        {
+            if (interval.name == "n")
+                n = &interval;
+            else if (interval.name == "t")
+                t = &interval;
+            else if (interval.name == "i")
+                i = &interval;
+        }
+        tf.assert_true(n && t && i, "Every variable has an interval");
+        if (n && t && i)
+        {
+            tf.assert_true(n->end >= t->end, "Loop bound stays live through the whole loop");
+            tf.assert_true(i->end > t->end, "Counter read after the loop outlives the loop's temporaries");
+            tf.assert_true(n->reg != t->reg && n->reg != i->reg && t->reg != i->reg, "Overlapping intervals get distinct registers");
+        }
+    }
+
+    // A left operand read after its right operand keeps its register
+    // through the right operand's temporaries and calls
+    tf.assert_equal(runProgram("int f(int a, int b, int c) { int r = a; int s = b; int t = c; "
+                               "return r > ((!s) > (t * t)); } return f(5, 1, 2);"),
+                    1, "Mirrored comparison reads the left operand intact");
+    tf.assert_equal(runProgram("int f(int a, int b, int c) { int r = a; int s = b; int t = c; "
+                               "return r + ((s + 1) - (t * t)); } return f(5, 1, 2);"),
+                    3, "Commutative operator reads the left operand intact");
+    tf.assert_equal(runProgram("int f(int a, int b, int c) { int r = a; int s = b; int t = c; "
+                               "return (r - s) - ((t * t) * (s + t)); } return 40 + f(5, 1, 2);"),
+                    32, "Operand evaluated second keeps its variables intact");
+    tf.assert_equal(runProgram("int id(int x) { return x; } int f(int a) { int r = a; return r - (id(3) + r * 2); } "
+                               "return 20 + f(7);"),
+                    10, "Left operand read after a call survives it");
+}
+
+void test_instruction_selection()
+{
+    TestFramework tf("Instruction Selection");
+
+    {
+        std::string assembly = generateProgram("int x = 3; int y = 4; print(x * y + 5);");
+        tf.assert_contains(assembly, "imul rax, r11\n    add rax, 5", "Register and immediate operands used in place");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 3; int y = 4; print(x + y * 4);");
+        tf.assert_contains(assembly, "lea rax, [r10+r11*4]", "Base plus scaled index folds into lea");
+    }
+
+    {
+        std::string assembly = generateProgram("int i = 0; while (i < 10) { i = i + 1; } print(i);");
+        tf.assert_contains(assembly, "cmp r10, 10", "Condition compares the register against an immediate");
+        tf.assert_contains(assembly, "add r10d, 1\n    movsxd r10, r10d", "Update happens in the variable's register");
+        tf.assert_false(assembly.find("push rax") != std::string::npos, "No stack traffic for leaf operands");
+    }
+
+    {
+        std::string code = "int v0 = 0; int v1 = 1; int v2 = 2; int v3 = 3; int v4 = 4; int v5 = 5; int v6 = 6; "
+                           "int v7 = 7; int v8 = 8; int v9 = 9; int v10 = 10; int v11 = 11; int v12 = 12; "
+                           "v12 = v12 + v1; if (v12 > 3) { print(v12); } "
+                           "print(v0 + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + v11 + v12);";
+        std::string assembly = generateProgram(code);
+        tf.assert_contains(assembly, "add dword [rbp-", "Spilled variable is updated in memory");
+        tf.assert_contains(assembly, "cmp dword [rbp-", "Spilled variable compared in memory");
+        tf.assert_contains(assembly, "movsxd rcx, dword [rbp-", "Spilled right operand loaded straight into rcx");
+    }
+}
+
+void test_frame_layout()
+{
+    TestFramework tf("Frame Layout");
+
+    {
+        std::string assembly = generateProgram("int add(int a, int b) { return a + b; } print(add(2, 3));");
+        tf.assert_false(assembly.find("sub rsp") != std::string::npos, "No frame when every variable has a register");
+    }
+
+    // Two blocks that each keep more variables live than there are registers
+    auto crowdedBlock = [](const std::string &prefix)
+    {
+        std::string decls, sum = "0";
+        for (int i = 0; i < 15; ++i)
+        {
+            decls += "int " + prefix + std::to_string(i) + " = " + std::to_string(i) + "; ";
+            sum += " + " + prefix + std::to_string(i);
+        }
+        return "if (k > 0) { " + decls + "print(" + sum + "); } ";
+    };
+    std::string code = "int k = 1; " + crowdedBlock("a") + crowdedBlock("b");
+
+    {
+        Lexer lexer(code);
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto program = parser.ParseProgram();
+        std::vector<const StmtAST *> stmts;
+        for (const auto &stmt : program->getStatements())
+            stmts.push_back(stmt.get());
+        RegisterAllocator allocator;
+        allocator.run(stmts);
+
+        int spilled = 0;
+        bool aligned = true, shared = false;
+        std::map<int, std::string> owners;
+        for (const auto &interval : allocator.intervals())
+        {
+            int offset = allocator.stackSlotOf(interval.name);
+            if (!offset)
+                continue;
+            ++spilled;
+            aligned = aligned && offset % allocator.slotWidthOf(interval.name) == 0;
+            if (owners.count(offset) && owners[offset][0] != interval.name[0])
+                shared = true;
+            owners[offset] = interval.name;
+        }
+        tf.assert_true(spilled > 4, "Both blocks spill variables");
+        tf.assert_true(shared, "Variables of disjoint blocks share slots");
+        tf.assert_true(aligned, "Slots aligned to their width");
+        tf.assert_true(allocator.frameBytes() < spilled * 4, "Frame smaller than one slot per variable");
+    }
+
+    {
+        std::string assembly = generateProgram(code);
+        tf.assert_contains(assembly, "sub rsp, 32", "Frame sized from the slots, rounded to 16 bytes");
+    }
+}
+
+// Run the peephole pass over a listing given as lines
+static std::string runPeephole(const std::vector<std::string> &listing, PeepholeOptimizer &peephole)
+{
+    MachineFunction function("");
+    for (const auto &line : listing)
+    {
+        if (line.back() == ':')
+            function.appendLabel(line.substr(0, line.size() - 1));
+        else
+            function.append(MachineInstr::parse(line));
+    }
+    peephole.run(function);
+    std::ostringstream text;
+    function.print(text);
+    return text.str();
+}
+
+void test_machine_ir()
+{
+    TestFramework tf("Machine IR");
+
+    {
+        MachineInstr instr = MachineInstr::parse("    mov rdi, rax        ; argument for print_int");
+        tf.assert_true(instr.opcode == Opcode::Mov, "Opcode parsed from the mnemonic");
+        tf.assert_true(instr.operands.size() == 2 && instr.operands[1].isReg("rax"), "Register operand");
+        tf.assert_equal(instr.comment, std::string("argument for print_int"), "Trailing comment kept");
+    }
+
+    {
+        MachineInstr instr = MachineInstr::parse("    add dword [rbp-8], 3");
+        tf.assert_true(instr.operands[0].isMem() && instr.operands[0].size == 4 && instr.operands[0].text == "rbp-8",
+                       "Memory operand keeps its width and address");
+        tf.assert_true(instr.operands[1].isImm(3), "Immediate operand");
+        tf.assert_true(instr.operands[0].uses("rbp") && !instr.operands[0].uses("rax"), "Address registers are uses");
+    }
+
+    {
+        MachineInstr jump = MachineInstr::parse("    jle if_false_0");
+        tf.assert_true(jump.opcode == Opcode::Jcc && jump.condition == "le", "Conditional jump keeps its condition");
+        tf.assert_true(jump.operands[0].kind == MachineOperand::Label, "Jump target is a label reference");
+        tf.assert_equal(jump.str(), std::string("    jle if_false_0"), "Printed back as written");
+    }
+
+    {
+        MachineOperand rax = MachineOperand::reg("rax");
+        MachineOperand slot = MachineOperand::mem("rbp-8", 4);
+        tf.assert_true(MachineInstr::mov(MachineOperand::reg("rdi"), rax, "argument for print_int").str() ==
+                           MachineInstr::parse("    mov rdi, rax        ; argument for print_int").str(),
+                       "mov builder matches the parsed form");
+        tf.assert_true(MachineInstr::arithmetic(Opcode::Add, slot, MachineOperand::imm(3)).str() ==
+                           MachineInstr::parse("    add dword [rbp-8], 3").str(),
+                       "Arithmetic builder matches the parsed form");
+        tf.assert_true(MachineInstr::jumpIf("le", "if_false_0").str() == MachineInstr::parse("    jle if_false_0").str(),
+                       "Conditional jump builder matches the parsed form");
+        tf.assert_true(MachineInstr::lea(rax, "rax+rax*4").str() == MachineInstr::parse("    lea rax, [rax+rax*4]").str() &&
+                           MachineInstr::call("print_int").str() == MachineInstr::parse("    call print_int").str() &&
+                           MachineInstr::push(rax).str() == MachineInstr::parse("    push rax").str(),
+                       "lea, call and push builders match the parsed forms");
+    }
+
+    {
+        MachineFunction function("f");
+        function.append(MachineInstr(Opcode::Cmp, {MachineOperand::reg("r10"), MachineOperand::imm(1)}));
+        function.append(MachineInstr::conditional(Opcode::Jcc, "g", {MachineOperand::label("done")}));
+        function.append(MachineInstr(Opcode::Inc, {MachineOperand::reg("r10")}));
+        function.appendLabel("done");
+        function.append(MachineInstr(Opcode::Ret));
+        tf.assert_equal(function.blocks.size(), size_t(3), "Blocks split after a branch and at a label");
+        tf.assert_true(function.blocks[1].label.empty(), "Fall-through block has no label");
+        tf.assert_equal(function.instructionCount(), size_t(4), "Instructions counted across blocks");
+    }
+
+    {
+        bool rejected = false;
+        try
+        {
+            MachineInstr::parse("    frobnicate rax");
+        }
+        catch (const std::invalid_argument &)
+        {
+            rejected = true;
+        }
+        tf.assert_true(rejected, "Unknown mnemonic rejected");
+    }
+
+    {
+        CodeGen gen;
+        gen.beginFunction("main");
+        gen.emit("    mov rax, 1");
+        gen.emitLabel("next");
+        gen.emit(MachineInstr(Opcode::Ret));
+        tf.assert_equal(gen.getModule().functions.size(), size_t(1), "Code goes into the current function");
+        tf.assert_contains(gen.getAssembly(), "main:\n    mov rax, 1\nnext:\n    ret", "Module printed as NASM");
+    }
+}
+
+void test_peephole()
+{
+    TestFramework tf("Peephole");
+
+    {
+        PeepholeOptimizer peephole;
+        std::string text = runPeephole({"    push rax", "    pop rax", "    push r10", "    pop rcx"}, peephole);
+        tf.assert_equal(text, std::string("    mov rcx, r10\n"), "push/pop pairs fold to a move or vanish");
+        tf.assert_equal(peephole.getStats().at("peephole.push_pop"), 2, "Both pairs counted");
+    }
+
+    {
+        PeepholeOptimizer peephole;
+        std::string text = runPeephole({"    mov dword [rbp-4], eax", "    movsxd rax, dword [rbp-4]"}, peephole);
+        tf.assert_contains(text, "movsxd rax, eax", "Reload after a store uses the stored register");
+    }
+
+    {
+        PeepholeOptimizer peephole;
+        std::string text = runPeephole({"    mov rax, 0", "    cmp r10, 1", "    mov rcx, 0", "    cmovl rax, rcx"}, peephole);
+        tf.assert_contains(text, "xor eax, eax", "Zero idiom used when the flags are overwritten");
+        tf.assert_contains(text, "mov rcx, 0", "mov kept when the flags are still read");
+    }
+
+    {
+        PeepholeOptimizer peephole;
+        std::string text = runPeephole({"    jmp if_end_1", "    mov rax, 1", "if_false_0:", "    jmp if_end_1", "if_end_1:"}, peephole);
+        tf.assert_false(text.find("mov rax, 1") != std::string::npos, "Code after an unconditional jump removed");
+        tf.assert_equal(text, std::string("if_false_0:\nif_end_1:\n"), "Jumps falling through to their label removed");
+    }
+
+    {
+        std::string assembly = generateProgram("int add(int a, int b) { return a + b; } print(add(2, 3));");
+        tf.assert_contains(assembly, "mov rsi, 3\n    mov rdi, 2\n    call fn_add", "Argument pushes become moves");
+    }
+}
+
+void test_output_buffering()
+{
+    TestFramework tf("Output Buffering");
+
+    {
+        std::string assembly = generateProgram("print(1);");
+        tf.assert_contains(assembly, "section .bss\n    outbuf resb 65536", "Output buffer reserved in .bss");
+        size_t begin = assembly.find("print_int:"), end = assembly.find("flush_output:");
+        tf.assert_true(begin < end && assembly.substr(begin, end - begin).find("syscall") == std::string::npos,
+                       "print_int makes no syscall of its own");
+        tf.assert_contains(assembly, "exit_program:\n    ; End the program with the status in rdi\n    call flush_output",
+                           "Buffer flushed before exit");
+        tf.assert_contains(assembly, "exit status\n    jmp exit_program", "The program ends through exit_program");
+    }
+
+    {
+        std::string assembly = generateProgram("int x = 1; if (x > 0) { return 2; } print(x);");
+        size_t first = assembly.find("exit status\n    jmp exit_program");
+        tf.assert_true(first != std::string::npos &&
+                           assembly.find("exit status\n    jmp exit_program", first + 1) != std::string::npos,
+                       "A top-level return ends through exit_program");
+    }
+
+    {
+        std::string assembly = generateProgram("print(1); flush(); print(2);");
+        tf.assert_false(assembly.find("ERROR") != std::string::npos, "flush() is a builtin");
+        tf.assert_contains(assembly, "print function\n    call flush_output", "flush() writes out the buffer");
+    }
+
+    {
+        std::string assembly = generateProgram("int flush() { return 7; } print(flush());");
+        tf.assert_contains(assembly, "call fn_flush", "A user function named flush takes precedence");
+    }
+}
+
+void test_print_formatting()
+{
+    TestFramework tf("Print Formatting");
+
+    std::string assembly = generateProgram("print(-5);");
+    size_t begin = assembly.find("print_int:"), end = assembly.find("flush_output:");
+    std::string runtime = begin < end ? assembly.substr(begin, end - begin) : "";
+
+    tf.assert_false(runtime.find("div") != std::string::npos, "Digits extracted without a div");
+    tf.assert_contains(runtime, "bsr rbx, rcx", "Digit count estimated from the bit length");
+    tf.assert_contains(runtime, "[digit_pairs + rbx*2]", "Two digits stored per lookup");
+
+    std::string pairs = assembly.substr(assembly.find("digit_pairs db \"") + 16, 200);
+    tf.assert_equal(pairs.substr(0, 6), std::string("000102"), "Pair table starts at 00");
+    tf.assert_equal(pairs.substr(194, 6), std::string("979899"), "Pair table ends at 99");
+    tf.assert_contains(assembly, "pow10 dq 1, 10, 100,", "Powers of ten for the count check");
+}
+
+// Encode instructions as the body of _start and return the text bytes in hex
+static std::string encode(const std::vector<std::string> &lines, uint64_t address = 0x401000)
+{
+    MachineModule module;
+    module.functions.push_back(MachineFunction("_start"));
+    for (const auto &line : lines)
+    {
+        if (line.back() == ':')
+            module.functions.back().appendLabel(line.substr(0, line.size() - 1));
+        else
+            module.functions.back().append(MachineInstr::parse(line));
+    }
+    AssembledImage image = Assembler::assemble(module, address);
+    std::string hex;
+    for (uint8_t byte : image.text)
+    {
+        char digits[4];
+        std::snprintf(digits, sizeof(digits), "%02x ", byte);
+        hex += digits;
+    }
+    return hex;
+}
+
+void test_assembler()
+{
+    TestFramework tf("Built-in Assembler");
+
+    tf.assert_equal(encode({"    mov rax, 1"}), std::string("48 c7 c0 01 00 00 00 "), "mov with a sign-extended immediate");
+    tf.assert_equal(encode({"    add r10, r11"}), std::string("4d 01 da "), "REX.R and REX.B for r8-r15");
+    tf.assert_equal(encode({"    movsxd rax, dword [rbp-8]"}), std::string("48 63 45 f8 "), "rbp base with an 8-bit displacement");
+    tf.assert_equal(encode({"    mov byte [rsi], 10"}), std::string("c6 06 0a "), "Byte store of an immediate");
+    tf.assert_equal(encode({"    lea rax, [r10+r11*4]"}), std::string("4b 8d 04 9a "), "Scaled index through a SIB byte");
+    tf.assert_equal(encode({"    mov qword [rsp], r12"}), std::string("4c 89 24 24 "), "rsp base needs a SIB byte");
+    tf.assert_equal(encode({"    sete sil"}), std::string("40 0f 94 c6 "), "sil needs an empty REX prefix");
+    tf.assert_equal(encode({"    mov rcx, 2951479051793528259"}), std::string("48 b9 c3 f5 28 5c 8f c2 f5 28 "),
+                    "64-bit immediate");
+    tf.assert_equal(encode({"    imul rbx, rbx, 1233", "    shr rdx, 2"}), std::string("48 69 db d1 04 00 00 48 c1 ea 02 "),
+                    "Three-operand imul and shift by an immediate");
+
+    tf.assert_equal(encode({"    jmp .skip", "    ret", ".skip:", "    jne _start"}),
+                    std::string("e9 01 00 00 00 c3 0f 85 f4 ff ff ff "), "Jumps resolve to 32-bit displacements");
+
+    {
+        MachineModule module;
+        module.data.push_back("table dq 1, 10");
+        module.bss.push_back("counter resq 1");
+        module.functions.push_back(MachineFunction("_start"));
+        module.functions.back().append(MachineInstr::parse("    mov rax, [counter]"));
+        module.functions.back().append(MachineInstr::parse("    mov rcx, table"));
+        AssembledImage image = Assembler::assemble(module, 0x401000);
+        tf.assert_equal(image.dataAddress, (uint64_t)0x402000, "Data starts on the page after the text");
+        tf.assert_equal(image.data.size(), (size_t)16, "Data words laid out");
+        tf.assert_equal(image.symbols.at("counter"), (uint64_t)0x402010, "Reservations follow the data");
+        tf.assert_equal(image.text[4], (uint8_t)0x10, "Absolute address of a reservation patched in");
+        tf.assert_equal(image.entry, (uint64_t)0x401000, "Entry point is _start");
+    }
+
+    {
+        bool threw = false;
+        try
+        {
+            encode({"    call missing"});
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        tf.assert_true(threw, "Undefined symbols are reported");
+    }
+}
+
+// Compile a program and run it in memory, returning its exit status
+static int runProgram(const std::string &code)
+{
+    Lexer lexer(code);
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    auto program = parser.ParseProgram();
+    CodeGen gen;
+    gen.generateAssembly(program.get());
+    int status = -1;
+    if (!JitRunner::run(gen.getModule(), status))
+        return -1;
+    return status;
+}
+
+void test_jit_runner()
+{
+    TestFramework tf("In-Memory Execution");
+
+    tf.assert_equal(runProgram("int x = 6; return x * 7;"), 42, "Top-level return comes back as the exit status");
+    tf.assert_equal(runProgram("int x = 1;"), 0, "Falling off the end exits with 0");
+    tf.assert_equal(runProgram("int fact(int n) { if (n <= 1) { return 1; } return n * fact(n - 1); } return fact(5);"),
+                    120, "Recursive calls run on the program's own stack");
+    tf.assert_equal(runProgram("int s = 0; for (int i = 0; i < 10; i = i + 1) { s = s + i; } return s;"), 45,
+                    "Loops run");
+    tf.assert_equal(runProgram("return 300;"), 44, "Status truncated to a byte like a process exit");
+    tf.assert_equal(runProgram("return 1;") + runProgram("return 2;"), 3, "Programs run one after another");
+}
+
+// Compile a program to bytecode and run it, returning its exit status and
+// collecting what it prints
+static int runBytecode(const std::string &code, std::string &output, std::string *listing = nullptr)
+{
+    Lexer lexer(code);
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    auto program = parser.ParseProgram();
+    VmProgram bytecode = BytecodeVM::compile(*program);
+    if (listing)
+        *listing = BytecodeVM::listing(bytecode);
+
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0)
+        return -1;
+    int status = -1;
+    bool ran = BytecodeVM::run(bytecode, status, pipeFds[1]);
+    close(pipeFds[1]);
+    output.clear();
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(pipeFds[0], buffer, sizeof(buffer))) > 0)
+        output.append(buffer, count);
+    close(pipeFds[0]);
+    return ran ? status : -1;
+}
+
+void test_bytecode_vm()
+{
+    TestFramework tf("Bytecode VM");
+    std::string output, listing;
+
+    tf.assert_equal(runBytecode("int x = 6; return x * 7;", output), 42, "Top-level return is the exit status");
+    tf.assert_equal(runBytecode("return 300;", output), 44, "Status truncated to a byte like a process exit");
+
+    runBytecode("int fact(int n) { if (n <= 1) { return 1; } return n * fact(n - 1); } print(fact(10)); print(-5);",
+                output);
+    tf.assert_equal(output, std::string("3628800\n-5\n"), "Calls and prints");
+
+    runBytecode("int x = 2147483647; x = x + 1; print(x); print(2147483647 + 1);", output);
+    tf.assert_equal(output, std::string("-2147483648\n2147483648\n"),
+                    "int variables wrap at 32 bits, temporaries do not");
+
+    runBytecode("int s = 0; for (int i = 0; i < 10; i = i + 1) { if (i == 3) { continue; } if (i == 6) { break; } "
+                "s = s + i; } print(s);",
+                output, &listing);
+    tf.assert_equal(output, std::string("12\n"), "break and continue");
+    tf.assert_contains(listing, "jgei", "Loop entry test is a fused compare-and-branch");
+    tf.assert_contains(listing, "jlti", "Loop back edge is a fused compare-and-branch");
+    tf.assert_contains(listing, "addiw", "int update wraps in the add itself");
+
+    runBytecode("int count(int n, int acc) { if (n == 0) { return acc; } return count(n - 1, acc + 1); } "
+                "print(count(1000000, 0));",
+                output, &listing);
+    tf.assert_equal(output, std::string("1000000\n"), "Deep tail recursion");
+    tf.assert_contains(listing, "tailcall count", "Returned calls reuse the frame");
+
+    runBytecode("int f(int x) { print(x); return x; } print(f(0) && f(1)); print(f(2) || f(3));", output);
+    tf.assert_equal(output, std::string("0\n0\n2\n1\n"), "&& and || skip the right operand");
+
+    tf.assert_equal(runBytecode("int z = 0; print(1); return 5 / z;", output), -1, "Division by zero stops the program");
+    tf.assert_equal(output, std::string("1\n"), "Output before the error is written");
+
+    tf.assert_equal(runBytecode("int down(int n) { return down(n + 1) + 1; } print(7); print(down(0));", output), -1,
+                    "Unbounded recursion stops the program");
+    tf.assert_equal(output, std::string("7\n"), "Output before the overflow is written");
+    runBytecode("int depth(int n) { if (n == 0) { return 0; } return depth(n - 1) + 1; } print(depth(100000));",
+                output);
+    tf.assert_equal(output, std::string("100000\n"), "Deep recursion within the limit");
+}
+
+static std::string translateToC(const std::string &code)
+{
+    Lexer lexer(code);
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    auto program = parser.ParseProgram();
+    return CBackend::translate(*program);
+}
+
+// Translate a program to C, build it with the system compiler and run it,
+// returning its exit status and collecting what it prints
+static int runC(const std::string &code, std::string &output)
+{
+    char dir[] = "/tmp/vesper_c_XXXXXX";
+    if (!mkdtemp(dir))
+        return -1;
+    std::string source = std::string(dir) + "/program.c";
+    std::string binary = std::string(dir) + "/program";
+    FILE *file = fopen(source.c_str(), "w");
+    std::string translated = translateToC(code);
+    fwrite(translated.data(), 1, translated.size(), file);
+    fclose(file);
+
+    int status = -1;
+    output.clear();
+    if (CBackend::compile(source, binary))
+    {
+        FILE *process = popen(binary.c_str(), "r");
+        char buffer[256];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), process)) > 0)
+            output.append(buffer, count);
+        int waited = pclose(process);
+        if (WIFEXITED(waited))
+            status = WEXITSTATUS(waited);
+        else if (WIFSIGNALED(waited))
+            status = 128 + WTERMSIG(waited); // as a shell reports it
+    }
+    std::remove(binary.c_str());
+    std::remove(source.c_str());
+    rmdir(dir);
+    return status;
+}
+
+void test_c_backend()
+{
+    TestFramework tf("C Backend");
+    std::string output;
+
+    std::string translated = translateToC("int s = 0; for (int i = 0; i < 10; i = i + 1) { s = s + i; } print(s);");
+    tf.assert_contains(translated, "for (", "Pure loops stay C for loops");
+    tf.assert_contains(translated, "vs_print(", "print goes through the runtime");
+    tf.assert_contains(translated, "vs_wrap32", "int stores wrap to 32 bits");
+
+    translated = translateToC("int sign(int x) { if (x < 0) { return -1; } else { return 1; } } "
+                              "int pos(int x) { if (x > 0) { return 1; } } print(sign(3)); print(pos(3));");
+    tf.assert_false(translated.find("return 1;\n        }\n    }\n    return 0;") != std::string::npos,
+                    "No trailing return after a body that always returns");
+    tf.assert_contains(translated, "return 1;\n    }\n    return 0;", "Trailing return when the body can fall through");
+
+    tf.assert_equal(runC("int fact(int n) { if (n <= 1) { return 1; } return n * fact(n - 1); } "
+                         "print(fact(10)); return 300;",
+                         output),
+                    44, "Status truncated to a byte like a process exit");
+    tf.assert_equal(output, std::string("3628800\n"), "Calls and prints");
+
+    runC("int x = 2147483647; x = x + 1; print(x); print(2147483647 + 1); print(5000000 * 1000000);", output);
+    tf.assert_equal(output, std::string("-2147483648\n2147483648\n5000000000000\n"),
+                    "int variables wrap at 32 bits, temporaries do not");
+
+    runC("int x = 1; int f() { x = 5; return 2; } int y = x + f(); print(y);", output);
+    tf.assert_equal(output, std::string("3\n"), "Functions do not see top-level variables");
+
+    runC("int bump(int n) { print(n); return n; } int r = bump(1) + bump(2) * bump(3); print(r);",
+         output);
+    tf.assert_equal(output, std::string("1\n2\n3\n7\n"), "Operands are evaluated left to right");
+
+    runC("int f(int x) { print(x); return x; } print(f(0) && f(1)); print(f(2) || f(3));", output);
+    tf.assert_equal(output, std::string("0\n0\n2\n1\n"), "&& and || skip the right operand");
+
+    runC("int s = 0; int i = 0; while (i < 10) { i = i + 1; if (i == 3) { continue; } if (i == 6) { break; } "
+         "s = s + i; } print(s);",
+         output);
+    tf.assert_equal(output, std::string("12\n"), "break and continue");
+
+    // Truth values and literals are C ints, but the sums must not wrap
+    std::string mixed = "int v1 = 3; int v2 = 7; print((v1 <= 5) + 10 + 2147483647); "
+                        "print((v1 < v2) * 2147483647 * 4); print((-(v1 < v2)) - 2147483647 - 5); "
+                        "print(((v1 > 0) && (v2 > 0)) + 2147483647);";
+    std::string vmOutput;
+    runBytecode(mixed, vmOutput);
+    runC(mixed, output);
+    tf.assert_equal(output, vmOutput, "Mixed truth value and literal arithmetic matches the VM");
+    tf.assert_equal(output, std::string("2147483658\n8589934588\n-2147483653\n2147483648\n"),
+                    "Truth values are combined in 64 bits");
+
+    // Division by zero traps even when the quotient is unused
+    tf.assert_equal(runC("int z = 0; int w = 0; print(1); w = 9 / z; print(3);", output), 128 + SIGFPE,
+                    "Division by zero raises SIGFPE");
+    tf.assert_equal(output, std::string("1\n"), "Output before the trap is written");
+    tf.assert_equal(runC("print(2); print(5 % 0); print(3);", output), 128 + SIGFPE, "Modulo by zero raises SIGFPE");
+    std::string extremes = "int n = -1; int m = -2147483647 - 1; print(m * m * (-2) / n); print(m * m * (-2) % n); "
+                           "print(-7 / 2); print(-7 % 2);";
+    runBytecode(extremes, vmOutput);
+    runC(extremes, output);
+    tf.assert_equal(output, vmOutput, "Division matches the VM");
+    tf.assert_equal(output, std::string("-9223372036854775808\n0\n-3\n-1\n"), "INT64_MIN / -1 wraps");
+}
+
+void test_switch_lowering()
+{
+    TestFramework tf("Switch Lowering");
+    std::string output;
+
+    std::string asmCode = generateProgram("int f(int x) { switch (x) { case 1: return 10; case 2: return 20; "
+                                          "case 3: return 30; case 4: return 40; case 5: return 50; } return 0; } "
+                                          "print(f(3));");
+    tf.assert_contains(asmCode, "switch_table", "Dense cases dispatch through a table");
+    tf.assert_contains(asmCode, "jmp rcx", "Table entries are reached by an indirect jump");
+
+    asmCode = generateProgram("int f(char c) { switch (c) { case 'a': case 'e': case 'i': case 'o': case 'u': return 1; "
+                              "default: return 0; } } print(f('e'));");
+    tf.assert_contains(asmCode, "bt rdx, rcx", "Small sets with few targets test a bit mask");
+
+    asmCode = generateProgram("int f(int x) { switch (x) { case 1: return 1; case 100: return 2; case 5000: return 3; "
+                              "case 70000: return 4; case 900000: return 5; } return 0; } print(f(3));");
+    tf.assert_contains(asmCode, "jge switch_upper", "Sparse cases split by binary search");
+    tf.assert_true(asmCode.find("switch_table") == std::string::npos, "Sparse cases build no table");
+
+    tf.assert_equal(runProgram("int f(int x) { switch (x) { case 1: return 10; case 2: return 20; case 3: return 30; "
+                               "case 4: return 40; default: return 7; } } return f(3) + f(9);"),
+                    37, "Table and default targets");
+    tf.assert_equal(runProgram("int s = 0; switch (2) { case 1: s = s + 1; case 2: s = s + 2; case 3: s = s + 4; break; "
+                               "case 4: s = s + 8; } return s;"),
+                    6, "Cases fall through until a break");
+    tf.assert_equal(runProgram("int s = 0; for (int i = 0; i < 6; i = i + 1) { switch (i) { case 2: continue; "
+                               "case 4: break; default: s = s + i; } s = s + 10; } return s;"),
+                    59, "break leaves the switch, continue the loop");
+
+    std::string program = "int s = 0; for (int i = 0; i < 8; i = i + 1) { switch (i * 3) { case 0: case 9: s = s + 1; "
+                          "case 12: s = s + 10; break; case 21: continue; default: s = s + 100; } print(s); }";
+    std::string expected = "11\n111\n211\n222\n232\n332\n432\n";
+    runBytecode(program, output);
+    tf.assert_equal(output, expected, "Bytecode VM runs switches");
+    runC(program, output);
+    tf.assert_equal(output, expected, "C backend runs switches");
+
+    Lexer lexer("int x = 1; switch (x) { case 1: break; case 1: break; }");
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    tf.assert_true(parser.ParseProgram() == nullptr, "Duplicate case labels are rejected");
+}
@@ -266,6 +266,14 @@ void test_preprocessor()
         tf.assert_contains(tokens[7], "PUNCTUATOR:=", "Assignment operator after preprocessor directive");
         tf.assert_contains(tokens[8], "NUMBER:42", "Number after preprocessor directive");
     }
+
+    // Test compiler hints - kept as a single token
+    {
+        Lexer lexer("#pragma unroll (4)\nfor");
+        auto tokens = lexer.tokenize();
+        tf.assert_equal(tokens.size(), size_t(2), "Pragma line becomes one token");
+        tf.assert_equal(tokens[0], "PRAGMA:unroll(4)", "Pragma hint without whitespace");
+    }
 }
 
 void test_error_handling()
@@ -0,0 +1,498 @@
+#include "test_framework.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "AST.h"
+#include "Optimizer.h"
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+// Parse a program and run the optimizer over it. Unrolling is off unless
+// asked for, so the loop passes see the loops as written.
+static std::unique_ptr<ProgramAST> optimizeProgram(const std::string &code, OptStats &stats, int unrollFactor = 1)
+{
+    Lexer lexer(code);
+    auto tokens = lexer.tokenize();
+    Parser parser(tokens);
+    auto program = parser.ParseProgram();
+    if (program)
+    {
+        Optimizer optimizer;
+        optimizer.setUnrollFactor(unrollFactor);
+        optimizer.run(*program);
+        stats = optimizer.getStats();
+    }
+    return program;
+}
+
+// Capture the printed form of a program
+static std::string renderProgram(const ProgramAST &program)
+{
+    std::ostringstream out;
+    std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+    program.print();
+    std::cout.rdbuf(old);
+    return out.str();
+}
+
+void test_constant_folding()
+{
+    TestFramework tf("Constant Folding");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int x = 2 * 3 + 4; print(x);", stats);
+        tf.assert_true(program != nullptr, "Program parsed");
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "x = 10", "Arithmetic on literals folded");
+    }
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int x = 7 / 0; print(x);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "(7 / 0)", "Division by zero left for runtime");
+    }
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("print(100000 * 100000);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "(100000 * 100000)", "Results wider than int are not folded");
+    }
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int y = 0; int x = 0 && 10 / y; int z = 2 || y; print(x); print(z);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "x = 0", "&& with a false left operand folded without its right operand");
+        tf.assert_contains(text, "z = 1", "|| with a true left operand folded to 1");
+    }
+}
+
+void test_dead_code_elimination()
+{
+    TestFramework tf("Dead Code Elimination");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("if (1 > 2) { print(1); } else { print(2); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("print(1)") != std::string::npos, "Constant-false branch removed");
+        tf.assert_contains(text, "print(2)", "Taken branch kept");
+        tf.assert_equal(stats["dce.constant_branches"], 1, "Constant branch counted");
+    }
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("for (int i = 0; i < 3; i = i + 1) { break; print(i); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("print(i)") != std::string::npos, "Code after break removed");
+    }
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("while (0) { print(1); } print(2);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("while") != std::string::npos, "Loop with false condition removed");
+    }
+}
+
+void test_dead_store_elimination()
+{
+    TestFramework tf("Dead Store Elimination");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int t = 5; t = 6; print(t);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("t = 5") != std::string::npos, "Overwritten initializer removed");
+        tf.assert_contains(text, "t = 6", "Live store kept");
+    }
+
+    {
+        // Accumulator that is never read outside its own update
+        OptStats stats;
+        auto program = optimizeProgram("int sum = 0; for (int i = 0; i < 3; i = i + 1) { sum = sum + i; print(i); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("sum") != std::string::npos, "Unused accumulator removed");
+        tf.assert_equal(stats["dce.unused_locals"], 1, "Unused local dropped from the frame");
+    }
+
+    {
+        // The value stored in the last iteration is read by the next one
+        OptStats stats;
+        auto program = optimizeProgram("int a = 0; int b = 0; while (a < 3) { if (a > 0) { print(b); } b = a; a = a + 1; }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "b = a", "Loop-carried store kept");
+    }
+
+    {
+        // A redeclaration gets its own name, so the first slot stays intact
+        OptStats stats;
+        auto program = optimizeProgram("int y = 3; print(y); int y = 4; print(y);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "y.1 = 4", "Redeclared variable renamed");
+        tf.assert_contains(text, "y = 3", "Original declaration kept");
+    }
+
+    {
+        // Division by zero traps whether or not its value is used
+        OptStats stats;
+        auto program = optimizeProgram("int b = 0; int c = 5 / b; print(1);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "(5 / ", "Unused division that can trap kept");
+        program = optimizeProgram("int b = 3; int c = b / 4; print(1);", stats);
+        text = renderProgram(*program);
+        tf.assert_false(text.find("/") != std::string::npos, "Unused division by a non-zero constant removed");
+    }
+
+    {
+        // The call in an unused && only runs when the left operand is true
+        OptStats stats;
+        auto program = optimizeProgram("int f(int x) { print(x); return x; } "
+                                       "int g(int p) { int l = 0; l = p && f(p); return 1; } print(g(0)); print(g(2));",
+                                       stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "&&", "Left operand still guards the call");
+    }
+}
+
+void test_common_subexpression_elimination()
+{
+    TestFramework tf("Common Subexpression Elimination");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int a = 3; int b = 4; print(a * b); print(a * b + 1);", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".cse0 = (a * b)", "First computation saved to a temporary");
+        tf.assert_contains(text, "print((.cse0 + 1))", "Repeated computation reuses the temporary");
+        tf.assert_equal(stats["cse.eliminated"], 1, "One recomputation removed");
+    }
+
+    {
+        // Operand order does not matter for commutative operators
+        OptStats stats;
+        auto program = optimizeProgram("int a = 3; int b = 4; print(a + b); print(b + a);", stats);
+        tf.assert_equal(stats["cse.eliminated"], 1, "Commutative operands matched");
+    }
+
+    {
+        // A store to an operand in between invalidates the earlier value
+        OptStats stats;
+        auto program = optimizeProgram("int a = 3; int b = 4; print(a * b); a = 5; print(a * b);", stats);
+        tf.assert_equal(stats["cse.eliminated"], 0, "Value killed by intervening store");
+    }
+
+    {
+        // Values from before a loop survive unless the loop writes an operand
+        OptStats stats;
+        auto program = optimizeProgram(
+            "int a = 3; int b = 4; int i = 0; print(a * b); print(i * b);"
+            "while (i < 3) { print(a * b); print(i * b); i = i + 1; }",
+            stats);
+        std::string text = renderProgram(*program);
+        tf.assert_equal(stats["cse.eliminated"], 1, "Only the loop-invariant value reused");
+        tf.assert_contains(text, "print((i * b))", "Loop-variant value recomputed");
+    }
+
+    {
+        // A value computed in one branch is not available after the if
+        OptStats stats;
+        auto program = optimizeProgram("int a = 3; int b = 4; if (a > 1) { print(a * b); } print(a * b);", stats);
+        tf.assert_equal(stats["cse.eliminated"], 0, "Branch-local value not reused");
+    }
+}
+
+void test_loop_invariant_code_motion()
+{
+    TestFramework tf("Loop-Invariant Code Motion");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int n = 3; for (int i = 0; i < n * 4; i = i + 1) { print(i); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".licm0 = (n * 4)", "Invariant bound computed in the preheader");
+        tf.assert_contains(text, "(i < .licm0)", "Loop condition reads the hoisted value");
+    }
+
+    {
+        // Outer-loop products move out of the inner loop only
+        OptStats stats;
+        auto program = optimizeProgram(
+            "int m = 5; for (int i = 0; i < 3; i = i + 1) { for (int j = 0; j < 3; j = j + 1) { print(i * m + j); } }",
+            stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".licm0 = (i * m)", "Outer-loop product hoisted from the inner loop");
+        tf.assert_equal(stats["licm.loops"], 1, "Only the inner loop gets a preheader");
+    }
+
+    {
+        // Values stored in the loop and possible traps stay in place
+        OptStats stats;
+        auto program = optimizeProgram("int a = 6; int b = 2; while (a > 0) { print(a * b); print(b / a); a = a - 1; }",
+                                       stats);
+        tf.assert_equal(stats["licm.hoisted"], 0, "Variant and trapping expressions not hoisted");
+    }
+}
+
+void test_induction_variable_strength_reduction()
+{
+    TestFramework tf("Induction Variable Strength Reduction");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("for (int i = 0; i < 4; i = i + 1) { print(i * 12); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".iv0 = (i * 12)", "Derived variable starts from the for init");
+        tf.assert_contains(text, ".iv0 = (.iv0 + 12)", "Derived variable advanced by step times factor");
+        tf.assert_contains(text, "print(.iv0)", "Multiplication replaced by the derived variable");
+    }
+
+    {
+        // A continue would skip the advance placed at the end of the body
+        OptStats stats;
+        auto program = optimizeProgram(
+            "for (int i = 0; i < 4; i = i + 1) { if (i == 1) { continue; } print(i * 12); }", stats);
+        tf.assert_equal(stats["sr.induction_variables"], 0, "Loop with continue left alone");
+    }
+
+    {
+        // Shifts are already cheaper than the extra update
+        OptStats stats;
+        auto program = optimizeProgram("int i = 0; while (i < 4) { print(i * 8); i = i + 1; }", stats);
+        tf.assert_equal(stats["sr.induction_variables"], 0, "Power-of-two factor not reduced");
+    }
+}
+
+void test_function_inlining()
+{
+    TestFramework tf("Function Inlining");
+
+    {
+        OptStats stats;
+        auto program = optimizeProgram("int sq(int x) { return x * x; } int k = 5; print(sq(k));", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".inl0.x = k", "Parameter bound to the argument");
+        tf.assert_contains(text, "print(.inl0.ret)", "Call replaced by the result");
+        tf.assert_false(text.find("def sq") != std::string::npos, "Fully inlined function removed");
+        tf.assert_equal(stats["inline.functions_removed"], 1, "Removed function counted");
+    }
+
+    {
+        // Literal arguments are substituted and folded
+        OptStats stats;
+        auto program = optimizeProgram("int sq(int x) { return x * x; } print(sq(6));", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, ".inl0.ret = 36", "Copy specialized for the literal argument");
+    }
+
+    {
+        // Early returns leave a one-iteration loop
+        OptStats stats;
+        auto program = optimizeProgram(
+            "int abs1(int v) { if (v < 0) { print(v); return 0 - v; } return v; } int k = 0 - 3; print(abs1(k));", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "while (1)", "Body with several returns wrapped in a loop");
+        tf.assert_equal(stats["inline.calls_inlined"], 1, "Call inlined");
+    }
+
+    {
+        // Recursion is never inlined
+        OptStats stats;
+        auto program = optimizeProgram(
+            "int fact(int n) { if (n <= 1) { return 1; } return n * fact(n - 1); } print(fact(5));", stats);
+        tf.assert_equal(stats["inline.calls_inlined"], 0, "Recursive function kept as a call");
+    }
+
+    {
+        // A call with more arguments than registers yields 0 unoptimized, so
+        // inlining it would change the result
+        OptStats stats;
+        auto program = optimizeProgram("int s7(int a, int b, int c, int d, int e, int f, int g) { return a + g; }"
+                                       " print(s7(1, 2, 3, 4, 5, 6, 7));",
+                                       stats);
+        tf.assert_equal(stats["inline.calls_inlined"], 0, "Call with seven arguments kept");
+    }
+
+    {
+        // The threshold decides for bodies larger than an accessor
+        std::string code = "int big(int x) { int a = x * 3; int b = a + 7; int c = b * b - a; int d = c % 11;"
+                           " if (d > 5) { d = d - 5; } else { d = d + 5; } return d * a + b - c; }"
+                           " int k = 2; print(big(k));";
+        int inlined[2];
+        int thresholds[2] = {100, 10};
+        for (int i = 0; i < 2; ++i)
+        {
+            Lexer lexer(code);
+            auto tokens = lexer.tokenize();
+            Parser parser(tokens);
+            auto program = parser.ParseProgram();
+            Optimizer optimizer;
+            optimizer.setInlineThreshold(thresholds[i]);
+            optimizer.run(*program);
+            OptStats stats = optimizer.getStats();
+            inlined[i] = stats["inline.calls_inlined"];
+        }
+        tf.assert_equal(inlined[0], 1, "Body under the threshold inlined");
+        tf.assert_equal(inlined[1], 0, "Lower threshold keeps the call");
+    }
+}
+
+void test_loop_unrolling()
+{
+    TestFramework tf("Loop Unrolling");
+
+    {
+        // Small constant trip count: one copy per iteration
+        OptStats stats;
+        auto program = optimizeProgram("for (int i = 0; i < 3; i = i + 1) { print(i * 7); }", stats, 4);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("for (") != std::string::npos, "Loop removed");
+        tf.assert_contains(text, "print(14)", "Counter replaced by its value in each copy");
+        tf.assert_equal(stats["unroll.complete"], 1, "Complete unrolling counted");
+    }
+
+    {
+        // Unknown bound: unrolled by four with a remainder loop
+        OptStats stats;
+        auto program = optimizeProgram(
+            "int n = 10; int s = 0; for (int i = 0; i < n; i = i + 1) { s = s + i; print(s); }", stats, 4);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "i = (i + 4)", "Counter advanced once per four copies");
+        tf.assert_contains(text, "(s + (i + 2))", "Later copies read the counter plus their step");
+        tf.assert_contains(text, "i = (i + 1)", "Remainder loop keeps the original step");
+        tf.assert_equal(stats["unroll.partial"], 1, "Partial unrolling counted");
+    }
+
+    {
+        // A trip count that is a multiple of the factor needs no remainder
+        OptStats stats;
+        auto program = optimizeProgram("#pragma unroll(4)\nfor (int i = 0; i < 400; i = i + 1) { print(i); }", stats, 4);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("i = (i + 1)") != std::string::npos, "No remainder loop");
+    }
+
+    {
+        // A hint for more copies than the limit is clamped to it
+        OptStats stats;
+        auto program =
+            optimizeProgram("int n = 5000; #pragma unroll(20000)\nfor (int i = 0; i < n; i = i + 1) { print(i); }", stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "i = (i + 1024)", "Hinted factor limited to 1024 copies");
+    }
+
+    {
+        // Early exits and stores to the counter keep the loop as written
+        OptStats stats;
+        optimizeProgram("int n = 9; for (int i = 0; i < n; i = i + 1) { if (i == 3) { break; } print(i); }"
+                        "for (int j = 0; j < n; j = j + 1) { j = j + 1; print(j); }"
+                        "#pragma nounroll\nfor (int k = 0; k < 2; k = k + 1) { print(k); }",
+                        stats, 4);
+        tf.assert_equal(stats["unroll.complete"] + stats["unroll.partial"], 0, "Loops left alone");
+    }
+}
+
+void test_closed_form_loops()
+{
+    TestFramework tf("Closed-Form Loops");
+
+    {
+        // Every input is known: the loop runs at compile time
+        OptStats stats;
+        auto program = optimizeProgram("int sum = 0; for (int i = 0; i < 10; i = i + 1) { sum = sum + i; } print(sum);",
+                                       stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("for (") != std::string::npos, "Loop removed");
+        tf.assert_contains(text, "sum = 45", "Final value stored");
+        tf.assert_equal(stats["scev.loops_evaluated"], 1, "Evaluated loop counted");
+    }
+
+    {
+        // Conditional updates and a nested loop still have a fixed count
+        OptStats stats;
+        auto program = optimizeProgram("int counter = 10; while (counter > 0) { if (counter > 5) {"
+                                       " for (int k = 0; k < 2; k = k + 1) { counter = counter - 1; } }"
+                                       " else { counter = counter - 1; } } print(counter);",
+                                       stats);
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("while (") != std::string::npos, "Counter loop removed");
+        tf.assert_contains(text, "counter = 0", "Counter folded to its final value");
+    }
+
+    {
+        // Unknown trip count: sum of the counter becomes n(n-1)/2
+        std::string code = "int tri(int n) { int s = 0; for (int i = 0; i < n; i = i + 1) { s = s + i; } return s; }"
+                           " print(tri(5));";
+        Lexer lexer(code);
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto program = parser.ParseProgram();
+        Optimizer optimizer;
+        optimizer.setInlineThreshold(0);
+        optimizer.run(*program);
+        OptStats stats = optimizer.getStats();
+        std::string text = renderProgram(*program);
+        tf.assert_false(text.find("for (") != std::string::npos, "Loop replaced");
+        tf.assert_contains(text, "if ((i < n))", "Closed form guarded by the loop condition");
+        tf.assert_contains(text, ".scev0 = n", "Trip count computed once");
+        tf.assert_contains(text, "(.scev0 / 2)", "Quadratic term of the sum");
+        tf.assert_equal(stats["scev.closed_forms"], 1, "Closed form counted");
+    }
+
+    {
+        // Output has to happen at runtime, and a counter compared with <=
+        // against an unknown bound could wrap
+        std::string code = "int f(int n) { int s = 0; for (int i = 0; i <= n; i = i + 1) { s = s + 1; } return s; }"
+                           " int k = 3; while (k > 0) { print(k); k = k - 1; } print(f(k));";
+        Lexer lexer(code);
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto program = parser.ParseProgram();
+        Optimizer optimizer;
+        optimizer.setInlineThreshold(0);
+        optimizer.run(*program);
+        OptStats stats = optimizer.getStats();
+        tf.assert_equal(stats["scev.loops_evaluated"] + stats["scev.closed_forms"], 0, "Loops kept");
+    }
+}
+
+void test_loop_unswitching()
+{
+    TestFramework tf("Loop Unswitching");
+
+    {
+        // A mode flag the loop never changes picks one copy up front
+        OptStats stats;
+        auto program = optimizeProgram("int mode = 1; int s = 0; for (int i = 0; i < 5; i = i + 1) {"
+                                       " if (mode == 1) { s = s + i; } else { s = s - i; } print(s); }",
+                                       stats);
+        std::string text = renderProgram(*program);
+        tf.assert_contains(text, "if ((mode == 1)) for (var .uns0.i = 0;", "Test moved in front of the loop");
+        tf.assert_contains(text, "s = (s + .uns0.i)", "Copy for the then branch");
+        tf.assert_contains(text, "s = (s - i)", "Original loop keeps the else branch");
+        tf.assert_equal(stats["unswitch.loops"], 1, "Unswitched loop counted");
+    }
+
+    {
+        // The condition changes inside the loop, or the counter is read
+        // after it
+        OptStats stats;
+        optimizeProgram("int f = 0; for (int i = 0; i < 5; i = i + 1) { if (f == 0) { print(1); } f = i; }"
+                        "int m = 1; for (int j = 0; j < 5; j = j + 1) { if (m) { print(j); } } print(j);",
+                        stats);
+        tf.assert_equal(stats["unswitch.loops"], 0, "Loops kept");
+    }
+
+    {
+        // Copying a large loop costs more than the branch
+        std::string code = "int m = 1; for (int i = 0; i < 5; i = i + 1) { if (m) { print(i); }";
+        for (int i = 0; i < 30; ++i)
+            code += " print(i * " + std::to_string(i + 2) + ");";
+        code += " }";
+        OptStats stats;
+        optimizeProgram(code, stats);
+        tf.assert_equal(stats["unswitch.loops"], 0, "Size cap respected");
+    }
+}
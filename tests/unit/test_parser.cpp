@@ -118,6 +118,24 @@ void test_operator_precedence()
             std::cout << std::endl;
         }
     }
+
+    // Test comparisons before && before ||
+    {
+        std::string code = "a > 1 && b == 0 || c;";
+        Lexer lexer(code);
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto ast = parser.ParseProgram();
+        tf.assert_true(ast != nullptr, "Logical operators parsed successfully");
+        if (ast)
+        {
+            const ExprStmtAST *stmt = dynamic_cast<const ExprStmtAST *>(ast->getStatements()[0].get());
+            const BinaryExprAST *root = stmt ? dynamic_cast<const BinaryExprAST *>(stmt->getExpr()) : nullptr;
+            const BinaryExprAST *lhs = root ? dynamic_cast<const BinaryExprAST *>(root->getLHS()) : nullptr;
+            tf.assert_true(root && root->getOp() == "||", "|| binds loosest");
+            tf.assert_true(lhs && lhs->getOp() == "&&", "&& binds looser than comparisons");
+        }
+    }
 }
 
 void test_function_calls()
@@ -253,6 +271,22 @@ void test_control_flow()
             std::cout << std::endl;
         }
     }
+
+    // Test unroll hint on a for loop
+    {
+        std::string code = "#pragma unroll(8)\nfor (int i = 0; i < 10; i = i + 1) { print(i); }";
+        Lexer lexer(code);
+        auto tokens = lexer.tokenize();
+        Parser parser(tokens);
+        auto ast = parser.ParseProgram();
+        tf.assert_true(ast != nullptr, "Loop with pragma parsed successfully");
+        if (ast)
+        {
+            const ForStmtAST *loop = dynamic_cast<const ForStmtAST *>(ast->getStatements()[0].get());
+            tf.assert_true(loop != nullptr, "Pragma applies to the following loop");
+            tf.assert_equal(loop ? loop->getUnrollHint() : 0, 8, "Unroll count recorded");
+        }
+    }
 }
 
 void test_functions()